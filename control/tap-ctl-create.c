@@ -43,7 +43,8 @@
 
 int
 tap_ctl_create(const char *params, char **devname, int flags, int parent_minor,
-		char *secondary, int timeout, const char *logpath)
+		char *secondary, int timeout, const char *logpath,
+		int bm_cache_size)
 {
 	int err, id, minor;
 
@@ -62,7 +63,7 @@ tap_ctl_create(const char *params, char **devname, int flags, int parent_minor,
 		goto destroy;
 
 	err = tap_ctl_open(id, minor, params, flags, parent_minor, secondary,
-			   timeout, logpath, 0, NULL);
+			   timeout, logpath, 0, NULL, bm_cache_size);
 	if (err)
 		goto detach;
 
@@ -50,8 +50,9 @@
 #include "util.h"
 
 int
-tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid, int poll_duration,
-		int poll_idle_threshold,
+tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
+		const int queue, int poll_duration,
+		int poll_idle_threshold, bool persistent_grants,
 		const grant_ref_t * grefs, const int order, const evtchn_port_t port,
 		int proto, const char *pool, const int minor)
 {
@@ -64,6 +65,7 @@ tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
 
     message.u.blkif.domid = domid;
     message.u.blkif.devid = devid;
+    message.u.blkif.queue = queue;
     for (i = 0; i < 1 << order; i++)
         message.u.blkif.gref[i] = grefs[i];
     message.u.blkif.order = order;
@@ -71,6 +73,7 @@ tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
     message.u.blkif.proto = proto;
     message.u.blkif.poll_duration = poll_duration;
     message.u.blkif.poll_idle_threshold = poll_idle_threshold;
+    message.u.blkif.persistent_grants = persistent_grants;
     if (pool) {
         if (unlikely(strlen(pool) > (sizeof(message.u.blkif.pool) - 1))) {
             EPRINTF("pool name too long: %s\n", pool);
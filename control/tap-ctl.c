@@ -277,13 +277,14 @@ tap_cli_create_usage(FILE *stream)
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
-		"[-C <path/to/logfile> insert log layer to track changed blocks]\n");
+		"[-C <path/to/logfile> insert log layer to track changed blocks] "
+		"[-b <entries> bitmap cache size of each VHD image]\n");
 }
 
 static int
 tap_cli_create(int argc, char **argv)
 {
-	int c, err, flags, prt_minor, timeout;
+	int c, err, flags, prt_minor, timeout, bm_cache_size;
 	char *args, *devname, *secondary;
 	char d_flag = 0;
 	char *logpath = NULL;
@@ -294,9 +295,10 @@ tap_cli_create(int argc, char **argv)
 	prt_minor = -1;
 	flags     = 0;
 	timeout   = 0;
+	bm_cache_size = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:RDd:e:r2:st:C:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:RDd:e:r2:st:C:b:h")) != -1) {
 		switch (c) {
 		case 'a':
 			args = optarg;
@@ -328,6 +330,9 @@ tap_cli_create(int argc, char **argv)
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'b':
+			bm_cache_size = atoi(optarg);
+			break;
 		case 'C':
 			logpath = optarg;
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LOG;
@@ -344,7 +349,7 @@ tap_cli_create(int argc, char **argv)
 		goto usage;
 
 	err = tap_ctl_create(args, &devname, flags, prt_minor, secondary,
-			timeout, logpath);
+			timeout, logpath, bm_cache_size);
 	if (!err)
 		printf("%s\n", devname);
 
@@ -708,14 +713,15 @@ tap_cli_open_usage(FILE *stream)
 		"fail over to the secondary image on ENOSPC] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
 		"[-C </path/to/logfile> insert log layer to track changed blocks] "
-		"[-E read encryption key from stdin]\n");
+		"[-E read encryption key from stdin] "
+		"[-b <entries> bitmap cache size of each VHD image]\n");
 }
 
 static int
 tap_cli_open(int argc, char **argv)
 {
 	const char *args, *secondary, *logpath;
-	int c, pid, minor, flags, prt_minor, timeout;
+	int c, pid, minor, flags, prt_minor, timeout, bm_cache_size;
 	uint8_t *encryption_key;
 	ssize_t key_size = 0;
 
@@ -724,13 +730,14 @@ tap_cli_open(int argc, char **argv)
 	minor      = -1;
 	prt_minor  = -1;
 	timeout    = 0;
+	bm_cache_size = 0;
 	args       = NULL;
 	secondary  = NULL;
 	logpath    = NULL;
 	encryption_key = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:RDm:p:e:r2:st:C:Eh")) != -1) {
+	while ((c = getopt(argc, argv, "a:RDm:p:e:r2:st:C:b:Eh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -764,6 +771,9 @@ tap_cli_open(int argc, char **argv)
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'b':
+			bm_cache_size = atoi(optarg);
+			break;
 		case 'C': 
 			logpath = optarg;
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LOG;
@@ -802,7 +812,8 @@ tap_cli_open(int argc, char **argv)
 		goto usage;
 
 	return tap_ctl_open(pid, minor, args, flags, prt_minor, secondary,
-			    timeout, logpath, (uint8_t)key_size, encryption_key);
+			    timeout, logpath, (uint8_t)key_size, encryption_key,
+			    bm_cache_size);
 
 usage:
 	tap_cli_open_usage(stderr);
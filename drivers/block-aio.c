@@ -128,6 +128,10 @@ int tdaio_open(td_driver_t *driver, const char *name,
 	for (i = 0; i < MAX_AIO_REQS; i++)
 		prv->aio_free_list[i] = &prv->aio_requests[i];
 
+	prv->iov_free_count = MAX_AIO_IOVS;
+	for (i = 0; i < MAX_AIO_IOVS; i++)
+		prv->iov_free_list[i] = prv->iovs[i];
+
 	/* Open the file */
 	o_flags = O_DIRECT | O_LARGEFILE | 
 		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
@@ -157,6 +161,13 @@ int tdaio_open(td_driver_t *driver, const char *name,
 
         prv->fd = fd;
 
+	if (!(flags & TD_OPEN_RDONLY)) {
+		int nr = tapdisk_workers_sync_threads();
+
+		if (nr > 0 && !tapdisk_workers_get(TD_WORKERS_SYNC, nr))
+			prv->workers = 1;
+	}
+
 done:
 	return ret;	
 }
@@ -167,9 +178,77 @@ void tdaio_complete(void *arg, struct tiocb *tiocb, int err)
 	struct tdaio_state *prv = aio->state;
 
 	td_complete_request(aio->treq, err);
+	if (aio->iov) {
+		prv->iov_free_list[prv->iov_free_count++] = aio->iov;
+		aio->iov = NULL;
+	}
 	prv->aio_free_list[prv->aio_free_count++] = aio;
 }
 
+static int
+tdaio_prep_vectored(td_driver_t *driver, struct aio_request *aio, int rw)
+{
+	struct tdaio_state *prv = aio->state;
+	td_request_t *treq = &aio->treq;
+	struct iovec *iov;
+	uint64_t offset;
+	int i, err;
+
+	if (!prv->iov_free_count || treq->iovcnt > TD_IOV_MAX)
+		return -EBUSY;
+
+	iov    = prv->iov_free_list[--prv->iov_free_count];
+	offset = treq->sec * (uint64_t)SECTOR_SIZE;
+
+	for (i = 0; i < treq->iovcnt; i++) {
+		iov[i].iov_base = treq->iov[i].base;
+		iov[i].iov_len  = (size_t)treq->iov[i].secs * SECTOR_SIZE;
+	}
+
+	if (rw)
+		err = td_prep_writev(driver, &aio->tiocb, prv->fd,
+				     iov, treq->iovcnt, offset,
+				     tdaio_complete, aio);
+	else
+		err = td_prep_readv(driver, &aio->tiocb, prv->fd,
+				    iov, treq->iovcnt, offset,
+				    tdaio_complete, aio);
+	if (err) {
+		prv->iov_free_list[prv->iov_free_count++] = iov;
+		return err;
+	}
+
+	aio->iov = iov;
+	return 0;
+}
+
+/*
+ * The io backend cannot take iovecs, or no iovec array is free: fall
+ * back to one request per segment.
+ */
+static void
+tdaio_split_request(td_driver_t *driver, td_request_t treq, int rw)
+{
+	td_request_t clone = treq;
+	int i;
+
+	clone.iov    = NULL;
+	clone.iovcnt = 0;
+
+	for (i = 0; i < treq.iovcnt; i++) {
+		clone.buf  = treq.iov[i].base;
+		clone.secs = treq.iov[i].secs;
+		clone.sidx = i;
+
+		if (rw)
+			tdaio_queue_write(driver, clone);
+		else
+			tdaio_queue_read(driver, clone);
+
+		clone.sec += clone.secs;
+	}
+}
+
 void tdaio_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	int size;
@@ -188,8 +267,15 @@ void tdaio_queue_read(td_driver_t *driver, td_request_t treq)
 	aio->treq  = treq;
 	aio->state = prv;
 
-	td_prep_read(driver, &aio->tiocb, prv->fd, treq.buf,
-		     size, offset, tdaio_complete, aio);
+	if (treq.iovcnt) {
+		if (tdaio_prep_vectored(driver, aio, 0)) {
+			prv->aio_free_list[prv->aio_free_count++] = aio;
+			tdaio_split_request(driver, treq, 0);
+			return;
+		}
+	} else
+		td_prep_read(driver, &aio->tiocb, prv->fd, treq.buf,
+			     size, offset, tdaio_complete, aio);
 	td_queue_tiocb(driver, &aio->tiocb);
 
 	return;
@@ -216,8 +302,15 @@ void tdaio_queue_write(td_driver_t *driver, td_request_t treq)
 	aio->treq  = treq;
 	aio->state = prv;
 
-	td_prep_write(driver, &aio->tiocb, prv->fd, treq.buf,
-		      size, offset, tdaio_complete, aio);
+	if (treq.iovcnt) {
+		if (tdaio_prep_vectored(driver, aio, 1)) {
+			prv->aio_free_list[prv->aio_free_count++] = aio;
+			tdaio_split_request(driver, treq, 1);
+			return;
+		}
+	} else
+		td_prep_write(driver, &aio->tiocb, prv->fd, treq.buf,
+			      size, offset, tdaio_complete, aio);
 	td_queue_tiocb(driver, &aio->tiocb);
 
 	return;
@@ -226,12 +319,137 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+/*
+ * Discards, zeroing and flushes go straight to the file (or device), on
+ * the workers if there are any, as they block. They take an aio slot
+ * until done runs on the tapdisk thread.
+ */
+static int tdaio_fallocate(struct aio_request *aio, int mode)
+{
+	int err;
+
+	err = fallocate(aio->state->fd, mode | FALLOC_FL_KEEP_SIZE,
+			aio->treq.sec * (uint64_t)SECTOR_SIZE,
+			(uint64_t)aio->treq.secs * SECTOR_SIZE);
+
+	return err ? -errno : 0;
+}
+
+static void tdaio_discard_work(td_work_t *work)
+{
+	struct aio_request *aio = container_of(work, struct aio_request, work);
+
+	aio->error = tdaio_fallocate(aio, FALLOC_FL_PUNCH_HOLE);
+
+	/* a discard is only a hint */
+	if (aio->error == -EOPNOTSUPP || aio->error == -ENOSYS)
+		aio->error = 0;
+}
+
+static void tdaio_zero_work(td_work_t *work)
+{
+	struct aio_request *aio = container_of(work, struct aio_request, work);
+
+	aio->error = tdaio_fallocate(aio, FALLOC_FL_ZERO_RANGE);
+}
+
+static void tdaio_flush_work(td_work_t *work)
+{
+	struct aio_request *aio = container_of(work, struct aio_request, work);
+
+	aio->error = fdatasync(aio->state->fd) ? -errno : 0;
+}
+
+static void tdaio_work_done(td_work_t *work)
+{
+	struct aio_request *aio = container_of(work, struct aio_request, work);
+	struct tdaio_state *prv = aio->state;
+
+	td_complete_request(aio->treq, aio->error);
+	prv->aio_free_list[prv->aio_free_count++] = aio;
+}
+
+static void tdaio_zero_done(td_work_t *work)
+{
+	struct aio_request *aio = container_of(work, struct aio_request, work);
+	struct tdaio_state *prv = aio->state;
+	td_request_t treq = aio->treq;
+
+	if (aio->error != -EOPNOTSUPP && aio->error != -ENOSYS) {
+		tdaio_work_done(work);
+		return;
+	}
+
+	prv->aio_free_list[prv->aio_free_count++] = aio;
+
+	if (!prv->no_zero_range) {
+		DPRINTF("block-aio: zero range not supported, "
+			"writing zeroes\n");
+		prv->no_zero_range = 1;
+	}
+
+	td_queue_zero_writes(treq.image, treq);
+}
+
+static void tdaio_queue_work(td_driver_t *driver, td_request_t treq,
+			     td_work_fn_t fn, td_work_fn_t done)
+{
+	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
+	struct aio_request *aio;
+
+	if (prv->aio_free_count == 0) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	aio            = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq      = treq;
+	aio->state     = prv;
+	aio->error     = 0;
+	aio->work.fn   = fn;
+	aio->work.done = done;
+
+	if (prv->workers)
+		tapdisk_workers_queue(TD_WORKERS_SYNC, &aio->work);
+	else {
+		fn(&aio->work);
+		done(&aio->work);
+	}
+}
+
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	tdaio_queue_work(driver, treq, tdaio_discard_work, tdaio_work_done);
+}
+
+void tdaio_queue_write_zeroes(td_driver_t *driver, td_request_t treq)
+{
+	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
+
+	if (prv->no_zero_range) {
+		td_queue_zero_writes(treq.image, treq);
+		return;
+	}
+
+	tdaio_queue_work(driver, treq, tdaio_zero_work, tdaio_zero_done);
+}
+
+void tdaio_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	tdaio_queue_work(driver, treq, tdaio_flush_work, tdaio_work_done);
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
 	close(prv->fd);
 
+	if (prv->workers) {
+		tapdisk_workers_put(TD_WORKERS_SYNC);
+		prv->workers = 0;
+	}
+
 	return 0;
 }
 
@@ -261,12 +479,15 @@ void tdaio_stats(td_driver_t *driver, td_stats_t *st)
 
 struct tap_disk tapdisk_aio = {
 	.disk_type          = "tapdisk_aio",
-	.flags              = 0,
+	.flags              = TD_DISK_VECTORED,
 	.private_data_size  = sizeof(struct tdaio_state),
 	.td_open            = tdaio_open,
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_discard   = tdaio_queue_discard,
+	.td_queue_write_zeroes = tdaio_queue_write_zeroes,
+	.td_queue_flush     = tdaio_queue_flush,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
@@ -31,28 +31,53 @@
 #ifndef __BLOCK_AIO_H__
 #define __BLOCK_AIO_H__
 
+#include <sys/uio.h>
+
 #include "tapdisk.h"
+#include "tapdisk-workers.h"
 
 
 #define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
 
+/*
+ * iovec arrays for vectored requests, about one per guest request in
+ * flight. Vectored requests beyond that are split per segment.
+ */
+#define MAX_AIO_IOVS         MAX_REQUESTS
+
 struct tdaio_state;
 
 struct aio_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdaio_state  *state;
+	struct iovec        *iov;         /* vectored requests only */
+
+	/* discards, zeroing and flushes, on the workers */
+	td_work_t            work;
+	int                  error;
 };
 
 struct tdaio_state {
 	int                  fd;
 	td_driver_t         *driver;
+	int                  no_zero_range;
+	int                  workers;
 
 	int                  aio_free_count;
 	struct aio_request   aio_requests[MAX_AIO_REQS];
 	struct aio_request  *aio_free_list[MAX_AIO_REQS];
+
+	int                  iov_free_count;
+	struct iovec         iovs[MAX_AIO_IOVS][TD_IOV_MAX];
+	struct iovec        *iov_free_list[MAX_AIO_IOVS];
 };
 
 void tdaio_complete(void *arg, struct tiocb *tiocb, int err);
+void tdaio_queue_read(td_driver_t *driver, td_request_t treq);
+void tdaio_queue_write(td_driver_t *driver, td_request_t treq);
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq);
+void tdaio_queue_write_zeroes(td_driver_t *driver, td_request_t treq);
+void tdaio_queue_flush(td_driver_t *driver, td_request_t treq);
 
 #endif
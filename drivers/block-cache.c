@@ -39,10 +39,12 @@
 #include <sys/mman.h>
 
 #include "tapdisk.h"
+#include "tapdisk-stats.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-shared-cache.h"
 #include "timeout-math.h"
 
 #ifdef DEBUG
@@ -62,30 +64,50 @@
 
 #define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
-#define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
+#define BLOCK_CACHE_DEFAULT_SIZE        (10 << 20) /* 10MB cache */
+#define BLOCK_CACHE_REQUESTS            TAPDISK_DATA_REQUESTS
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
 typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
 
 typedef struct block_cache              block_cache_t;
+typedef struct block_cache_page         block_cache_page_t;
+typedef struct block_cache_store        block_cache_store_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
 
-struct radix_tree_page {
-	char                           *buf;
+/*
+ * The contents of a sector, held once however many sectors of however
+ * many caches read the same data. Each leaf holding it takes a reference.
+ */
+struct block_cache_page {
+	block_cache_page_t             *next;      /* hash chain */
+	uint64_t                        hash;
+	uint32_t                        refs;
+	char                            buf[RADIX_TREE_NODE_SIZE];
+};
+
+/*
+ * Pages of all caches in the process, by content hash. The cache size
+ * (TAPDISK3_BLOCK_CACHE_SIZE, in MB) bounds the pages and tree nodes
+ * together, not the sectors they stand for.
+ */
+struct block_cache_store {
+	int                             users;
+	size_t                          max_size;
 	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
+	uint32_t                        hash_mask;
+	block_cache_page_t            **hash;
+
+	uint64_t                        pages;
+	uint64_t                        refs;
 };
 
 struct radix_tree_leaf {
-	radix_tree_page_t              *page;
-	char                           *buf;
+	block_cache_page_t             *page;
 };
 
 struct radix_tree_link {
@@ -123,6 +145,9 @@ struct block_cache_stats {
 	uint64_t                        hits;
 	uint64_t                        misses;
 	uint64_t                        prunes;
+	uint64_t                        inserts;
+	uint64_t                        dedups;    /* inserts found in store */
+	uint64_t                        shared_hits;
 };
 
 struct block_cache {
@@ -131,6 +156,9 @@ struct block_cache {
 
 	uint64_t                        sectors;
 
+	int                             shared;
+	td_shared_image_t               image;
+
 	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
@@ -142,6 +170,216 @@ struct block_cache {
 	block_cache_stats_t             stats;
 };
 
+static block_cache_store_t store;
+
+#define BLOCK_CACHE_PRIME32_1           0x9E3779B1U
+#define BLOCK_CACHE_PRIME32_2           0x85EBCA77U
+#define BLOCK_CACHE_PRIME32_3           0xC2B2AE3DU
+#define BLOCK_CACHE_PRIME64_1           0x9E3779B185EBCA87ULL
+#define BLOCK_CACHE_PRIME64_2           0xC2B2AE3D27D4EB4FULL
+#define BLOCK_CACHE_PRIME64_3           0x165667B19E3779F9ULL
+#define BLOCK_CACHE_PRIME64_4           0x85EBCA77C2B2AE63ULL
+#define BLOCK_CACHE_PRIME64_5           0x27D4EB2F165667C5ULL
+
+#define BLOCK_CACHE_HASH_LANES          8
+#define BLOCK_CACHE_HASH_STRIPE         (BLOCK_CACHE_HASH_LANES * sizeof(uint64_t))
+#define BLOCK_CACHE_HASH_STRIPES        (RADIX_TREE_NODE_SIZE / BLOCK_CACHE_HASH_STRIPE)
+
+/* each stripe is keyed from one word further into the secret */
+static const uint64_t
+block_cache_secret[BLOCK_CACHE_HASH_LANES + BLOCK_CACHE_HASH_STRIPES - 1] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+	0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+	0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+	0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+	0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL,
+	0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+	0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL,
+	0x3159b4cd4be0518aULL,
+};
+
+static inline uint64_t
+block_cache_read64(const char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+block_cache_mul128_fold64(uint64_t a, uint64_t b)
+{
+	__uint128_t product = (__uint128_t)a * b;
+
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+/*
+ * An XXH3-style hash of one sector: eight independent lanes of 32x32
+ * multiplies over 64 byte stripes, which the compiler turns into vector
+ * code, folded and mixed at the end. Matches are always confirmed by
+ * comparing contents, so this only needs to spread well.
+ */
+static uint64_t
+block_cache_hash(const char *buf)
+{
+	uint64_t acc[BLOCK_CACHE_HASH_LANES] = {
+		BLOCK_CACHE_PRIME32_3, BLOCK_CACHE_PRIME64_1,
+		BLOCK_CACHE_PRIME64_2, BLOCK_CACHE_PRIME64_3,
+		BLOCK_CACHE_PRIME64_4, BLOCK_CACHE_PRIME32_2,
+		BLOCK_CACHE_PRIME64_5, BLOCK_CACHE_PRIME32_1,
+	};
+	const char *p;
+	uint64_t h;
+	int i, n;
+
+	for (n = 0; n < BLOCK_CACHE_HASH_STRIPES; n++) {
+		p = buf + n * BLOCK_CACHE_HASH_STRIPE;
+
+		for (i = 0; i < BLOCK_CACHE_HASH_LANES; i++) {
+			uint64_t v = block_cache_read64(p + i * sizeof(v));
+			uint64_t k = v ^ block_cache_secret[i + n];
+
+			acc[i ^ 1] += v;
+			acc[i]     += (k & 0xffffffff) * (k >> 32);
+		}
+	}
+
+	h = RADIX_TREE_NODE_SIZE * BLOCK_CACHE_PRIME64_1;
+	for (i = 0; i < BLOCK_CACHE_HASH_LANES; i += 2)
+		h += block_cache_mul128_fold64(acc[i] ^ block_cache_secret[i],
+					       acc[i + 1] ^
+					       block_cache_secret[i + 1]);
+
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static size_t
+block_cache_max_size(void)
+{
+	const char *size;
+	long mb;
+
+	size = getenv("TAPDISK3_BLOCK_CACHE_SIZE");
+	if (!size)
+		return BLOCK_CACHE_DEFAULT_SIZE;
+
+	mb = atol(size);
+	if (mb <= 0)
+		return BLOCK_CACHE_DEFAULT_SIZE;
+
+	return (size_t)mb << 20;
+}
+
+static int
+block_cache_store_get(void)
+{
+	size_t buckets;
+
+	if (store.users++)
+		return 0;
+
+	store.max_size = block_cache_max_size();
+
+	/* about two pages per chain when full */
+	buckets = 1;
+	while (buckets * 2 * sizeof(block_cache_page_t) < store.max_size)
+		buckets <<= 1;
+
+	store.hash = calloc(buckets, sizeof(block_cache_page_t *));
+	if (!store.hash) {
+		store.users--;
+		return -ENOMEM;
+	}
+
+	store.hash_mask = buckets - 1;
+	DPRINTF("block cache: %zu bytes, %zu hash chains\n",
+		store.max_size, buckets);
+
+	return 0;
+}
+
+static void
+block_cache_store_put(void)
+{
+	if (--store.users)
+		return;
+
+	free(store.hash);
+	memset(&store, 0, sizeof(store));
+}
+
+static inline int
+block_cache_store_full(uint64_t secs)
+{
+	return store.size + secs * sizeof(block_cache_page_t) >=
+		store.max_size;
+}
+
+/*
+ * Returns a reference to the page holding @buf, adding one if needed.
+ */
+static block_cache_page_t *
+block_cache_page_get(block_cache_t *cache, const char *buf)
+{
+	block_cache_page_t *page, **chain;
+	uint64_t hash;
+
+	hash  = block_cache_hash(buf);
+	chain = &store.hash[hash & store.hash_mask];
+
+	cache->stats.inserts++;
+
+	for (page = *chain; page; page = page->next)
+		if (page->hash == hash &&
+		    !memcmp(page->buf, buf, RADIX_TREE_NODE_SIZE)) {
+			cache->stats.dedups++;
+			goto out;
+		}
+
+	page = malloc(sizeof(block_cache_page_t));
+	if (!page)
+		return NULL;
+
+	memcpy(page->buf, buf, RADIX_TREE_NODE_SIZE);
+	page->hash = hash;
+	page->refs = 0;
+	page->next = *chain;
+	*chain     = page;
+
+	store.pages++;
+	store.size += sizeof(block_cache_page_t);
+
+out:
+	page->refs++;
+	store.refs++;
+	return page;
+}
+
+static void
+block_cache_page_put(block_cache_page_t *page)
+{
+	block_cache_page_t **p;
+
+	store.refs--;
+	if (--page->refs)
+		return;
+
+	for (p = &store.hash[page->hash & store.hash_mask]; *p != page;
+	     p = &(*p)->next)
+		;
+	*p = page->next;
+
+	store.pages--;
+	store.size -= sizeof(block_cache_page_t);
+	free(page);
+}
+
 static inline uint64_t
 radix_tree_calculate_size(int height)
 {
@@ -182,12 +420,6 @@ radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
 	return (node->height == tree->height);
 }
 
-static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
-{
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
-}
-
 static inline void
 radix_tree_clear_link(radix_tree_link_t *link)
 {
@@ -206,6 +438,7 @@ radix_tree_allocate_node(radix_tree_t *tree, int height)
 
 	node->height = height;
 	tree->nodes++;
+	store.size += sizeof(radix_tree_node_t);
 
 	return node;
 }
@@ -224,78 +457,23 @@ radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
 
 	free(node);
 	tree->nodes--;
-}
-
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
-{
-	radix_tree_page_t *page;
-
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
-		return NULL;
-
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
-
-	return page;
-}
-
-static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
-{
-	int i;
-
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
-
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	store.size -= sizeof(radix_tree_node_t);
 }
 
 /*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
+ * drop the page of a leaf. nodes are not deleted; gc will reap them later.
  */
 static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
+radix_tree_remove_leaf(radix_tree_t *tree, radix_tree_link_t *link)
 {
-	int i;
-
-	if (!page)
+	if (!link->u.leaf.page)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
+	block_cache_page_put(link->u.leaf.page);
+	link->u.leaf.page = NULL;
 
-	radix_tree_free_page(tree, page);
-}
-
-static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
-{
-	int i;
-
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
-		return;
-
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
-			continue;
-
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
-
-		break;
-	}
+	tree->size -= RADIX_TREE_NODE_SIZE;
+	tree->cache->stats.prunes++;
 }
 
 static char *
@@ -315,7 +493,7 @@ radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
 		link->time = now.tv_sec;
 
 		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+			return link->u.leaf.page ? link->u.leaf.page->buf : NULL;
 
 		if (!link->u.next)
 			return NULL;
@@ -324,9 +502,9 @@ radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
 	} while (1);
 }
 
-static char *
+static int
 radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
+		    block_cache_page_t *page)
 {
 	int idx;
 	struct timeval now;
@@ -342,16 +520,17 @@ radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
 		link->time = now.tv_sec;
 
 		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
+			radix_tree_remove_leaf(tree, link);
+			link->u.leaf.page = page;
+			tree->size += RADIX_TREE_NODE_SIZE;
+			return 0;
 		}
 
 		if (!link->u.next) {
 			link->u.next = radix_tree_allocate_child_node(tree,
 								      node);
 			if (!link->u.next)
-				return NULL;
+				return -ENOMEM;
 		}
 
 		node = link->u.next;
@@ -363,24 +542,21 @@ radix_tree_add_leaves(radix_tree_t *tree, char *buf,
 		      uint64_t sector, uint64_t sectors)
 {
 	int i;
-	radix_tree_page_t *page;
+	block_cache_page_t *page;
 
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
-		return -ENOMEM;
+	for (i = 0; i < sectors; i++) {
+		page = block_cache_page_get(tree->cache,
+					    buf + ((size_t)i << RADIX_TREE_NODE_SHIFT));
+		if (!page)
+			return -ENOMEM;
 
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, ((off_t)i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
+		if (radix_tree_add_leaf(tree, sector + i, page)) {
+			block_cache_page_put(page);
+			return -ENOMEM;
+		}
+	}
 
 	return 0;
-
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
 }
 
 static void
@@ -396,7 +572,7 @@ radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
 		link = node->links + i;
 
 		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
+			radix_tree_remove_leaf(tree, link);
 		else
 			radix_tree_delete_branch(tree, link->u.next);
 
@@ -445,7 +621,7 @@ radix_tree_prune_branch(radix_tree_t *tree,
 		}
 
 		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
+			radix_tree_remove_leaf(tree, link);
 		else
 			radix_tree_delete_branch(tree, link->u.next);
 
@@ -524,6 +700,51 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+/*
+ * Pins everything but a shared segment already mapped, which is left to
+ * fault in on use.
+ */
+static void
+block_cache_mlock(void)
+{
+	td_shared_cache_info_t info;
+	int flags = MCL_FUTURE;
+
+	tapdisk_shared_cache_info(&info);
+	if (!info.size)
+		flags |= MCL_CURRENT;
+
+	if (mlockall(flags))
+		DPRINTF("mlockall failed: %d\n", -errno);
+}
+
+/*
+ * Only VHDs have an identity other tapdisks agree on.  Plaintext of an
+ * encrypted chain must not leave this process, so it is never shared.
+ */
+static int
+block_cache_shared_open(block_cache_t *cache,
+			struct td_vbd_encryption *encryption)
+{
+	int err;
+
+	if (encryption && encryption->encryption_key)
+		return -EPERM;
+
+	err = tapdisk_shared_cache_get();
+	if (err)
+		return err;
+
+	err = tapdisk_shared_image_vhd(cache->name, &cache->image);
+	if (err) {
+		tapdisk_shared_cache_put();
+		return err;
+	}
+
+	cache->shared = 1;
+	return 0;
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name,
 		 struct td_vbd_encryption *encryption, td_flag_t flags)
@@ -543,6 +764,12 @@ block_cache_open(td_driver_t *driver, const char *name,
 	if (err)
 		return -ENOMEM;
 
+	err = block_cache_store_get();
+	if (err) {
+		free(cache->name);
+		return err;
+	}
+
 	cache->sectors = driver->info.size;
 
 	tree = &cache->tree;
@@ -555,26 +782,33 @@ block_cache_open(td_driver_t *driver, const char *name,
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
+	block_cache_mlock();
+
+	if (!block_cache_shared_open(cache, encryption))
+		DPRINTF("%s: sectors shared host-wide\n", cache->name);
+
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
 							  TV_SECS(BLOCK_CACHE_PAGE_IDLETIME << 1),
 							  block_cache_prune_event,
 							  cache);
-	if (cache->timeout_id < 0)
+	if (cache->timeout_id < 0) {
+		err = cache->timeout_id;
 		goto fail;
+	}
 
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
 
-	if (mlockall(MCL_CURRENT | MCL_FUTURE))
-		DPRINTF("mlockall failed: %d\n", -errno);
-
 	return 0;
 
 fail:
+	if (cache->shared)
+		tapdisk_shared_cache_put();
 	free(cache->name);
 	radix_tree_free(&cache->tree);
+	block_cache_store_put();
 	return err;
 }
 
@@ -591,30 +825,14 @@ block_cache_close(td_driver_t *driver)
 
 	tapdisk_server_unregister_event(cache->timeout_id);
 	radix_tree_free(tree);
+	block_cache_store_put();
+	if (cache->shared)
+		tapdisk_shared_cache_put();
 	free(cache->name);
 
 	return 0;
 }
 
-static inline uint64_t
-block_cache_hash(block_cache_t *cache, char *buf)
-{
-	return 0;
-#if 0
-	int i, n;
-	uint64_t cksm, *data;
-
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
-
-	for (i = 0; i < n; i++)
-		cksm += data[i];
-
-	return ~cksm;
-#endif
-}
-
 static void
 block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 {
@@ -624,8 +842,8 @@ block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 	cache->stats.hits += treq.secs;
 
 	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
+		DBG("%s: block cache hit: sec 0x%08llx\n",
+		    cache->name, treq.sec + i);
 
 		off = (off_t)i << RADIX_TREE_NODE_SHIFT;
 		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
@@ -656,6 +874,16 @@ block_cache_populate_cache(td_request_t clone, int err)
 		goto out;
 	}
 
+	if (cache->shared) {
+		for (i = 0; i < breq->treq.secs; i++) {
+			off_t off = (off_t)i << RADIX_TREE_NODE_SHIFT;
+			tapdisk_shared_cache_write(&cache->image,
+						   breq->treq.sec + i,
+						   breq->treq.buf + off);
+		}
+		goto out;
+	}
+
 	for (i = 0; i < breq->treq.secs; i++) {
 		off_t off = (off_t)i << RADIX_TREE_NODE_SHIFT;
 		DBG("%s: populating sec 0x%08llx\n",
@@ -664,9 +892,9 @@ block_cache_populate_cache(td_request_t clone, int err)
 		       breq->buf + off, RADIX_TREE_NODE_SIZE);
 	}
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+	radix_tree_add_leaves(tree, breq->buf,
+			      breq->treq.sec, breq->treq.secs);
+	free(breq->buf);
 
 out:
 	td_complete_request(breq->treq, breq->err);
@@ -679,25 +907,26 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	void *buf;
 	size_t size;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
 	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
 
 	clone = treq;
-	tree  = &cache->tree;
 	size  = (size_t)treq.secs << RADIX_TREE_NODE_SHIFT;
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
+	if (!cache->shared && block_cache_store_full(treq.secs))
 		goto out;
 
 	breq = block_cache_get_request(cache);
 	if (!breq)
 		goto out;
 
-	if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
+	/* shared sectors are copied out of the request itself */
+	if (cache->shared)
+		buf = NULL;
+	else if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
 		block_cache_put_request(cache, breq);
 		goto out;
 	}
@@ -708,7 +937,7 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	breq->buf     = buf;
 	breq->cache   = cache;
 
-	clone.buf     = buf;
+	clone.buf     = buf ? buf : treq.buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
@@ -716,6 +945,25 @@ out:
 	td_forward_request(clone);
 }
 
+static void
+block_cache_shared_read(block_cache_t *cache, td_request_t treq)
+{
+	int i;
+	off_t off;
+
+	for (i = 0; i < treq.secs; i++) {
+		off = (off_t)i << RADIX_TREE_NODE_SHIFT;
+		if (tapdisk_shared_cache_read(&cache->image, treq.sec + i,
+					      treq.buf + off))
+			return block_cache_miss(cache, treq);
+	}
+
+	cache->stats.hits        += treq.secs;
+	cache->stats.shared_hits += treq.secs;
+
+	td_complete_request(treq, 0);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -729,6 +977,10 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	cache->stats.reads += treq.secs;
 
+	/* shared reads copy straight into the request, at any size */
+	if (cache->shared)
+		return block_cache_shared_read(cache, treq);
+
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
@@ -766,6 +1018,12 @@ block_cache_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static double
+block_cache_ratio(uint64_t n, uint64_t d)
+{
+	return d ? (double)n / d : 0.0;
+}
+
 static void
 block_cache_debug(td_driver_t *driver)
 {
@@ -777,8 +1035,86 @@ block_cache_debug(td_driver_t *driver)
 
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", "
-	     "misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	     "misses: %"PRIu64", prunes: %"PRIu64", hit ratio: %.3f\n",
+	     stats->reads, stats->hits, stats->misses, stats->prunes,
+	     block_cache_ratio(stats->hits, stats->reads));
+	WARN("sectors: %"PRIu64", inserts: %"PRIu64", dedups: %"PRIu64"\n",
+	     cache->tree.size >> RADIX_TREE_NODE_SHIFT, stats->inserts,
+	     stats->dedups);
+	WARN("store: %zu of %zu bytes, pages: %"PRIu64", refs: %"PRIu64", "
+	     "dedup ratio: %.3f\n", store.size, store.max_size, store.pages,
+	     store.refs, block_cache_ratio(store.refs, store.pages));
+
+	if (cache->shared) {
+		td_shared_cache_info_t info;
+
+		tapdisk_shared_cache_info(&info);
+		WARN("shared: %zu bytes, slots: %"PRIu64", hits: %"PRIu64", "
+		     "process lookups: %"PRIu64", hits: %"PRIu64", "
+		     "inserts: %"PRIu64", evictions: %"PRIu64", "
+		     "busy: %"PRIu64"\n", info.size, info.slots,
+		     stats->shared_hits, info.lookups, info.hits, info.inserts,
+		     info.evictions, info.busy);
+	}
+}
+
+static void
+block_cache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	block_cache_t *cache;
+	block_cache_stats_t *stats;
+
+	cache = (block_cache_t *)driver->data;
+	stats = &cache->stats;
+
+	tapdisk_stats_field(st, "reads", "llu",
+			    (unsigned long long)stats->reads);
+	tapdisk_stats_field(st, "hits", "llu",
+			    (unsigned long long)stats->hits);
+	tapdisk_stats_field(st, "misses", "llu",
+			    (unsigned long long)stats->misses);
+	tapdisk_stats_field(st, "prunes", "llu",
+			    (unsigned long long)stats->prunes);
+	tapdisk_stats_field(st, "hit_ratio", ".3f",
+			    block_cache_ratio(stats->hits, stats->reads));
+	tapdisk_stats_field(st, "sectors", "llu",
+			    (unsigned long long)(cache->tree.size >>
+						 RADIX_TREE_NODE_SHIFT));
+	tapdisk_stats_field(st, "dedups", "llu",
+			    (unsigned long long)stats->dedups);
+
+	tapdisk_stats_field(st, "store", "{");
+	tapdisk_stats_field(st, "size", "zu", store.size);
+	tapdisk_stats_field(st, "max_size", "zu", store.max_size);
+	tapdisk_stats_field(st, "pages", "llu",
+			    (unsigned long long)store.pages);
+	tapdisk_stats_field(st, "refs", "llu",
+			    (unsigned long long)store.refs);
+	tapdisk_stats_field(st, "dedup_ratio", ".3f",
+			    block_cache_ratio(store.refs, store.pages));
+	tapdisk_stats_leave(st, '}');
+
+	if (cache->shared) {
+		td_shared_cache_info_t info;
+
+		tapdisk_shared_cache_info(&info);
+
+		tapdisk_stats_field(st, "shared", "{");
+		tapdisk_stats_field(st, "hits", "llu",
+				    (unsigned long long)stats->shared_hits);
+		tapdisk_stats_field(st, "size", "zu", info.size);
+		tapdisk_stats_field(st, "slots", "llu",
+				    (unsigned long long)info.slots);
+		tapdisk_stats_field(st, "lookups", "llu",
+				    (unsigned long long)info.lookups);
+		tapdisk_stats_field(st, "inserts", "llu",
+				    (unsigned long long)info.inserts);
+		tapdisk_stats_field(st, "evictions", "llu",
+				    (unsigned long long)info.evictions);
+		tapdisk_stats_field(st, "busy", "llu",
+				    (unsigned long long)info.busy);
+		tapdisk_stats_leave(st, '}');
+	}
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -792,4 +1128,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
@@ -409,30 +409,23 @@ void
 vhd_close_crypto(vhd_context_t *vhd)
 {
 	if (vhd->xts_tfm)
-	{
-		EVP_CIPHER_CTX_free(vhd->xts_tfm->en_ctx);
-		EVP_CIPHER_CTX_free(vhd->xts_tfm->de_ctx);
-		free(vhd->xts_tfm);
-	}
+		xts_aes_free(vhd->xts_tfm);
 }
 
-void
+int
 vhd_crypto_decrypt(vhd_context_t *vhd, td_request_t *t)
 {
-	int sec, ret;
-
-	for (sec = 0; sec < t->secs; sec++) {
-		ret = xts_aes_plain_decrypt(vhd->xts_tfm, t->sec + sec,
-					    (uint8_t *)t->buf +
-					    sec * VHD_SECTOR_SIZE,
-					    (uint8_t *)t->buf +
-					    sec * VHD_SECTOR_SIZE,
-					    VHD_SECTOR_SIZE);
-		if (ret) {
-			DPRINTF("crypto decrypt failed: %d : TERMINATED\n", ret);
-			exit(1); /* XXX */
-		}
+	int ret;
+
+	ret = xts_aes_plain_decrypt_sectors(vhd->xts_tfm, t->sec,
+					    (uint8_t *)t->buf,
+					    (uint8_t *)t->buf, t->secs);
+	if (ret) {
+		EPRINTF("crypto decrypt failed: %d\n", ret);
+		return -EIO;
 	}
+
+	return 0;
 }
 
 int
@@ -442,21 +435,18 @@ vhd_crypto_encrypt_block(vhd_context_t *vhd, sector_t sector, uint8_t *source,
 	return xts_aes_plain_encrypt(vhd->xts_tfm, sector, dst, source, block_size);
 }
 
-void
+int
 vhd_crypto_encrypt(vhd_context_t *vhd, td_request_t *t, char *orig_buf)
 {
-	int sec, ret;
-
-	for (sec = 0; sec < t->secs; sec++) {
-		ret = vhd_crypto_encrypt_block(
-			vhd, t->sec + sec,
-			(uint8_t *)orig_buf + sec * VHD_SECTOR_SIZE,
-			(uint8_t *)t->buf + sec * VHD_SECTOR_SIZE,
-			VHD_SECTOR_SIZE);
-		if (ret) {
-			DPRINTF("crypto encrypt failed: %d : TERMINATED\n", ret);
-			exit(1); /* XXX */
-		}
+	int ret;
+
+	ret = xts_aes_plain_encrypt_sectors(vhd->xts_tfm, t->sec,
+					    (uint8_t *)t->buf,
+					    (uint8_t *)orig_buf, t->secs);
+	if (ret) {
+		EPRINTF("crypto encrypt failed: %d\n", ret);
+		return -EIO;
 	}
-}
 
+	return 0;
+}
@@ -74,7 +74,8 @@ typedef struct lcache                   td_lcache_t;
 typedef struct lcache_request           td_lcache_req_t;
 
 struct lcache_request {
-	char                           *buf;
+	char                           *buf;        /* TD_LCACHE_BUFSZ, locked */
+	char                           *xbuf;       /* reads beyond that */
 	int                             err;
 
 	td_request_t                    treq;
@@ -115,9 +116,40 @@ static void
 lcache_free_request(td_lcache_t *cache, td_lcache_req_t *req)
 {
 	BUG_ON(cache->n_free >= TD_LCACHE_MAX_REQ);
+
+	free(req->xbuf);
+	req->xbuf = NULL;
+
 	cache->free[cache->n_free++] = req;
 }
 
+static inline char *
+lcache_request_buf(td_lcache_req_t *req)
+{
+	return req->xbuf ? : req->buf;
+}
+
+/*
+ * Only the common case is pinned up front. The rare read larger than
+ * that, now that indirect requests reach 1MB, gets a buffer of its own.
+ */
+static int
+lcache_request_size(td_lcache_req_t *req, size_t size)
+{
+	void *buf;
+	int err;
+
+	if (size <= TD_LCACHE_BUFSZ)
+		return 0;
+
+	err = posix_memalign(&buf, 1 << PAGE_SHIFT, size);
+	if (err)
+		return -err;
+
+	req->xbuf = buf;
+	return 0;
+}
+
 static void
 lcache_destroy_buffers(td_lcache_t *cache)
 {
@@ -126,7 +158,7 @@ lcache_destroy_buffers(td_lcache_t *cache)
 	do {
 		req = lcache_alloc_request(cache);
 		if (req)
-			munmap(req->buf, (size_t)TD_REQ_BUFFER_SIZE);
+			munmap(req->buf, (size_t)TD_LCACHE_BUFSZ);
 	} while (req);
 }
 
@@ -143,7 +175,7 @@ lcache_create_buffers(td_lcache_t *cache)
 	for (i = 0; i < TD_LCACHE_MAX_REQ; i++) {
 		td_lcache_req_t *req = &cache->reqv[i];
 
-		req->buf = mmap(NULL, (size_t)TD_REQ_BUFFER_SIZE, prot, flags, -1, 0);
+		req->buf = mmap(NULL, (size_t)TD_LCACHE_BUFSZ, prot, flags, -1, 0);
 		if (req->buf == MAP_FAILED) {
 			req->buf = NULL;
 			err = -errno;
@@ -274,7 +306,7 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 	int err;
 
 	iov          = &req->iov;
-	iov->base    = req->buf;
+	iov->base    = lcache_request_buf(req);
 	iov->secs    = req->treq.secs;
 
 	vreq         = &req->vreq;
@@ -297,7 +329,7 @@ lcache_complete_read(td_lcache_t *cache, td_lcache_req_t *req)
 {
 	if (likely(!req->err)) {
 		size_t sz = (size_t)req->treq.secs << SECTOR_SHIFT;
-		memcpy(req->treq.buf, req->buf, sz);
+		memcpy(req->treq.buf, lcache_request_buf(req), sz);
 	}
 
 	td_complete_request(req->treq, req->err);
@@ -330,6 +362,7 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	td_lcache_t *cache = driver->data;
 	td_request_t clone;
 	td_lcache_req_t *req;
+	int err;
 
 	req = lcache_alloc_request(cache);
 	if (!req) {
@@ -337,6 +370,13 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 		return;
 	}
 
+	err = lcache_request_size(req, (size_t)treq.secs << SECTOR_SHIFT);
+	if (err) {
+		lcache_free_request(cache, req);
+		td_complete_request(treq, err);
+		return;
+	}
+
 	req->treq    = treq;
 	req->cache   = cache;
 
@@ -344,7 +384,7 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	req->err     = 0;
 
 	clone         = treq;
-	clone.buf     = req->buf;
+	clone.buf     = lcache_request_buf(req);
 	clone.cb      = __lcache_read_cb;
 	clone.cb_data = req;
 
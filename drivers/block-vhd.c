@@ -47,6 +47,11 @@
  *     writes and the zero-bitmap write complete, the BAT and bitmap writes
  *     are started in parallel.  The transaction is completed only after both
  *     the BAT and bitmap writes successfully return.
+ *   - Preallocated BAT updates: when preallocating, the whole new block is
+ *     zeroed (with FALLOC_FL_ZERO_RANGE, or asynchronous zero writes if the
+ *     filesystem lacks it) before the BAT write is issued.  Data writes to
+ *     a block still being zeroed are held back until zeroing completes.
+ *     The bitmap write follows the data and BAT writes.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -75,10 +80,17 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-image.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "timeout-math.h"
 #include "block-crypto.h"
+#include "tapdisk-workers.h"
 
 unsigned int SPB;
 
+extern struct tap_disk tapdisk_vhd;
+
 #define DEBUGGING   2
 #define MICROSOFT_COMPAT
 
@@ -88,10 +100,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%u, BBLK: 0x%04x\n",				\
+		    "%u, ALLOCS: %d\n",					\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.nr_allocs);					\
 	} while(0)
 
 #if (DEBUGGING == 1)
@@ -110,11 +122,27 @@ unsigned int SPB;
 
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE_MAX           65536
+#define VHD_CACHE_TOTAL_MAX          65536 /* all images in the process */
+#define VHD_BAT_ALLOCS               8  /* concurrent block allocations */
+#define VHD_BAT_ENTRIES_PER_SEC      (VHD_SECTOR_SIZE / sizeof(uint32_t))
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
+#define VHD_REQS_META                (VHD_CACHE_SIZE + 2 * VHD_BAT_ALLOCS)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
+/*
+ * Bounce buffers for encrypted writes come from a pool of pages, enough
+ * for a ring full of the largest writes, rounded up to a huge page.
+ */
+#define VHD_BOUNCE_PAGE_SHIFT        12
+#define VHD_BOUNCE_PAGE_SIZE         (1 << VHD_BOUNCE_PAGE_SHIFT)
+#define VHD_BOUNCE_HUGEPAGE_SIZE     (2 << 20)
+#define VHD_BOUNCE_POOL_PAGES        (MAX_REQUESTS * TD_MAX_SEGMENTS_PER_REQUEST)
+#define VHD_BOUNCE_POOL_SIZE					\
+	((((size_t)VHD_BOUNCE_POOL_PAGES << VHD_BOUNCE_PAGE_SHIFT) +	\
+	  VHD_BOUNCE_HUGEPAGE_SIZE - 1) & ~(VHD_BOUNCE_HUGEPAGE_SIZE - 1))
+
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
 #define VHD_OP_DATA_WRITE            2
@@ -123,6 +151,9 @@ unsigned int SPB;
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
 #define VHD_OP_BLOCK_STATUS          7
+#define VHD_OP_PREALLOC_WRITE        8
+#define VHD_OP_FALLOCATE             9
+#define VHD_OP_FLUSH                 10
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -140,8 +171,10 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_NO_O_DIRECT    64
 #define VHD_FLAG_OPEN_LOCAL_CACHE    128
 
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_ALLOC_BUSY          1
+#define VHD_FLAG_ALLOC_BAT_READY     2
+#define VHD_FLAG_ALLOC_BAT_STARTED   4
+#define VHD_FLAG_ALLOC_ZEROING       8
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
@@ -152,9 +185,11 @@ unsigned int SPB;
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_ENCRYPTED       16
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_COMMIT_WAIT      4
 
 typedef uint8_t vhd_flag_t;
 
@@ -185,22 +220,64 @@ struct vhd_request {
 	struct vhd_state         *state;
 	struct vhd_request       *next;
 	struct vhd_transaction   *tx;
+
+	/* en/decryption, or a blocking call, on the workers */
+	td_work_t                 work;
+	uint64_t                  offset;      /* of the pending data write */
+	struct list_head          crypto;      /* position on crypto_writes */
+	int                       mode;        /* of VHD_OP_FALLOCATE */
+};
+
+/*
+ * A block allocation in flight.  The new block is reserved at the end of
+ * the file immediately, so several allocations can proceed in parallel;
+ * the BAT entry is only committed once the bitmap area is initialized.
+ */
+struct vhd_bat_alloc {
+	vhd_flag_t                status;
+	int                       error;
+	uint32_t                  blk;         /* blk num of pending write */
+	uint64_t                  lb_end;      /* next_db before reservation */
+	uint64_t                  offset;      /* sector offset of new bitmap */
+	struct vhd_transaction   *tx;          /* bitmap tx waiting on bat */
+	struct vhd_request        req;         /* bat write placeholder in tx */
+	struct vhd_request        zero_req;    /* for initializing bitmaps */
+};
+
+/*
+ * A BAT sector write.  At most one write per BAT sector is in flight;
+ * allocations in that sector which become ready meanwhile are batched
+ * into the next write.
+ */
+struct vhd_bat_write {
+	uint32_t                  bsec;        /* bat sector being written */
+	uint32_t                  allocs;      /* mask of allocations carried */
+	struct vhd_request        req;
+	char                     *buf;
 };
 
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
-	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
-	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
-	char                     *bat_buf;
+	uint8_t                  *full;        /* blocks known to be fully
+						* written, whether or not
+						* the batmap says so */
+	int                       nr_allocs;
+	struct vhd_bat_alloc      alloc[VHD_BAT_ALLOCS];
+	struct vhd_bat_write      write[VHD_BAT_ALLOCS];
+	struct vhd_req_list       queue;       /* writes waiting for a free
+						* allocation slot */
+	uint64_t                  allocs;
+	uint64_t                  bat_writes;
+	uint64_t                  alloc_waits;
+	int                       requeue;     /* resubmit queued writes */
 };
 
 struct vhd_bitmap {
 	uint32_t                  blk;
-	uint64_t                  seqno;       /* lru sequence number */
+	struct hlist_node         hash;        /* bm_hash chain */
+	struct list_head          lru;         /* position on bm_lru */
+	struct list_head          commit;      /* position on bm_commit */
 	vhd_flag_t                status;
 
 	char                     *map;         /* map should only be modified
@@ -220,6 +297,53 @@ struct vhd_bitmap {
 	struct vhd_request        req;
 };
 
+/*
+ * Chain map: for each block, the index of the topmost parent image with
+ * that block allocated, VHD_CHAIN_HOLE if no image in the chain has it,
+ * or VHD_CHAIN_UNMAPPED if reads must walk the chain as usual.
+ */
+#define VHD_CHAIN_MAP_OFF            0
+#define VHD_CHAIN_MAP_UNBUILT        1
+#define VHD_CHAIN_MAP_READY          2
+
+#define VHD_CHAIN_UNMAPPED           0
+#define VHD_CHAIN_HOLE               0xffff
+#define VHD_CHAIN_MAX_DEPTH          (VHD_CHAIN_HOLE - 1)
+
+struct vhd_chain_map {
+	int                       status;
+	td_vbd_t                 *vbd;
+	uint32_t                  nr_blocks;
+	uint16_t                 *owner;
+	int                       nr_images;
+	td_image_t              **image;       /* parents, from 1 */
+	uint64_t                  direct;      /* reads sent to the owner */
+	uint64_t                  holes;       /* reads completed as zeros */
+};
+
+/*
+ * The bounce buffer pool, handing out runs of pages first fit. Huge
+ * pages are all there from the start, and are handed out from the end
+ * of the last run. Otherwise pages fault in as they are used, so runs
+ * come from the bottom of the pool, and only as much of it as writes
+ * keep in flight stays resident. A write which finds no room fails
+ * with -EBUSY, and is retried by the VBD once buffers have been
+ * returned. Writes larger than the whole pool get a buffer of their
+ * own.
+ */
+struct vhd_bounce_pool {
+	char                     *base;
+	uint32_t                  nr_pages;
+	uint32_t                  free_pages;
+	uint32_t                  hint;        /* page to search from */
+	uint8_t                  *used;        /* per page */
+	bool                      hugetlb;
+
+	uint64_t                  allocs;
+	uint64_t                  exhausted;   /* writes sent back as busy */
+	uint64_t                  oversize;    /* allocated outside the pool */
+};
+
 struct vhd_state {
 	vhd_flag_t                flags;
 
@@ -237,13 +361,64 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	uint64_t                  bm_lru;      /* lru sequence number */
+	/*
+	 * Preallocation: the file is zeroed up to prealloc_end (in sectors),
+	 * either through FALLOC_FL_ZERO_RANGE or by a stream of asynchronous
+	 * zero writes, the one in flight ending at prealloc_pending.  Up to
+	 * prealloc_blocks blocks beyond next_db are zeroed ahead of time.
+	 */
+	int                       prealloc_blocks;
+	bool                      no_zero_range;
+	uint64_t                  prealloc_end;
+	uint64_t                  prealloc_pending;
+	struct vhd_request        prealloc_req;
+
+	struct vhd_chain_map      chain;
+
+	/*
+	 * With crypto_workers, encryption and decryption run on the worker
+	 * pool. Encrypted writes wait on crypto_writes, in the order they
+	 * were queued, and are issued in that order.
+	 */
+	bool                      crypto_workers;
+	struct list_head          crypto_writes;
+	uint64_t                  crypto_offloads;
+
+	/* discards, zeroing and flushes run on the workers */
+	bool                      sync_workers;
+
+	struct vhd_bounce_pool    bounce;
+
 	uint32_t                  bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+
+	/*
+	 * Bitmap cache: bm_cache_size bitmaps, looked up by block through
+	 * bm_hash (1 << bm_hash_shift chains) and kept on bm_lru from least
+	 * to most recently used.
+	 */
+	int                       bm_cache_size;
+	int                       bm_hash_shift;
+	struct hlist_head        *bm_hash;
+	struct list_head          bm_lru;
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_evictions;
+
+	/*
+	 * Group commit: a bitmap transaction whose data writes are done
+	 * stays open for bm_commit_delay, so that further writes to the
+	 * same block join it and share a single bitmap write.
+	 */
+	struct timeval            bm_commit_delay;
+	struct list_head          bm_commit;
+	event_id_t                bm_commit_event;
+	uint64_t                  bm_writes;
+	uint64_t                  bm_write_reqs;
+	uint64_t                  bm_deferred;
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -273,9 +448,9 @@ struct crypto_interface
 		vhd_context_t *, const uint8_t *, size_t,
 		const char *);
 	void (*vhd_close_crypto)(vhd_context_t *);
-	void (*vhd_crypto_encrypt)(
+	int (*vhd_crypto_encrypt)(
 		vhd_context_t *, td_request_t *, char *);
-	void (*vhd_crypto_decrypt)(vhd_context_t *, td_request_t *);
+	int (*vhd_crypto_decrypt)(vhd_context_t *, td_request_t *);
 };
 
 static struct crypto_interface *crypto_interface = NULL;
@@ -288,7 +463,9 @@ static void *crypto_handle;
 #define bat_entry(s, blk)          ((s)->bat.bat.bat[(blk)])
 
 static void vhd_complete(void *, struct tiocb *, int);
+static void vhd_queue_write(td_driver_t *, td_request_t);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void commit_data_transaction(struct vhd_state *, struct vhd_bitmap *);
 
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
@@ -372,9 +549,26 @@ _get_vhd_zeros(const char *func, unsigned long size)
 
 #define vhd_zeros(size)	_get_vhd_zeros(__func__, size)
 
+static inline void
+set_block_full(struct vhd_state *s, uint32_t blk)
+{
+	if (s->bat.full && blk < s->bat.bat.entries)
+		set_bit(s->bat.full, blk);
+}
+
+static inline int
+test_block_full(struct vhd_state *s, uint32_t blk)
+{
+	if (!s->bat.full || blk >= s->bat.bat.entries)
+		return 0;
+	return test_bit(s->bat.full, blk);
+}
+
 static inline void
 set_batmap(struct vhd_state *s, uint32_t blk)
 {
+	set_block_full(s, blk);
+
 	if (s->bat.batmap.map) {
 		vhd_batmap_set(&s->vhd, &s->bat.batmap, blk);
 		DBG(TLOG_DBG, "block 0x%x completely full\n", blk);
@@ -455,10 +649,14 @@ find_next_free_block(struct vhd_state *s)
 static void
 vhd_free_bat(struct vhd_state *s)
 {
+	int i;
+
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
-	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	free(s->bat.full);
+	for (i = 0; i < VHD_BAT_ALLOCS; i++)
+		free(s->bat.write[i].buf);
+	memset(&s->bat, 0, sizeof(struct vhd_bat_state));
 }
 
 static int
@@ -467,7 +665,7 @@ vhd_initialize_bat(struct vhd_state *s)
 	int err, batmap_required, i;
 	void *buf;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(struct vhd_bat_state));
 
 	err = vhd_read_bat(&s->vhd, &s->bat.bat);
 	if (err) {
@@ -501,11 +699,30 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
-	if (err)
+	/*
+	 * The batmap seeds the in-memory full-block bits; reading or
+	 * writing a full bitmap sets the rest, so that no block's bitmap
+	 * is read more than once even without a (valid) batmap.
+	 */
+	s->bat.full = calloc((s->bat.bat.entries + 7) >> 3, 1);
+	if (!s->bat.full) {
+		err = -ENOMEM;
 		goto fail;
+	}
+
+	for (i = 0; i < s->bat.bat.entries; i++)
+		if (test_batmap(s, i))
+			set_bit(s->bat.full, i);
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+		if (err) {
+			err = -err;
+			goto fail;
+		}
 
-	s->bat.bat_buf = buf;
+		s->bat.write[i].buf = buf;
+	}
 
 	return 0;
 
@@ -514,36 +731,137 @@ fail:
 	return err;
 }
 
+/* bitmaps held by the caches of all open images */
+static int vhd_bitmap_cache_used;
+
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
+	if (s->bitmap_list) {
+		for (i = 0; i < s->bm_cache_size; i++) {
+			bm = s->bitmap_list + i;
+			free(bm->map);
+			free(bm->shadow);
+		}
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(s->bitmap_list);
+	free(s->bitmap_free);
+	free(s->bm_hash);
+
+	vhd_bitmap_cache_used -= s->bm_cache_size;
+	s->bm_cache_size = 0;
+
+	s->bitmap_list   = NULL;
+	s->bitmap_free   = NULL;
+	s->bm_hash       = NULL;
+	s->bm_free_count = 0;
+}
+
+static int
+vhd_bitmap_cache_env(const char *name, int def, int min, int max)
+{
+	const char *size;
+
+	size = getenv(name);
+	if (!size)
+		return def;
+
+	return MIN(MAX(atoi(size), min), max);
+}
+
+/*
+ * The size asked for at open time (tap-ctl -b) wins over
+ * TAPDISK3_VHD_BITMAP_CACHE_SIZE, which wins over VHD_CACHE_SIZE. A
+ * process serves several VBDs, each with a chain of images, so
+ * TAPDISK3_VHD_BITMAP_CACHE_TOTAL bounds the bitmaps of all of them:
+ * an image gets what is left of it if that is less than it asked for,
+ * and fails to open once it is spent.
+ */
+static int
+vhd_bitmap_cache_size(struct vhd_state *s, int want)
+{
+	int total, left;
+
+	if (want > 0)
+		want = MIN(MAX(want, VHD_CACHE_SIZE), VHD_CACHE_SIZE_MAX);
+	else
+		want = vhd_bitmap_cache_env("TAPDISK3_VHD_BITMAP_CACHE_SIZE",
+					    VHD_CACHE_SIZE, VHD_CACHE_SIZE,
+					    VHD_CACHE_SIZE_MAX);
+
+	total = vhd_bitmap_cache_env("TAPDISK3_VHD_BITMAP_CACHE_TOTAL",
+				     VHD_CACHE_TOTAL_MAX, 0, INT_MAX / 2);
+
+	left = MAX(total - vhd_bitmap_cache_used, 0);
+	if (left < want)
+		DPRINTF("%s: bitmap cache of %d, %d of %d left\n",
+			s->vhd.file, want, left, total);
+
+	return MIN(want, left);
+}
+
+static void
+vhd_initialize_bitmap_commit(struct vhd_state *s)
+{
+	const char *delay;
+	int usecs;
+
+	s->bm_commit_delay = TV_ZERO;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
+		return;
+
+	delay = getenv("TAPDISK3_VHD_BITMAP_COMMIT_US");
+	if (!delay)
+		return;
+
+	usecs = MIN(MAX(atoi(delay), 0), 1000000);
+	s->bm_commit_delay = TV_USECS(usecs);
 }
 
 static int
-vhd_initialize_bitmap_cache(struct vhd_state *s)
+vhd_initialize_bitmap_cache(struct vhd_state *s, int size)
 {
 	int i, err, map_size;
 	struct vhd_bitmap *bm;
 	void *map, *shadow;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	size = vhd_bitmap_cache_size(s, size);
+	if (!size) {
+		EPRINTF("%s: bitmap cache budget spent\n", s->vhd.file);
+		return -ENOMEM;
+	}
+
+	s->bm_cache_size = size;
+	vhd_bitmap_cache_used += s->bm_cache_size;
+	s->bm_hash_shift = 1;
+	while ((1 << s->bm_hash_shift) < s->bm_cache_size)
+		s->bm_hash_shift++;
+
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_commit);
+	s->bm_commit_event = -1;
+	vhd_initialize_bitmap_commit(s);
+	s->bm_hits       = 0;
+	s->bm_misses     = 0;
+	s->bm_evictions  = 0;
+	s->bm_free_count = 0;
+
+	s->bitmap_list = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap));
+	s->bitmap_free = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap *));
+	s->bm_hash     = calloc(1 << s->bm_hash_shift, sizeof(struct hlist_head));
+	if (!s->bitmap_list || !s->bitmap_free || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign(&map, 512, map_size);
@@ -560,7 +878,7 @@ vhd_initialize_bitmap_cache(struct vhd_state *s)
 
 		memset(bm->map, 0, map_size);
 		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+		s->bitmap_free[s->bm_free_count++] = bm;
 	}
 
 	return 0;
@@ -571,7 +889,7 @@ fail:
 }
 
 static int
-vhd_initialize_dynamic_disk(struct vhd_state *s)
+vhd_initialize_dynamic_disk(struct vhd_state *s, int bm_cache_size)
 {
 	uint32_t bm_size;
 	void *buf;
@@ -616,7 +934,7 @@ vhd_initialize_dynamic_disk(struct vhd_state *s)
 	if (err)
 		return err;
 
-	err = vhd_initialize_bitmap_cache(s);
+	err = vhd_initialize_bitmap_cache(s, bm_cache_size);
 	if (err) {
 		vhd_free_bat(s);
 		return err;
@@ -625,6 +943,44 @@ vhd_initialize_dynamic_disk(struct vhd_state *s)
 	return 0;
 }
 
+static void
+vhd_initialize_prealloc(struct vhd_state *s)
+{
+	const char *blocks;
+
+	s->prealloc_end     = s->next_db;
+	s->prealloc_pending = s->next_db;
+
+	blocks = getenv("TAPDISK3_VHD_PREALLOC_BLOCKS");
+	if (blocks)
+		s->prealloc_blocks = MAX(atoi(blocks), 0);
+}
+
+static void
+vhd_initialize_chain_map(struct vhd_state *s)
+{
+	const char *map;
+
+	map = getenv("TAPDISK3_VHD_CHAIN_MAP");
+	if (map && atoi(map) > 0)
+		s->chain.status = VHD_CHAIN_MAP_UNBUILT;
+}
+
+static void
+vhd_free_chain_map(struct vhd_state *s)
+{
+	struct vhd_chain_map *map = &s->chain;
+
+	free(map->owner);
+	free(map->image);
+
+	map->owner     = NULL;
+	map->image     = NULL;
+	map->nr_blocks = 0;
+	map->nr_images = 0;
+	map->status    = VHD_CHAIN_MAP_OFF;
+}
+
 static int
 vhd_check_version(struct vhd_state *s)
 {
@@ -724,11 +1080,11 @@ __load_crypto(struct td_vbd_encryption *encryption)
 			(void (*)(vhd_context_t *))
 			dlsym(crypto_handle, "vhd_close_crypto");
 		crypto_interface->vhd_crypto_encrypt =
-			(void (*)(vhd_context_t *, td_request_t *,
-				  char *))
+			(int (*)(vhd_context_t *, td_request_t *,
+				 char *))
 			dlsym(crypto_handle, "vhd_crypto_encrypt");
 		crypto_interface->vhd_crypto_decrypt =
-			(void (*)(vhd_context_t *, td_request_t *))
+			(int (*)(vhd_context_t *, td_request_t *))
 			dlsym(crypto_handle, "vhd_crypto_decrypt");
 
 		if (!crypto_interface->vhd_open_crypto ||
@@ -778,6 +1134,219 @@ __load_and_open_crypto(vhd_context_t *vhd, struct td_vbd_encryption *encryption,
 		vhd, encryption->encryption_key, encryption->key_size, name);
 }
 
+static bool
+vhd_is_encrypted(struct vhd_state *s)
+{
+	return s->vhd.xts_tfm != NULL;
+}
+
+static void
+vhd_initialize_bounce_pool(struct vhd_state *s)
+{
+	struct vhd_bounce_pool *pool = &s->bounce;
+	size_t size = VHD_BOUNCE_POOL_SIZE;
+	void *base;
+
+	if (!vhd_is_encrypted(s) ||
+	    test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
+		return;
+
+	pool->hugetlb = true;
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+		    -1, 0);
+	if (base == MAP_FAILED) {
+		pool->hugetlb = false;
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			EPRINTF("%s: no bounce buffer pool: %s\n",
+				s->vhd.file, strerror(errno));
+			return;
+		}
+
+		madvise(base, size, MADV_HUGEPAGE);
+	}
+
+	pool->nr_pages = size >> VHD_BOUNCE_PAGE_SHIFT;
+	pool->used = calloc(pool->nr_pages, sizeof(uint8_t));
+	if (!pool->used) {
+		munmap(base, size);
+		pool->nr_pages = 0;
+		return;
+	}
+
+	pool->base       = base;
+	pool->free_pages = pool->nr_pages;
+
+	DPRINTF("%s: %zu bytes of bounce buffers%s\n", s->vhd.file, size,
+		pool->hugetlb ? " in huge pages" : "");
+}
+
+static void
+vhd_free_bounce_pool(struct vhd_state *s)
+{
+	struct vhd_bounce_pool *pool = &s->bounce;
+
+	if (!pool->base)
+		return;
+
+	ASSERT(pool->free_pages == pool->nr_pages);
+	DPRINTF("%s: bounce buffers: %"PRIu64" allocs, %"PRIu64" exhausted, "
+		"%"PRIu64" oversize\n", s->vhd.file, pool->allocs,
+		pool->exhausted, pool->oversize);
+
+	munmap(pool->base, (size_t)pool->nr_pages << VHD_BOUNCE_PAGE_SHIFT);
+	free(pool->used);
+	memset(pool, 0, sizeof(*pool));
+}
+
+static int
+vhd_bounce_find(struct vhd_bounce_pool *pool, uint32_t from, uint32_t to,
+		uint32_t n)
+{
+	uint32_t i, run = 0;
+
+	for (i = from; i < to; i++) {
+		run = pool->used[i] ? 0 : run + 1;
+		if (run == n)
+			return i + 1 - n;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns a buffer for @secs sectors, or NULL if the pool has no room
+ * for it now.
+ */
+static char *
+vhd_bounce_get(struct vhd_state *s, uint32_t secs)
+{
+	struct vhd_bounce_pool *pool = &s->bounce;
+	size_t size = vhd_sectors_to_bytes(secs);
+	uint32_t n;
+	void *buf;
+	int start;
+
+	n = (size + VHD_BOUNCE_PAGE_SIZE - 1) >> VHD_BOUNCE_PAGE_SHIFT;
+
+	if (n > pool->nr_pages) {
+		if (posix_memalign(&buf, VHD_SECTOR_SIZE, size))
+			return NULL;
+		pool->oversize++;
+		return buf;
+	}
+
+	start = -1;
+	if (n <= pool->free_pages) {
+		start = vhd_bounce_find(pool, pool->hint, pool->nr_pages, n);
+		if (start < 0)
+			start = vhd_bounce_find(pool, 0,
+						MIN(pool->hint + n - 1,
+						    pool->nr_pages), n);
+	}
+	if (start < 0) {
+		pool->exhausted++;
+		return NULL;
+	}
+
+	memset(pool->used + start, 1, n);
+	pool->free_pages -= n;
+	if (pool->hugetlb)
+		pool->hint = (start + n) % pool->nr_pages;
+	pool->allocs++;
+
+	return pool->base + ((size_t)start << VHD_BOUNCE_PAGE_SHIFT);
+}
+
+static void
+vhd_bounce_put(struct vhd_state *s, char *buf, uint32_t secs)
+{
+	struct vhd_bounce_pool *pool = &s->bounce;
+	size_t size = vhd_sectors_to_bytes(secs);
+	uint32_t start, n;
+
+	if (!pool->base || buf < pool->base ||
+	    buf >= pool->base + ((size_t)pool->nr_pages <<
+				 VHD_BOUNCE_PAGE_SHIFT)) {
+		free(buf);
+		return;
+	}
+
+	start = (buf - pool->base) >> VHD_BOUNCE_PAGE_SHIFT;
+	n     = (size + VHD_BOUNCE_PAGE_SIZE - 1) >> VHD_BOUNCE_PAGE_SHIFT;
+
+	memset(pool->used + start, 0, n);
+	pool->free_pages += n;
+}
+
+static void
+vhd_initialize_crypto_workers(struct vhd_state *s)
+{
+	const char *threads;
+	int n, err;
+
+	if (!vhd_is_encrypted(s))
+		return;
+
+	threads = getenv("TAPDISK3_VHD_CRYPTO_THREADS");
+	if (!threads)
+		return;
+
+	n = atoi(threads);
+	if (n <= 0)
+		return;
+
+	err = tapdisk_workers_get(TD_WORKERS_CPU, n);
+	if (err) {
+		EPRINTF("%s: no crypto workers, encrypting inline: %d\n",
+			s->vhd.file, err);
+		return;
+	}
+
+	s->crypto_workers = true;
+}
+
+static void
+vhd_free_crypto_workers(struct vhd_state *s)
+{
+	if (!s->crypto_workers)
+		return;
+
+	ASSERT(list_empty(&s->crypto_writes));
+	DPRINTF("%s: %"PRIu64" requests en/decrypted by workers\n",
+		s->vhd.file, s->crypto_offloads);
+
+	tapdisk_workers_put(TD_WORKERS_CPU);
+	s->crypto_workers = false;
+}
+
+static void
+vhd_initialize_sync_workers(struct vhd_state *s)
+{
+	int n;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
+		return;
+
+	n = tapdisk_workers_sync_threads();
+	if (n <= 0 || tapdisk_workers_get(TD_WORKERS_SYNC, n))
+		return;
+
+	s->sync_workers = true;
+}
+
+static void
+vhd_free_sync_workers(struct vhd_state *s)
+{
+	if (!s->sync_workers)
+		return;
+
+	tapdisk_workers_put(TD_WORKERS_SYNC);
+	s->sync_workers = false;
+}
+
 static int
 __vhd_open(td_driver_t *driver, const char *name,
 	   struct td_vbd_encryption *encryption, vhd_flag_t flags)
@@ -794,6 +1363,10 @@ __vhd_open(td_driver_t *driver, const char *name,
 
 	s->flags  = flags;
 	s->driver = driver;
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_commit);
+	INIT_LIST_HEAD(&s->crypto_writes);
+	s->bm_commit_event = -1;
 
 	err = vhd_initialize(s);
 	if (err)
@@ -826,9 +1399,15 @@ __vhd_open(td_driver_t *driver, const char *name,
 	s->spb = s->spp = 1;
 
 	if (vhd_type_dynamic(&s->vhd)) {
-		err = vhd_initialize_dynamic_disk(s);
+		err = vhd_initialize_dynamic_disk(s,
+						  encryption->bm_cache_size);
 		if (err)
 			goto fail;
+
+		if (test_vhd_flag(flags, VHD_FLAG_OPEN_PREALLOCATE))
+			vhd_initialize_prealloc(s);
+
+		vhd_initialize_chain_map(s);
 	}
 
 	vhd_log_open(s);
@@ -862,6 +1441,10 @@ __vhd_open(td_driver_t *driver, const char *name,
 		s->writes++;
 	}
 
+	vhd_initialize_bounce_pool(s);
+	vhd_initialize_crypto_workers(s);
+	vhd_initialize_sync_workers(s);
+
         return 0;
 
  fail:
@@ -966,9 +1549,15 @@ _vhd_close(td_driver_t *driver)
 	}
 
  free:
+	if (s->bm_commit_event >= 0)
+		tapdisk_server_unregister_event(s->bm_commit_event);
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	vhd_free_chain_map(s);
+	vhd_free_crypto_workers(s);
+	vhd_free_sync_workers(s);
+	vhd_free_bounce_pool(s);
 	__vhd_free_crypto(&s->vhd);
 	vhd_close(&s->vhd);
 	vhd_free(s);
@@ -1139,42 +1728,35 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
+static inline struct vhd_bat_alloc *
+get_bat_alloc(struct vhd_state *s, uint32_t blk)
 {
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
+	int i;
+	struct vhd_bat_alloc *a;
 
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		a = s->bat.alloc + i;
+		if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_BUSY) &&
+		    a->blk == blk)
+			return a;
+	}
 
-static inline void
-unlock_bat(struct vhd_state *s)
-{
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return NULL;
 }
 
 static inline int
-bat_locked(struct vhd_state *s)
+bat_allocs_full(struct vhd_state *s)
 {
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return s->bat.nr_allocs == VHD_BAT_ALLOCS;
 }
 
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
 	init_tx(&bm->tx);
+	INIT_LIST_HEAD(&bm->commit);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
@@ -1182,15 +1764,26 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct hlist_head *
+bitmap_hash(struct vhd_state *s, uint32_t block)
+{
+	/* multiplicative (fibonacci) hashing of the block number */
+	uint32_t h = (block * 0x9E3779B1U) >> (32 - s->bm_hash_shift);
+	return &s->bm_hash[h];
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
+	struct hlist_node *node;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	if (!s->bm_hash)
+		return NULL;
+
+	hlist_for_each(node, bitmap_hash(s, block)) {
+		bm = hlist_entry(node, struct vhd_bitmap, hash);
+		if (bm->blk == block)
 			return bm;
 	}
 
@@ -1247,25 +1840,20 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	uint64_t seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (bitmap_locked(bm))
+			continue;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		ASSERT(!bitmap_in_use(bm));
+		hlist_del(&bm->hash);
+		list_del(&bm->lru);
+		s->bm_evictions++;
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1290,62 +1878,30 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_move_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	hlist_add_head(&bm->hash, bitmap_hash(s, bm->blk));
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
+	hlist_del(&bm->hash);
+	list_del(&bm->lru);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
@@ -1372,23 +1928,29 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
+		struct vhd_bat_alloc *a = get_bat_alloc(s, blk);
+
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    (a ? test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROING) :
+		     (bat_allocs_full(s) || s->bat.queue.head)))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
 	}
 
-	if (test_batmap(s, blk)) {
-		DBG(TLOG_DBG, "batmap set for 0x%04x\n", blk);
+	if (test_block_full(s, blk)) {
+		DBG(TLOG_DBG, "block 0x%04x full\n", blk);
 		return VHD_BM_BIT_SET;
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
-	/* bump lru count */
+	/* move to the most recently used end */
+	s->bm_hits++;
 	touch_bitmap(s, bm);
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
@@ -1413,7 +1975,7 @@ read_bitmap_cache_span(struct vhd_state *s,
 	sec = sector % s->spb;
 	blk = sector / s->spb;
 
-	if (test_batmap(s, blk))
+	if (test_block_full(s, blk))
 		return MIN(nr_secs, s->spb - sec);
 
 	bm  = get_bitmap(s, blk);
@@ -1482,89 +2044,157 @@ do_aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 }
 
 /**
- * Reserves a new extent.
+ * Reserves a new extent at the end of the file for @blk.
  *
- * @returns a 64-bit unsigned integer where the error code is stored in the
- * upper 32 bits and the reserved block number is stored in the lower 32 bits.
- * If an error is returned (the upper 32 bits are not zero), the lower 32 bits
- * are undefined.
+ * The BAT entry is not touched; it is written once the extent has been
+ * initialized (see schedule_bat_write).
+ *
+ * @returns 0 on success, -EBUSY if all allocation slots are in use, or
+ * -ENOSPC if the file cannot grow any further.
  */
-static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+static int
+reserve_new_block(struct vhd_state *s, uint32_t blk,
+		  struct vhd_bat_alloc **alloc)
 {
-	int gap = 0;
+	int i, gap = 0;
+	struct vhd_bat_alloc *a = NULL;
+
+	ASSERT(!get_bat_alloc(s, blk));
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++)
+		if (!test_vhd_flag(s->bat.alloc[i].status,
+				   VHD_FLAG_ALLOC_BUSY)) {
+			a = s->bat.alloc + i;
+			break;
+		}
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	if (!a)
+		return -EBUSY;
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
 	if (s->next_db + gap > UINT_MAX)
-		return (uint64_t)ENOSPC << 32;
+		return -ENOSPC;
+
+	memset(a, 0, sizeof(struct vhd_bat_alloc));
+	a->status = VHD_FLAG_ALLOC_BUSY;
+	a->blk    = blk;
+	a->lb_end = s->next_db;
+	a->offset = s->next_db + gap;
+	init_vhd_request(s, &a->req);
+	a->req.treq.sec = (td_sector_t)blk * s->spb;
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	s->next_db = a->offset + s->spb + s->bm_secs;
+	s->bat.nr_allocs++;
+	s->bat.allocs++;
 
-	return s->next_db;
+	DBG(TLOG_DBG, "blk: 0x%04x, offset: 0x%08"PRIx64", allocs: %d\n",
+	    blk, a->offset, s->bat.nr_allocs);
+
+	*alloc = a;
+	return 0;
 }
 
-static int
-schedule_bat_write(struct vhd_state *s)
+static void
+release_new_block(struct vhd_state *s, struct vhd_bat_alloc *a)
+{
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", a->blk, a->error);
+
+	ASSERT(!test_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_STARTED));
+
+	/* give the extent back if nobody reserved space behind it */
+	if (a->error && s->next_db == a->offset + s->spb + s->bm_secs)
+		s->next_db = a->lb_end;
+
+	a->status = 0;
+	a->tx     = NULL;
+	s->bat.nr_allocs--;
+	s->bat.requeue = 1;
+}
+
+static void
+schedule_bat_write(struct vhd_state *s, uint32_t bsec)
 {
 	int i;
-	uint32_t blk;
 	char *buf;
 	uint64_t offset;
+	struct vhd_bat_alloc *a;
+	struct vhd_bat_write *w = NULL;
 	struct vhd_request *req;
 
-	ASSERT(bat_locked(s));
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		if (s->bat.write[i].allocs) {
+			/* picked up once the write in flight completes */
+			if (s->bat.write[i].bsec == bsec)
+				return;
+		} else if (!w)
+			w = s->bat.write + i;
+	}
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	ASSERT(w);
 
-	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	buf = w->buf;
+	memcpy(buf, &bat_entry(s, bsec * VHD_BAT_ENTRIES_PER_SEC), 512);
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		a = s->bat.alloc + i;
+
+		if (!test_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_READY) ||
+		    a->blk / VHD_BAT_ENTRIES_PER_SEC != bsec)
+			continue;
+
+		((uint32_t *)buf)[a->blk % VHD_BAT_ENTRIES_PER_SEC] = a->offset;
+		clear_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_READY);
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_STARTED);
+		w->allocs |= (1U << i);
+	}
 
-	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
+	if (!w->allocs)
+		return;
 
-	for (i = 0; i < 128; i++)
+	for (i = 0; i < VHD_BAT_ENTRIES_PER_SEC; i++)
 		BE32_OUT(&((uint32_t *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + ((uint64_t)blk - (blk % 128)) * 4;
+	req = &w->req;
+	init_vhd_request(s, req);
+
+	offset         = s->vhd.header.table_offset +
+		(uint64_t)bsec * VHD_SECTOR_SIZE;
+	req->treq.sec  = (td_sector_t)bsec * VHD_BAT_ENTRIES_PER_SEC * s->spb;
 	req->treq.secs = 1;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
-	do_aio_write(s, req, offset);
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+	w->bsec = bsec;
+	s->bat.bat_writes++;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	do_aio_write(s, req, offset);
 
-	return 0;
+	DBG(TLOG_DBG, "bsec: %u, allocs: 0x%x, table_offset: 0x%08"PRIx64"\n",
+	    bsec, w->allocs, offset);
 }
 
 static void
 schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+		       struct vhd_bitmap *bm, struct vhd_bat_alloc *a)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &a->zero_req;
 
 	init_vhd_request(s, req);
 
-	offset         = vhd_sectors_to_bytes(lb_end);
+	offset         = vhd_sectors_to_bytes(a->lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = (td_sector_t)s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = (td_sector_t)a->blk * s->spb;
+	req->treq.secs = (a->offset - a->lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    a->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1624,15 +2254,13 @@ static int
 update_bat(struct vhd_state *s, uint32_t blk)
 {
 	int err;
-	uint64_t lb_end;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+
+	if (get_bat_alloc(s, blk))
 		return 0;
-	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1646,69 +2274,124 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	if (lb_end >> 32) {
-		unlock_bat(s);
-		return -(lb_end >> 32);
-	}
-	schedule_zero_bm_write(s, bm, lb_end);
+	err = reserve_new_block(s, blk, &a);
+	if (err)
+		return err;
+
+	schedule_zero_bm_write(s, bm, a);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
 	return 0;
 }
 
-static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+static inline uint64_t
+prealloc_target(struct vhd_state *s)
 {
-	int err, gap;
-	uint64_t offset, size;
-	struct vhd_bitmap *bm;
-	ssize_t count;
-	uint64_t next_db;
+	uint64_t target;
 
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
+	target  = s->spb + s->bm_secs + s->spp;
+	target *= s->prealloc_blocks;
+	target += s->next_db;
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
-		return 0;
-	}
+	return MAX(s->next_db, MIN(target, (uint64_t)UINT_MAX));
+}
 
-	gap     = 0;
-	offset  = vhd_sectors_to_bytes(s->next_db);
-	next_db = s->next_db;
+/*
+ * Zeroes the next chunk of the preallocation area, up to the end of the
+ * last reserved block plus prealloc_blocks blocks.  Only one such write
+ * is in flight at a time; finish_prealloc_write continues the stream.
+ */
+static void
+schedule_prealloc_write(struct vhd_state *s)
+{
+	uint64_t target, secs;
+	struct vhd_request *req = &s->prealloc_req;
 
-	/* data region of segment should begin on page boundary */
-	if ((next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((next_db + s->bm_secs) % s->spp));
-		next_db += gap;
-	}
+	if (s->prealloc_pending > s->prealloc_end)
+		return;
 
-	if (next_db > UINT_MAX)
-		return -ENOSPC;
+	target = prealloc_target(s);
+	if (target <= s->prealloc_end)
+		return;
+
+	secs = MIN(target - s->prealloc_end, _vhd_zsize >> VHD_SECTOR_SHIFT);
+
+	init_vhd_request(s, req);
 
-	s->next_db = next_db;
+	req->op        = VHD_OP_PREALLOC_WRITE;
+	req->treq.secs = secs;
+	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(secs));
+	req->next      = NULL;
 
-	s->bat.pbw_blk = blk;
-	s->bat.pbw_offset = s->next_db;
+	s->prealloc_pending = s->prealloc_end + secs;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	DBG(TLOG_DBG, "zeroing 0x%08"PRIx64" - 0x%08"PRIx64"\n",
+	    s->prealloc_end, s->prealloc_pending);
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(s, -errno, "lseek failed\n");
-		return -errno;
+	do_aio_write(s, req, vhd_sectors_to_bytes(s->prealloc_end));
+}
+
+/*
+ * Makes sure the extent reserved by @a reads back as zeroes.
+ *
+ * @returns 0 if the extent is ready to be referenced by the BAT, 1 if it
+ * is being zeroed asynchronously, or -errno.
+ */
+static int
+prealloc_new_block(struct vhd_state *s, struct vhd_bat_alloc *a)
+{
+	int err;
+	uint64_t start, end, target;
+
+	end = a->offset + s->spb + s->bm_secs;
+	if (end <= s->prealloc_end)
+		return 0;
+
+	if (!s->no_zero_range && s->prealloc_pending <= s->prealloc_end) {
+		start  = MAX(a->lb_end, s->prealloc_end);
+		target = prealloc_target(s);
+
+		err = fallocate(s->vhd.fd, FALLOC_FL_ZERO_RANGE,
+				vhd_sectors_to_bytes(start),
+				vhd_sectors_to_bytes(target - start));
+		if (!err) {
+			s->prealloc_end     = target;
+			s->prealloc_pending = target;
+			return 0;
+		}
+
+		err = -errno;
+		if (err != -EOPNOTSUPP && err != -ENOSYS) {
+			ERR(s, err, "fallocate failed (offset %"PRIu64")\n",
+			    vhd_sectors_to_bytes(start));
+			return err;
+		}
+
+		DPRINTF("%s: zero range not supported, zeroing "
+			"asynchronously\n", s->vhd.file);
+		s->no_zero_range = true;
 	}
 
-	size  = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	count = write(s->vhd.fd, vhd_zeros(size), size);
-	if (count != size) {
-		err = count < 0 ? -errno : -ENOSPC;
-		ERR(s, -errno,
-		    "write failed (%zd, offset %"PRIu64")\n", count, offset);
-		return err;
+	set_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROING);
+	schedule_prealloc_write(s);
+
+	return 1;
+}
+
+static int
+allocate_block(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
+
+	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
+
+	a = get_bat_alloc(s, blk);
+	if (a) {
+		if (a->error)
+			return -EBUSY;
+		return 0;
 	}
 
 	/* empty bitmap could already be in
@@ -1723,14 +2406,38 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
+	err = reserve_new_block(s, blk, &a);
+	if (err)
+		return err;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n", blk, a->offset);
+
+	err = prealloc_new_block(s, a);
+	if (err < 0) {
+		a->error = err;
+		release_new_block(s, a);
+		return err;
+	}
+
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	add_to_transaction(&bm->tx, &a->req);
+
+	if (!err) {
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_READY);
+		schedule_bat_write(s, blk / VHD_BAT_ENTRIES_PER_SEC);
+	}
 
 	return 0;
 }
 
+static inline int
+block_zeroing(struct vhd_state *s, uint32_t blk)
+{
+	struct vhd_bat_alloc *a = get_bat_alloc(s, blk);
+
+	return a && test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROING);
+}
+
 static int 
 schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 {
@@ -1750,7 +2457,7 @@ schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	offset = bat_entry(s, blk);
 
 	ASSERT(offset != DD_BLK_UNUSED);
-	ASSERT(test_batmap(s, blk) || (bm && bitmap_valid(bm)));
+	ASSERT(test_block_full(s, blk) || (bm && bitmap_valid(bm)));
 
 	offset += s->bm_secs + sec;
 	offset  = vhd_sectors_to_bytes(offset);
@@ -1775,10 +2482,57 @@ schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	return 0;
 }
 
-static bool
-vhd_is_encrypted(struct vhd_state *s)
+static void
+vhd_crypto_work(td_work_t *work)
 {
-	return s->vhd.xts_tfm != NULL;
+	struct vhd_request *req = container_of(work, struct vhd_request, work);
+	struct vhd_state *s = req->state;
+
+	if (req->op == VHD_OP_DATA_WRITE)
+		req->error = crypto_interface->vhd_crypto_encrypt(
+			&s->vhd, &req->treq, req->orig_buf);
+	else
+		req->error = crypto_interface->vhd_crypto_decrypt(
+			&s->vhd, &req->treq);
+}
+
+/*
+ * Writes come back from the workers in any order, but are issued in the
+ * order they were queued, as they would have been when encrypted inline.
+ * A write which failed to encrypt completes as if its I/O had failed.
+ */
+static void
+vhd_crypto_write_done(td_work_t *work)
+{
+	struct vhd_request *req = container_of(work, struct vhd_request, work);
+	struct vhd_state *s = req->state;
+	struct vhd_request *r, *next;
+
+	set_vhd_flag(req->flags, VHD_FLAG_REQ_ENCRYPTED);
+
+	list_for_each_entry_safe(r, next, &s->crypto_writes, crypto) {
+		if (!test_vhd_flag(r->flags, VHD_FLAG_REQ_ENCRYPTED))
+			break;
+
+		list_del(&r->crypto);
+		if (r->error)
+			vhd_complete(r, &r->tiocb, r->error);
+		else
+			do_aio_write(s, r, r->offset);
+	}
+}
+
+static void
+vhd_queue_encrypt(struct vhd_state *s, struct vhd_request *req,
+		  uint64_t offset)
+{
+	req->offset    = offset;
+	req->work.fn   = vhd_crypto_work;
+	req->work.done = vhd_crypto_write_done;
+	list_add_tail(&req->crypto, &s->crypto_writes);
+
+	s->crypto_offloads++;
+	tapdisk_workers_queue(TD_WORKERS_CPU, &req->work);
 }
 
 static int
@@ -1792,10 +2546,20 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	char *crypto_buf = NULL;
 
 	if (vhd_is_encrypted(s)) {
-		err = posix_memalign((void **)&crypto_buf, VHD_SECTOR_SIZE,
-				     (size_t)treq.secs * VHD_SECTOR_SIZE);
-		if (err)
+		crypto_buf = vhd_bounce_get(s, treq.secs);
+		if (!crypto_buf)
 			return -EBUSY;
+
+		/* before anything is allocated, so failure is clean */
+		if (!s->crypto_workers) {
+			td_request_t creq = treq;
+
+			creq.buf = crypto_buf;
+			err = crypto_interface->vhd_crypto_encrypt(
+				&s->vhd, &creq, treq.buf);
+			if (err)
+				goto fail;
+		}
 	}
 	req = alloc_vhd_request(s);
 	if (!req) {
@@ -1821,7 +2585,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 				goto fail;
 			}
 
-			offset = s->bat.pbw_offset;
+			offset = get_bat_alloc(s, blk)->offset;
 		}
 
 		offset += s->bm_secs + sec;
@@ -1839,8 +2603,6 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	if (vhd_is_encrypted(s)) {
 		req->orig_buf = req->treq.buf;
 		req->treq.buf = crypto_buf;
-		crypto_interface->vhd_crypto_encrypt(
-			&s->vhd, &req->treq, req->orig_buf);
 	}
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BITMAP)) {
@@ -1859,7 +2621,10 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		   test_batmap(s, blk))
 		schedule_redundant_bm_write(s, blk);
 
-	do_aio_write(s, req, offset);
+	if (vhd_is_encrypted(s) && s->crypto_workers)
+		vhd_queue_encrypt(s, req, offset);
+	else
+		do_aio_write(s, req, offset);
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
 	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x\n",
@@ -1868,7 +2633,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	return 0;
 fail:
 	if (crypto_buf)
-		free(crypto_buf);
+		vhd_bounce_put(s, crypto_buf, treq.secs);
 
 	if (req)
 		free_vhd_request(s, req);
@@ -1939,8 +2704,9 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	}
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		struct vhd_bat_alloc *a = get_bat_alloc(s, blk);
+		ASSERT(a);
+		offset = a->offset;
 	}
 
 	offset = vhd_sectors_to_bytes(offset);
@@ -1960,6 +2726,9 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	touch_bitmap(s, bm);     /* bump lru count */
 	set_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
 
+	s->bm_writes++;
+	s->bm_write_reqs += bm->tx.started;
+
 	DBG(TLOG_DBG, "%s: blk: 0x%04x, sec: 0x%08"PRIx64", nr_secs: 0x%04x, "
 	    "offset: 0x%"PRIx64"\n", s->vhd.file, blk, req->treq.sec,
 	    req->treq.secs, offset);
@@ -2002,6 +2771,237 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+/*
+ * writes to unallocated blocks wait here while all allocation
+ * slots are busy, and are resubmitted as soon as one is released.
+ */
+static int
+__vhd_queue_allocation(struct vhd_state *s, td_request_t treq)
+{
+	struct vhd_request *req;
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = VHD_OP_DATA_WRITE;
+	req->next = NULL;
+
+	add_to_tail(&s->bat.queue, req);
+	s->bat.alloc_waits++;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
+	    "nr_secs: 0x%04x\n", s->vhd.file, treq.sec, treq.sec / s->spb,
+	    treq.secs);
+
+	TRACE(s);
+	return 0;
+}
+
+static void
+vhd_requeue_allocations(struct vhd_state *s)
+{
+	struct vhd_request *r, *next;
+
+	r = s->bat.queue.head;
+	clear_req_list(&s->bat.queue);
+
+	while (r) {
+		struct vhd_request tmp;
+
+		tmp  = *r;
+		next =  r->next;
+		free_vhd_request(s, r);
+
+		vhd_queue_write(s->driver, tmp.treq);
+
+		r = next;
+	}
+}
+
+static inline td_image_t *
+vhd_chain_next(td_image_t *image)
+{
+	return tapdisk_image_entry(image->next.next);
+}
+
+static inline int
+vhd_chain_last(td_vbd_t *vbd, td_image_t *image)
+{
+	return list_is_last(&image->next, &vbd->images);
+}
+
+/*
+ * Resolve, for every block, which parent a read missing in this image
+ * has to go to.  Parents are read-only, and this image consults its own
+ * BAT and bitmaps before the map, so blocks it allocates later never
+ * make the map stale.  Parents are not open yet when td_open runs, so
+ * the map is built on the first forwarded read after open (or resume,
+ * which reopens the chain).
+ */
+static int
+vhd_chain_map_build(struct vhd_state *s, td_request_t *treq)
+{
+	int idx, depth;
+	uint32_t blk, limit;
+	td_image_t *leaf, *image;
+	struct vhd_state *ps;
+	struct vhd_chain_map *map = &s->chain;
+	td_vbd_t *vbd = treq->vreq->vbd;
+
+	leaf = treq->image;
+
+	/* only the topmost vhd of the chain keeps a map */
+	tapdisk_for_each_image(image, &vbd->images) {
+		if (image == leaf)
+			break;
+		if (image->driver->ops == &tapdisk_vhd)
+			return -EINVAL;
+	}
+
+	if (vhd_chain_last(vbd, leaf))
+		return -EINVAL;
+
+	depth = 0;
+	for (image = leaf; !vhd_chain_last(vbd, image);
+	     image = vhd_chain_next(image))
+		depth++;
+
+	if (depth > VHD_CHAIN_MAX_DEPTH)
+		return -E2BIG;
+
+	map->nr_blocks = s->bat.bat.entries;
+	map->nr_images = depth;
+	map->owner     = calloc(map->nr_blocks, sizeof(uint16_t));
+	map->image     = calloc(depth + 1, sizeof(td_image_t *));
+	if (!map->owner || !map->image)
+		return -ENOMEM;
+
+	idx   = 0;
+	image = leaf;
+	limit = map->nr_blocks;
+
+	while (!vhd_chain_last(vbd, image)) {
+		image = vhd_chain_next(image);
+		map->image[++idx] = image;
+
+		/*
+		 * Reads beyond the end of a parent come back as zeros from
+		 * it, whatever lies further down: blocks not resolved by
+		 * then must keep walking the chain.
+		 */
+		limit = MIN(limit, image->info.size / s->spb);
+
+		ps = NULL;
+		if (image->driver->ops == &tapdisk_vhd)
+			ps = (struct vhd_state *)image->driver->data;
+
+		if (!ps || !vhd_type_dynamic(&ps->vhd) || ps->spb != s->spb) {
+			/* from here on, forwarding proceeds as usual */
+			for (blk = 0; blk < limit; blk++)
+				if (map->owner[blk] == VHD_CHAIN_UNMAPPED)
+					map->owner[blk] = idx;
+			break;
+		}
+
+		for (blk = 0; blk < MIN(limit, ps->bat.bat.entries); blk++)
+			if (map->owner[blk] == VHD_CHAIN_UNMAPPED &&
+			    bat_entry(ps, blk) != DD_BLK_UNUSED)
+				map->owner[blk] = idx;
+	}
+
+	for (blk = 0; blk < limit; blk++)
+		if (map->owner[blk] == VHD_CHAIN_UNMAPPED)
+			map->owner[blk] = VHD_CHAIN_HOLE;
+
+	map->vbd    = vbd;
+	map->status = VHD_CHAIN_MAP_READY;
+
+	DPRINTF("%s: chain map: %d parents, %u of %u blocks mapped\n",
+		s->vhd.file, depth, limit, map->nr_blocks);
+
+	return 0;
+}
+
+/*
+ * Forward a read of sectors missing in this image, skipping the parents
+ * known not to hold its block.
+ */
+static void
+vhd_forward_read(struct vhd_state *s, td_request_t treq)
+{
+	int err;
+	uint32_t blk;
+	uint16_t owner;
+	td_vbd_t *vbd = treq.vreq->vbd;
+	struct vhd_chain_map *map = &s->chain;
+
+	if (map->status == VHD_CHAIN_MAP_UNBUILT) {
+		err = vhd_chain_map_build(s, &treq);
+		if (err) {
+			if (err != -EINVAL)
+				EPRINTF("%s: chain map: %d\n", s->vhd.file, err);
+			vhd_free_chain_map(s);
+		}
+	}
+
+	if (map->status != VHD_CHAIN_MAP_READY ||
+	    map->vbd != vbd || vbd->retired)
+		goto forward;
+
+	blk = treq.sec / s->spb;
+	if (blk >= map->nr_blocks)
+		goto forward;
+
+	owner = map->owner[blk];
+	switch (owner) {
+	case VHD_CHAIN_UNMAPPED:
+		break;
+
+	case VHD_CHAIN_HOLE:
+		/* the last image completes forwarded reads with zeros */
+		treq.image = tapdisk_image_entry(vbd->images.prev);
+		map->holes++;
+		break;
+
+	default:
+		treq.image = tapdisk_image_entry(map->image[owner]->next.prev);
+		map->direct++;
+		break;
+	}
+
+forward:
+	td_forward_request(treq);
+}
+
+/*
+ * Sectors from sector on that fall in a run of blocks missing from the BAT,
+ * so that unallocated ranges go down the chain in one piece.
+ */
+static int
+vhd_bat_clear_span(struct vhd_state *s, uint64_t sector, int nr_secs)
+{
+	uint32_t blk = sector / s->spb;
+	int secs;
+
+	secs = MIN(nr_secs, s->spb - (sector % s->spb));
+
+	while (secs < nr_secs && ++blk < s->vhd.header.max_bat_size &&
+	       bat_entry(s, blk) == DD_BLK_UNUSED)
+		secs += MIN(nr_secs - secs, s->spb);
+
+	return secs;
+}
+
+/*
+ * Allocated blocks answer from their bitmap. Bitmaps that aren't cached yet
+ * are all read in one pass over the range, and the request waits on them
+ * like reads do, so a query costs at most one metadata read per allocated
+ * block and leaves the bitmaps cached for the I/O that usually follows.
+ * Should the cache run dry, the block is reported as allocated, which is
+ * never wrong, only less precise.
+ */
 static void
 vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 {
@@ -2023,7 +3023,7 @@ vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 			goto fail;
 
 		case VHD_BM_BAT_CLEAR:
-			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			clone.secs = vhd_bat_clear_span(s, clone.sec, clone.secs);
 			td_forward_request(clone);
 			break;
 
@@ -2040,13 +3040,20 @@ vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_NOT_CACHED:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			clone.status = TD_BLOCK_STATE_NONE;
-			td_complete_request(clone, 0);
+			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			if (!err)
+				err = __vhd_queue_request(s, VHD_OP_BLOCK_STATUS, clone);
+			if (err == -EBUSY)
+				goto busy;
+			if (err)
+				goto fail;
 			break;
 
 		case VHD_BM_READ_PENDING:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
 			err = __vhd_queue_request(s, VHD_OP_BLOCK_STATUS, clone);
+			if (err == -EBUSY)
+				goto busy;
 			if (err)
 				goto fail;
 			break;
@@ -2057,11 +3064,17 @@ vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 			break;
 		}
 
+	next:
 		treq.sec  += clone.secs;
 		treq.secs -= clone.secs;
 		treq.buf  += vhd_sectors_to_bytes(clone.secs);
 		continue;
 
+	busy:
+		clone.status = TD_BLOCK_STATE_NONE;
+		td_complete_request(clone, 0);
+		goto next;
+
 	fail:
 		clone.secs = treq.secs;
 		td_complete_request(clone, err);
@@ -2091,12 +3104,12 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_BAT_CLEAR:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			td_forward_request(clone);
+			vhd_forward_read(s, clone);
 			break;
 
 		case VHD_BM_BIT_CLEAR:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
-			td_forward_request(clone);
+			vhd_forward_read(s, clone);
 			break;
 
 		case VHD_BM_BIT_SET:
@@ -2165,13 +3178,32 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			goto fail;
 
 		case VHD_BM_BAT_LOCKED:
-			err = -EBUSY;
-			goto fail;
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = __vhd_queue_allocation(s, clone);
+			if (err)
+				goto fail;
+			break;
 
 		case VHD_BM_BAT_CLEAR:
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
+				uint32_t blk = clone.sec / s->spb;
+
+				err = allocate_block(s, blk);
+				if (err)
+					goto fail;
+
+				/* data must not race the zero writes */
+				if (block_zeroing(s, blk)) {
+					err = __vhd_queue_allocation(s, clone);
+					if (err)
+						goto fail;
+					break;
+				}
+			}
+
 			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
 				      VHD_FLAG_REQ_UPDATE_BITMAP);
-			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -2227,6 +3259,237 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * Runs on a worker: @req->offset is the file sector, @req->treq.secs the
+ * length.
+ */
+static void
+vhd_sync_work(td_work_t *work)
+{
+	struct vhd_request *req = container_of(work, struct vhd_request, work);
+	struct vhd_state *s = req->state;
+	int err;
+
+	if (req->op == VHD_OP_FLUSH)
+		err = fdatasync(s->vhd.fd);
+	else
+		err = fallocate(s->vhd.fd, req->mode | FALLOC_FL_KEEP_SIZE,
+				vhd_sectors_to_bytes(req->offset),
+				vhd_sectors_to_bytes(req->treq.secs));
+
+	req->error = err ? -errno : 0;
+}
+
+static void
+vhd_sync_done(td_work_t *work)
+{
+	struct vhd_request *req = container_of(work, struct vhd_request, work);
+	struct vhd_state *s = req->state;
+	td_request_t treq = req->treq;
+	uint64_t sec = req->offset;
+	int mode = req->mode;
+	int err = req->error;
+
+	free_vhd_request(s, req);
+
+	if (err == -EOPNOTSUPP || err == -ENOSYS) {
+		/* a discard is only a hint */
+		if (mode == FALLOC_FL_PUNCH_HOLE)
+			err = 0;
+
+		if (mode == FALLOC_FL_ZERO_RANGE) {
+			if (!s->no_zero_range) {
+				DPRINTF("%s: zero range not supported, "
+					"writing zeroes\n", s->vhd.file);
+				s->no_zero_range = true;
+			}
+			td_queue_zero_writes(treq.image, treq);
+			return;
+		}
+	}
+
+	if (err)
+		ERR(s, err, "%s failed (offset %"PRIu64")\n",
+		    mode ? "fallocate" : "flush", vhd_sectors_to_bytes(sec));
+
+	td_complete_request(treq, err);
+}
+
+/*
+ * fallocate() and fdatasync() block, so they run on the workers when
+ * there are some, and complete from the scheduler.
+ */
+static void
+vhd_queue_sync(struct vhd_state *s, td_request_t treq, uint8_t op,
+	       int mode, uint64_t sec)
+{
+	struct vhd_request *req;
+
+	req = alloc_vhd_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	req->treq      = treq;
+	req->op        = op;
+	req->mode      = mode;
+	req->offset    = sec;
+	req->work.fn   = vhd_sync_work;
+	req->work.done = vhd_sync_done;
+
+	if (s->sync_workers)
+		tapdisk_workers_queue(TD_WORKERS_SYNC, &req->work);
+	else {
+		vhd_sync_work(&req->work);
+		vhd_sync_done(&req->work);
+	}
+}
+
+/*
+ * Discards never free BAT entries: new blocks are only ever appended at
+ * next_db, so a released entry could not be reused. Instead the data area
+ * of every allocated block the request fully covers is punched out of the
+ * file, which gives the space back to the filesystem. Partial blocks,
+ * blocks being allocated and encrypted disks (whose holes would not decrypt
+ * to zeroes) are left alone.
+ */
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	if (vhd_is_encrypted(s)) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		vhd_queue_sync(s, treq, VHD_OP_FALLOCATE,
+			       FALLOC_FL_PUNCH_HOLE, treq.sec);
+		return;
+	}
+
+	while (treq.secs) {
+		td_request_t clone;
+		uint32_t blk, entry;
+
+		clone      = treq;
+		blk        = clone.sec / s->spb;
+		clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+		entry      = bat_entry(s, blk);
+
+		if (clone.secs == s->spb && entry != DD_BLK_UNUSED &&
+		    !get_bat_alloc(s, blk))
+			vhd_queue_sync(s, clone, VHD_OP_FALLOCATE,
+				       FALLOC_FL_PUNCH_HOLE,
+				       (uint64_t)entry + s->bm_secs);
+		else
+			td_complete_request(clone, 0);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+	}
+}
+
+/* Zeroes @treq in place, at sector @sec of the file. */
+static void
+vhd_zero_extent(struct vhd_state *s, td_request_t treq, uint64_t sec)
+{
+	if (s->no_zero_range) {
+		td_queue_zero_writes(treq.image, treq);
+		return;
+	}
+
+	vhd_queue_sync(s, treq, VHD_OP_FALLOCATE, FALLOC_FL_ZERO_RANGE, sec);
+}
+
+/*
+ * Unallocated blocks of a dynamic disk already read back as zeroes, and
+ * allocated ones are zeroed in place. Differencing and encrypted disks, as
+ * well as blocks with an allocation in flight, get ordinary zero writes.
+ */
+static void
+vhd_queue_write_zeroes(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	if (vhd_is_encrypted(s) || s->vhd.footer.type == HD_TYPE_DIFF) {
+		td_queue_zero_writes(treq.image, treq);
+		return;
+	}
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		vhd_zero_extent(s, treq, treq.sec);
+		return;
+	}
+
+	while (treq.secs) {
+		td_request_t clone;
+		uint32_t blk, entry;
+
+		clone      = treq;
+		blk        = clone.sec / s->spb;
+		clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+		entry      = bat_entry(s, blk);
+
+		if (get_bat_alloc(s, blk))
+			td_queue_zero_writes(clone.image, clone);
+		else if (entry == DD_BLK_UNUSED)
+			td_complete_request(clone, 0);
+		else
+			vhd_zero_extent(s, clone, (uint64_t)entry + s->bm_secs +
+					clone.sec % s->spb);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+	}
+}
+
+static void
+vhd_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	vhd_queue_sync(s, treq, VHD_OP_FLUSH, 0, 0);
+}
+
+static void
+vhd_return_request(struct vhd_state *s, struct vhd_request *r, int err)
+{
+	td_complete_request(r->treq, err);
+	DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
+	    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
+	free_vhd_request(s, r);
+
+	s->returned++;
+	TRACE(s);
+}
+
+static void
+vhd_crypto_read_done(td_work_t *work)
+{
+	struct vhd_request *req = container_of(work, struct vhd_request, work);
+
+	vhd_return_request(req->state, req, req->error);
+}
+
+static void
+vhd_queue_decrypt(struct vhd_state *s, struct vhd_request *req)
+{
+	req->work.fn   = vhd_crypto_work;
+	req->work.done = vhd_crypto_read_done;
+
+	s->crypto_offloads++;
+	tapdisk_workers_queue(TD_WORKERS_CPU, &req->work);
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -2239,7 +3502,7 @@ signal_completion(struct vhd_request *list, int error)
 	r = list;
 	s = list->state;
 
-	while (r) {
+	for (; r; r = next) {
 		int err;
 
 		err  = (error ? error : r->error);
@@ -2247,23 +3510,22 @@ signal_completion(struct vhd_request *list, int error)
 		if (vhd_is_encrypted(s)) {
 			switch (r->op) {
 			case VHD_OP_DATA_READ:
-				crypto_interface->vhd_crypto_decrypt(
+				if (err)
+					break;
+				if (s->crypto_workers) {
+					vhd_queue_decrypt(s, r);
+					continue;
+				}
+				err = crypto_interface->vhd_crypto_decrypt(
 					&s->vhd, &r->treq);
 				break;
 			case VHD_OP_DATA_WRITE:
-				free(r->treq.buf);
+				vhd_bounce_put(s, r->treq.buf, r->treq.secs);
 				r->treq.buf = r->orig_buf;
 				break;
 			}
 		}
-		td_complete_request(r->treq, err);
-		DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
-		    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
-		free_vhd_request(s, r);
-		r    = next;
-
-		s->returned++;
-		TRACE(s);
+		vhd_return_request(s, r, err);
 	}
 }
 
@@ -2306,21 +3568,20 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
 	/* perhaps all the queued writes already completed? */
 	if (tx->started && transaction_completed(tx))
-		finish_data_transaction(s, bm);
+		commit_data_transaction(s, bm);
 }
 
 static void
 finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
+	struct vhd_bat_alloc *a;
 	struct vhd_transaction *tx = &bm->tx;
 
-	if (!bat_locked(s))
+	a = get_bat_alloc(s, bm->blk);
+	if (!a)
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
-		return;
-
-	if (!s->bat.req.error)
+	if (!a->error)
 		goto release;
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
@@ -2330,9 +3591,7 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	return;
 
  release:
-	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	release_new_block(s, a);
 }
 
 static void
@@ -2349,10 +3608,12 @@ finish_bitmap_transaction(struct vhd_state *s,
 	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
 		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
 			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
+			struct vhd_bat_alloc *a = get_bat_alloc(s, bm->blk);
+			ASSERT(a);
+			ASSERT(test_vhd_flag(a->status,
+					     VHD_FLAG_ALLOC_BAT_READY |
+					     VHD_FLAG_ALLOC_BAT_STARTED));
+			a->tx = tx;
 			return;
 		}
 	}
@@ -2397,80 +3658,228 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 }
 
 static void
-finish_bat_write(struct vhd_request *req)
+vhd_bitmap_commit_event(event_id_t id, char mode, void *private)
 {
-	struct vhd_bitmap *bm;
+	struct vhd_state *s = private;
+	struct vhd_bitmap *bm, *next;
 	struct vhd_transaction *tx;
-	struct vhd_state *s = req->state;
 
-	s->returned++;
-	TRACE(s);
+	tapdisk_server_unregister_event(s->bm_commit_event);
+	s->bm_commit_event = -1;
+
+	list_for_each_entry_safe(bm, next, &s->bm_commit, commit) {
+		list_del_init(&bm->commit);
+
+		/* later writes to the block go to the next transaction */
+		tx = &bm->tx;
+		tx->closed = 1;
+		clear_vhd_flag(tx->status, VHD_FLAG_TX_COMMIT_WAIT);
+
+		if (transaction_completed(tx))
+			finish_data_transaction(s, bm);
+	}
+}
+
+/*
+ * Hold back the bitmap write of a transaction whose data writes have
+ * completed, unless group commit is off or the transaction allocates
+ * its block: BAT updates are not delayed.
+ */
+static int
+defer_bitmap_commit(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_transaction *tx = &bm->tx;
+
+	if (!timerisset(&s->bm_commit_delay))
+		return 0;
+
+	if (tx->closed || tx->error)
+		return 0;
+
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_COMMIT_WAIT))
+		return 1;
+
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT) ||
+	    get_bat_alloc(s, bm->blk))
+		return 0;
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	if (s->bm_commit_event < 0) {
+		event_id_t id;
+
+		id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						   -1, s->bm_commit_delay,
+						   vhd_bitmap_commit_event, s);
+		if (id < 0)
+			return 0;
+
+		s->bm_commit_event = id;
+	}
+
+	set_vhd_flag(tx->status, VHD_FLAG_TX_COMMIT_WAIT);
+	list_add_tail(&bm->commit, &s->bm_commit);
+	s->bm_deferred++;
+
+	return 1;
+}
+
+static void
+commit_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	if (!defer_bitmap_commit(s, bm))
+		finish_data_transaction(s, bm);
+}
+
+static void
+finish_bat_alloc(struct vhd_state *s, struct vhd_bat_alloc *a, int error)
+{
+	struct vhd_bitmap *bm;
+	struct vhd_transaction *tx;
+
+	bm = get_bitmap(s, a->blk);
 
 	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
+	    a->blk, a->offset, error);
 	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(test_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_STARTED |
+			     VHD_FLAG_ALLOC_ZEROING));
+
+	clear_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_STARTED |
+		       VHD_FLAG_ALLOC_ZEROING);
 
 	tx = &bm->tx;
 	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+	if (!error)
+		bat_entry(s, a->blk) = a->offset;
+	else {
+		a->error  = error;
+		tx->error = error;
+	}
 
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
 		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
+		remove_from_req_list(&tx->requests, &a->req);
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
 	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+		if (a->tx)
+			finish_bitmap_transaction(s, bm, error);
 	}
 
 	finish_bat_transaction(s, bm);
 }
 
+static void
+finish_bat_write(struct vhd_request *req)
+{
+	int i, err;
+	uint32_t bsec, allocs;
+	struct vhd_bat_write *w;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	w         = container_of(req, struct vhd_bat_write, req);
+	err       = req->error;
+	bsec      = w->bsec;
+	allocs    = w->allocs;
+	w->allocs = 0;
+
+	DBG(TLOG_DBG, "bsec: %u, allocs: 0x%x, err: %d\n", bsec, allocs, err);
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++)
+		if (allocs & (1U << i))
+			finish_bat_alloc(s, s->bat.alloc + i, err);
+
+	/* allocations which became ready while this write was in flight */
+	schedule_bat_write(s, bsec);
+}
+
 static void
 finish_zero_bm_write(struct vhd_request *req)
 {
 	uint32_t blk;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	blk = req->treq.sec / s->spb;
+	a   = container_of(req, struct vhd_bat_alloc, zero_req);
+	blk = a->blk;
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(test_vhd_flag(a->status, VHD_FLAG_ALLOC_BUSY));
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		a->error = req->error;
+		release_new_block(s, a);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
-		schedule_bat_write(s);
+	} else {
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_READY);
+		schedule_bat_write(s, blk / VHD_BAT_ENTRIES_PER_SEC);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
 }
 
+static void
+finish_prealloc_write(struct vhd_request *req)
+{
+	int i;
+	uint64_t end;
+	struct vhd_bat_alloc *a;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	DBG(TLOG_DBG, "zeroed 0x%08"PRIx64" - 0x%08"PRIx64", err: %d\n",
+	    s->prealloc_end, s->prealloc_pending, req->error);
+
+	if (!req->error)
+		s->prealloc_end = s->prealloc_pending;
+	else
+		s->prealloc_pending = s->prealloc_end;
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		a = s->bat.alloc + i;
+
+		if (!test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROING))
+			continue;
+
+		if (req->error) {
+			finish_bat_alloc(s, a, req->error);
+			continue;
+		}
+
+		end = a->offset + s->spb + s->bm_secs;
+		if (end > s->prealloc_end)
+			continue;
+
+		clear_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROING);
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_READY);
+		schedule_bat_write(s, a->blk / VHD_BAT_ENTRIES_PER_SEC);
+	}
+
+	/* writes deferred behind the zeroing can go now */
+	s->bat.requeue = 1;
+
+	if (!req->error)
+		schedule_prealloc_write(s);
+}
+
 static int
 finish_redundant_bm_write(struct vhd_request *req)
 {
@@ -2515,6 +3924,9 @@ finish_bitmap_read(struct vhd_request *req)
 	if (!req->error) {
 		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
 
+		if (bitmap_full(s, bm))
+			set_block_full(s, blk);
+
 		while (r) {
 			struct vhd_request tmp;
 
@@ -2523,12 +3935,15 @@ finish_bitmap_read(struct vhd_request *req)
 			free_vhd_request(s, r);
 
 			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
+			       tmp.op == VHD_OP_DATA_WRITE ||
+			       tmp.op == VHD_OP_BLOCK_STATUS);
 
 			if (tmp.op == VHD_OP_DATA_READ)
 				vhd_queue_read(s->driver, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
+			else
+				vhd_queue_block_status(s->driver, tmp.treq);
 
 			r = next;
 		}
@@ -2609,7 +4024,7 @@ finish_data_write(struct vhd_request *req)
 				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
 
 		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
+			commit_data_transaction(s, bm);
 
 	} else if (!test_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED)) {
 		ASSERT(!req->next);
@@ -2666,16 +4081,27 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_PREALLOC_WRITE:
+		finish_prealloc_write(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
 	}
+
+	if (s->bat.requeue) {
+		s->bat.requeue = 0;
+		if (s->bat.queue.head)
+			vhd_requeue_allocations(s);
+	}
 }
 
 void 
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2698,16 +4124,22 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: size: %d, used: %d, hits: %"PRIu64
+	    ", misses: %"PRIu64", evictions: %"PRIu64"\n", s->bm_cache_size,
+	    s->bm_cache_size - s->bm_free_count, s->bm_hits, s->bm_misses,
+	    s->bm_evictions);
+	DBG(TLOG_WARN, "BITMAP WRITES: %"PRIu64", reqs: %"PRIu64", deferred: %"
+	    PRIu64", commit delay: %ldus, waiting: %d\n", s->bm_writes,
+	    s->bm_write_reqs, s->bm_deferred,
+	    (long)(s->bm_commit_delay.tv_sec * 1000000 +
+		   s->bm_commit_delay.tv_usec),
+	    !list_empty(&s->bm_commit));
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2733,11 +4165,38 @@ vhd_debug(td_driver_t *driver)
 		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
+		i++;
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: allocs: %d, total: %"PRIu64", bat writes: %"PRIu64
+	    ", waits: %"PRIu64", queued: %p\n", s->bat.nr_allocs,
+	    s->bat.allocs, s->bat.bat_writes, s->bat.alloc_waits,
+	    s->bat.queue.head);
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		struct vhd_bat_alloc *a = &s->bat.alloc[i];
+
+		if (!test_vhd_flag(a->status, VHD_FLAG_ALLOC_BUSY))
+			continue;
+
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%02x, "
+		    "offset: 0x%08"PRIx64", err: %d, tx: %p\n", i, a->blk,
+		    a->status, a->offset, a->error, a->tx);
+	}
+
+	DBG(TLOG_WARN, "PREALLOC: blocks: %d, zero range: %d, "
+	    "end: 0x%08"PRIx64", pending: 0x%08"PRIx64"\n",
+	    s->prealloc_blocks, !s->no_zero_range, s->prealloc_end,
+	    s->prealloc_pending);
+
+	DBG(TLOG_WARN, "CHAIN MAP: status: %d, parents: %d, blocks: %u, "
+	    "direct: %"PRIu64", holes: %"PRIu64"\n", s->chain.status,
+	    s->chain.nr_images, s->chain.nr_blocks, s->chain.direct,
+	    s->chain.holes);
+
+	DBG(TLOG_WARN, "BOUNCE: pages: %u, free: %u, hugetlb: %d, allocs: %"
+	    PRIu64", exhausted: %"PRIu64", oversize: %"PRIu64"\n",
+	    s->bounce.nr_pages, s->bounce.free_pages, s->bounce.hugetlb,
+	    s->bounce.allocs, s->bounce.exhausted, s->bounce.oversize);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2745,6 +4204,66 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "bitmap_cache", "{");
+	tapdisk_stats_field(st, "size", "d", s->bm_cache_size);
+	tapdisk_stats_field(st, "used", "d",
+			    s->bm_cache_size - s->bm_free_count);
+	tapdisk_stats_field(st, "hits", "llu",
+			    (unsigned long long)s->bm_hits);
+	tapdisk_stats_field(st, "misses", "llu",
+			    (unsigned long long)s->bm_misses);
+	tapdisk_stats_field(st, "evictions", "llu",
+			    (unsigned long long)s->bm_evictions);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "bitmap_writes", "{");
+	tapdisk_stats_field(st, "writes", "llu",
+			    (unsigned long long)s->bm_writes);
+	tapdisk_stats_field(st, "reqs", "llu",
+			    (unsigned long long)s->bm_write_reqs);
+	tapdisk_stats_field(st, "deferred", "llu",
+			    (unsigned long long)s->bm_deferred);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "bat", "{");
+	tapdisk_stats_field(st, "allocs", "llu",
+			    (unsigned long long)s->bat.allocs);
+	tapdisk_stats_field(st, "pending", "d", s->bat.nr_allocs);
+	tapdisk_stats_field(st, "writes", "llu",
+			    (unsigned long long)s->bat.bat_writes);
+	tapdisk_stats_field(st, "waits", "llu",
+			    (unsigned long long)s->bat.alloc_waits);
+	tapdisk_stats_leave(st, '}');
+
+	if (s->chain.status == VHD_CHAIN_MAP_READY) {
+		tapdisk_stats_field(st, "chain_map", "{");
+		tapdisk_stats_field(st, "parents", "d", s->chain.nr_images);
+		tapdisk_stats_field(st, "direct", "llu",
+				    (unsigned long long)s->chain.direct);
+		tapdisk_stats_field(st, "holes", "llu",
+				    (unsigned long long)s->chain.holes);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (s->bounce.base) {
+		tapdisk_stats_field(st, "bounce", "{");
+		tapdisk_stats_field(st, "pages", "d", s->bounce.nr_pages);
+		tapdisk_stats_field(st, "free", "d", s->bounce.free_pages);
+		tapdisk_stats_field(st, "allocs", "llu",
+				    (unsigned long long)s->bounce.allocs);
+		tapdisk_stats_field(st, "exhausted", "llu",
+				    (unsigned long long)s->bounce.exhausted);
+		tapdisk_stats_field(st, "oversize", "llu",
+				    (unsigned long long)s->bounce.oversize);
+		tapdisk_stats_leave(st, '}');
+	}
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2755,7 +4274,12 @@ struct tap_disk tapdisk_vhd = {
 	.td_queue_block_status
 			    = vhd_queue_block_status,
 	.td_queue_write     = vhd_queue_write,
+	.td_queue_discard   = vhd_queue_discard,
+	.td_queue_write_zeroes
+			    = vhd_queue_write_zeroes,
+	.td_queue_flush     = vhd_queue_flush,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
 };
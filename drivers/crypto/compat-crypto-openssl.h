@@ -5,12 +5,30 @@
 #ifndef COMPAT_CRYPTO_OPENSSL_H
 #define COMPAT_CRYPTO_OPENSSL_H
 
+#include <pthread.h>
 #include <openssl/evp.h>
 
+/* AES-ECB under the data and the tweak key, for batched XTS */
+struct xts_aes_lane
+{
+	pthread_mutex_t lock;
+	EVP_CIPHER_CTX *ecb_de_ctx;
+	EVP_CIPHER_CTX *ecb_en_ctx;
+	EVP_CIPHER_CTX *ecb_tweak_ctx;
+};
+
 struct crypto_blkcipher
 {
 	EVP_CIPHER_CTX *de_ctx;
 	EVP_CIPHER_CTX *en_ctx;
+	pthread_mutex_t lock;		/* for the above, in the _sectors calls */
+
+	/*
+	 * Cipher contexts are not thread-safe, so concurrent callers of the
+	 * _sectors calls each take a lane of their own.
+	 */
+	int nr_lanes;
+	struct xts_aes_lane *lanes;
 };
 
 #endif
@@ -34,10 +34,28 @@
 #include <err.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <endian.h>
+#include <pthread.h>
 #include "compat-crypto-openssl.h"
 #include "xts_aes.h"
 
+#define XTS_AES_BLOCK_SIZE 16
+#define XTS_AES_BLOCKS_PER_SECTOR (XTS_AES_SECTOR_SIZE / XTS_AES_BLOCK_SIZE)
+
+/*
+ * Sectors put through the cipher at once by the batched path, bounded by
+ * the tweaks kept on the stack (one per cipher block).
+ */
+#define XTS_AES_BATCH_SECTORS 32
+
+/*
+ * Lanes of batched contexts per cipher, enough for the callers that may be
+ * running at once on the same disk.
+ */
+#define XTS_AES_LANES 8
+
 struct crypto_blkcipher * xts_aes_setup(void)
 {
 	struct crypto_blkcipher *ret;
@@ -45,9 +63,112 @@ struct crypto_blkcipher * xts_aes_setup(void)
 	ret = calloc(1, sizeof(struct crypto_blkcipher));
 	if (!ret)
 		return NULL;
+	pthread_mutex_init(&ret->lock, NULL);
 	return ret;
 }
 
+static void
+xts_aes_free_ecb(struct crypto_blkcipher *cipher)
+{
+	struct xts_aes_lane *lane;
+	int i;
+
+	for (i = 0; i < cipher->nr_lanes; i++) {
+		lane = &cipher->lanes[i];
+		EVP_CIPHER_CTX_free(lane->ecb_en_ctx);
+		EVP_CIPHER_CTX_free(lane->ecb_de_ctx);
+		EVP_CIPHER_CTX_free(lane->ecb_tweak_ctx);
+		pthread_mutex_destroy(&lane->lock);
+	}
+
+	free(cipher->lanes);
+	cipher->lanes = NULL;
+	cipher->nr_lanes = 0;
+}
+
+static EVP_CIPHER_CTX *
+xts_aes_ecb_ctx(const EVP_CIPHER *type, const uint8_t *key, int enc)
+{
+	EVP_CIPHER_CTX *ctx;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+		return NULL;
+
+	if (!EVP_CipherInit_ex(ctx, type, NULL, key, NULL, enc) ||
+	    !EVP_CIPHER_CTX_set_padding(ctx, 0)) {
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/*
+ * XTS is AES under the first half of the key, whitened with tweaks that are
+ * AES under the second half. Plain ECB contexts for both let the batched
+ * path use the widest AES-NI/VAES code OpenSSL has for this CPU. Without
+ * them, the per-sector XTS contexts are used.
+ */
+static void
+xts_aes_setup_ecb(struct crypto_blkcipher *cipher, const uint8_t *key,
+		  unsigned int keysize)
+{
+	const EVP_CIPHER *type;
+	struct xts_aes_lane *lane;
+
+	type = keysize == 64 ? EVP_aes_256_ecb() : EVP_aes_128_ecb();
+	if (!type)
+		return;
+
+	cipher->lanes = calloc(XTS_AES_LANES, sizeof(struct xts_aes_lane));
+	if (!cipher->lanes)
+		return;
+
+	for (; cipher->nr_lanes < XTS_AES_LANES; cipher->nr_lanes++) {
+		lane = &cipher->lanes[cipher->nr_lanes];
+		pthread_mutex_init(&lane->lock, NULL);
+
+		lane->ecb_en_ctx = xts_aes_ecb_ctx(type, key, 1);
+		lane->ecb_de_ctx = xts_aes_ecb_ctx(type, key, 0);
+		lane->ecb_tweak_ctx = xts_aes_ecb_ctx(type, key + keysize / 2, 1);
+
+		if (!lane->ecb_en_ctx || !lane->ecb_de_ctx ||
+		    !lane->ecb_tweak_ctx) {
+			cipher->nr_lanes++;
+			xts_aes_free_ecb(cipher);
+			return;
+		}
+	}
+}
+
+/*
+ * Each thread starts at a lane of its own, so workers only contend once
+ * there are more of them than lanes.
+ */
+static struct xts_aes_lane *
+xts_aes_get_lane(struct crypto_blkcipher *cipher)
+{
+	static unsigned int threads;
+	static __thread int home = -1;
+	struct xts_aes_lane *lane;
+	int i;
+
+	if (home < 0)
+		home = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED) %
+			XTS_AES_LANES;
+
+	for (i = 0; i < cipher->nr_lanes; i++) {
+		lane = &cipher->lanes[(home + i) % cipher->nr_lanes];
+		if (!pthread_mutex_trylock(&lane->lock))
+			return lane;
+	}
+
+	lane = &cipher->lanes[home % cipher->nr_lanes];
+	pthread_mutex_lock(&lane->lock);
+	return lane;
+}
+
 int xts_aes_setkey(struct crypto_blkcipher *cipher, const uint8_t *key, unsigned int keysize)
 {
 	const EVP_CIPHER *type;
@@ -92,10 +213,179 @@ int xts_aes_setkey(struct crypto_blkcipher *cipher, const uint8_t *key, unsigned
 		goto cleanup;
 	}
 
+	xts_aes_setup_ecb(cipher, key, keysize);
+
 	return 0;
 
 cleanup:
     EVP_CIPHER_CTX_free(cipher->en_ctx);
     EVP_CIPHER_CTX_free(cipher->de_ctx);
+    cipher->en_ctx = NULL;
+    cipher->de_ctx = NULL;
     return err;
 }
+
+void xts_aes_free(struct crypto_blkcipher *cipher)
+{
+	EVP_CIPHER_CTX_free(cipher->en_ctx);
+	EVP_CIPHER_CTX_free(cipher->de_ctx);
+	xts_aes_free_ecb(cipher);
+	pthread_mutex_destroy(&cipher->lock);
+	free(cipher);
+}
+
+/*
+ * Multiplies the tweak by the primitive element of GF(2^128), as per
+ * IEEE P1619 (little endian, reduction polynomial x^128 + x^7 + x^2 + x + 1).
+ */
+static inline void
+xts_aes_mult_x(uint64_t *lo, uint64_t *hi)
+{
+	uint64_t carry = *hi >> 63;
+
+	*hi = (*hi << 1) | (*lo >> 63);
+	*lo = (*lo << 1) ^ (carry * 0x87);
+}
+
+/* a cipher block, so the whitening is one vector op per block */
+typedef uint64_t xts_aes_block_t __attribute__((vector_size(XTS_AES_BLOCK_SIZE)));
+
+static inline void
+xts_aes_xor(uint8_t *dst, const uint8_t *src, const uint64_t *tweaks,
+	    size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i += sizeof(xts_aes_block_t)) {
+		xts_aes_block_t v, t;
+
+		memcpy(&v, src + i, sizeof(v));
+		memcpy(&t, (const uint8_t *)tweaks + i, sizeof(t));
+		v ^= t;
+		memcpy(dst + i, &v, sizeof(v));
+	}
+}
+
+static int
+xts_aes_crypt_sectors(EVP_CIPHER_CTX *tweak_ctx, EVP_CIPHER_CTX *ctx,
+		      sector_t sector, uint8_t *dst_buf,
+		      const uint8_t *src_buf, unsigned int nr_secs)
+{
+	uint64_t tweaks[XTS_AES_BATCH_SECTORS * XTS_AES_SECTOR_SIZE /
+			sizeof(uint64_t)];
+	uint8_t ivs[XTS_AES_BATCH_SECTORS][XTS_AES_BLOCK_SIZE];
+	unsigned int i, j, n;
+	int len;
+
+	while (nr_secs) {
+		n = nr_secs < XTS_AES_BATCH_SECTORS ?
+			nr_secs : XTS_AES_BATCH_SECTORS;
+
+		/* the initial tweaks of all sectors in a single pass */
+		for (i = 0; i < n; i++)
+			xts_aes_plain_iv_generate(ivs[i], XTS_AES_BLOCK_SIZE,
+						  sector + i);
+		if (!EVP_EncryptUpdate(tweak_ctx,
+				       (uint8_t *)ivs, &len,
+				       (uint8_t *)ivs, n * XTS_AES_BLOCK_SIZE))
+			return -3;
+
+		/* the rest follow by multiplication, whitening the input */
+		for (i = 0; i < n; i++) {
+			size_t off = i * XTS_AES_SECTOR_SIZE;
+			uint64_t *t = &tweaks[off / sizeof(uint64_t)];
+			uint64_t lo, hi;
+
+			memcpy(&lo, ivs[i], sizeof(lo));
+			memcpy(&hi, ivs[i] + sizeof(lo), sizeof(hi));
+			lo = le64toh(lo);
+			hi = le64toh(hi);
+
+			for (j = 0; j < XTS_AES_BLOCKS_PER_SECTOR; j++) {
+				t[2 * j] = htole64(lo);
+				t[2 * j + 1] = htole64(hi);
+				xts_aes_mult_x(&lo, &hi);
+			}
+
+			xts_aes_xor(dst_buf + off, src_buf + off, t,
+				    XTS_AES_SECTOR_SIZE);
+		}
+
+		/* one pass through the cipher, then whiten the output */
+		if (!EVP_CipherUpdate(ctx, dst_buf, &len, dst_buf,
+				      n * XTS_AES_SECTOR_SIZE))
+			return -2;
+		xts_aes_xor(dst_buf, dst_buf, tweaks, n * XTS_AES_SECTOR_SIZE);
+
+		sector  += n;
+		nr_secs -= n;
+		src_buf += n * XTS_AES_SECTOR_SIZE;
+		dst_buf += n * XTS_AES_SECTOR_SIZE;
+	}
+
+	return 0;
+}
+
+int xts_aes_plain_encrypt_sectors(struct crypto_blkcipher *xts_tfm,
+				  sector_t sector, uint8_t *dst_buf,
+				  const uint8_t *src_buf, unsigned int nr_secs)
+{
+	struct xts_aes_lane *lane;
+	unsigned int i;
+	int err = 0;
+
+	if (xts_tfm->nr_lanes) {
+		lane = xts_aes_get_lane(xts_tfm);
+		err = xts_aes_crypt_sectors(lane->ecb_tweak_ctx,
+					    lane->ecb_en_ctx, sector,
+					    dst_buf, src_buf, nr_secs);
+		pthread_mutex_unlock(&lane->lock);
+		return err;
+	}
+
+	pthread_mutex_lock(&xts_tfm->lock);
+	for (i = 0; i < nr_secs; i++) {
+		err = xts_aes_plain_encrypt(xts_tfm, sector + i,
+					    dst_buf + i * XTS_AES_SECTOR_SIZE,
+					    (uint8_t *)src_buf +
+					    i * XTS_AES_SECTOR_SIZE,
+					    XTS_AES_SECTOR_SIZE);
+		if (err)
+			break;
+	}
+	pthread_mutex_unlock(&xts_tfm->lock);
+
+	return err;
+}
+
+int xts_aes_plain_decrypt_sectors(struct crypto_blkcipher *xts_tfm,
+				  sector_t sector, uint8_t *dst_buf,
+				  const uint8_t *src_buf, unsigned int nr_secs)
+{
+	struct xts_aes_lane *lane;
+	unsigned int i;
+	int err = 0;
+
+	if (xts_tfm->nr_lanes) {
+		lane = xts_aes_get_lane(xts_tfm);
+		err = xts_aes_crypt_sectors(lane->ecb_tweak_ctx,
+					    lane->ecb_de_ctx, sector,
+					    dst_buf, src_buf, nr_secs);
+		pthread_mutex_unlock(&lane->lock);
+		return err;
+	}
+
+	pthread_mutex_lock(&xts_tfm->lock);
+	for (i = 0; i < nr_secs; i++) {
+		err = xts_aes_plain_decrypt(xts_tfm, sector + i,
+					    dst_buf + i * XTS_AES_SECTOR_SIZE,
+					    (uint8_t *)src_buf +
+					    i * XTS_AES_SECTOR_SIZE,
+					    XTS_AES_SECTOR_SIZE);
+		if (err)
+			break;
+	}
+	pthread_mutex_unlock(&xts_tfm->lock);
+
+	return err;
+}
@@ -35,6 +35,8 @@ extern struct crypto_blkcipher *xts_aes_setup(void);
 
 int xts_aes_setkey(struct crypto_blkcipher *cipher, const uint8_t *key, unsigned int keysize);
 
+void xts_aes_free(struct crypto_blkcipher *cipher);
+
 typedef uint64_t sector_t;
 
 static inline void
@@ -75,3 +77,19 @@ xts_aes_plain_decrypt(struct crypto_blkcipher *xts_tfm, sector_t sector,
 	/* no need to finalize with XTS when multiple of blocksize */
 	return 0;
 }
+
+#define XTS_AES_SECTOR_SIZE 512
+
+/*
+ * Encrypt or decrypt nr_secs consecutive sectors starting at sector, each
+ * one an XTS data unit with the same tweak as xts_aes_plain_*. The tweaks
+ * of the whole run are computed up front and the run goes through the
+ * cipher in one call, rather than re-initialising it for every sector.
+ * dst may be src.
+ */
+int xts_aes_plain_encrypt_sectors(struct crypto_blkcipher *xts_tfm,
+				  sector_t sector, uint8_t *dst_buf,
+				  const uint8_t *src_buf, unsigned int nr_secs);
+int xts_aes_plain_decrypt_sectors(struct crypto_blkcipher *xts_tfm,
+				  sector_t sector, uint8_t *dst_buf,
+				  const uint8_t *src_buf, unsigned int nr_secs);
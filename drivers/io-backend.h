@@ -33,6 +33,7 @@
 
 #include <aio.h>
 #include <libaio.h>
+#include <sys/uio.h>
 
 struct tiocb;
 struct tfilter;
@@ -66,6 +67,9 @@ typedef	int  (*submit_all_queue)(tqueue );
 typedef	int (*submit_tiocbs_queue)(tqueue );
 typedef	void (*prep_tiocb_queue)(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
+typedef	int (*prepv_tiocb_queue)(struct tiocb *, int, int, struct iovec *, int,
+			long long, td_queue_callback_t, void *);
+typedef	void (*forget_files_queue)(tqueue );
 
 struct backend {
 	debug_queue debug;
@@ -75,6 +79,8 @@ struct backend {
 	submit_all_queue submit_all;
 	submit_tiocbs_queue submit_tiocbs;
 	prep_tiocb_queue prep;
+	prepv_tiocb_queue prepv; /* optional, NULL if unsupported */
+	forget_files_queue forget_files; /* optional, drop cached fds */
 };
 
 #endif /*IO_BACKEND_H*/
@@ -66,6 +66,39 @@ opio_free(struct opioctx *ctx)
 	ctx->event_queue = NULL;
 }
 
+/*
+ * With the elevator on, io_sort orders each batch by fd and offset so
+ * contiguous iocbs merge even when they were queued interleaved, e.g.
+ * from several rings. Iocbs in one batch are in flight together, so
+ * their order carries no meaning. merge_max caps the merged size.
+ */
+void
+opio_set_elevator(struct opioctx *ctx, size_t merge_max)
+{
+	ctx->elevator  = !!merge_max;
+	ctx->merge_max = merge_max;
+}
+
+/*
+ * TAPDISK3_IO_ELEVATOR=<KiB> enables the elevator, 0 or unset disables.
+ */
+size_t
+opio_elevator_env(void)
+{
+	const char *kb;
+	long long n;
+
+	kb = getenv("TAPDISK3_IO_ELEVATOR");
+	if (!kb)
+		return 0;
+
+	n = strtoll(kb, NULL, 10);
+	if (n <= 0)
+		return 0;
+
+	return (size_t)n << 10;
+}
+
 int
 opio_init(struct opioctx *ctx, int num_iocbs)
 {
@@ -115,10 +148,27 @@ restore_iocb(struct opio *op)
 	*op->iocb = op->orig_iocb;
 }
 
+/*
+ * An iocb is optimized if we merged it: vectored, and its data points
+ * at one of our opios. Iocbs prepped as PREADV/PWRITEV by the caller
+ * carry their tiocb in data instead, and must be left alone.
+ */
 static inline int
 iocb_optimized(struct opioctx *ctx, struct iocb *io)
 {
-	return iocb_vectorized(io->aio_lio_opcode) == io->aio_lio_opcode;
+	struct opio *op = (struct opio *)io->data;
+
+	if (iocb_vectorized(io->aio_lio_opcode) != io->aio_lio_opcode)
+		return 0;
+
+	return op >= ctx->opios && op < ctx->opios + ctx->num_opios;
+}
+
+static inline int
+iocb_native_vectored(struct opioctx *ctx, struct iocb *io)
+{
+	return (iocb_vectorized(io->aio_lio_opcode) == io->aio_lio_opcode &&
+		!iocb_optimized(ctx, io));
 }
 
 static inline int
@@ -221,6 +271,9 @@ merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	if (iocb_vectorized(head->aio_lio_opcode) != iocb_vectorized(io->aio_lio_opcode))
 		return -EINVAL;
 
+	if (iocb_native_vectored(ctx, head) || iocb_native_vectored(ctx, io))
+		return -EINVAL;
+
 	if (!contiguous_iocbs(head, io))
 		return -EINVAL;
 
@@ -228,6 +281,10 @@ merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	if(iocb_optimized(ctx, head) && head->u.v.nr == UIO_FASTIOV)
 	    return -EINVAL;
 
+	if (ctx->merge_max &&
+	    iocb_nbytes(head) + iocb_nbytes(io) > ctx->merge_max)
+		return -EINVAL;
+
 	return merge_tail(ctx, head, io);		
 }
 
@@ -289,6 +346,79 @@ print_merged_iocbs(struct opioctx *ctx, struct iocb **iocbs, int num_iocbs)
 #define print_merged_iocbs(...)
 #endif
 
+static inline int
+iocb_before(struct iocb *l, struct iocb *r)
+{
+	if (l->aio_fildes != r->aio_fildes)
+		return l->aio_fildes < r->aio_fildes;
+
+	return iocb_offset(l) < iocb_offset(r);
+}
+
+static int
+iocbs_sorted(struct iocb **queue, int num)
+{
+	int i;
+
+	for (i = 1; i < num; i++)
+		if (iocb_before(queue[i], queue[i - 1]))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Stable bottom-up merge sort, tmp holds num entries.
+ */
+static void
+sort_iocbs(struct iocb **queue, struct iocb **tmp, int num)
+{
+	struct iocb **src, **dst, **swap;
+	int width, i, l, r, lend, rend, k;
+
+	src = queue;
+	dst = tmp;
+
+	for (width = 1; width < num; width <<= 1) {
+		for (i = 0; i < num; i += width << 1) {
+			l    = i;
+			lend = i + width < num ? i + width : num;
+			r    = lend;
+			rend = r + width < num ? r + width : num;
+
+			for (k = i; k < rend; k++) {
+				if (l < lend &&
+				    (r >= rend || !iocb_before(src[r], src[l])))
+					dst[k] = src[l++];
+				else
+					dst[k] = src[r++];
+			}
+		}
+
+		swap = src;
+		src  = dst;
+		dst  = swap;
+	}
+
+	if (src != queue)
+		memcpy(queue, src, num * sizeof(struct iocb *));
+}
+
+/*
+ * Elevator stage, ahead of io_merge. Returns 1 if the queue was
+ * reordered, callers chaining their iocbs in queue order must relink.
+ */
+int
+io_sort(struct opioctx *ctx, struct iocb **queue, int num)
+{
+	if (!ctx->elevator || num < 2 || iocbs_sorted(queue, num))
+		return 0;
+
+	sort_iocbs(queue, ctx->iocb_queue, num);
+
+	return 1;
+}
+
 int
 io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 {
@@ -310,6 +440,9 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 
 	print_merged_iocbs(ctx, queue, on_queue + 1);
 
+	ctx->iocbs_in  += num;
+	ctx->iocbs_out += on_queue + 1;
+
 	return ++on_queue;
 }
 
@@ -428,7 +561,8 @@ static void
 usage(void)
 {
 	fprintf(stderr, "usage: io_optimize [-n num_runs] "
-		"[-i num_iocbs] [-s num_secs] [-r random_seed]\n");
+		"[-i num_iocbs] [-s num_secs] [-r random_seed] "
+		"[-l num_streams] [-e elevator_kb]\n");
 	exit(-1);
 }
 
@@ -505,6 +639,29 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
 	}
 }
 
+/*
+ * Round-robin num_streams slices of the queue, like requests arriving
+ * from several rings at once.
+ */
+static void
+interleave_iocbs(struct iocb **iocbs, struct iocb **tmp,
+		 int num_iocbs, int num_streams)
+{
+	int i, s, n, len;
+
+	if (num_streams < 2)
+		return;
+
+	len = (num_iocbs + num_streams - 1) / num_streams;
+
+	for (i = 0, n = 0; i < len; i++)
+		for (s = 0; s < num_streams; s++)
+			if (s * len + i < num_iocbs)
+				tmp[n++] = iocbs[s * len + i];
+
+	memcpy(iocbs, tmp, num_iocbs * sizeof(struct iocb *));
+}
+
 static int
 simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 {
@@ -594,15 +751,18 @@ main(int argc, char **argv)
 	uint64_t num_secs;
 	struct opioctx ctx;
 	struct io_event *events;
-	int i, c, num_runs, num_iocbs, seed;
-	struct iocb *iocb_list, **iocbs, **ioqueue;
-
-	num_runs  = 1;
-	num_iocbs = 300;
-	seed      = time(NULL);
-	num_secs  = ((4ULL << 20) >> 9); /* 4GB disk */
-
-	while ((c = getopt(argc, argv, "n:i:s:r:h")) != -1) {
+	int i, c, num_runs, num_iocbs, seed, num_streams;
+	struct iocb *iocb_list, **iocbs, **ioqueue, **tmp;
+	size_t elevator;
+
+	num_runs    = 1;
+	num_iocbs   = 300;
+	seed        = time(NULL);
+	num_secs    = ((4ULL << 30) >> 9); /* 4GB disk */
+	num_streams = 1;
+	elevator    = 0;
+
+	while ((c = getopt(argc, argv, "n:i:s:r:l:e:h")) != -1) {
 		switch (c) {
 		case 'n':
 			num_runs  = atoi(optarg);
@@ -616,6 +776,12 @@ main(int argc, char **argv)
 		case 'r':
 			seed      = atoi(optarg);
 			break;
+		case 'l':
+			num_streams = atoi(optarg);
+			break;
+		case 'e':
+			elevator  = strtoull(optarg, NULL, 10) << 10;
+			break;
 		case 'h':
 			usage();
 		case '?':
@@ -632,22 +798,28 @@ main(int argc, char **argv)
 	iocb_list = malloc(num_iocbs * sizeof(struct iocb));
 	iocbs     = malloc(num_iocbs * sizeof(struct iocb *));
 	events    = malloc(num_iocbs * sizeof(struct io_event));
+	tmp       = malloc(num_iocbs * sizeof(struct iocb *));
 	
-	if (!iocb_list || !iocbs || !events || opio_init(&ctx, num_iocbs)) {
+	if (!iocb_list || !iocbs || !events || !tmp ||
+	    opio_init(&ctx, num_iocbs)) {
 		fprintf(stderr, "initialization failed\n");
 		exit(ENOMEM);
 	}
 
+	opio_set_elevator(&ctx, elevator);
+
 	for (i = 0; i < num_runs; i++) {
 		int op_rem, op_done, num_split, num_events, num_done;
 
 		ioqueue = iocbs;
 		init_optest(iocb_list, ioqueue, events, num_iocbs);
 		randomize_iocbs(ioqueue, num_iocbs, num_secs);
+		interleave_iocbs(ioqueue, tmp, num_iocbs, num_streams);
 		print_iocbs(&ctx, ioqueue, num_iocbs);
 
 		op_done  = 0;
 		num_done = 0;
+		io_sort(&ctx, ioqueue, num_iocbs);
 		op_rem   = io_merge(&ctx, ioqueue, num_iocbs);
 		print_iocbs(&ctx, ioqueue, op_rem);
 		print_merged_iocbs(&ctx, ioqueue, op_rem);
@@ -678,6 +850,12 @@ main(int argc, char **argv)
 		xalloc_cnt = xfree_cnt = 0;
 	}
 
+	printf("streams: %d, elevator: %zu bytes, merged %"PRIu64" iocbs "
+	       "into %"PRIu64", ratio %.2f\n", num_streams, elevator,
+	       ctx.iocbs_in, ctx.iocbs_out,
+	       ctx.iocbs_out ? (double)ctx.iocbs_in / ctx.iocbs_out : 0.0);
+
+	free(tmp);
 	free(iocbs);
 	free(events);
 	free(iocb_list);
@@ -61,10 +61,21 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+
+	/* sort batches by fd and offset before merging */
+	int                 elevator;
+	/* max bytes per merged iocb, 0 for no limit */
+	size_t              merge_max;
+
+	uint64_t            iocbs_in;
+	uint64_t            iocbs_out;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
 void opio_free(struct opioctx *ctx);
+void opio_set_elevator(struct opioctx *ctx, size_t merge_max);
+size_t opio_elevator_env(void);
+int io_sort(struct opioctx *ctx, struct iocb **queue, int num);
 int io_merge(struct opioctx *ctx, struct iocb **queue, int num);
 int io_split(struct opioctx *ctx, struct io_event *events, int num);
 int io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num);
@@ -466,6 +466,23 @@ fail:
 	return err;
 }
 
+/*
+ * Keep the tiocb chain in queue order after io_sort, fail_tiocbs
+ * relies on it.
+ */
+static void
+relink_tiocbs(libaio_queue *queue)
+{
+	struct tiocb *tiocb;
+	int i;
+
+	for (i = 0; i < queue->queued; i++) {
+		tiocb       = queue->iocbs[i]->data;
+		tiocb->next = i + 1 < queue->queued ?
+			queue->iocbs[i + 1]->data : NULL;
+	}
+}
+
 static int
 libaio_backend_lio_submit(libaio_queue *queue)
 {
@@ -475,6 +492,8 @@ libaio_backend_lio_submit(libaio_queue *queue)
 	if (!queue->queued)
 		return 0;
 
+	if (io_sort(&queue->opioctx, queue->iocbs, queue->queued))
+		relink_tiocbs(queue);
 	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 	libaio_backend_lio_set_eventfd(queue, merged, queue->iocbs);
 	submitted = io_submit(lio->aio_ctx, merged, queue->iocbs);
@@ -611,6 +630,8 @@ libaio_backend_init_queue(tqueue *q, int size,
 	if (err)
 		goto fail;
 
+	opio_set_elevator(&queue->opioctx, opio_elevator_env());
+
 	return 0;
 
  fail:
@@ -630,6 +651,9 @@ libaio_backend_debug_queue(tqueue q)
 	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("elevator: %zu, iocbs merged: %"PRIu64" -> %"PRIu64"\n",
+	     queue->opioctx.merge_max, queue->opioctx.iocbs_in,
+	     queue->opioctx.iocbs_out);
 
 	if (tiocb) {
 		WARN("deferred:\n");
@@ -659,6 +683,26 @@ libaio_backend_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t
 	tiocb->next = NULL;
 }
 
+static int
+libaio_backend_prepv_tiocb(struct tiocb *tiocb, int fd, int rw,
+	struct iovec *iov, int iovcnt,
+	long long offset, td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &(tiocb->uiocb.io);
+
+	if (rw)
+		io_prep_pwritev(iocb, fd, iov, iovcnt, offset);
+	else
+		io_prep_preadv(iocb, fd, iov, iovcnt, offset);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+
+	return 0;
+}
+
 static void
 libaio_backend_queue_tiocb(tqueue q, struct tiocb *tiocb)
 {
@@ -726,7 +770,8 @@ struct backend* get_libaio_backend()
 		.queue=libaio_backend_queue_tiocb,
 		.submit_all=libaio_backend_submit_all_tiocbs,
 		.submit_tiocbs=libaio_backend_submit_tiocbs,
-		.prep=libaio_backend_prep_tiocb
+		.prep=libaio_backend_prep_tiocb,
+		.prepv=libaio_backend_prepv_tiocb
 	};
 	return &lib_aio_backend;
 }
@@ -37,6 +37,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <limits.h>
 
 #include "debug.h"
@@ -49,6 +50,7 @@
 #define BUG_ON(_cond)                if (_cond) td_panic()
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_EPOLL_EVENTS       256
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -90,100 +92,394 @@ typedef struct event {
 	 */
 	struct timeval               deadline;
 
+	/**
+	 * Position in the timer heap, or -1 if not armed.
+	 */
+	int                          heap_idx;
+
+	/**
+	 * Polled descriptor, or NULL if the event is timeout-only.
+	 */
+	struct sched_fd             *sfd;
+
 	event_cb_t                   cb;
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             fd_next;
+	struct list_head             pending_next;
 } event_t;
 
+/**
+ * A descriptor known to epoll. Events sharing an fd are kept in
+ * registration order, so the first live one is the one dispatched,
+ * as with the old select() loop.
+ */
+struct sched_fd {
+	int                          fd;
+	uint32_t                     mask;
+	int                          always_ready;
+
+	struct list_head             events;
+	struct list_head             ready_next;
+};
+
+/*
+ * Timer heap.
+ */
+
+static inline int
+scheduler_heap_before(scheduler_t *s, int a, int b)
+{
+	return TV_BEFORE(s->heap[a]->deadline, s->heap[b]->deadline);
+}
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_heap_swap(scheduler_t *s, int a, int b)
 {
-	struct timeval diff;
-	struct timeval now;
+	event_t *tmp = s->heap[a];
+
+	s->heap[a] = s->heap[b];
+	s->heap[b] = tmp;
+
+	s->heap[a]->heap_idx = a;
+	s->heap[b]->heap_idx = b;
+}
+
+static void
+scheduler_heap_up(scheduler_t *s, int i)
+{
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (!scheduler_heap_before(s, i, parent))
+			break;
+
+		scheduler_heap_swap(s, i, parent);
+		i = parent;
+	}
+}
+
+static void
+scheduler_heap_down(scheduler_t *s, int i)
+{
+	for (;;) {
+		int l = 2 * i + 1, r = l + 1, min = i;
+
+		if (l < s->heap_len && scheduler_heap_before(s, l, min))
+			min = l;
+		if (r < s->heap_len && scheduler_heap_before(s, r, min))
+			min = r;
+		if (min == i)
+			break;
+
+		scheduler_heap_swap(s, i, min);
+		i = min;
+	}
+}
+
+static int
+scheduler_heap_reserve(scheduler_t *s)
+{
+	event_t **heap;
+	int size;
+
+	if (s->heap_len < s->heap_size)
+		return 0;
+
+	size = s->heap_size ? s->heap_size * 2 : 64;
+	heap = realloc(s->heap, size * sizeof(event_t *));
+	if (!heap)
+		return -ENOMEM;
+
+	s->heap      = heap;
+	s->heap_size = size;
+
+	return 0;
+}
+
+static void
+scheduler_heap_remove(scheduler_t *s, event_t *event)
+{
+	int i = event->heap_idx;
+
+	if (i < 0)
+		return;
+
+	event->heap_idx = -1;
+
+	if (--s->heap_len == i)
+		return;
+
+	s->heap[i] = s->heap[s->heap_len];
+	s->heap[i]->heap_idx = i;
+
+	scheduler_heap_up(s, i);
+	scheduler_heap_down(s, s->heap[i]->heap_idx);
+}
+
+/**
+ * (Re)arms an event in the timer heap after its deadline changed.
+ */
+static int
+scheduler_heap_update(scheduler_t *s, event_t *event)
+{
+	if (event->dead || !(event->mode & SCHEDULER_POLL_TIMEOUT) ||
+	    TV_IS_INF(event->timeout)) {
+		scheduler_heap_remove(s, event);
+		return 0;
+	}
+
+	if (event->heap_idx < 0) {
+		int err = scheduler_heap_reserve(s);
+		if (err)
+			return err;
+
+		event->heap_idx = s->heap_len++;
+		s->heap[event->heap_idx] = event;
+	}
+
+	scheduler_heap_up(s, event->heap_idx);
+	scheduler_heap_down(s, event->heap_idx);
+
+	return 0;
+}
+
+/*
+ * File descriptors.
+ */
+
+static inline struct sched_fd *
+scheduler_lookup_fd(scheduler_t *s, int fd)
+{
+	if (fd < 0 || fd >= s->nr_fds)
+		return NULL;
+
+	return s->fds[fd];
+}
+
+static struct sched_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	struct sched_fd *sfd;
+
+	if (fd >= s->nr_fds) {
+		struct sched_fd **fds;
+		int n = MAX(fd + 1, MAX(s->nr_fds * 2, 64));
+
+		fds = realloc(s->fds, n * sizeof(struct sched_fd *));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->nr_fds, 0,
+		       (n - s->nr_fds) * sizeof(struct sched_fd *));
+		s->fds    = fds;
+		s->nr_fds = n;
+	}
+
+	sfd = s->fds[fd];
+	if (sfd)
+		return sfd;
+
+	sfd = calloc(1, sizeof(*sfd));
+	if (!sfd)
+		return NULL;
+
+	sfd->fd = fd;
+	INIT_LIST_HEAD(&sfd->events);
+	INIT_LIST_HEAD(&sfd->ready_next);
+	s->fds[fd] = sfd;
+
+	return sfd;
+}
+
+static void
+scheduler_put_fd(scheduler_t *s, struct sched_fd *sfd)
+{
+	if (!list_empty(&sfd->events))
+		return;
+
+	list_del(&sfd->ready_next);
+	s->fds[sfd->fd] = NULL;
+	free(sfd);
+}
+
+static uint32_t
+scheduler_epoll_mask(char mode)
+{
+	uint32_t mask = 0;
+
+	if (mode & SCHEDULER_POLL_READ_FD)
+		mask |= EPOLLIN;
+	if (mode & SCHEDULER_POLL_WRITE_FD)
+		mask |= EPOLLOUT;
+	if (mode & SCHEDULER_POLL_EXCEPT_FD)
+		mask |= EPOLLPRI;
+
+	return mask;
+}
+
+/**
+ * Brings the epoll interest set for an fd in line with the live,
+ * unmasked events on it. Descriptors epoll refuses (regular files)
+ * are treated as always ready, which is what select() reports.
+ *
+ * The cached mask belongs to whatever file the fd number referred to
+ * when it was armed: closing it drops it from epoll behind our back,
+ * and the number may come back as another file. @rearm forgets the
+ * cache, for new registrations.
+ */
+static int
+scheduler_update_fd(scheduler_t *s, struct sched_fd *sfd, int rearm)
+{
+	struct epoll_event ev;
+	uint32_t mask = 0;
 	event_t *event;
+	int op, err;
+
+	list_for_each_entry(event, &sfd->events, fd_next)
+		if (!event->dead && !event->masked)
+			mask |= scheduler_epoll_mask(event->mode);
+
+	if (mask == sfd->mask && !rearm)
+		return 0;
+
+	if (!mask) {
+		if (!sfd->always_ready)
+			epoll_ctl(s->epfd, EPOLL_CTL_DEL, sfd->fd, NULL);
+		list_del_init(&sfd->ready_next);
+		sfd->always_ready = 0;
+		sfd->mask = 0;
+		return 0;
+	}
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	if (rearm && sfd->always_ready) {
+		list_del_init(&sfd->ready_next);
+		sfd->always_ready = 0;
+	}
 
-	s->max_fd  = -1;
-	s->timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
+	if (sfd->always_ready) {
+		sfd->mask = mask;
+		return 0;
+	}
 
-	gettimeofday(&now, NULL);
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = mask;
+	ev.data.fd = sfd->fd;
+
+	op  = sfd->mask && !rearm ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	err = epoll_ctl(s->epfd, op, sfd->fd, &ev);
+	if (err && op == EPOLL_CTL_MOD && errno == ENOENT)
+		err = epoll_ctl(s->epfd, EPOLL_CTL_ADD, sfd->fd, &ev);
+	else if (err && op == EPOLL_CTL_ADD && errno == EEXIST)
+		err = epoll_ctl(s->epfd, EPOLL_CTL_MOD, sfd->fd, &ev);
+
+	if (err && errno == EPERM) {
+		sfd->always_ready = 1;
+		list_add_tail(&sfd->ready_next, &s->always_ready);
+		err = 0;
+	}
+
+	if (err)
+		return -errno;
+
+	sfd->mask = mask;
+
+	return 0;
+}
+
+static void
+scheduler_set_pending(scheduler_t *s, event_t *event, char mode)
+{
+	if (!event->pending)
+		list_add_tail(&event->pending_next, &s->pending);
+
+	event->pending |= mode;
+}
 
-	scheduler_for_each_event(s, event) {
-		if (event->masked || event->dead)
+/**
+ * Hands each ready mode to the first live, unmasked event on the fd
+ * polling for it.
+ */
+static void
+scheduler_dispatch_fd(scheduler_t *s, struct sched_fd *sfd, char ready)
+{
+	event_t *event;
+	char mode;
+
+	for (mode = SCHEDULER_POLL_READ_FD;
+	     mode <= SCHEDULER_POLL_EXCEPT_FD; mode <<= 1) {
+		if (!(ready & mode))
 			continue;
 
-		if ((event->mode & SCHEDULER_POLL_READ_FD) && event->fd >= 0) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+		list_for_each_entry(event, &sfd->events, fd_next) {
+			if (event->dead || event->masked)
+				continue;
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) && event->fd >= 0) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
+			if (event->mode & mode) {
+				scheduler_set_pending(s, event, mode);
+				break;
+			}
 		}
+	}
+}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) && event->fd >= 0) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static void
+scheduler_prepare_events(scheduler_t *s)
+{
+	struct timeval diff;
+	struct timeval now;
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT
-				&& !TV_IS_INF(event->timeout)) {
-			TV_SUB(event->deadline, now, diff);
-			if (TV_AFTER(diff, TV_ZERO))
-				s->timeout = TV_MIN(s->timeout, diff);
-			else
-				s->timeout = TV_ZERO;
-		}
+	s->timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
+
+	if (!list_empty(&s->always_ready) || !list_empty(&s->pending))
+		s->timeout = TV_ZERO;
+	else if (s->heap_len) {
+		gettimeofday(&now, NULL);
+
+		TV_SUB(s->heap[0]->deadline, now, diff);
+		if (TV_AFTER(diff, TV_ZERO))
+			s->timeout = TV_MIN(s->timeout, diff);
+		else
+			s->timeout = TV_ZERO;
 	}
 
 	s->timeout = TV_MIN(s->timeout, s->max_timeout);
 }
 
-static int
+static void
 scheduler_check_fd_events(scheduler_t *s, int nfds)
 {
-	event_t *event;
+	struct sched_fd *sfd;
+	int i;
 
-	scheduler_for_each_event(s, event) {
-		if (!nfds)
-			break;
+	for (i = 0; i < nfds; i++) {
+		uint32_t ev = s->ep_events[i].events;
+		char ready = 0;
 
-		if (event->dead)
+		sfd = scheduler_lookup_fd(s, s->ep_events[i].data.fd);
+		if (!sfd)
 			continue;
 
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			event->pending |= SCHEDULER_POLL_READ_FD;
-			--nfds;
-		}
+		if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			ready |= SCHEDULER_POLL_READ_FD;
+		if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			ready |= SCHEDULER_POLL_WRITE_FD;
+		if (ev & EPOLLPRI)
+			ready |= SCHEDULER_POLL_EXCEPT_FD;
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			event->pending |= SCHEDULER_POLL_WRITE_FD;
-			--nfds;
-		}
-
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			event->pending |= SCHEDULER_POLL_EXCEPT_FD;
-			--nfds;
-		}
+		scheduler_dispatch_fd(s, sfd, ready);
 	}
 
-	return nfds;
+	list_for_each_entry(sfd, &s->always_ready, ready_next)
+		scheduler_dispatch_fd(s, sfd,
+				      SCHEDULER_POLL_READ_FD |
+				      SCHEDULER_POLL_WRITE_FD);
 }
 
 /**
- * Checks all scheduler events whose mode is set to SCHEDULER_POLL_TIMEOUT
- * whether their time out has elapsed, and if so it makes them runnable.
+ * Pops all expired events off the timer heap and makes them runnable.
+ * They are re-armed when their callback runs.
  */
 static void
 scheduler_check_timeouts(scheduler_t *s)
@@ -193,47 +489,37 @@ scheduler_check_timeouts(scheduler_t *s)
 
 	gettimeofday(&now, NULL);
 
-	scheduler_for_each_event(s, event) {
-		BUG_ON(event->pending && event->masked);
-
-		if (event->dead)
-			continue;
-
-		if (event->pending)
-			continue;
-
-		if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-			continue;
-
-		if (TV_IS_INF(event->timeout))
-			continue;
+	while (s->heap_len) {
+		event = s->heap[0];
 
 		if (TV_BEFORE(now, event->deadline))
-			continue;
+			break;
+
+		scheduler_heap_remove(s, event);
 
-		event->pending = SCHEDULER_POLL_TIMEOUT;
+		if (!event->pending)
+			scheduler_set_pending(s, event, SCHEDULER_POLL_TIMEOUT);
 	}
 }
 
-static int
+static void
 scheduler_check_events(scheduler_t *s, int nfds)
 {
-	if (nfds)
-		nfds = scheduler_check_fd_events(s, nfds);
+	scheduler_check_fd_events(s, nfds);
 
 	scheduler_check_timeouts(s);
-
-	return nfds;
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
 	if (event->mode & SCHEDULER_POLL_TIMEOUT
 			&& !TV_IS_INF(event->timeout)) {
 		struct timeval now;
 		gettimeofday(&now, NULL);
 		TV_ADD(now, event->timeout, event->deadline);
+		if (scheduler_heap_update(s, event))
+			EPRINTF("failed to re-arm event %d\n", event->id);
 	}
 
 	if (!event->masked)
@@ -246,19 +532,23 @@ scheduler_run_events(scheduler_t *s)
 	event_t *event;
 	int n_dispatched = 0;
 
-	scheduler_for_each_event(s, event) {
+	/* NB. callbacks may recurse into scheduler_wait_for_events,
+	 * which keeps draining the same list */
+	while (!list_empty(&s->pending)) {
 		char pending;
 
+		event = list_first_entry(&s->pending, event_t, pending_next);
+		list_del_init(&event->pending_next);
+
+		pending = event->pending;
+		event->pending = 0;
+
 		if (event->dead)
 			continue;
 
-		pending = event->pending;
-		if (pending) {
-			event->pending = 0;
-			/* NB. must clear before cb */
-			scheduler_event_callback(event, pending);
-			n_dispatched++;
-		}
+		/* NB. must clear before cb */
+		scheduler_event_callback(s, event, pending);
+		n_dispatched++;
 	}
 
 	return n_dispatched;
@@ -311,8 +601,10 @@ int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 struct timeval timeout, event_cb_t cb, void *private)
 {
+	struct sched_fd *sfd = NULL;
 	event_t *event;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -320,6 +612,12 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if (mode & SCHEDULER_POLL_TIMEOUT && !TV_IS_INF(timeout)) {
+		err = scheduler_heap_reserve(s);
+		if (err)
+			return err;
+	}
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
@@ -327,6 +625,8 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	gettimeofday(&now, NULL);
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->pending_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
@@ -336,16 +636,52 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 		event->deadline = TV_INF;
 	else
 		TV_ADD(now, timeout, event->deadline);
+	event->heap_idx = -1;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = scheduler_get_event_uuid(s);
 	event->masked   = 0;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd >= 0) {
+		sfd = scheduler_get_fd(s, fd);
+		if (!sfd) {
+			free(event);
+			return -ENOMEM;
+		}
+
+		list_add_tail(&event->fd_next, &sfd->events);
+		event->sfd = sfd;
+
+		err = scheduler_update_fd(s, sfd, 1);
+		if (err) {
+			EPRINTF("failed to poll fd %d: %s\n", fd, strerror(-err));
+			list_del(&event->fd_next);
+			scheduler_put_fd(s, sfd);
+			free(event);
+			return err;
+		}
+	}
+
+	event->id       = scheduler_get_event_uuid(s);
+
 	list_add_tail(&event->next, &s->events);
+	err = scheduler_heap_update(s, event);
+	BUG_ON(err); /* reserved above */
 
 	return event->id;
 }
 
+static event_t *
+scheduler_find_event(scheduler_t *s, event_id_t id)
+{
+	event_t *event;
+
+	scheduler_for_each_event(s, event)
+		if (event->id == id)
+			return event;
+
+	return NULL;
+}
+
 void
 scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
@@ -354,11 +690,15 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->dead = 1;
-			break;
-		}
+	event = scheduler_find_event(s, id);
+	if (!event)
+		return;
+
+	event->dead = 1;
+	scheduler_heap_remove(s, event);
+
+	if (event->sfd)
+		scheduler_update_fd(s, event->sfd, 0);
 }
 
 void
@@ -369,11 +709,18 @@ scheduler_mask_event(scheduler_t *s, event_id_t id, int masked)
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->masked = !!masked;
-			break;
-		}
+	event = scheduler_find_event(s, id);
+	if (!event)
+		return;
+
+	event->masked = !!masked;
+
+	if (event->sfd) {
+		int err = scheduler_update_fd(s, event->sfd, 0);
+		if (err)
+			EPRINTF("failed to poll fd %d: %s\n",
+				event->fd, strerror(-err));
+	}
 }
 
 static void
@@ -384,6 +731,14 @@ scheduler_gc_events(scheduler_t *s)
 	scheduler_for_each_event_safe(s, event, next)
 		if (event->dead) {
 			list_del(&event->next);
+			list_del(&event->pending_next);
+			scheduler_heap_remove(s, event);
+
+			if (event->sfd) {
+				list_del(&event->fd_next);
+				scheduler_put_fd(s, event->sfd);
+			}
+
 			free(event);
 		}
 }
@@ -398,8 +753,7 @@ scheduler_set_max_timeout(scheduler_t *s, struct timeval timeout)
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
-	int ret;
-	struct timeval tv;
+	int ret, ms;
 
 	s->depth++;
 	ret = 0;
@@ -412,27 +766,27 @@ scheduler_wait_for_events(scheduler_t *s)
 
 	scheduler_prepare_events(s);
 
-	tv = s->timeout;
-
 	DBG("timeout: %ld.%ld, max_timeout: %ld.%ld\n",
 	    s->timeout.tv_sec, s->timeout.tv_usec, s->max_timeout.tv_sec, s->max_timeout.tv_usec);
 
-    do {
-    	ret = select(s->max_fd + 1, &s->read_fds, &s->write_fds,
-                &s->except_fds, &tv);
-        if (ret < 0) {
-            ret = -errno;
-            ASSERT(ret);
-        }
-    } while (ret == -EINTR);
+	/* NB. round up, waking early would just spin */
+	ms = s->timeout.tv_sec * 1000 + (s->timeout.tv_usec + 999) / 1000;
 
-    if (ret < 0) {
-        EPRINTF("select failed: %s\n", strerror(-ret));
-        goto out;
-    }
+	do {
+		ret = epoll_wait(s->epfd, s->ep_events, s->ep_size, ms);
+		if (ret < 0) {
+			ret = -errno;
+			ASSERT(ret);
+		}
+	} while (ret == -EINTR);
 
-	ret = scheduler_check_events(s, ret);
-	BUG_ON(ret);
+	if (ret < 0) {
+		EPRINTF("epoll_wait failed: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	scheduler_check_events(s, ret);
+	ret = 0;
 
 	s->timeout     = TV_SECS(SCHEDULER_MAX_TIMEOUT);
 	s->max_timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
@@ -448,7 +802,7 @@ out:
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
 	memset(s, 0, sizeof(scheduler_t));
@@ -457,11 +811,25 @@ scheduler_initialize(scheduler_t *s)
 	s->depth = 0;
 	s->uuid_overflow = 0;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
-
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->pending);
+	INIT_LIST_HEAD(&s->always_ready);
+
+	s->ep_size   = SCHEDULER_EPOLL_EVENTS;
+	s->ep_events = calloc(s->ep_size, sizeof(struct epoll_event));
+	if (!s->ep_events)
+		return -ENOMEM;
+
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epfd < 0) {
+		int err = -errno;
+		EPRINTF("epoll_create1 failed: %s\n", strerror(-err));
+		free(s->ep_events);
+		s->ep_events = NULL;
+		return err;
+	}
+
+	return 0;
 }
 
 int
@@ -474,22 +842,21 @@ scheduler_event_set_timeout(scheduler_t *sched, event_id_t event_id, struct time
 	if (!event_id)
 		return -EINVAL;
 
-	scheduler_for_each_event(sched, event) {
-		if (event->id == event_id) {
-			if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-				return -EINVAL;
-			event->timeout = timeo;
-			if (TV_IS_INF(event->timeout))
-				event->deadline = TV_INF;
-			else {
-				struct timeval now;
-				gettimeofday(&now, NULL);
-				TV_ADD(now, event->timeout, event->deadline);
-			}
-			return 0;
-		}
+	event = scheduler_find_event(sched, event_id);
+	if (!event)
+		return -ENOENT;
+
+	if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
+		return -EINVAL;
+
+	event->timeout = timeo;
+	if (TV_IS_INF(event->timeout))
+		event->deadline = TV_INF;
+	else {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		TV_ADD(now, event->timeout, event->deadline);
 	}
 
-	return -ENOENT;
+	return scheduler_heap_update(sched, event);
 }
-
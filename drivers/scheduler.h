@@ -44,23 +44,37 @@
 typedef int32_t                      event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct event;
+struct sched_fd;
+struct epoll_event;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epfd;
+	struct epoll_event          *ep_events;
+	int                          ep_size;
+
+	/* fd-indexed table of polled descriptors */
+	struct sched_fd            **fds;
+	int                          nr_fds;
+	struct list_head             always_ready;
+
+	/* min-heap of armed timeouts, ordered by deadline */
+	struct event               **heap;
+	int                          heap_len;
+	int                          heap_size;
 
 	struct list_head             events;
+	struct list_head             pending;
 
 	event_id_t                   uuid;
 	int                          uuid_overflow;
-	int                          max_fd;
 	struct timeval               timeout;
 	struct timeval               max_timeout;
 	int                          depth;
 } scheduler_t;
 
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
 
 /**
  * Registers an event.
@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tapdisk-bench: issue a random-order write workload against an image
+ * through the regular tapdisk datapath, then report throughput and the
+ * driver statistics (e.g. the number of vhd bitmap writes, to compare
+ * metadata IOPS across driver settings).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-stats.h"
+
+#define BUG_ON(_cond)                    if (unlikely(_cond)) { td_panic(); }
+
+#define TD_BENCH_MAX_DEPTH               64
+#define TD_BENCH_MAX_SECS                256
+#define TD_BENCH_STATS_SIZE              (64 << 10)
+
+typedef struct tapdisk_bench_request td_bench_req_t;
+typedef struct tapdisk_bench td_bench_t;
+
+struct tapdisk_bench_request {
+	void                            *buf;
+	struct td_iovec                  iov;
+	td_vbd_request_t                 vreq;
+};
+
+struct tapdisk_bench {
+	td_vbd_t                        *vbd;
+
+	int                              err;
+
+	int                              secs;   /* per request */
+	td_sector_t                      start;
+	uint64_t                        *slots;  /* shuffled request offsets */
+	uint64_t                         nr_slots;
+	uint64_t                         next;
+	uint64_t                         done;
+	int                              pending;
+
+	struct timeval                   t0;
+	struct timeval                   t1;
+
+	td_bench_req_t                   reqs[TD_BENCH_MAX_DEPTH];
+	td_bench_req_t                  *free[TD_BENCH_MAX_DEPTH];
+	int                              n_free;
+};
+
+static void tapdisk_bench_queue_requests(td_bench_t *);
+static void tapdisk_bench_finish(td_bench_t *);
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s <-n type:/path/to/image> [-q queue depth] "
+	       "[-s sectors per request] [-o start sector] "
+	       "[-r range in sectors] [-c request count] [-S seed]\n", app);
+	exit(err);
+}
+
+static void
+__tapdisk_bench_request_cb(td_vbd_request_t *vreq, int error,
+			   void *token, int final)
+{
+	td_bench_req_t *req = container_of(vreq, td_bench_req_t, vreq);
+	td_bench_t *b = token;
+
+	if (error && !b->err) {
+		fprintf(stderr, "error writing sector 0x%"PRIx64": %d\n",
+			vreq->sec, error);
+		b->err = error;
+	}
+
+	if (!final)
+		return;
+
+	b->done++;
+	b->pending--;
+	b->free[b->n_free++] = req;
+
+	if (!b->pending && (b->next == b->nr_slots || b->err)) {
+		tapdisk_bench_finish(b);
+		return;
+	}
+
+	tapdisk_bench_queue_requests(b);
+}
+
+static void
+tapdisk_bench_queue_requests(td_bench_t *b)
+{
+	while (b->n_free && b->next < b->nr_slots && !b->err) {
+		td_bench_req_t *req;
+		td_vbd_request_t *vreq;
+		int err;
+
+		req = b->free[--b->n_free];
+
+		req->iov.base = req->buf;
+		req->iov.secs = b->secs;
+
+		vreq         = &req->vreq;
+		memset(vreq, 0, sizeof(*vreq));
+		vreq->iov    = &req->iov;
+		vreq->iovcnt = 1;
+		vreq->sec    = b->start + b->slots[b->next++];
+		vreq->op     = TD_OP_WRITE;
+		vreq->token  = b;
+		vreq->cb     = __tapdisk_bench_request_cb;
+
+		b->pending++;
+
+		err = tapdisk_vbd_queue_request(b->vbd, vreq);
+		if (err)
+			__tapdisk_bench_request_cb(vreq, err, b, 1);
+	}
+}
+
+static void
+tapdisk_bench_report(td_bench_t *b)
+{
+	td_stats_t st;
+	char *buf;
+	double secs;
+
+	secs = (b->t1.tv_sec - b->t0.tv_sec) +
+		(b->t1.tv_usec - b->t0.tv_usec) / 1000000.0;
+
+	printf("requests: %"PRIu64", sectors: %d, time: %.3fs, iops: %.0f\n",
+	       b->done, b->secs, secs, secs > 0 ? b->done / secs : 0.0);
+
+	buf = malloc(TD_BENCH_STATS_SIZE);
+	if (!buf)
+		return;
+
+	tapdisk_stats_init(&st, buf, TD_BENCH_STATS_SIZE);
+	tapdisk_vbd_stats(b->vbd, &st);
+	if (tapdisk_stats_length(&st) > 0)
+		printf("%.*s\n", (int)tapdisk_stats_length(&st), buf);
+
+	free(buf);
+}
+
+static void
+tapdisk_bench_close_image(td_bench_t *b)
+{
+	if (b->vbd) {
+		tapdisk_vbd_close_vdi(b->vbd);
+		tapdisk_server_remove_vbd(b->vbd);
+		tapdisk_vbd_free(b->vbd);
+		b->vbd = NULL;
+	}
+}
+
+static void
+tapdisk_bench_finish(td_bench_t *b)
+{
+	gettimeofday(&b->t1, NULL);
+	tapdisk_bench_report(b);
+	tapdisk_bench_close_image(b);
+}
+
+static int
+tapdisk_bench_open_image(td_bench_t *b, const char *name)
+{
+	int err;
+
+	err = tapdisk_server_initialize(NULL, NULL);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(-1, -1, 0);
+	if (err)
+		goto out;
+
+	b->vbd = tapdisk_server_get_vbd(0);
+	if (!b->vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	err = tapdisk_vbd_open_vdi(b->vbd, name, 0, -1);
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", name, err);
+	return err;
+}
+
+static int
+tapdisk_bench_create_slots(td_bench_t *b, uint64_t range,
+			   uint64_t count, unsigned int seed)
+{
+	td_disk_info_t info;
+	uint64_t i, j, tmp;
+	int err;
+
+	err = tapdisk_vbd_get_disk_info(b->vbd, &info);
+	if (err) {
+		fprintf(stderr, "failed getting image size: %d\n", err);
+		return err;
+	}
+
+	if (b->start + range > info.size) {
+		fprintf(stderr, "0x%"PRIx64" past end of image 0x%"PRIx64"\n",
+			b->start + range, info.size);
+		return -EINVAL;
+	}
+
+	b->nr_slots = range / b->secs;
+	if (!b->nr_slots)
+		return -EINVAL;
+
+	b->slots = calloc(b->nr_slots, sizeof(uint64_t));
+	if (!b->slots)
+		return -ENOMEM;
+
+	/*
+	 * Every slot is written at most once, so that each write lands
+	 * on sectors not yet allocated.
+	 */
+	for (i = 0; i < b->nr_slots; i++)
+		b->slots[i] = i * b->secs;
+
+	srandom(seed);
+	for (i = b->nr_slots - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		tmp         = b->slots[i];
+		b->slots[i] = b->slots[j];
+		b->slots[j] = tmp;
+	}
+
+	if (count < b->nr_slots)
+		b->nr_slots = count;
+
+	return 0;
+}
+
+static int
+tapdisk_bench_create_reqs(td_bench_t *b, int depth)
+{
+	int i, prot, flags;
+
+	prot  = PROT_READ|PROT_WRITE;
+	flags = MAP_ANONYMOUS|MAP_PRIVATE;
+
+	for (i = 0; i < depth; i++) {
+		td_bench_req_t *req = &b->reqs[i];
+
+		req->buf = mmap(NULL, b->secs << SECTOR_SHIFT,
+				prot, flags, -1, 0);
+		if (req->buf == MAP_FAILED) {
+			req->buf = NULL;
+			return -errno;
+		}
+
+		memset(req->buf, 0x5a, b->secs << SECTOR_SHIFT);
+		b->free[b->n_free++] = req;
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_bench_close(td_bench_t *b)
+{
+	int i;
+
+	tapdisk_bench_close_image(b);
+
+	for (i = 0; i < TD_BENCH_MAX_DEPTH; i++)
+		if (b->reqs[i].buf)
+			munmap(b->reqs[i].buf, b->secs << SECTOR_SHIFT);
+
+	free(b->slots);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, err, depth;
+	const char *params;
+	uint64_t range, count;
+	unsigned int seed;
+	td_bench_t bench;
+
+	memset(&bench, 0, sizeof(bench));
+
+	err         = 0;
+	depth       = 16;
+	bench.secs  = 8;
+	range       = 65536;
+	count       = (uint64_t)-1;
+	seed        = 0;
+	params      = NULL;
+
+	while ((c = getopt(argc, argv, "n:q:s:o:r:c:S:h")) != -1) {
+		switch (c) {
+		case 'n':
+			params = optarg;
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 's':
+			bench.secs = atoi(optarg);
+			break;
+		case 'o':
+			bench.start = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			range = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			err = EINVAL;
+		case 'h':
+			usage(argv[0], err);
+		}
+	}
+
+	if (!params ||
+	    depth < 1 || depth > TD_BENCH_MAX_DEPTH ||
+	    bench.secs < 1 || bench.secs > TD_BENCH_MAX_SECS)
+		usage(argv[0], EINVAL);
+
+	tapdisk_start_logging("tapdisk-bench", "daemon");
+
+	err = tapdisk_bench_open_image(&bench, params);
+	if (!err)
+		err = tapdisk_bench_create_slots(&bench, range, count, seed);
+	if (!err)
+		err = tapdisk_bench_create_reqs(&bench, depth);
+	if (err)
+		goto out;
+
+	gettimeofday(&bench.t0, NULL);
+	tapdisk_bench_queue_requests(&bench);
+	tapdisk_server_run();
+
+	err = bench.err;
+
+out:
+	tapdisk_bench_close(&bench);
+	tapdisk_stop_logging();
+	return err ? 1 : 0;
+}
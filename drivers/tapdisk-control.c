@@ -794,6 +794,8 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		vbd->encryption.encryption_key = encryption_key;
 	}
 
+	vbd->encryption.bm_cache_size = request->u.params.bm_cache_size;
+
 	err = tapdisk_vbd_open_vdi(vbd, request->u.params.path, flags,
 				   request->u.params.prt_devnum);
 	if (err)
@@ -1183,11 +1185,13 @@ tapdisk_control_xenblkif_connect(
     } else
         pool = blkif->pool;
 
-    DPRINTF("connecting VBD %d domid=%d, devid=%d, pool %s, evt %d, poll duration %d, poll idle threshold %d\n",
-            vbd->uuid, blkif->domid, blkif->devid, pool, blkif->port, blkif->poll_duration, blkif->poll_idle_threshold);
+    DPRINTF("connecting VBD %d domid=%d, devid=%d, queue %d, pool %s, evt %d, poll duration %d, poll idle threshold %d, persistent grants %d\n",
+            vbd->uuid, blkif->domid, blkif->devid, blkif->queue, pool, blkif->port, blkif->poll_duration, blkif->poll_idle_threshold,
+            blkif->persistent_grants);
 
-    err = tapdisk_xenblkif_connect(blkif->domid, blkif->devid, blkif->gref,
-            blkif->order, blkif->port, blkif->proto, blkif->poll_duration, blkif->poll_idle_threshold, pool, vbd);
+    err = tapdisk_xenblkif_connect(blkif->domid, blkif->devid, blkif->queue, blkif->gref,
+            blkif->order, blkif->port, blkif->proto, blkif->poll_duration, blkif->poll_idle_threshold,
+            !!blkif->persistent_grants, pool, vbd);
 
 out:
 	response->cookie = request->cookie;
@@ -101,9 +101,11 @@ tapdisk_driver_allocate(int type, const char *name, td_flag_t flags)
 	if (td_flag_test(flags, TD_OPEN_RDONLY)){
 		td_flag_set(driver->state, TD_DRIVER_RDONLY);
 		driver->prep_func = tapdisk_server_prep_tiocb_ro;
+		driver->prepv_func = tapdisk_server_prepv_tiocb_ro;
 		driver->queue_func = tapdisk_server_queue_tiocb_ro;
 	} else {
 		driver->prep_func = tapdisk_server_prep_tiocb;
+		driver->prepv_func = tapdisk_server_prepv_tiocb;
 		driver->queue_func = tapdisk_server_queue_tiocb;
 	}
 
@@ -147,6 +149,14 @@ tapdisk_driver_prep_tiocb(td_driver_t *driver, struct tiocb *tiocb, int fd, int
 	driver->prep_func(tiocb, fd, rw, buf, size, offset, cb, arg);
 }
 
+int
+tapdisk_driver_prepv_tiocb(td_driver_t *driver, struct tiocb *tiocb, int fd, int rw,
+		   struct iovec *iov, int iovcnt,
+		   long long offset, td_queue_callback_t cb, void *arg)
+{
+	return driver->prepv_func(tiocb, fd, rw, iov, iovcnt, offset, cb, arg);
+}
+
 void
 tapdisk_driver_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 {
@@ -59,6 +59,7 @@ struct td_driver_handle {
 	struct list_head             next;
 	q_tiocb                      queue_func;
 	p_tiocb                      prep_func;
+	pv_tiocb                     prepv_func;
 };
 
 td_driver_t *tapdisk_driver_allocate(int, const char *, td_flag_t);
@@ -68,6 +69,8 @@ void tapdisk_driver_queue_tiocb(td_driver_t *, struct tiocb *);
 
 void tapdisk_driver_prep_tiocb(td_driver_t *, struct tiocb *, int, int, char *, size_t,
 	long long, td_queue_callback_t, void *);
+int tapdisk_driver_prepv_tiocb(td_driver_t *, struct tiocb *, int, int,
+	struct iovec *, int, long long, td_queue_callback_t, void *);
 void tapdisk_driver_debug(td_driver_t *);
 
 void tapdisk_driver_stats(td_driver_t *, td_stats_t *);
@@ -109,10 +109,11 @@ tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 	info   = &image->info;
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE && treq.op != TD_OP_BLOCK_STATUS)
+	if (treq.op < 0 || treq.op >= TD_OPS_END)
 		goto fail;
 
-	if (treq.op == TD_OP_WRITE && rdonly) {
+	if ((treq.op == TD_OP_WRITE || treq.op == TD_OP_DISCARD ||
+	     treq.op == TD_OP_WRITE_ZEROES) && rdonly) {
 		err = -EPERM;
 		goto fail;
 	}
@@ -156,6 +157,8 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 
 	switch (vreq->op) {
 	case TD_OP_WRITE:
+	case TD_OP_DISCARD:
+	case TD_OP_WRITE_ZEROES:
 		if (rdonly) {
 			err = -EPERM;
 			goto fail;
@@ -163,6 +166,7 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 		/* continue */
 	case TD_OP_READ: /* fall through */
 	case TD_OP_BLOCK_STATUS:
+	case TD_OP_FLUSH:
 		if (vreq->sec + secs > info->size) {
 			err = -EINVAL;
 			goto fail;
@@ -35,6 +35,8 @@
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "tapdisk.h"
 #include "tapdisk-vbd.h"
@@ -44,6 +46,11 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-log.h"
 
+/* size of the shared buffer td_queue_zero_writes() writes from */
+#define TD_ZERO_SECS                 2048
+
+static void *td_zeros;
+
 int
 td_load(td_image_t *image)
 {
@@ -125,6 +132,8 @@ td_close(td_image_t *image)
 	if (!driver->refcnt && td_flag_test(driver->state, TD_DRIVER_OPEN)) {
 		driver->ops->td_close(driver);
 		td_flag_clear(driver->state, TD_DRIVER_OPEN);
+		/* fd numbers may be recycled from here on */
+		tapdisk_server_forget_files();
 	}
 
 	DPRINTF("closed image %s (%d users, state: 0x%08x, type: %d)\n",
@@ -270,6 +279,150 @@ fail:
 	td_complete_request(*treq, err);
 }
 
+/*
+ * Discards and flushes only matter to writable images. Drivers that don't
+ * implement them pass them on down the chain, read-only images (parents,
+ * caches) simply complete them.
+ */
+static int
+td_check_writeback_request(td_image_t *image, td_request_t treq,
+			   int supported)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (td_flag_test(image->flags, TD_OPEN_RDONLY)) {
+		td_complete_request(treq, 0);
+		return 1;
+	}
+
+	if (!supported) {
+		td_forward_request(treq);
+		return 1;
+	}
+
+	return tapdisk_image_check_td_request(image, treq);
+}
+
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+
+	err = td_check_writeback_request(image, treq,
+			image->driver && image->driver->ops->td_queue_discard);
+	if (err > 0)
+		return;
+	if (err)
+		goto fail;
+
+	image->driver->ops->td_queue_discard(image->driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+void
+td_queue_flush(td_image_t *image, td_request_t treq)
+{
+	int err;
+
+	err = td_check_writeback_request(image, treq,
+			image->driver && image->driver->ops->td_queue_flush);
+	if (err > 0)
+		return;
+	if (err)
+		goto fail;
+
+	image->driver->ops->td_queue_flush(image->driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+void
+td_queue_write_zeroes(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	if (!driver->ops->td_queue_write_zeroes) {
+		td_queue_zero_writes(image, treq);
+		return;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	driver->ops->td_queue_write_zeroes(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+/*
+ * Zeroes the range of @treq with plain writes from a shared zero buffer,
+ * for drivers (or files) that can't zero it natively. The pieces complete
+ * through @treq's callback one by one.
+ */
+void
+td_queue_zero_writes(td_image_t *image, td_request_t treq)
+{
+	td_request_t clone;
+	int err;
+
+	if (!td_zeros) {
+		err = posix_memalign(&td_zeros, 4096,
+				     TD_ZERO_SECS << SECTOR_SHIFT);
+		if (err) {
+			td_zeros = NULL;
+			td_complete_request(treq, -err);
+			return;
+		}
+		memset(td_zeros, 0, TD_ZERO_SECS << SECTOR_SHIFT);
+	}
+
+	clone        = treq;
+	clone.op     = TD_OP_WRITE;
+	clone.buf    = td_zeros;
+	clone.iov    = NULL;
+	clone.iovcnt = 0;
+
+	while (treq.secs) {
+		clone.sec  = treq.sec;
+		clone.secs = treq.secs < TD_ZERO_SECS ? treq.secs : TD_ZERO_SECS;
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+
+		td_queue_write(image, clone);
+	}
+}
+
 void
 td_forward_request(td_request_t treq)
 {
@@ -302,6 +455,24 @@ td_prep_write(td_driver_t *driver, struct tiocb *tiocb, int fd, char *buf, size_
 	tapdisk_driver_prep_tiocb(driver, tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+int
+td_prep_readv(td_driver_t *driver, struct tiocb *tiocb, int fd,
+	struct iovec *iov, int iovcnt,
+	long long offset, td_queue_callback_t cb, void *arg)
+{
+	return tapdisk_driver_prepv_tiocb(driver, tiocb, fd, 0, iov, iovcnt,
+					  offset, cb, arg);
+}
+
+int
+td_prep_writev(td_driver_t *driver, struct tiocb *tiocb, int fd,
+	struct iovec *iov, int iovcnt,
+	long long offset, td_queue_callback_t cb, void *arg)
+{
+	return tapdisk_driver_prepv_tiocb(driver, tiocb, fd, 1, iov, iovcnt,
+					  offset, cb, arg);
+}
+
 void
 td_debug(td_image_t *image)
 {
@@ -46,6 +46,10 @@ int td_validate_parent(td_image_t *, td_image_t *);
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
 void td_queue_block_status(td_image_t*, td_request_t*);
+void td_queue_discard(td_image_t *, td_request_t);
+void td_queue_write_zeroes(td_image_t *, td_request_t);
+void td_queue_flush(td_image_t *, td_request_t);
+void td_queue_zero_writes(td_image_t *, td_request_t);
 void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
@@ -56,6 +60,10 @@ void td_prep_read(td_driver_t *, struct tiocb *, int, char *, size_t,
 	long long, td_queue_callback_t, void *);
 void td_prep_write(td_driver_t *, struct tiocb *, int, char *, size_t,
 	long long, td_queue_callback_t, void *);
+int td_prep_readv(td_driver_t *, struct tiocb *, int, struct iovec *, int,
+	long long, td_queue_callback_t, void *);
+int td_prep_writev(td_driver_t *, struct tiocb *, int, struct iovec *, int,
+	long long, td_queue_callback_t, void *);
 void td_panic(void) __noreturn;
 
 #endif
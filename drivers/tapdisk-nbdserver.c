@@ -40,6 +40,8 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include "tapdisk-protocol-new.h"
 #include <byteswap.h>
 
@@ -50,6 +52,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-utils.h"
+#include "tapdisk-stats.h"
 #include "tapdisk-nbdserver.h"
 #include "tapdisk-fdreceiver.h"
 
@@ -66,9 +69,29 @@
 
 #define MEGABYTES 1024 * 1024
 
-#define NBD_SERVER_NUM_REQS 8
+#define NBD_SERVER_NUM_REQS 16
 #define MAX_REQUEST_SIZE (64 * MEGABYTES)
 
+/*
+ * Request buffers up to this size stay attached to their request slot once
+ * allocated and are reused by later requests, larger ones are released as
+ * soon as the request completes.
+ */
+#define NBD_SERVER_BUF_CACHE_MAX (4 * MEGABYTES)
+#define NBD_SERVER_BUF_ALIGN 512
+
+/*
+ * Structured reads whose range is more fragmented than this go back as a
+ * single data chunk.
+ */
+#define NBD_SERVER_MAX_READ_CHUNKS 64
+
+/*
+ * Block status requests carry no data, but each allocated block they span
+ * may need its bitmap read: keep them to what the VHD bitmap cache holds.
+ */
+#define NBD_SERVER_BLOCK_STATUS_MAX (64 * MEGABYTES)
+
 uint16_t gflags = (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
 
 /*
@@ -87,10 +110,54 @@ uint16_t gflags = (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
 		BUG();						\
 	}
 
+/*
+ * Header of a structured read reply chunk. Data chunks stop after the
+ * offset and are followed by their payload.
+ */
+struct td_nbdserver_chunk {
+	struct nbd_structured_reply              reply;
+	struct nbd_structured_reply_offset_hole  hole;
+} __attribute__((__packed__));
+
+#define NBD_CHUNK_DATA_HDR_LEN \
+	(sizeof(struct nbd_structured_reply) + sizeof(uint64_t))
+
 struct td_nbdserver_req {
 	td_vbd_request_t        vreq;
 	char                    id[16];
 	struct td_iovec         iov;
+
+
+	/**
+	 * Aligned I/O buffer cached with this request slot.
+	 */
+	void                   *buf;
+	size_t                  buf_size;
+
+	/**
+	 * Reply to the request, queued on the client until the socket has
+	 * taken all of it.
+	 */
+	union {
+		struct nbd_reply             simple;
+		struct nbd_structured_reply  structured;
+	} reply;
+	union {
+		uint64_t                     offset;
+		uint32_t                     context_id;
+	} reply_hdr;
+	struct nbd_block_descriptor *blocks;
+	struct iovec            reply_iov[3];
+
+	/**
+	 * Allocation of a structured read, and the chunks it is sent back in
+	 * when it has holes.
+	 */
+	tapdisk_extents_t      *extents;
+	struct td_nbdserver_chunk *chunks;
+	struct iovec           *chunk_iov;
+	struct msghdr           reply_msg;
+	struct list_head        next;
 };
 
 int recv_fully_or_fail(int f, void *buf, size_t len) {
@@ -143,6 +210,46 @@ int send_fully_or_fail(int f, void *buf, size_t len) {
 	return -err;
 }
 
+/*
+ * Sends as much of msg as the socket takes without blocking, advancing
+ * msg_iov past what went out. Returns 0 once everything is sent, -EAGAIN if
+ * the socket is full, or another negative errno.
+ */
+static int
+sendmsg_some(int f, struct msghdr *msg)
+{
+	ssize_t res;
+
+	for (;;) {
+		while (msg->msg_iovlen > 0 && !msg->msg_iov->iov_len) {
+			msg->msg_iov++;
+			msg->msg_iovlen--;
+		}
+		if (!msg->msg_iovlen)
+			return 0;
+
+		res = sendmsg(f, msg, 0);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EWOULDBLOCK)
+				return -EAGAIN;
+			return -errno;
+		}
+
+		while (msg->msg_iovlen > 0 &&
+		       (size_t)res >= msg->msg_iov->iov_len) {
+			res -= msg->msg_iov->iov_len;
+			msg->msg_iov++;
+			msg->msg_iovlen--;
+		}
+		if (res > 0) {
+			msg->msg_iov->iov_base += res;
+			msg->msg_iov->iov_len -= res;
+		}
+	}
+}
+
 void
 free_extents(struct tapdisk_extents *extents)
 {
@@ -156,6 +263,65 @@ free_extents(struct tapdisk_extents *extents)
 	free(extents);
 }
 
+static int
+extent_cmp(const void *a, const void *b)
+{
+	const tapdisk_extent_t *x = *(tapdisk_extent_t * const *)a;
+	const tapdisk_extent_t *y = *(tapdisk_extent_t * const *)b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/*
+ * The pieces of a block status request complete in whatever order the
+ * images of the chain answer them. Sorts the extents by offset and merges
+ * the adjacent ones in the same state.
+ */
+int
+coalesce_extents(struct tapdisk_extents *extents)
+{
+	tapdisk_extent_t **sorted, *curr, *prev = NULL;
+	size_t i, n = 0;
+
+	if (extents->count < 2)
+		return 0;
+
+	sorted = malloc(extents->count * sizeof(*sorted));
+	if (!sorted)
+		return -ENOMEM;
+
+	for (curr = extents->head; curr; curr = curr->next)
+		sorted[n++] = curr;
+	qsort(sorted, n, sizeof(*sorted), extent_cmp);
+
+	extents->head = NULL;
+	extents->count = 0;
+
+	for (i = 0; i < n; i++) {
+		curr = sorted[i];
+
+		if (prev && prev->flag == curr->flag &&
+		    prev->start + prev->length == curr->start) {
+			prev->length += curr->length;
+			free(curr);
+			continue;
+		}
+
+		if (prev)
+			prev->next = curr;
+		else
+			extents->head = curr;
+		prev = curr;
+		extents->count++;
+	}
+
+	prev->next = NULL;
+	extents->tail = prev;
+
+	free(sorted);
+	return 0;
+}
+
 struct nbd_block_descriptor *
 convert_extents_to_block_descriptors (struct tapdisk_extents *extents)
 {
@@ -176,57 +342,6 @@ convert_extents_to_block_descriptors (struct tapdisk_extents *extents)
     return blocks;
 }
 
-static int
-send_structured_reply_block_status (int fd, char* id, struct tapdisk_extents *extents)
-{
-	struct nbd_structured_reply reply;
-	struct nbd_block_descriptor *blocks;
-	size_t i, nr_blocks = extents->count;
-	uint32_t context_id;
-	int ret = 0;
-
-	blocks = convert_extents_to_block_descriptors (extents);
-	if(blocks == NULL) {
-		ERR("Could not allocate blocks for extents");
-		ret = -1;
-		goto done;
-	}	
-
-	reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-	memcpy(&reply.handle, id, sizeof(reply.handle));
-	reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-	reply.type = htobe16 (NBD_REPLY_TYPE_BLOCK_STATUS);
-	reply.length = htobe32 (sizeof context_id +
-				nr_blocks * sizeof (struct nbd_block_descriptor));
-
-	int rc = send (fd, &reply, sizeof(reply), 0);
-	if(rc != sizeof(reply)) {
-		ERR("Could  not send stuctured reply struct");
-		ret = -errno;
-		goto done;
-	}	
-
-	context_id = htobe32 (base_allocation_id);
-	rc = send (fd, &context_id, sizeof(context_id), 0);
-	if(rc != sizeof(context_id)) {
-		ERR("Could  not send contect_id");
-		ret = -errno;
-		goto done;
-	}	
-
-	for (i = 0; i < nr_blocks; ++i) {
-		rc = send (fd, &blocks[i], sizeof blocks[i], 0);
-		if(rc != sizeof(blocks[i])) {
-			ERR("Could not send extent block");
-			ret = -errno;
-			goto done;
-		}	
-	}
-done:
-	free(blocks);
-	return ret;   
-}
-
 td_nbdserver_req_t *
 tapdisk_nbdserver_alloc_request(td_nbdserver_client_t *client)
 {
@@ -331,10 +446,225 @@ tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 		tapdisk_nbdserver_free_client(client);
 }
 
+/*
+ * Points the request at an aligned buffer of at least len bytes, reusing the
+ * one cached with the request slot whenever it is large enough.
+ */
+static int
+tapdisk_nbdserver_get_buffer(td_nbdserver_req_t *req, size_t len)
+{
+	void *buf;
+	int err;
+
+	if (len <= req->buf_size) {
+		req->iov.base = req->buf;
+		return 0;
+	}
+
+	err = posix_memalign(&buf, NBD_SERVER_BUF_ALIGN, len);
+	if (err)
+		return -err;
+
+	if (len <= NBD_SERVER_BUF_CACHE_MAX) {
+		free(req->buf);
+		req->buf = buf;
+		req->buf_size = len;
+	}
+
+	req->iov.base = buf;
+	return 0;
+}
+
+static void
+tapdisk_nbdserver_put_buffer(td_nbdserver_req_t *req)
+{
+	if (req->iov.base != req->buf)
+		free(req->iov.base);
+	req->iov.base = NULL;
+}
+
+static void tapdisk_nbd_server_free_vreq(
+	td_nbdserver_client_t *client, td_vbd_request_t *vreq, bool free_client_if_dead)
+{
+	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+	tapdisk_nbdserver_put_buffer(req);
+	tapdisk_nbdserver_free_request(client, req, free_client_if_dead);
+}
+
+
+static void
+tapdisk_nbdserver_free_reply(td_nbdserver_req_t *req)
+{
+	free(req->blocks);
+	req->blocks = NULL;
+	if (req->extents) {
+		free_extents(req->extents);
+		req->extents = NULL;
+	}
+	free(req->chunks);
+	req->chunks = NULL;
+	free(req->chunk_iov);
+	req->chunk_iov = NULL;
+}
+
+static void
+tapdisk_nbdserver_release_reply(td_nbdserver_req_t *req)
+{
+	list_del(&req->next);
+	tapdisk_nbdserver_free_reply(req);
+}
+
+static int
+tapdisk_nbdserver_enable_writer(td_nbdserver_client_t *client)
+{
+	event_id_t id;
+
+	if (client->tx_event_id >= 0)
+		return 0;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
+					   client->client_fd, TV_ZERO,
+					   tapdisk_nbdserver_writercb,
+					   client);
+	if (id < 0) {
+		ERR("Error registering write event on client: %d", id);
+		return id;
+	}
+
+	client->tx_event_id = id;
+	return 0;
+}
+
+static void
+tapdisk_nbdserver_disable_writer(td_nbdserver_client_t *client)
+{
+	if (client->tx_event_id < 0)
+		return;
+
+	tapdisk_server_unregister_event(client->tx_event_id);
+	client->tx_event_id = -1;
+}
+
+/*
+ * Releases requests whose replies were never (fully) sent and the write
+ * request still waiting for its payload, so a client going away doesn't
+ * hold on to them.
+ */
+static void
+tapdisk_nbdserver_drop_requests(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req, *next;
+
+	list_for_each_entry_safe(req, next, &client->tx_queue, next) {
+		tapdisk_nbdserver_release_reply(req);
+		tapdisk_nbdserver_put_buffer(req);
+		tapdisk_nbdserver_set_free_request(client, req);
+	}
+
+	if (client->rx_req) {
+		tapdisk_nbdserver_put_buffer(client->rx_req);
+		tapdisk_nbdserver_set_free_request(client, client->rx_req);
+		client->rx_req = NULL;
+	}
+	client->rx_done = 0;
+}
+
+static void
+tapdisk_nbdserver_kill_client(td_nbdserver_client_t *client)
+{
+	close(client->client_fd);
+	client->client_fd = -1;
+	tapdisk_nbdserver_free_client(client);
+}
+
+/*
+ * Pushes queued replies out in completion order until the socket fills up,
+ * in which case the rest goes out from the write event.
+ */
+static int
+tapdisk_nbdserver_send_replies(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req, *next;
+	int err;
+
+	list_for_each_entry_safe(req, next, &client->tx_queue, next) {
+		err = sendmsg_some(client->client_fd, &req->reply_msg);
+		if (err == -EAGAIN)
+			return tapdisk_nbdserver_enable_writer(client);
+		if (err) {
+			ERR("Send failed: %s", strerror(-err));
+			return err;
+		}
+
+		tapdisk_nbdserver_release_reply(req);
+		tapdisk_nbd_server_free_vreq(client, &req->vreq, false);
+	}
+
+	tapdisk_nbdserver_disable_writer(client);
+	return 0;
+}
+
+static void
+tapdisk_nbdserver_add_reply(td_nbdserver_client_t *client,
+			    td_nbdserver_req_t *req, int iovcnt)
+{
+	memset(&req->reply_msg, 0, sizeof(req->reply_msg));
+	req->reply_msg.msg_iov = req->chunk_iov ? req->chunk_iov : req->reply_iov;
+	req->reply_msg.msg_iovlen = iovcnt;
+	list_add_tail(&req->next, &client->tx_queue);
+	client->stats.reqs_out++;
+}
+
+/*
+ * Queues a reply from under the receive loop, which must not lose the
+ * client: the write event sends it, and kills the client if that fails.
+ */
+static int
+tapdisk_nbdserver_defer_reply(td_nbdserver_client_t *client,
+			      td_nbdserver_req_t *req, int iovcnt)
+{
+	tapdisk_nbdserver_add_reply(client, req, iovcnt);
+	return tapdisk_nbdserver_enable_writer(client);
+}
+
+static void
+tapdisk_nbdserver_queue_reply(td_nbdserver_client_t *client,
+			      td_nbdserver_req_t *req, int iovcnt)
+{
+	if (client->client_fd < 0) {
+		ERR("Finishing request for client that has disappeared");
+		tapdisk_nbdserver_free_reply(req);
+		tapdisk_nbd_server_free_vreq(client, &req->vreq, true);
+		return;
+	}
+
+	tapdisk_nbdserver_add_reply(client, req, iovcnt);
+
+	/* socket still full, the write event picks it up */
+	if (client->tx_event_id >= 0)
+		return;
+
+	if (tapdisk_nbdserver_send_replies(client))
+		tapdisk_nbdserver_kill_client(client);
+}
+
+void
+tapdisk_nbdserver_writercb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+
+	if (tapdisk_nbdserver_send_replies(client))
+		tapdisk_nbdserver_kill_client(client);
+}
+
 static void
 tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
 {
+	int i;
+
 	if (client->reqs) {
+		for (i = 0; i < client->n_reqs; i++)
+			free(client->reqs[i].buf);
 		free(client->reqs);
 		client->reqs = NULL;
 	}
@@ -449,7 +779,18 @@ send_meta_context (int new_fd, uint32_t reply, uint32_t context_id, const char *
 }
 
 #define NBD_EXPORTSIZE(X) (uint64_t)((X)->info.size * (X)->info.sector_size)
-#define NBD_FLAGS (uint16_t)(NBD_FLAG_HAS_FLAGS)
+/*
+ * All connections share the VBD, and a flush syncs the image files
+ * underneath it, so it covers the writes completed on every connection:
+ * clients may spread their I/O over as many of them as they like.
+ */
+#define NBD_FLAGS (uint16_t)(NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | \
+			   NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES | \
+			   NBD_FLAG_SEND_CACHE | NBD_FLAG_CAN_MULTI_CONN)
+
+/* reads only come back in pieces with structured replies */
+#define NBD_EFLAGS(C) (uint16_t)(NBD_FLAGS | \
+				 ((C)->structured_reply ? NBD_FLAG_SEND_DF : 0))
 
 /**
  * Sends an NBD_OPT_INFO or an NBD_OPT_GO response. These are identical; the only difference is that
@@ -460,8 +801,9 @@ send_meta_context (int new_fd, uint32_t reply, uint32_t context_id, const char *
  *
  */
 int
-send_nbd_opt_infogo(int fd, td_nbdserver_t *server, int option)
+send_nbd_opt_infogo(int fd, td_nbdserver_client_t *client, int option)
 {
+	td_nbdserver_t *server = client->server;
 	uint32_t exportnamelen;
 	uint16_t nrInfoReq;
 	char *exportname = NULL;
@@ -503,7 +845,7 @@ send_nbd_opt_infogo(int fd, td_nbdserver_t *server, int option)
 	}
 
 	/* Always send NBD_INFO_EXPORT*/
-	if (send_info_export(fd, option, NBD_REP_INFO, NBD_INFO_EXPORT, NBD_EXPORTSIZE(server), NBD_FLAGS)){
+	if (send_info_export(fd, option, NBD_REP_INFO, NBD_INFO_EXPORT, NBD_EXPORTSIZE(server), NBD_EFLAGS(client))){
 		ERR("Could not send reply info export");
 		goto fail1;
 	}
@@ -576,7 +918,7 @@ receive_newstyle_options(td_nbdserver_client_t *client, int new_fd, bool no_zero
 
 				bzero(&handshake_finish, sizeof handshake_finish);
 				handshake_finish.exportsize = htobe64(NBD_EXPORTSIZE(server));
-				handshake_finish.eflags = htobe16(NBD_FLAGS);
+				handshake_finish.eflags = htobe16(NBD_EFLAGS(client));
 				ssize_t len = no_zeroes ? 10 : sizeof(handshake_finish);
 				ssize_t sent = send (new_fd, &handshake_finish,len, 0);
 				if(sent != len) {
@@ -610,12 +952,12 @@ receive_newstyle_options(td_nbdserver_client_t *client, int new_fd, bool no_zero
 				break;
 			case NBD_OPT_INFO:
 				INFO("Processing NBD_OPT_INFO");
-				if (send_nbd_opt_infogo(new_fd, server, NBD_OPT_INFO))
+				if (send_nbd_opt_infogo(new_fd, client, NBD_OPT_INFO))
 					goto fail;
 				break;
 			case NBD_OPT_GO:
 				INFO("Processing NBD_OPT_GO");
-				if (send_nbd_opt_infogo(new_fd, server, NBD_OPT_GO)) goto fail;
+				if (send_nbd_opt_infogo(new_fd, client, NBD_OPT_GO)) goto fail;
 				/* Immediately enter data transfer */
 				goto done;
 				break;
@@ -715,7 +1057,7 @@ tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs)
 
 	INFO("Reqs init");
 
-	client->reqs = malloc(n_reqs * sizeof(td_nbdserver_req_t));
+	client->reqs = calloc(n_reqs, sizeof(td_nbdserver_req_t));
 	if (!client->reqs) {
 		err = -errno;
 		goto fail;
@@ -752,12 +1094,22 @@ fail:
 static int
 tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client)
 {
+	int err;
+
 	ASSERT(client);
 	ASSERT(client->client_event_id == -1);
 	ASSERT(client->client_fd >= 0);
 
 	INFO("Enable client");
 
+	/* requests and replies are streamed, never wait on the socket */
+	if (fcntl(client->client_fd, F_SETFL,
+		  fcntl(client->client_fd, F_GETFL) | O_NONBLOCK) < 0) {
+		err = -errno;
+		ERR("Could not set O_NONBLOCK on client: %s", strerror(-err));
+		return err;
+	}
+
 	client->client_event_id = tapdisk_server_register_event(
 			SCHEDULER_POLL_READ_FD,
 			client->client_fd, TV_ZERO,
@@ -810,8 +1162,10 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 
 	client->client_fd = -1;
 	client->client_event_id = -1;
+	client->tx_event_id = -1;
 	client->server = server;
 	INIT_LIST_HEAD(&client->clientlist);
+	INIT_LIST_HEAD(&client->tx_queue);
 	list_add(&client->clientlist, &server->clients);
 
 	client->paused = 0;
@@ -837,6 +1191,9 @@ tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 	if (client->client_event_id >= 0)
 		tapdisk_nbdserver_disable_client(client);
 
+	tapdisk_nbdserver_disable_writer(client);
+	tapdisk_nbdserver_drop_requests(client);
+
 	INFO("Freeing client, max used requests %d", client->max_used_reqs);
 
 	if (likely(!tapdisk_nbdserver_reqs_pending(client))) {
@@ -856,15 +1213,6 @@ static void
 	return &(((struct sockaddr_in6*)ss)->sin6_addr);
 }
 
-static void tapdisk_nbd_server_free_vreq(
-	td_nbdserver_client_t *client, td_vbd_request_t *vreq, bool free_client_if_dead)
-{
-	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req, free_client_if_dead);
-}
-
-
 static void
 __tapdisk_nbdserver_block_status_cb(td_vbd_request_t *vreq, int err,
 		void *token, int final)
@@ -872,31 +1220,98 @@ __tapdisk_nbdserver_block_status_cb(td_vbd_request_t *vreq, int err,
 	td_nbdserver_client_t *client = token;
 	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
 	tapdisk_extents_t* extents = (tapdisk_extents_t *)(vreq->data);
-	send_structured_reply_block_status (client->client_fd, req->id, extents);
+	struct nbd_structured_reply *reply = &req->reply.structured;
+	size_t nr_blocks;
+
+	if (!coalesce_extents(extents))
+		req->blocks = convert_extents_to_block_descriptors(extents);
+	nr_blocks = extents->count;
 	free_extents(extents);
-	tapdisk_nbd_server_free_vreq(client, vreq, true);
+	if (req->blocks == NULL) {
+		ERR("Could not allocate blocks for extents");
+		tapdisk_nbd_server_free_vreq(client, vreq, true);
+		return;
+	}
+
+	reply->magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+	memcpy(&reply->handle, req->id, sizeof(reply->handle));
+	reply->flags = htobe16 (NBD_REPLY_FLAG_DONE);
+	reply->type = htobe16 (NBD_REPLY_TYPE_BLOCK_STATUS);
+	reply->length = htobe32 (sizeof(req->reply_hdr.context_id) +
+				 nr_blocks * sizeof (struct nbd_block_descriptor));
+	req->reply_hdr.context_id = htobe32 (base_allocation_id);
+
+	req->reply_iov[0].iov_base = reply;
+	req->reply_iov[0].iov_len = sizeof(*reply);
+	req->reply_iov[1].iov_base = &req->reply_hdr.context_id;
+	req->reply_iov[1].iov_len = sizeof(req->reply_hdr.context_id);
+	req->reply_iov[2].iov_base = req->blocks;
+	req->reply_iov[2].iov_len = nr_blocks * sizeof(struct nbd_block_descriptor);
+
+	tapdisk_nbdserver_queue_reply(client, req, 3);
 }
 
+/*
+ * Splits a structured read into a chunk per extent, with holes sent as
+ * NBD_REPLY_TYPE_OFFSET_HOLE and no payload. Only the last chunk is
+ * flagged as done.
+ */
 static int
-__tapdisk_nbdserver_send_structured_reply(
-	int fd, uint16_t type, uint16_t flags, char *handle, uint32_t length)
+tapdisk_nbdserver_prep_read_chunks(td_nbdserver_req_t *req)
 {
-	struct nbd_structured_reply reply;
-	int rc = 0;
-
-	reply.magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC);
-	reply.flags = htobe16(flags);
-	reply.type = htobe16(type);
-	memcpy(&reply.handle, handle, sizeof(reply.handle));
-	reply.length = htobe32(length);
+	td_vbd_request_t *vreq = &req->vreq;
+	tapdisk_extents_t *extents = req->extents;
+	tapdisk_extent_t *extent;
+	struct td_nbdserver_chunk *chunk;
+	struct iovec *iov;
+
+	req->chunks = calloc(extents->count, sizeof(*req->chunks));
+	req->chunk_iov = calloc(2 * extents->count, sizeof(*req->chunk_iov));
+	if (!req->chunks || !req->chunk_iov) {
+		free(req->chunks);
+		req->chunks = NULL;
+		free(req->chunk_iov);
+		req->chunk_iov = NULL;
+		return -ENOMEM;
+	}
+
+	chunk = req->chunks;
+	iov = req->chunk_iov;
+
+	for (extent = extents->head; extent; extent = extent->next) {
+		size_t len = extent->length << SECTOR_SHIFT;
+
+		chunk->reply.magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC);
+		chunk->reply.flags = htobe16(extent->next ? 0 :
+					     NBD_REPLY_FLAG_DONE);
+		memcpy(&chunk->reply.handle, req->id,
+		       sizeof(chunk->reply.handle));
+		chunk->hole.offset = htobe64((uint64_t)extent->start <<
+					     SECTOR_SHIFT);
+
+		iov->iov_base = chunk;
+
+		if (extent->flag & TD_BLOCK_STATE_HOLE) {
+			chunk->reply.type = htobe16(NBD_REPLY_TYPE_OFFSET_HOLE);
+			chunk->reply.length = htobe32(sizeof(chunk->hole));
+			chunk->hole.hole_size = htobe32(len);
+			iov->iov_len = sizeof(*chunk);
+			iov++;
+		} else {
+			chunk->reply.type = htobe16(NBD_REPLY_TYPE_OFFSET_DATA);
+			chunk->reply.length = htobe32(sizeof(uint64_t) + len);
+			iov->iov_len = NBD_CHUNK_DATA_HDR_LEN;
+			iov++;
+			iov->iov_base = vreq->iov->base +
+				((extent->start - vreq->sec) << SECTOR_SHIFT);
+			iov->iov_len = len;
+			iov++;
+		}
 
-	rc = send_fully_or_fail(fd, &reply, sizeof(reply));
-	if (rc < 0) {
-		ERR("Short send/error in callback");
-		return -1;
+		chunk++;
 	}
 
-	return 0;
+	return iov - req->chunk_iov;
 }
 
 static void
@@ -906,11 +1321,10 @@ __tapdisk_nbdserver_structured_read_cb(
 	td_nbdserver_client_t *client = token;
 	td_nbdserver_t *server = client->server;
 	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+	struct nbd_structured_reply *reply = &req->reply.structured;
 	unsigned long long interval;
 	struct timeval now;
-	uint64_t offset;
-	int rc = 0;
-	int len = 0;
+	int len = 0, iovcnt;
 
 	gettimeofday(&now, NULL);
 	interval = timeval_to_us(&now) - timeval_to_us(&vreq->ts);
@@ -919,46 +1333,160 @@ __tapdisk_nbdserver_structured_read_cb(
 		INFO("Structured read took %llu microseconds to complete", interval);
 	}
 
-	if (client->client_fd < 0) {
-		ERR("Finishing request for client that has disappeared");
-		goto finish;
+	server->nbd_stats.stats->read_reqs_completed++;
+	server->nbd_stats.stats->read_sectors += vreq->iov->secs;
+	server->nbd_stats.stats->read_total_ticks += interval;
+	client->stats.read_secs += vreq->iov->secs;
+	if (error) {
+		server->nbd_stats.stats->io_errors++;
+		client->stats.errors++;
+	}
+
+	if (req->extents && !error && client->client_fd >= 0) {
+		iovcnt = tapdisk_nbdserver_prep_read_chunks(req);
+		if (iovcnt > 0) {
+			tapdisk_nbdserver_queue_reply(client, req, iovcnt);
+			return;
+		}
 	}
 
 	len = vreq->iov->secs << SECTOR_SHIFT;
 
-	/* For now, say we're done, if we have to support multiple chunks it will be harder */
-	if (__tapdisk_nbdserver_send_structured_reply(
-		client->client_fd, NBD_REPLY_TYPE_OFFSET_DATA,
-		NBD_REPLY_FLAG_DONE, req->id, len + sizeof(uint64_t)) == -1)
-	{
-		ERR("Failed to send structured reply header");
-		goto finish;
-	}
+	/* the whole range in one chunk */
+	reply->magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC);
+	reply->flags = htobe16(NBD_REPLY_FLAG_DONE);
+	reply->type = htobe16(NBD_REPLY_TYPE_OFFSET_DATA);
+	memcpy(&reply->handle, req->id, sizeof(reply->handle));
+	reply->length = htobe32(len + sizeof(uint64_t));
+	req->reply_hdr.offset = htobe64((uint64_t)vreq->sec << SECTOR_SHIFT);
+
+	/* header, offset and data go out in a single sendmsg */
+	req->reply_iov[0].iov_base = reply;
+	req->reply_iov[0].iov_len = sizeof(*reply);
+	req->reply_iov[1].iov_base = &req->reply_hdr.offset;
+	req->reply_iov[1].iov_len = sizeof(req->reply_hdr.offset);
+	req->reply_iov[2].iov_base = vreq->iov->base;
+	req->reply_iov[2].iov_len = len;
+
+	tapdisk_nbdserver_queue_reply(client, req, 3);
+}
 
-	offset = vreq->sec << SECTOR_SHIFT;
-	offset = htobe64(offset);
-	rc = send_fully_or_fail(client->client_fd, &offset, sizeof(offset));
-	if (rc < 0) {
-		ERR("Failed to send offset for structured read reply");
-		goto finish;
+/*
+ * Checks the extents tile the range of the request, and returns how many of
+ * its sectors hold data, or -1 if the extents can't be used.
+ */
+static int64_t
+tapdisk_nbdserver_extents_data_secs(td_vbd_request_t *vreq,
+				    tapdisk_extents_t *extents)
+{
+	td_sector_t end = vreq->sec + vreq->iov->secs;
+	td_sector_t secs = 0, data = 0;
+	tapdisk_extent_t *extent;
+
+	if (!extents->count || extents->count > NBD_SERVER_MAX_READ_CHUNKS)
+		return -1;
+
+	for (extent = extents->head; extent; extent = extent->next) {
+		if (extent->start < vreq->sec ||
+		    extent->start + extent->length > end)
+			return -1;
+
+		secs += extent->length;
+		if (!(extent->flag & TD_BLOCK_STATE_HOLE))
+			data += extent->length;
 	}
 
-	server->nbd_stats.stats->read_reqs_completed++;
-	server->nbd_stats.stats->read_sectors += vreq->iov->secs;
-	server->nbd_stats.stats->read_total_ticks += interval;
-	rc = send_fully_or_fail(client->client_fd,
-				vreq->iov->base, len);
-	if (rc < 0) {
-		ERR("Short send/error in callback");
-		goto finish;
+	return secs == vreq->iov->secs ? (int64_t)data : -1;
+}
+
+static void
+tapdisk_nbdserver_prep_vreq(td_nbdserver_client_t *client,
+			    td_nbdserver_req_t *req, td_sector_t sec,
+			    uint32_t len)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->sec = sec;
+	vreq->iovcnt = 1;
+	vreq->iov = &req->iov;
+	vreq->iov->secs = len >> SECTOR_SHIFT;
+	vreq->token = client;
+	vreq->name = req->id;
+	vreq->vbd = client->server->vbd;
+}
+
+/*
+ * Structured reads first ask for the allocation of the range. When none of
+ * it is allocated anywhere in the chain there is nothing to read, otherwise
+ * the read goes ahead and the reply skips the holes.
+ */
+static void
+__tapdisk_nbdserver_sparse_read_cb(td_vbd_request_t *vreq, int error,
+		void *token, int final)
+{
+	td_nbdserver_client_t *client = token;
+	td_nbdserver_t *server = client->server;
+	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+	tapdisk_extents_t *extents = vreq->data;
+	int64_t data = -1;
+
+	if (error == -EOPNOTSUPP)
+		client->no_block_status = true;
+
+	if (!error && !coalesce_extents(extents))
+		data = tapdisk_nbdserver_extents_data_secs(vreq, extents);
+	if (data < 0)
+		free_extents(extents);
+	else
+		req->extents = extents;
+
+	if (!data || client->client_fd < 0) {
+		__tapdisk_nbdserver_structured_read_cb(vreq, 0, token, final);
+		return;
 	}
 
-	if (error)
+	tapdisk_nbdserver_prep_vreq(client, req, vreq->sec,
+				    vreq->iov->secs << SECTOR_SHIFT);
+	vreq->cb = __tapdisk_nbdserver_structured_read_cb;
+	vreq->op = TD_OP_READ;
+
+	if (tapdisk_vbd_queue_request(server->vbd, vreq))
+		__tapdisk_nbdserver_structured_read_cb(vreq, -EIO, token, final);
+}
+
+static void
+tapdisk_nbdserver_prep_simple_reply(td_nbdserver_req_t *req, int error)
+{
+	struct nbd_reply *reply = &req->reply.simple;
+
+	reply->magic = htonl(NBD_REPLY_MAGIC);
+	reply->error = htonl(error);
+	memcpy(reply->handle, req->id, sizeof(reply->handle));
+
+	req->reply_iov[0].iov_base = reply;
+	req->reply_iov[0].iov_len = sizeof(*reply);
+}
+
+/*
+ * NBD_CMD_CACHE reads the range to warm the caches below, only the
+ * outcome goes back to the client.
+ */
+static void
+__tapdisk_nbdserver_cache_cb(td_vbd_request_t *vreq, int error,
+		void *token, int final)
+{
+	td_nbdserver_client_t *client = token;
+	td_nbdserver_t *server = client->server;
+	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+
+	if (error) {
 		server->nbd_stats.stats->io_errors++;
+		client->stats.errors++;
+	}
 
-finish:
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req, true);
+	tapdisk_nbdserver_prep_simple_reply(req, error);
+	tapdisk_nbdserver_queue_reply(client, req, 1);
 }
 
 static void
@@ -970,12 +1498,9 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
 	unsigned long long interval;
 	struct timeval now;
-	struct nbd_reply reply;
-	int rc = 0;
+	int iovcnt = 1;
 
-	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = htonl(error);
-	memcpy(reply.handle, req->id, sizeof(reply.handle));
+	tapdisk_nbdserver_prep_simple_reply(req, error);
 
 	gettimeofday(&now, NULL);
 	interval = timeval_to_us(&now) - timeval_to_us(&vreq->ts);
@@ -984,46 +1509,32 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 		INFO("Op %d request took %llu microseconds to complete", vreq->op, interval);
 	}
 
-	if (client->client_fd < 0) {
-		ERR("Finishing request for client that has disappeared");
-		goto finish;
-	}
-
-	rc = send_fully_or_fail(client->client_fd,
-				&reply,
-				sizeof(reply));
-	if (rc < 0) {
-		ERR("Short send/error in callback");
-		goto finish;
-	}
-
 	switch(vreq->op) {
 	case TD_OP_READ:
 		server->nbd_stats.stats->read_reqs_completed++;
 		server->nbd_stats.stats->read_sectors += vreq->iov->secs;
 		server->nbd_stats.stats->read_total_ticks += interval;
-		rc = send_fully_or_fail(client->client_fd,
-					vreq->iov->base,
-					vreq->iov->secs << SECTOR_SHIFT);
-		if (rc < 0) {
-			ERR("Short send/error in callback");
-			goto finish;
-		}
+		client->stats.read_secs += vreq->iov->secs;
+		/* the payload follows the reply in the same sendmsg */
+		req->reply_iov[1].iov_base = vreq->iov->base;
+		req->reply_iov[1].iov_len = vreq->iov->secs << SECTOR_SHIFT;
+		iovcnt = 2;
 		break;
 	case TD_OP_WRITE:
 		server->nbd_stats.stats->write_reqs_completed++;
 		server->nbd_stats.stats->write_sectors += vreq->iov->secs;
 		server->nbd_stats.stats->write_total_ticks += interval;
+		client->stats.write_secs += vreq->iov->secs;
 	default:
 		break;
 	}
 
-	if (error)
+	if (error) {
 		server->nbd_stats.stats->io_errors++;
+		client->stats.errors++;
+	}
 
-finish:
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req, true);
+	tapdisk_nbdserver_queue_reply(client, req, iovcnt);
 }
 
 void
@@ -1033,32 +1544,36 @@ tapdisk_nbdserver_handshake_cb(event_id_t id, char mode, void *data)
 	int tmp_fd;
 
 	td_nbdserver_client_t *client = (td_nbdserver_client_t*)data;
-	td_nbdserver_t *server = client->server;
 
-	int rc = recv_fully_or_fail(server->handshake_fd, &cflags, sizeof(cflags));
+	/* several connections may be negotiating at once */
+	tmp_fd = client->client_fd;
+
+	int rc = recv_fully_or_fail(tmp_fd, &cflags, sizeof(cflags));
 	if(rc < 0) {
 		ERR("Could not receive client flags");
-		close(server->handshake_fd);
-		goto out;
+		goto fail;
 	}
 
 	cflags = be32toh (cflags);
 	bool no_zeroes = (NBD_FLAG_NO_ZEROES & cflags) != 0;
 
 	/* Receive newstyle options. */
-	if (receive_newstyle_options(client, server->handshake_fd, no_zeroes) == -1) {
+	if (receive_newstyle_options(client, tmp_fd, no_zeroes) == -1) {
 		INFO("Option negotiation terminated");
-		close(server->handshake_fd);
+		goto fail;
 	}
 
 	INFO("About to enable client on fd %d", client->client_fd);
 	if (tapdisk_nbdserver_enable_client(client) < 0) {
 		ERR("Error enabling client");
-		tmp_fd = client->client_fd;
-		tapdisk_nbdserver_free_client(client);
-		close(tmp_fd);
+		goto fail;
 	}
 
+	goto out;
+
+fail:
+	tapdisk_nbdserver_free_client(client);
+	close(tmp_fd);
 out:
 	tapdisk_server_unregister_event(id);
 }
@@ -1066,7 +1581,6 @@ out:
 int
 tapdisk_nbdserver_new_protocol_handshake(td_nbdserver_client_t *client, int new_fd)
 {
-	td_nbdserver_t *server = client->server;
 	struct nbd_new_handshake handshake;
 
 	handshake.nbdmagic = htobe64 (NBD_MAGIC);
@@ -1078,7 +1592,6 @@ tapdisk_nbdserver_new_protocol_handshake(td_nbdserver_client_t *client, int new_
 		ERR("Sending newstyle handshake");
 		return -1;
 	}
-	server->handshake_fd = new_fd;
 	/* We may need to wait upto 40 seconds for a reply especially during
 	 * SXM contexts, so setup an event and return so that tapdisk is 
 	 * reponsive during the interim*/
@@ -1184,11 +1697,15 @@ tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
 	};
 }
 
+/*
+ * Sets up a request for @len bytes at request.from. Requests that carry no
+ * data (discards, zeroing, flushes) leave @data false and get no buffer.
+ */
 static td_vbd_request_t *create_request_vreq(
-	td_nbdserver_client_t *client, struct nbd_request request, uint32_t len)
+	td_nbdserver_client_t *client, struct nbd_request request, uint32_t len,
+	bool data)
 {
 	int rc;
-	td_nbdserver_t *server = client->server;
 	td_vbd_request_t *vreq;
 	td_nbdserver_req_t *req;
 
@@ -1200,24 +1717,22 @@ static td_vbd_request_t *create_request_vreq(
 
 	vreq = &req->vreq;
 
-	memset(req, 0, sizeof(td_nbdserver_req_t));
+	/* the cached buffer outlives the request, leave it alone */
+	memset(&req->iov, 0, sizeof(req->iov));
 
 	bzero(req->id, sizeof(req->id));
 	memcpy(req->id, request.handle, sizeof(request.handle));
 
-	rc = posix_memalign(&req->iov.base, 512, len);
-	if (rc < 0) {
-		ERR("posix_memalign failed (%d)", rc);
-		goto fail;
+	if (data) {
+		rc = tapdisk_nbdserver_get_buffer(req, len);
+		if (rc) {
+			ERR("Failed to allocate request buffer (%d)", rc);
+			goto fail;
+		}
 	}
 
-	vreq->sec = request.from >> SECTOR_SHIFT;
-	vreq->iovcnt = 1;
-	vreq->iov = &req->iov;
-	vreq->iov->secs = len >> SECTOR_SHIFT;
-	vreq->token = client;
-	vreq->name = req->id;
-	vreq->vbd = server->vbd;
+	tapdisk_nbdserver_prep_vreq(client, req,
+				    request.from >> SECTOR_SHIFT, len);
 
 	return vreq;
 
@@ -1228,31 +1743,120 @@ failreq:
 }
 
 
-void
-tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+/*
+ * Receives into buf until client->rx_done reaches len. Returns 0 once
+ * complete, -EAGAIN if the rest hasn't arrived yet, or another negative
+ * errno.
+ */
+static int
+tapdisk_nbdserver_recv_some(td_nbdserver_client_t *client, void *buf,
+			    size_t len)
+{
+	ssize_t res;
+	int err;
+
+	while (client->rx_done < len) {
+		res = recv(client->client_fd, buf + client->rx_done,
+			   len - client->rx_done, 0);
+		if (res > 0) {
+			client->rx_done += res;
+			continue;
+		}
+
+		if (res == 0) {
+			/* EOF */
+			INFO("Zero return from recv");
+			return -ECONNRESET;
+		}
+
+		err = errno;
+		if (err == EINTR)
+			continue;
+		if (err == EAGAIN || err == EWOULDBLOCK)
+			return -EAGAIN;
+
+		ERR("Read failed: %s", strerror(err));
+		return -err;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_submit(td_nbdserver_client_t *client,
+			 td_vbd_request_t *vreq)
 {
-	td_nbdserver_client_t *client = data;
 	td_nbdserver_t *server = client->server;
 	int rc;
-	uint32_t len;
-	int fd = client->client_fd;
+
+	rc = tapdisk_vbd_queue_request(server->vbd, vreq);
+	if (rc) {
+		ERR("tapdisk_vbd_queue_request failed: %d", rc);
+		tapdisk_nbd_server_free_vreq(client, vreq, false);
+		return -EIO;
+	}
+
+	client->stats.reqs_in++;
+
+	return 0;
+}
+
+/*
+ * Receives the payload of the write request in client->rx_req and submits
+ * it once complete.
+ */
+static int
+tapdisk_nbdserver_recv_payload(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req = client->rx_req;
+	int rc;
+
+	rc = tapdisk_nbdserver_recv_some(client, req->iov.base,
+					 ntohl(client->rx_request.len));
+	if (rc)
+		return rc;
+
+	client->rx_req = NULL;
+	client->rx_done = 0;
+
+	return tapdisk_nbdserver_submit(client, &req->vreq);
+}
+
+/*
+ * Receives and dispatches the next request header. Returns 0 when the
+ * request was handled, -EAGAIN if it hasn't fully arrived, 1 if the client
+ * has been handed back to the handshake, or another negative errno if the
+ * client must be dropped.
+ */
+static int
+tapdisk_nbdserver_recv_request(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
 	td_vbd_request_t *vreq = NULL;
 	struct nbd_request request;
+	uint16_t flags;
+	uint32_t len;
+	int fd = client->client_fd;
+	int rc;
 
-	/* Read the request the client has sent */
-	rc = recv_fully_or_fail(fd, &request, sizeof(request));
-	if (rc < 0) {
-		ERR("failed to receive from client. Closing connection");
-		goto fail;
-	}
+	rc = tapdisk_nbdserver_recv_some(client, &client->rx_request,
+					 sizeof(client->rx_request));
+	if (rc)
+		return rc;
+
+	client->rx_done = 0;
+	request = client->rx_request;
 
 	if (request.magic != htonl(NBD_REQUEST_MAGIC)) {
 		ERR("Not enough magic, %X", request.magic);
-		goto fail;
+		return -EINVAL;
 	}
 
 	request.from = ntohll(request.from);
 	request.type = ntohl(request.type);
+	/* command flags live in the upper half of the type */
+	flags = request.type >> 16;
+	request.type &= 0xffff;
 	len = ntohl(request.len);
 	if (((len & 0x1ff) != 0) || ((request.from & 0x1ff) != 0)) {
 		ERR("Non sector-aligned request (%"PRIu64", %d)",
@@ -1261,60 +1865,123 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 
 	switch(request.type) {
 	case TAPDISK_NBD_CMD_READ:
-		vreq = create_request_vreq(client, request, len);
+		vreq = create_request_vreq(client, request, len, true);
 		if (!vreq) {
 			ERR("Failed to create vreq");
-			goto fail;
+			return -ENOMEM;
 		}
-		vreq->cb = client->structured_reply ?
-			__tapdisk_nbdserver_structured_read_cb :
-		        __tapdisk_nbdserver_request_cb;
-		vreq->op = TD_OP_READ;
                 server->nbd_stats.stats->read_reqs_submitted++;
+
+		if (!client->structured_reply) {
+			vreq->cb = __tapdisk_nbdserver_request_cb;
+			vreq->op = TD_OP_READ;
+			break;
+		}
+
+		/* DF asks for the whole range in a single data chunk */
+		if (!len || (flags & NBD_CMD_FLAG_DF) ||
+		    client->no_block_status) {
+			vreq->cb = __tapdisk_nbdserver_structured_read_cb;
+			vreq->op = TD_OP_READ;
+			break;
+		}
+
+		vreq->data = calloc(1, sizeof(tapdisk_extents_t));
+		if (!vreq->data) {
+			ERR("Could not allocate memory for tapdisk_extents_t");
+			tapdisk_nbd_server_free_vreq(client, vreq, false);
+			return -ENOMEM;
+		}
+		vreq->cb = __tapdisk_nbdserver_sparse_read_cb;
+		vreq->op = TD_OP_BLOCK_STATUS;
 		break;
 	case TAPDISK_NBD_CMD_WRITE:
-		vreq = create_request_vreq(client, request, len);
+		vreq = create_request_vreq(client, request, len, true);
 		if (!vreq) {
 			ERR("Failed to create vreq");
-			goto fail;
+			return -ENOMEM;
 		}
 		vreq->cb = __tapdisk_nbdserver_request_cb;
 		vreq->op = TD_OP_WRITE;
 		server->nbd_stats.stats->write_reqs_submitted++;
-		rc = recv_fully_or_fail(fd, vreq->iov->base, len);
-		if (rc < 0) {
-			ERR("Short send or error in "
-			    "callback: %d", rc);
-			goto fail;
+
+		/* the payload may trickle in over several callbacks */
+		client->rx_req = container_of(vreq, td_nbdserver_req_t, vreq);
+		return tapdisk_nbdserver_recv_payload(client);
+	case TAPDISK_NBD_CMD_TRIM:
+	case TAPDISK_NBD_CMD_WRITE_ZEROES:
+		vreq = create_request_vreq(client, request, len, false);
+		if (!vreq) {
+			ERR("Failed to create vreq");
+			return -ENOMEM;
 		}
+		vreq->cb = __tapdisk_nbdserver_request_cb;
+		vreq->op = request.type == TAPDISK_NBD_CMD_TRIM ?
+			TD_OP_DISCARD : TD_OP_WRITE_ZEROES;
+
+		/* nothing to do, but the client still wants its reply */
+		if (!len) {
+			td_nbdserver_req_t *req =
+				container_of(vreq, td_nbdserver_req_t, vreq);
 
+			tapdisk_nbdserver_prep_simple_reply(req, 0);
+			return tapdisk_nbdserver_defer_reply(client, req, 1);
+		}
+		break;
+	case TAPDISK_NBD_CMD_FLUSH:
+		/* flushes cover the whole disk, and one nominal sector */
+		request.from = 0;
+		vreq = create_request_vreq(client, request, SECTOR_SIZE, false);
+		if (!vreq) {
+			ERR("Failed to create vreq");
+			return -ENOMEM;
+		}
+		vreq->cb = __tapdisk_nbdserver_request_cb;
+		vreq->op = TD_OP_FLUSH;
+		break;
+	case TAPDISK_NBD_CMD_CACHE:
+		if (len > 2 * MEGABYTES) {
+			/* limit request to 2MB, it's only a hint */
+			len = 2 * MEGABYTES;
+		}
+
+		vreq = create_request_vreq(client, request, len, true);
+		if (!vreq) {
+			ERR("Failed to create vreq");
+			return -ENOMEM;
+		}
+		vreq->cb = __tapdisk_nbdserver_cache_cb;
+		vreq->op = TD_OP_READ;
 		break;
 	case TAPDISK_NBD_CMD_DISC:
 		INFO("Received close message. Sending reconnect header");
+		/* the handshake still talks to the socket synchronously */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		client->client_fd = -1;
 		tapdisk_nbdserver_free_client(client);
 		INFO("About to send initial connection message");
 		tapdisk_nbdserver_newclient_fd(server, fd);
 		INFO("Sent initial connection message");
-		return;
+		return 1;
 	case TAPDISK_NBD_CMD_BLOCK_STATUS:
 	{
 		if (!client->structured_reply)
 			ERR("NBD_CMD_BLOCK_STATUS: when not in structured reply");
 
-		if (len > 2 * MEGABYTES) {
-			/* limit request to 2MB */
-			len = 2 * MEGABYTES;
-		}
+		/* the reply may cover less than was asked for */
+		if (len > NBD_SERVER_BLOCK_STATUS_MAX)
+			len = NBD_SERVER_BLOCK_STATUS_MAX;
 
-		vreq = create_request_vreq(client, request, len);
+		vreq = create_request_vreq(client, request, len, false);
 		if (!vreq) {
 			ERR("Failed to create vreq");
-			goto fail;
+			return -ENOMEM;
 		}
 		tapdisk_extents_t *extents = (tapdisk_extents_t*)malloc(sizeof(tapdisk_extents_t));
 		if(extents == NULL) {
 			ERR("Could not allocate memory for tapdisk_extents_t");
-			goto fail;
+			tapdisk_nbd_server_free_vreq(client, vreq, false);
+			return -ENOMEM;
 		}
 		bzero(extents, sizeof(tapdisk_extents_t));
 		vreq->data = extents;
@@ -1324,23 +1991,35 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 		break;
 	default:
 		ERR("Unsupported operation: 0x%x", request.type);
-		goto fail;
+		return -EOPNOTSUPP;
 	}
 
-	rc = tapdisk_vbd_queue_request(server->vbd, vreq);
-	if (rc) {
-		ERR("tapdisk_vbd_queue_request failed: %d", rc);
-		goto fail;
-	}
+	return tapdisk_nbdserver_submit(client, vreq);
+}
 
-	return;
+void
+tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+	int rc;
 
-fail:
-	if (vreq)
-		tapdisk_nbd_server_free_vreq(client, vreq, false);
-	close(client->client_fd);
-	tapdisk_nbdserver_free_client(client);
-	return;
+	/*
+	 * Keep taking requests off the socket while there are free request
+	 * slots, replies are sent as the requests complete in whatever order
+	 * that happens.
+	 */
+	do {
+		if (client->rx_req)
+			rc = tapdisk_nbdserver_recv_payload(client);
+		else
+			rc = tapdisk_nbdserver_recv_request(client);
+	} while (!rc && (client->n_reqs_free || client->rx_req));
+
+	if (rc == -EAGAIN || rc >= 0)
+		return;
+
+	ERR("failed to receive from client (%d). Closing connection", rc);
+	tapdisk_nbdserver_kill_client(client);
 }
 
 static void
@@ -1808,6 +2487,34 @@ tapdisk_nbdserver_reqs_pending(td_nbdserver_client_t *client)
 	return client->n_reqs - client->n_reqs_free;
 }
 
+void
+tapdisk_nbdserver_stats(td_nbdserver_t *server, td_stats_t *st)
+{
+	td_nbdserver_client_t *client;
+
+	ASSERT(server);
+	ASSERT(st);
+
+	list_for_each_entry(client, &server->clients, clientlist) {
+		tapdisk_stats_enter(st, '{');
+		tapdisk_stats_field(st, "fd", "d", client->client_fd);
+		tapdisk_stats_field(st, "reqs", "[");
+		tapdisk_stats_val(st, "llu", client->stats.reqs_in);
+		tapdisk_stats_val(st, "llu", client->stats.reqs_out);
+		tapdisk_stats_leave(st, ']');
+		tapdisk_stats_field(st, "secs", "[");
+		tapdisk_stats_val(st, "llu", client->stats.read_secs);
+		tapdisk_stats_val(st, "llu", client->stats.write_secs);
+		tapdisk_stats_leave(st, ']');
+		tapdisk_stats_field(st, "errors", "llu", client->stats.errors);
+		tapdisk_stats_field(st, "pending", "d",
+				    tapdisk_nbdserver_reqs_pending(client));
+		tapdisk_stats_field(st, "max_used_reqs", "d",
+				    client->max_used_reqs);
+		tapdisk_stats_leave(st, '}');
+	}
+}
+
 bool
 tapdisk_nbdserver_contains_client(td_nbdserver_t *server,
 		td_nbdserver_client_t *client)
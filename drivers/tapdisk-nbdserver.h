@@ -104,11 +104,6 @@ struct td_nbdserver {
 	 */
 	int                     unix_listening_fd;
 
-	/**
-	 * Socket opened during handshake negotiation.
-	 */
-	int                     handshake_fd;
-
 	/**
 	 * Event ID for the file descriptor receiver.
 	 */
@@ -153,7 +148,49 @@ struct td_nbdserver_client {
 	 */
 	bool                    structured_reply;
 
+	/**
+	 * The VBD can't tell allocated from unallocated ranges, structured
+	 * reads go out as a single data chunk without asking first.
+	 */
+	bool                    no_block_status;
+
 	int                     max_used_reqs;
+
+	/**
+	 * Request header being received. The socket is non-blocking, so the
+	 * header and a write payload may arrive over several callbacks;
+	 * rx_done counts what has arrived of whichever is pending.
+	 */
+	struct nbd_request      rx_request;
+	size_t                  rx_done;
+
+	/**
+	 * Write request waiting for the rest of its payload.
+	 */
+	td_nbdserver_req_t     *rx_req;
+
+	/**
+	 * Completed requests whose replies haven't been fully sent, in
+	 * completion order.
+	 */
+	struct list_head        tx_queue;
+
+	/**
+	 * Event ID for socket writability, only registered while tx_queue
+	 * cannot be flushed.
+	 */
+	int                     tx_event_id;
+
+	/**
+	 * Per-connection counters, the server-wide ones live in nbd_stats.
+	 */
+	struct {
+		unsigned long long  reqs_in;
+		unsigned long long  reqs_out;
+		unsigned long long  read_secs;
+		unsigned long long  write_secs;
+		unsigned long long  errors;
+	} stats;
 };
 
 td_nbdserver_t *tapdisk_nbdserver_alloc(td_vbd_t *, td_disk_info_t, nbd_protocol_style_t);
@@ -178,6 +215,12 @@ int tapdisk_nbdserver_unpause(td_nbdserver_t *);
  * I/O write, disconnect, etc.).
  */
 void tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data);
+
+/**
+ * Callback to be executed when the client socket becomes writable again,
+ * sends the replies that didn't fit in the socket buffer.
+ */
+void tapdisk_nbdserver_writercb(event_id_t id, char mode, void *data);
 int tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs);
 
 /**
@@ -203,6 +246,11 @@ void tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
  */
 int tapdisk_nbdserver_reqs_pending(td_nbdserver_client_t *client);
 
+/**
+ * Adds the counters of each connection to @st.
+ */
+void tapdisk_nbdserver_stats(td_nbdserver_t *server, td_stats_t *st);
+
 int tapdisk_nbdserver_new_protocol_handshake(td_nbdserver_client_t *client, int);
 void tapdisk_nbdserver_handshake_cb(event_id_t, char, void*);
 
@@ -214,4 +262,10 @@ int send_fully_or_fail(int f, void *buf, size_t len);
 
 void free_extents(struct tapdisk_extents *extents);
 
+/**
+ * Sorts block status extents by offset and merges adjacent ones in the same
+ * state.
+ */
+int coalesce_extents(struct tapdisk_extents *extents);
+
 #endif /* _TAPDISK_NBDSERVER_H_ */
@@ -70,6 +70,10 @@
 #define NBD_OPT_LIST_META_CONTEXT  9
 #define NBD_OPT_SET_META_CONTEXT   10
 
+#define NBD_CMD_FLAG_FUA            (1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE        (1 << 1)
+#define NBD_CMD_FLAG_DF             (1 << 2)
+
 #define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
 
 #define NBD_REPLY_FLAG_DONE         (1<<0)
@@ -166,5 +170,10 @@ struct nbd_structured_reply {
   uint32_t length;
 } __attribute__((__packed__));
 
+struct nbd_structured_reply_offset_hole {
+  uint64_t offset;
+  uint32_t hole_size;
+} __attribute__((__packed__));
+
 #endif /* _TAPDISK_PROTOCOL_NEW_H_ */
 
@@ -54,6 +54,7 @@
 #include "tapdisk-driver.h"
 #include "posixaio-backend.h"
 #include "libaio-backend.h"
+#include "uring-backend.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-log.h"
 #include "td-blkif.h"
@@ -66,7 +67,13 @@
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 
-#define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
+/*
+ * Depth of the kernel I/O queues. Drivers hold their own tiocbs, and
+ * the backends defer whatever does not fit, so this need not follow
+ * TAPDISK_DATA_REQUESTS; every aio context counts against the host-wide
+ * fs.aio-max-nr.
+ */
+#define TAPDISK_TIOCBS              (MAX_REQUESTS * BLKIF_MAX_SEGMENTS_PER_REQUEST + 50)
 
 typedef struct tapdisk_server {
 	int                          run;
@@ -155,6 +162,27 @@ tapdisk_server_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t
 	server.rw_backend->prep(tiocb, fd, rw, buf, size, offset, cb, arg);
 }
 
+int
+tapdisk_server_prepv_tiocb(struct tiocb *tiocb, int fd, int rw,
+	struct iovec *iov, int iovcnt,
+	long long offset, td_queue_callback_t cb, void *arg)
+{
+	if (!server.rw_backend->prepv)
+		return -EOPNOTSUPP;
+
+	return server.rw_backend->prepv(tiocb, fd, rw, iov, iovcnt,
+					offset, cb, arg);
+}
+
+void
+tapdisk_server_forget_files(void)
+{
+	if (server.rw_queue && server.rw_backend->forget_files)
+		server.rw_backend->forget_files(server.rw_queue);
+	if (server.ro_queue && server.ro_backend->forget_files)
+		server.ro_backend->forget_files(server.ro_queue);
+}
+
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
@@ -168,6 +196,18 @@ tapdisk_server_prep_tiocb_ro(struct tiocb *tiocb, int fd, int rw, char *buf, siz
 	server.ro_backend->prep(tiocb, fd, rw, buf, size, offset, cb, arg);
 }
 
+int
+tapdisk_server_prepv_tiocb_ro(struct tiocb *tiocb, int fd, int rw,
+	struct iovec *iov, int iovcnt,
+	long long offset, td_queue_callback_t cb, void *arg)
+{
+	if (!server.ro_backend->prepv)
+		return -EOPNOTSUPP;
+
+	return server.ro_backend->prepv(tiocb, fd, rw, iov, iovcnt,
+					offset, cb, arg);
+}
+
 void
 tapdisk_server_queue_tiocb_ro(struct tiocb *tiocb)
 {
@@ -304,8 +344,17 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+static void
+tapdisk_server_close_aio(void)
+{
+	if (server.rw_queue)
+		server.rw_backend->free_queue(&server.rw_queue);
+	if (server.ro_queue)
+		server.ro_backend->free_queue(&server.ro_queue);
+}
+
 static int
-tapdisk_server_init_aio(void)
+__tapdisk_server_init_aio(void)
 {
 	int err;
        	err = server.ro_backend->init(&server.ro_queue, TAPDISK_TIOCBS,
@@ -313,15 +362,56 @@ tapdisk_server_init_aio(void)
 	if(err)
 		return err;
 	
-	return server.rw_backend->init(&server.rw_queue, TAPDISK_TIOCBS,
+	err = server.rw_backend->init(&server.rw_queue, TAPDISK_TIOCBS,
 				  TIO_DRV_LIO, NULL);
+	if (err)
+		tapdisk_server_close_aio();
+
+	return err;
 }
 
-static void
-tapdisk_server_close_aio(void)
+/*
+ * TAPDISK3_IO_BACKEND=uring selects io_uring, libaio is the default
+ * and the fallback wherever io_uring is unavailable.
+ */
+static struct backend *
+tapdisk_server_io_backend(void)
 {
-	server.rw_backend->free_queue(&server.rw_queue);
-	server.ro_backend->free_queue(&server.ro_queue);
+	const char *name;
+	struct backend *backend;
+
+	name = getenv("TAPDISK3_IO_BACKEND");
+	if (!name || !strcmp(name, "libaio"))
+		return get_libaio_backend();
+
+	if (!strcmp(name, "uring")) {
+		backend = get_uring_backend();
+		if (backend)
+			return backend;
+		EPRINTF("built without io_uring support, using libaio\n");
+	} else
+		EPRINTF("unknown io backend '%s', using libaio\n", name);
+
+	return get_libaio_backend();
+}
+
+static int
+tapdisk_server_init_aio(void)
+{
+	int err;
+
+	server.rw_backend = tapdisk_server_io_backend();
+	server.ro_backend = server.rw_backend;
+
+	err = __tapdisk_server_init_aio();
+	if (err && server.rw_backend != get_libaio_backend()) {
+		EPRINTF("io backend setup failed (%d), using libaio\n", err);
+		server.rw_backend = get_libaio_backend();
+		server.ro_backend = server.rw_backend;
+		err = __tapdisk_server_init_aio();
+	}
+
+	return err;
 }
 
 int
@@ -512,7 +602,11 @@ tapdisk_server_init(void)
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
 
-	scheduler_initialize(&server.scheduler);
+	ret = scheduler_initialize(&server.scheduler);
+	if (ret) {
+		EPRINTF("Failed to initialize scheduler: %s\n", strerror(-ret));
+		return ret;
+	}
 
 	if ((ret = tapdisk_server_initialize_cpumond_client()) < 0) {
 		EPRINTF("Failed to connect to cpumond: %s\n",
@@ -529,10 +623,7 @@ int
 tapdisk_server_complete(void)
 {
 	int err;
-	server.rw_backend = get_libaio_backend();
-	server.ro_backend = get_libaio_backend();
 
-	server.rw_backend = get_libaio_backend();
 	err = tapdisk_server_init_aio();
 	if (err)
 		goto fail;
@@ -60,13 +60,20 @@ void tapdisk_server_remove_vbd(td_vbd_t *);
 typedef void (*q_tiocb)(struct tiocb *);
 typedef void (*p_tiocb)(struct tiocb *, int, int, char *, size_t,
 	long long, td_queue_callback_t, void *);
+typedef int (*pv_tiocb)(struct tiocb *, int, int, struct iovec *, int,
+	long long, td_queue_callback_t, void *);
 
 void tapdisk_server_queue_tiocb_ro(struct tiocb *);
 void tapdisk_server_prep_tiocb_ro(struct tiocb *, int, int, char *, size_t,
 	long long, td_queue_callback_t, void *);
+int tapdisk_server_prepv_tiocb_ro(struct tiocb *, int, int, struct iovec *, int,
+	long long, td_queue_callback_t, void *);
 void tapdisk_server_queue_tiocb(struct tiocb *);
+void tapdisk_server_forget_files(void);
 void tapdisk_server_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 	long long, td_queue_callback_t, void *);
+int tapdisk_server_prepv_tiocb(struct tiocb *, int, int, struct iovec *, int,
+	long long, td_queue_callback_t, void *);
 
 void tapdisk_server_check_state(void);
 
@@ -0,0 +1,581 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The segment is a file, on tmpfs by default, or on hugetlbfs if
+ * TAPDISK3_SHARED_CACHE_PATH points there, so that unrelated tapdisks
+ * find it by name and it outlives them. Whoever maps it first, under
+ * flock, lays it out.
+ *
+ * The index is set associative: a sector hashes to a set of
+ * TD_SHARED_CACHE_WAYS entries, each owning one data slot. An entry is
+ * guarded by a sequence lock, whose count is odd while a writer fills
+ * it, and which carries the writer's pid, so that an entry left locked
+ * by a dead tapdisk can be taken over. Readers copy, then check that
+ * the count did not move.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libvhd.h"
+#include "tapdisk-log.h"
+#include "tapdisk-shared-cache.h"
+
+#define TD_SHARED_CACHE_PATH         "/dev/shm/tapdisk3-shared-cache"
+#define TD_SHARED_CACHE_MAGIC        0x7464736863616368ULL /* "tdshcach" */
+#define TD_SHARED_CACHE_VERSION      1
+#define TD_SHARED_CACHE_WAYS         8
+#define TD_SHARED_CACHE_HEADER_SIZE  4096
+#define TD_SHARED_CACHE_ALIGN        (2 << 20) /* hugetlbfs page */
+#define TD_SHARED_CACHE_WORDS        (TD_SHARED_CACHE_SECTOR_SIZE / sizeof(uint64_t))
+
+#define TD_SHARED_LOCK_SEQ(_l)       ((uint32_t)(_l))
+#define TD_SHARED_LOCK_OWNER(_l)     ((pid_t)((_l) >> 32))
+
+struct td_shared_header {
+	uint64_t              magic;
+	uint32_t              version;
+	uint32_t              ways;
+	uint64_t              size;
+	uint64_t              sets;
+	uint64_t              index;       /* offset of the entries */
+	uint64_t              data;        /* offset of the slots */
+	uint32_t              clock;       /* bumped by every insert */
+};
+
+/* one cache line */
+struct td_shared_entry {
+	uint64_t              lock;        /* owner pid << 32 | seq */
+	uint64_t              key[4];      /* image id, gen, sector */
+	uint32_t              stamp;       /* clock when last used */
+	uint32_t              pad;
+	uint64_t              reserved[2];
+};
+
+static struct {
+	int                   refs;
+	pid_t                 pid;
+
+	char                 *map;
+	size_t                size;
+	struct td_shared_header *hdr;
+	struct td_shared_entry  *index;
+	uint64_t             *data;
+	uint64_t              sets;
+
+	uint64_t              lookups;
+	uint64_t              hits;
+	uint64_t              inserts;
+	uint64_t              evictions;
+	uint64_t              busy;
+} shared;
+
+static void
+tapdisk_shared_cache_key(uint64_t *key, const td_shared_image_t *image,
+			 uint64_t sector)
+{
+	key[0] = image->id[0];
+	key[1] = image->id[1];
+	key[2] = image->gen;
+	key[3] = sector;
+}
+
+static struct td_shared_entry *
+tapdisk_shared_cache_set(const uint64_t *key)
+{
+	uint64_t h;
+
+	h  = key[0] ^ (key[1] * 0x9E3779B185EBCA87ULL) ^ key[2];
+	h ^= key[3] * 0xC2B2AE3D27D4EB4FULL;
+	h ^= h >> 29;
+	h *= 0x165667B19E3779F9ULL;
+	h ^= h >> 32;
+
+	return shared.index + (h % shared.sets) * TD_SHARED_CACHE_WAYS;
+}
+
+static inline uint64_t *
+tapdisk_shared_cache_slot(struct td_shared_entry *e)
+{
+	return shared.data + (e - shared.index) * TD_SHARED_CACHE_WORDS;
+}
+
+static int
+tapdisk_shared_cache_match(struct td_shared_entry *e, const uint64_t *key)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (__atomic_load_n(&e->key[i], __ATOMIC_RELAXED) != key[i])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * A single-threaded tapdisk never finds its own entry locked, so a lock
+ * held by our pid is left over from a previous process that had it.
+ */
+static int
+tapdisk_shared_cache_abandoned(uint64_t lock)
+{
+	pid_t owner = TD_SHARED_LOCK_OWNER(lock);
+
+	if (owner == shared.pid)
+		return 1;
+
+	return kill(owner, 0) == -1 && errno == ESRCH;
+}
+
+int
+tapdisk_shared_cache_read(const td_shared_image_t *image,
+			  uint64_t sector, char *buf)
+{
+	struct td_shared_entry *e;
+	uint64_t key[4], lock, word, *slot;
+	uint32_t clock;
+	int i, j;
+
+	tapdisk_shared_cache_key(key, image, sector);
+	e = tapdisk_shared_cache_set(key);
+
+	shared.lookups++;
+
+	for (i = 0; i < TD_SHARED_CACHE_WAYS; i++, e++) {
+		lock = __atomic_load_n(&e->lock, __ATOMIC_ACQUIRE);
+		if (lock & 1)
+			continue;
+
+		if (!tapdisk_shared_cache_match(e, key))
+			continue;
+
+		slot = tapdisk_shared_cache_slot(e);
+		for (j = 0; j < TD_SHARED_CACHE_WORDS; j++) {
+			word = __atomic_load_n(&slot[j], __ATOMIC_RELAXED);
+			memcpy(buf + j * sizeof(word), &word, sizeof(word));
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->lock, __ATOMIC_RELAXED) != lock) {
+			shared.busy++;
+			return -ENOENT;
+		}
+
+		clock = __atomic_load_n(&shared.hdr->clock, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&e->stamp, __ATOMIC_RELAXED) != clock)
+			__atomic_store_n(&e->stamp, clock, __ATOMIC_RELAXED);
+
+		shared.hits++;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Two tapdisks missing on the same sector at once may both insert it,
+ * into different ways. Lookups take the first, and the other ages out.
+ */
+int
+tapdisk_shared_cache_write(const td_shared_image_t *image,
+			   uint64_t sector, const char *buf)
+{
+	struct td_shared_entry *e, *victim;
+	uint64_t key[4], lock, vlock, word, *slot;
+	uint32_t clock, age, oldest;
+	int i, used;
+
+	tapdisk_shared_cache_key(key, image, sector);
+	e = tapdisk_shared_cache_set(key);
+
+	clock  = __atomic_load_n(&shared.hdr->clock, __ATOMIC_RELAXED);
+	victim = NULL;
+	vlock  = 0;
+	oldest = 0;
+	used   = 0;
+
+	for (i = 0; i < TD_SHARED_CACHE_WAYS; i++, e++) {
+		lock = __atomic_load_n(&e->lock, __ATOMIC_ACQUIRE);
+
+		if (lock & 1) {
+			if (!tapdisk_shared_cache_abandoned(lock))
+				continue;
+			age = UINT32_MAX;
+		} else if (tapdisk_shared_cache_match(e, key))
+			return 0;
+		else if (!__atomic_load_n(&e->key[0], __ATOMIC_RELAXED) &&
+			 !__atomic_load_n(&e->key[1], __ATOMIC_RELAXED))
+			age = UINT32_MAX;
+		else
+			age = clock - __atomic_load_n(&e->stamp,
+						      __ATOMIC_RELAXED);
+
+		if (!victim || age > oldest) {
+			victim = e;
+			vlock  = lock;
+			oldest = age;
+			used   = age != UINT32_MAX;
+		}
+	}
+
+	if (!victim) {
+		shared.busy++;
+		return -EBUSY;
+	}
+
+	/* even counts go odd, and a dead writer's odd count stays odd */
+	lock = (uint64_t)shared.pid << 32 |
+		(uint32_t)(TD_SHARED_LOCK_SEQ(vlock) + (vlock & 1 ? 2 : 1));
+	if (!__atomic_compare_exchange_n(&victim->lock, &vlock, lock, 0,
+					 __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED)) {
+		shared.busy++;
+		return -EBUSY;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (i = 0; i < 4; i++)
+		__atomic_store_n(&victim->key[i], key[i], __ATOMIC_RELAXED);
+
+	slot = tapdisk_shared_cache_slot(victim);
+	for (i = 0; i < TD_SHARED_CACHE_WORDS; i++) {
+		memcpy(&word, buf + i * sizeof(word), sizeof(word));
+		__atomic_store_n(&slot[i], word, __ATOMIC_RELAXED);
+	}
+
+	clock = __atomic_add_fetch(&shared.hdr->clock, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->stamp, clock, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&victim->lock,
+			 (uint64_t)(uint32_t)(TD_SHARED_LOCK_SEQ(lock) + 1),
+			 __ATOMIC_RELEASE);
+
+	shared.inserts++;
+	if (used)
+		shared.evictions++;
+
+	return 0;
+}
+
+static inline uint64_t
+tapdisk_shared_image_mix(uint64_t h, uint64_t v)
+{
+	h ^= v;
+	h *= 0x9E3779B185EBCA87ULL;
+	h ^= h >> 31;
+
+	return h;
+}
+
+/*
+ * The footer does not change when the data does (a coalesce into the
+ * image leaves it alone), so the generation also covers the file:
+ * which one it is, its size, and when it was last written or had its
+ * inode changed. Block devices have no such record of writes, and are
+ * refused.
+ */
+int
+tapdisk_shared_image_vhd(const char *name, td_shared_image_t *image)
+{
+	vhd_context_t vhd;
+	struct stat st;
+	uint64_t gen;
+	int err;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY | VHD_OPEN_FAST);
+	if (err)
+		return err;
+
+	err = 0;
+	if (fstat(vhd.fd, &st))
+		err = -errno;
+	else if (!S_ISREG(st.st_mode))
+		err = -EOPNOTSUPP;
+	else if (uuid_is_null(vhd.footer.uuid))
+		err = -EINVAL;
+	if (err)
+		goto out;
+
+	gen = (uint64_t)vhd.footer.timestamp << 32 | vhd.footer.checksum;
+	gen = tapdisk_shared_image_mix(gen, st.st_dev);
+	gen = tapdisk_shared_image_mix(gen, st.st_ino);
+	gen = tapdisk_shared_image_mix(gen, st.st_size);
+	gen = tapdisk_shared_image_mix(gen, st.st_mtim.tv_sec);
+	gen = tapdisk_shared_image_mix(gen, st.st_mtim.tv_nsec);
+	gen = tapdisk_shared_image_mix(gen, st.st_ctim.tv_sec);
+	gen = tapdisk_shared_image_mix(gen, st.st_ctim.tv_nsec);
+
+	memcpy(image->id, vhd.footer.uuid, sizeof(image->id));
+	image->gen = gen;
+
+out:
+	vhd_close(&vhd);
+	return err;
+}
+
+static size_t
+tapdisk_shared_cache_size(void)
+{
+	const char *size;
+	long mb;
+
+	size = getenv("TAPDISK3_SHARED_CACHE_SIZE");
+	if (!size)
+		return 0;
+
+	mb = atol(size);
+	if (mb <= 0)
+		return 0;
+
+	return (((size_t)mb << 20) + TD_SHARED_CACHE_ALIGN - 1) &
+		~((size_t)TD_SHARED_CACHE_ALIGN - 1);
+}
+
+/*
+ * Called with the segment locked, on a zero-filled mapping. The magic
+ * goes last: a creator dying halfway leaves it for the next to redo.
+ */
+static int
+tapdisk_shared_cache_format(struct td_shared_header *hdr, size_t size)
+{
+	uint64_t slots, sets;
+
+	slots = (size - 2 * TD_SHARED_CACHE_HEADER_SIZE) /
+		(sizeof(struct td_shared_entry) + TD_SHARED_CACHE_SECTOR_SIZE);
+	sets  = slots / TD_SHARED_CACHE_WAYS;
+	if (!sets)
+		return -EINVAL;
+
+	hdr->version = TD_SHARED_CACHE_VERSION;
+	hdr->ways    = TD_SHARED_CACHE_WAYS;
+	hdr->size    = size;
+	hdr->sets    = sets;
+	hdr->index   = TD_SHARED_CACHE_HEADER_SIZE;
+	hdr->data    = hdr->index +
+		sets * TD_SHARED_CACHE_WAYS * sizeof(struct td_shared_entry);
+	hdr->data    = (hdr->data + TD_SHARED_CACHE_HEADER_SIZE - 1) &
+		~((uint64_t)TD_SHARED_CACHE_HEADER_SIZE - 1);
+
+	__atomic_store_n(&hdr->magic, TD_SHARED_CACHE_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Called on an existing layout, which offsets are only trusted once
+ * they are seen to fit, without overflow, in the mapping.
+ */
+static int
+tapdisk_shared_cache_check(const struct td_shared_header *hdr, size_t size)
+{
+	uint64_t slots, index, data;
+
+	if (hdr->magic != TD_SHARED_CACHE_MAGIC ||
+	    hdr->version != TD_SHARED_CACHE_VERSION ||
+	    hdr->ways != TD_SHARED_CACHE_WAYS ||
+	    hdr->size != size)
+		return -EINVAL;
+
+	slots = size / (sizeof(struct td_shared_entry) +
+			TD_SHARED_CACHE_SECTOR_SIZE);
+	if (!hdr->sets || hdr->sets > slots / TD_SHARED_CACHE_WAYS)
+		return -EINVAL;
+
+	index = hdr->sets * TD_SHARED_CACHE_WAYS *
+		sizeof(struct td_shared_entry);
+	data  = hdr->sets * TD_SHARED_CACHE_WAYS *
+		TD_SHARED_CACHE_SECTOR_SIZE;
+
+	if (hdr->index < TD_SHARED_CACHE_HEADER_SIZE ||
+	    hdr->index > hdr->data || index > hdr->data - hdr->index ||
+	    hdr->data > size || data > size - hdr->data)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * The segment holds other guests' data, so only a private file of our
+ * own is mapped: never through a link, nor readable by anyone else.
+ */
+static int
+tapdisk_shared_cache_map(void)
+{
+	struct td_shared_header *hdr;
+	const char *path;
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd, err;
+
+	size = tapdisk_shared_cache_size();
+	if (!size)
+		return -ENOENT;
+
+	path = getenv("TAPDISK3_SHARED_CACHE_PATH");
+	if (!path)
+		path = TD_SHARED_CACHE_PATH;
+
+	map = MAP_FAILED;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+	if (fd == -1) {
+		err = -errno;
+		EPRINTF("failed to open shared cache %s: %s\n",
+			path, strerror(-err));
+		return err;
+	}
+
+	if (flock(fd, LOCK_EX)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    st.st_mode & (S_IRWXG | S_IRWXO)) {
+		err = -EPERM;
+		goto out;
+	}
+
+	if (st.st_size && st.st_size < 2 * TD_SHARED_CACHE_HEADER_SIZE) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (st.st_size)
+		size = st.st_size;
+	else if (ftruncate(fd, size)) {
+		err = -errno;
+		goto out;
+	}
+
+	/*
+	 * tapdisk runs with mlockall(MCL_FUTURE), which would fault in and
+	 * pin the whole segment here, page tables and all, in every tapdisk.
+	 * A PROT_NONE mapping is locked but not populated; unlocked, it can
+	 * be opened up, and then only faults in what is used.
+	 */
+	map = mmap(NULL, size, PROT_NONE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	if (munlock(map, size) ||
+	    mprotect(map, size, PROT_READ | PROT_WRITE)) {
+		err = -errno;
+		goto out;
+	}
+
+	hdr = map;
+	err = 0;
+
+	if (!hdr->magic)
+		err = tapdisk_shared_cache_format(hdr, size);
+	else
+		err = tapdisk_shared_cache_check(hdr, size);
+	if (err)
+		goto out;
+
+	shared.pid   = getpid();
+	shared.map   = map;
+	shared.size  = size;
+	shared.hdr   = hdr;
+	shared.index = (struct td_shared_entry *)((char *)map + hdr->index);
+	shared.data  = (uint64_t *)((char *)map + hdr->data);
+	shared.sets  = hdr->sets;
+
+	DPRINTF("shared cache %s: %zu bytes, %"PRIu64" slots\n",
+		path, size, shared.sets * TD_SHARED_CACHE_WAYS);
+
+out:
+	if (err) {
+		EPRINTF("failed to map shared cache %s: %s\n",
+			path, strerror(-err));
+		if (map != MAP_FAILED)
+			munmap(map, size);
+	}
+	close(fd);
+	return err;
+}
+
+int
+tapdisk_shared_cache_get(void)
+{
+	int err;
+
+	if (shared.refs++)
+		return 0;
+
+	err = tapdisk_shared_cache_map();
+	if (err)
+		shared.refs--;
+
+	return err;
+}
+
+void
+tapdisk_shared_cache_put(void)
+{
+	if (--shared.refs)
+		return;
+
+	munmap(shared.map, shared.size);
+	memset(&shared, 0, sizeof(shared));
+}
+
+void
+tapdisk_shared_cache_info(td_shared_cache_info_t *info)
+{
+	info->size      = shared.size;
+	info->slots     = shared.sets * TD_SHARED_CACHE_WAYS;
+	info->lookups   = shared.lookups;
+	info->hits      = shared.hits;
+	info->inserts   = shared.inserts;
+	info->evictions = shared.evictions;
+	info->busy      = shared.busy;
+}
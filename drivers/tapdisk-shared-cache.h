@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TAPDISK_SHARED_CACHE_H__
+#define __TAPDISK_SHARED_CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A host-wide cache of read-only image sectors, in a shared memory
+ * segment that every tapdisk on the host maps. Sectors are keyed by
+ * image and sector number; an image must not change while it keeps its
+ * key. Neither lookups nor inserts take a lock, and a tapdisk dying
+ * halfway through an insert loses that one slot, no more.
+ */
+
+#define TD_SHARED_CACHE_SECTOR_SIZE  512
+
+typedef struct td_shared_image       td_shared_image_t;
+typedef struct td_shared_cache_info  td_shared_cache_info_t;
+
+struct td_shared_image {
+	uint64_t              id[2];       /* image uuid, never null */
+	uint64_t              gen;         /* changes with the data */
+};
+
+struct td_shared_cache_info {
+	size_t                size;
+	uint64_t              slots;
+
+	/* this process only */
+	uint64_t              lookups;
+	uint64_t              hits;
+	uint64_t              inserts;
+	uint64_t              evictions;
+	uint64_t              busy;        /* raced with a writer */
+};
+
+/*
+ * Identifies the VHD at @name by its uuid, footer and file. Only regular
+ * files can be told apart once rewritten: -EOPNOTSUPP for anything else.
+ */
+int tapdisk_shared_image_vhd(const char *name, td_shared_image_t *image);
+
+/*
+ * Takes a reference on the segment, mapping it if not mapped yet, and
+ * creating it if no tapdisk has. Returns -ENOENT if the cache is
+ * disabled, which it is unless TAPDISK3_SHARED_CACHE_SIZE is set.
+ */
+int tapdisk_shared_cache_get(void);
+void tapdisk_shared_cache_put(void);
+
+/*
+ * Copies @sector of @image into @buf, or returns -ENOENT.
+ */
+int tapdisk_shared_cache_read(const td_shared_image_t *image,
+			      uint64_t sector, char *buf);
+
+/*
+ * Adds @sector of @image, evicting the least recently used sector in
+ * its set. Returns -EBUSY if it raced with another writer; the insert
+ * is best-effort and is not retried.
+ */
+int tapdisk_shared_cache_write(const td_shared_image_t *image,
+			       uint64_t sector, const char *buf);
+
+void tapdisk_shared_cache_info(td_shared_cache_info_t *info);
+
+#endif /* __TAPDISK_SHARED_CACHE_H__ */
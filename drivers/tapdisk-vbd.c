@@ -70,7 +70,8 @@
 #define TD_VBD_EIO_SLEEP            1
 #define TD_VBD_WATCHDOG_TIMEOUT     10
 
-char* op_strings[TD_OPS_END] ={"read", "write", "block_status"};
+char* op_strings[TD_OPS_END] ={"read", "write", "block_status", "discard",
+			       "write_zeroes", "flush"};
 
 static void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 static int  tapdisk_vbd_queue_ready(td_vbd_t *);
@@ -1306,6 +1307,13 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	tapdisk_vbd_complete_vbd_request(vbd, vreq);
 }
 
+static inline int
+tapdisk_vbd_dataless_op(int op)
+{
+	return op == TD_OP_DISCARD || op == TD_OP_WRITE_ZEROES ||
+		op == TD_OP_FLUSH;
+}
+
 static void
 __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 				 td_image_t *image, td_request_t treq)
@@ -1320,7 +1328,16 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	if (tapdisk_vbd_is_last_image(vbd, image)) {
 		if (unlikely(treq.op == TD_OP_BLOCK_STATUS)) {
-			treq.status = TD_BLOCK_STATE_HOLE;
+			/* unallocated throughout the chain, reads as zeroes */
+			treq.status = TD_BLOCK_STATE_HOLE | TD_BLOCK_STATE_ZERO;
+		} else if (tapdisk_vbd_dataless_op(treq.op)) {
+			/* nothing further down to discard or flush */
+		} else if (treq.iovcnt) {
+			int i;
+
+			for (i = 0; i < treq.iovcnt; i++)
+				memset(treq.iov[i].base, 0,
+				       (size_t)treq.iov[i].secs << SECTOR_SHIFT);
 		} else {
 			memset(treq.buf, 0, (size_t)treq.secs << SECTOR_SHIFT);
 		}
@@ -1351,7 +1368,11 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 		} else
 			treq.secs   = 0;
 
-		memset(clone.buf, 0, (size_t)clone.secs << SECTOR_SHIFT);
+		if (clone.op == TD_OP_BLOCK_STATUS)
+			clone.status = TD_BLOCK_STATE_HOLE | TD_BLOCK_STATE_ZERO;
+		else if (!tapdisk_vbd_dataless_op(clone.op))
+			memset(clone.buf, 0,
+			       (size_t)clone.secs << SECTOR_SHIFT);
 		td_complete_request(clone, 0);
 
 		if (!treq.secs)
@@ -1369,6 +1390,15 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 	case TD_OP_BLOCK_STATUS:
 		td_queue_block_status(parent, &treq);
 		break;
+	case TD_OP_DISCARD:
+		td_queue_discard(parent, treq);
+		break;
+	case TD_OP_WRITE_ZEROES:
+		td_queue_write_zeroes(parent, treq);
+		break;
+	case TD_OP_FLUSH:
+		td_queue_flush(parent, treq);
+		break;
 	}
 
 done:
@@ -1428,7 +1458,9 @@ block_status_add_extent(tapdisk_extents_t *extents, td_request_t *vreq)
 	if(extents->tail == NULL) {
 		ret = add_extent(extents, vreq);
 	} else {
-		if(extents->tail->flag == vreq->status) {
+		/* pieces may complete out of order, only merge adjacent ones */
+		if(extents->tail->flag == vreq->status &&
+		   extents->tail->start + extents->tail->length == vreq->sec) {
 			extents->tail->length += vreq->secs;
 		} else {
 			ret = add_extent(extents, vreq);
@@ -1527,7 +1559,34 @@ static inline void
 queue_mirror_req(td_vbd_t *vbd, td_request_t clone)
 {
 	clone.image = vbd->secondary;
-	td_queue_write(vbd->secondary, clone);
+	if (clone.op == TD_OP_WRITE_ZEROES)
+		td_queue_write_zeroes(vbd->secondary, clone);
+	else
+		td_queue_write(vbd->secondary, clone);
+}
+
+/*
+ * Whole guest requests go down as one vectored td_request when the
+ * image driver takes iovecs and nothing can split the request on the
+ * way: no parents to forward to and no secondary to mirror into.
+ */
+static int
+tapdisk_vbd_vectored_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
+			     td_image_t *image)
+{
+	if (vreq->op != TD_OP_READ && vreq->op != TD_OP_WRITE)
+		return 0;
+
+	if (vreq->iovcnt < 2 || vreq->iovcnt > TD_IOV_MAX)
+		return 0;
+
+	if (!td_flag_test(image->driver->ops->flags, TD_DISK_VECTORED))
+		return 0;
+
+	if (!tapdisk_vbd_is_last_image(vbd, image))
+		return 0;
+
+	return vbd->secondary_mode == TD_VBD_SECONDARY_DISABLED;
 }
 
 int
@@ -1537,7 +1596,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	td_request_t treq;
 	bzero(&treq, sizeof(treq));
 	td_sector_t sec;
-	int i, err;
+	int i, nr, secs, err;
 
 	sec    = vreq->sec;
 	image  = tapdisk_vbd_first_image(vbd);
@@ -1561,27 +1620,42 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		goto fail;
 	}
 
-	for (i = 0; i < vreq->iovcnt; i++) {
+	nr = vreq->iovcnt;
+	if (tapdisk_vbd_vectored_request(vbd, vreq, image)) {
+		for (i = 0, secs = 0; i < vreq->iovcnt; i++)
+			secs += vreq->iov[i].secs;
+
+		treq.iov    = vreq->iov;
+		treq.iovcnt = vreq->iovcnt;
+		nr          = 1;
+	}
+
+	for (i = 0; i < nr; i++) {
 		struct td_iovec *iov = &vreq->iov[i];
 
+		if (!treq.iovcnt) {
+			treq.buf    = iov->base;
+			secs        = iov->secs;
+		}
+
 		treq.sidx           = i;
-		treq.buf            = iov->base;
 		treq.sec            = sec;
-		treq.secs           = iov->secs;
+		treq.secs           = secs;
 		treq.image          = image;
 		treq.cb             = tapdisk_vbd_complete_td_request;
 		treq.cb_data        = NULL;
 		treq.vreq           = vreq;
 
 
-		vreq->secs_pending += iov->secs;
-		vbd->secs_pending  += iov->secs;
+		vreq->secs_pending += secs;
+		vbd->secs_pending  += secs;
 		if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
-		    vreq->op == TD_OP_WRITE &&
+		    (vreq->op == TD_OP_WRITE ||
+		     vreq->op == TD_OP_WRITE_ZEROES) &&
 			likely(vreq->skip_mirror == false))
 		{
-			vreq->secs_pending += iov->secs;
-			vbd->secs_pending  += iov->secs;
+			vreq->secs_pending += secs;
+			vbd->secs_pending  += secs;
 		}
 
 		switch (vreq->op) {
@@ -1617,12 +1691,32 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 			treq.cb = tapdisk_vbd_complete_block_status_request;
 			td_queue_block_status(treq.image, &treq);
 			break;
+		case TD_OP_DISCARD:
+			/*
+			 * Discarded data reads back undefined, the mirror
+			 * is left as it is.
+			 */
+			treq.op = TD_OP_DISCARD;
+			td_queue_discard(treq.image, treq);
+			break;
+		case TD_OP_WRITE_ZEROES:
+			treq.op = TD_OP_WRITE_ZEROES;
+			if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
+				likely(vreq->skip_mirror == false)) {
+					queue_mirror_req(vbd, treq);
+			}
+			td_queue_write_zeroes(treq.image, treq);
+			break;
+		case TD_OP_FLUSH:
+			treq.op = TD_OP_FLUSH;
+			td_queue_flush(treq.image, treq);
+			break;
 		}
 
 		DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08"PRIx64" secs 0x%04x "
-		    "buf %p op %d\n", image->name, vreq->name, i, treq.sec, treq.secs,
-		    treq.buf, vreq->op);
-		sec += iov->secs;
+		    "buf %p iovcnt %d op %d\n", image->name, vreq->name, i,
+		    treq.sec, treq.secs, treq.buf, treq.iovcnt, vreq->op);
+		sec += secs;
 	}
 
 	err = 0;
@@ -1921,6 +2015,15 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
     	tapdisk_stats_leave(st, '}');
     }
 
+	if (vbd->nbdserver || vbd->nbdserver_new) {
+		tapdisk_stats_field(st, "nbd", "[");
+		if (vbd->nbdserver)
+			tapdisk_nbdserver_stats(vbd->nbdserver, st);
+		if (vbd->nbdserver_new)
+			tapdisk_nbdserver_stats(vbd->nbdserver_new, st);
+		tapdisk_stats_leave(st, ']');
+	}
+
 	tapdisk_stats_field(st,
 			"FIXME_enospc_redirect_count",
 			"llu", vbd->FIXME_enospc_redirect_count);
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Each worker has a single-producer, single-consumer ring, filled round
+ * robin by the tapdisk thread, and sleeps on an eventfd only once the
+ * ring is empty. Finished work is pushed onto a lock-free stack, which
+ * the tapdisk thread takes over as a whole when the completion eventfd
+ * fires, reversing it back into completion order.
+ *
+ * CPU-bound and blocking work go to separate pools, each sized by its
+ * first user, so that a slow fdatasync never holds up the encryption
+ * queued behind it on the same ring.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "tapdisk-log.h"
+#include "tapdisk-server.h"
+#include "tapdisk-workers.h"
+#include "timeout-math.h"
+
+#define TD_WORKERS_MAX               64
+#define TD_WORKERS_SYNC_DEFAULT      2
+#define TD_WORKER_RING_SIZE          256
+
+struct td_workers_pool;
+
+struct td_worker {
+	pthread_t             thread;
+	struct td_workers_pool *pool;
+	int                   kick;        /* eventfd, wakes the worker */
+	int                   idle;        /* set before sleeping on kick */
+	unsigned int          head;        /* next to run, worker only */
+	unsigned int          tail;        /* next free, tapdisk only */
+	td_work_t            *ring[TD_WORKER_RING_SIZE];
+};
+
+struct td_workers_pool {
+	const char           *name;
+	int                   refs;
+	int                   nr_workers;
+	int                   next;        /* worker to try first */
+	struct td_worker     *workers;
+	int                   stop;
+
+	int                   done_fd;
+	event_id_t            done_event;
+	td_work_t            *done;        /* finished, most recent first */
+
+	uint64_t              queued;
+	uint64_t              inlined;
+};
+
+static struct td_workers_pool pools[TD_WORKERS_POOLS] = {
+	[TD_WORKERS_CPU] = {
+		.name       = "cpu",
+		.done_fd    = -1,
+		.done_event = -1,
+	},
+	[TD_WORKERS_SYNC] = {
+		.name       = "sync",
+		.done_fd    = -1,
+		.done_event = -1,
+	},
+};
+
+static void
+tapdisk_workers_signal(int fd)
+{
+	uint64_t val = 1;
+
+	if (write(fd, &val, sizeof(val)) != sizeof(val))
+		EPRINTF("worker signal failed: %s\n", strerror(errno));
+}
+
+/*
+ * Called from any thread. Whoever finds the stack empty signals; the
+ * tapdisk thread reads the eventfd before taking the stack, so no
+ * completion is left behind without a pending signal.
+ */
+static void
+tapdisk_workers_complete(struct td_workers_pool *pool, td_work_t *work)
+{
+	td_work_t *head;
+
+	head = __atomic_load_n(&pool->done, __ATOMIC_RELAXED);
+	do {
+		work->next = head;
+	} while (!__atomic_compare_exchange_n(&pool->done, &head, work, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	if (!head)
+		tapdisk_workers_signal(pool->done_fd);
+}
+
+static void *
+tapdisk_worker_run(void *arg)
+{
+	struct td_worker *w = arg;
+	struct td_workers_pool *pool = w->pool;
+	td_work_t *work;
+	unsigned int head;
+	uint64_t val;
+
+	for (;;) {
+		head = w->head;
+
+		if (head == __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+				break;
+
+			/* pairs with the exchange in tapdisk_worker_push */
+			__atomic_store_n(&w->idle, 1, __ATOMIC_SEQ_CST);
+			if (head == __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) &&
+			    !__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST))
+				if (read(w->kick, &val, sizeof(val)) < 0 &&
+				    errno != EINTR)
+					break;
+			__atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		work = w->ring[head % TD_WORKER_RING_SIZE];
+		__atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+
+		work->fn(work);
+		tapdisk_workers_complete(pool, work);
+	}
+
+	return NULL;
+}
+
+static int
+tapdisk_worker_push(struct td_worker *w, td_work_t *work)
+{
+	unsigned int tail = w->tail;
+
+	if (tail - __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) ==
+	    TD_WORKER_RING_SIZE)
+		return -EBUSY;
+
+	w->ring[tail % TD_WORKER_RING_SIZE] = work;
+	__atomic_store_n(&w->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&w->idle, 0, __ATOMIC_SEQ_CST))
+		tapdisk_workers_signal(w->kick);
+
+	return 0;
+}
+
+void
+tapdisk_workers_queue(td_workers_pool_t id, td_work_t *work)
+{
+	struct td_workers_pool *pool = &pools[id];
+	int i, n;
+
+	for (i = 0; i < pool->nr_workers; i++) {
+		n = (pool->next + i) % pool->nr_workers;
+		if (!tapdisk_worker_push(&pool->workers[n], work)) {
+			pool->next = (n + 1) % pool->nr_workers;
+			pool->queued++;
+			return;
+		}
+	}
+
+	work->fn(work);
+	tapdisk_workers_complete(pool, work);
+	pool->inlined++;
+}
+
+static void
+tapdisk_workers_reap_pool(struct td_workers_pool *pool)
+{
+	td_work_t *work, *next, *list = NULL;
+
+	work = __atomic_exchange_n(&pool->done, NULL, __ATOMIC_ACQUIRE);
+	for (; work; work = next) {
+		next = work->next;
+		work->next = list;
+		list = work;
+	}
+
+	for (work = list; work; work = next) {
+		next = work->next;
+		work->done(work);
+	}
+}
+
+void
+tapdisk_workers_reap(void)
+{
+	int i;
+
+	for (i = 0; i < TD_WORKERS_POOLS; i++)
+		tapdisk_workers_reap_pool(&pools[i]);
+}
+
+static void
+tapdisk_workers_event(event_id_t id, char mode, void *private)
+{
+	struct td_workers_pool *pool = private;
+	uint64_t val;
+
+	if (read(pool->done_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		EPRINTF("worker completion read failed: %s\n",
+			strerror(errno));
+
+	tapdisk_workers_reap_pool(pool);
+}
+
+static void
+tapdisk_workers_stop(struct td_workers_pool *pool)
+{
+	const char *name = pool->name;
+	int i;
+
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < pool->nr_workers; i++) {
+		tapdisk_workers_signal(pool->workers[i].kick);
+		pthread_join(pool->workers[i].thread, NULL);
+		close(pool->workers[i].kick);
+	}
+
+	tapdisk_workers_reap_pool(pool);
+
+	if (pool->done_event >= 0)
+		tapdisk_server_unregister_event(pool->done_event);
+	if (pool->done_fd >= 0)
+		close(pool->done_fd);
+
+	DPRINTF("stopped %d %s workers: %"PRIu64" queued, %"PRIu64" inline\n",
+		pool->nr_workers, name, pool->queued, pool->inlined);
+
+	free(pool->workers);
+	memset(pool, 0, sizeof(*pool));
+	pool->name       = name;
+	pool->done_fd    = -1;
+	pool->done_event = -1;
+}
+
+static int
+tapdisk_workers_start(struct td_workers_pool *pool, int nr)
+{
+	struct td_worker *w;
+	sigset_t mask, omask;
+	int err;
+
+	if (nr > TD_WORKERS_MAX)
+		nr = TD_WORKERS_MAX;
+
+	pool->workers = calloc(nr, sizeof(struct td_worker));
+	if (!pool->workers)
+		return -ENOMEM;
+
+	pool->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool->done_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	pool->done_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      pool->done_fd, TV_ZERO,
+					      tapdisk_workers_event, pool);
+	if (pool->done_event < 0) {
+		err = pool->done_event;
+		goto fail;
+	}
+
+	for (; pool->nr_workers < nr; pool->nr_workers++) {
+		w = &pool->workers[pool->nr_workers];
+		w->pool = pool;
+
+		w->kick = eventfd(0, EFD_CLOEXEC);
+		if (w->kick < 0) {
+			err = -errno;
+			goto fail;
+		}
+
+		/* signals are for the tapdisk thread only */
+		sigfillset(&mask);
+		pthread_sigmask(SIG_BLOCK, &mask, &omask);
+		err = -pthread_create(&w->thread, NULL, tapdisk_worker_run, w);
+		pthread_sigmask(SIG_SETMASK, &omask, NULL);
+		if (err) {
+			close(w->kick);
+			goto fail;
+		}
+	}
+
+	DPRINTF("started %d %s workers\n", nr, pool->name);
+	return 0;
+
+fail:
+	EPRINTF("failed to start %d %s workers: %s\n",
+		nr, pool->name, strerror(-err));
+	tapdisk_workers_stop(pool);
+	return err;
+}
+
+int
+tapdisk_workers_get(td_workers_pool_t id, int nr)
+{
+	struct td_workers_pool *pool = &pools[id];
+	int err;
+
+	if (nr <= 0)
+		return -EINVAL;
+
+	if (!pool->refs) {
+		err = tapdisk_workers_start(pool, nr);
+		if (err)
+			return err;
+	}
+
+	pool->refs++;
+	return 0;
+}
+
+void
+tapdisk_workers_put(td_workers_pool_t id)
+{
+	struct td_workers_pool *pool = &pools[id];
+
+	if (--pool->refs)
+		return;
+
+	tapdisk_workers_stop(pool);
+}
+
+int
+tapdisk_workers_sync_threads(void)
+{
+	const char *env;
+	int nr;
+
+	env = getenv("TAPDISK3_SYNC_THREADS");
+	if (!env)
+		return TD_WORKERS_SYNC_DEFAULT;
+
+	nr = atoi(env);
+
+	return nr > 0 ? nr : 0;
+}
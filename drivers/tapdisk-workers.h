@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TAPDISK_WORKERS_H__
+#define __TAPDISK_WORKERS_H__
+
+/*
+ * Process-wide pools of worker threads for CPU-bound work, such as
+ * encryption, or blocking calls, such as fallocate, that would otherwise
+ * stall the event loop. Work is run by fn on a worker, then handed back
+ * to done on the tapdisk thread, from the scheduler. Neither queueing nor
+ * completion takes a lock.
+ */
+
+typedef enum {
+	TD_WORKERS_CPU,                    /* encryption */
+	TD_WORKERS_SYNC,                   /* fallocate, fdatasync */
+	TD_WORKERS_POOLS
+} td_workers_pool_t;
+
+typedef struct td_work td_work_t;
+typedef void (*td_work_fn_t)(td_work_t *);
+
+struct td_work {
+	td_work_fn_t          fn;          /* on a worker thread */
+	td_work_fn_t          done;        /* on the tapdisk thread */
+	td_work_t            *next;
+};
+
+/*
+ * Takes a reference on @pool, starting @nr threads if not running.
+ */
+int tapdisk_workers_get(td_workers_pool_t pool, int nr);
+void tapdisk_workers_put(td_workers_pool_t pool);
+
+/*
+ * Queues @work. If all workers are saturated, fn runs in the caller, but
+ * done is still deferred to the scheduler.
+ */
+void tapdisk_workers_queue(td_workers_pool_t pool, td_work_t *work);
+
+/*
+ * Runs done for all completed work, in the order it finished in each pool.
+ */
+void tapdisk_workers_reap(void);
+
+/*
+ * Number of TD_WORKERS_SYNC workers image drivers should ask for to run
+ * blocking calls (discards, zeroing, flushes), from TAPDISK3_SYNC_THREADS.
+ * 0 means they stay on the tapdisk thread.
+ */
+int tapdisk_workers_sync_threads(void);
+
+#endif /* __TAPDISK_WORKERS_H__ */
@@ -62,6 +62,7 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <limits.h>
 
 #include "list.h"
 #include "compiler.h"
@@ -69,6 +70,10 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-stats.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX                      1024
+#endif
+
 extern unsigned int PAGE_SIZE;
 extern unsigned int PAGE_MASK;
 extern unsigned int PAGE_SHIFT;
@@ -83,17 +88,37 @@ extern unsigned int PAGE_SHIFT;
 #define SECTOR_SHIFT                 9
 #define DEFAULT_SECTOR_SIZE          512
 
-#define TAPDISK_DATA_REQUESTS       (MAX_REQUESTS * BLKIF_MAX_SEGMENTS_PER_REQUEST)
+/*
+ * Largest guest request, in segments, with indirect descriptors. Must
+ * match BLKIF_MAX_INDIRECT_SEGMENTS_PER_REQUEST, td-req.h checks.
+ */
+#define TD_MAX_SEGMENTS_PER_REQUEST  256
+
+/*
+ * A ring full of the largest requests the frontend may send, split per
+ * segment. Drivers size their request pools from this.
+ */
+#define TAPDISK_DATA_REQUESTS       (MAX_REQUESTS * TD_MAX_SEGMENTS_PER_REQUEST)
+#define TD_IOV_MAX                   (TD_MAX_SEGMENTS_PER_REQUEST < IOV_MAX ? \
+				      TD_MAX_SEGMENTS_PER_REQUEST : IOV_MAX)
 
 //#define BLK_NOT_ALLOCATED            (-99)
 #define TD_NO_PARENT                 1
 
 #define MAX_RAMDISK_SIZE             1024000 /*500MB disk limit*/
 
+/*
+ * TD_OP_DISCARD and TD_OP_WRITE_ZEROES carry no data (buf and iov are
+ * NULL), only a sector range. TD_OP_FLUSH covers a nominal single sector,
+ * so it goes through the same accounting as the data requests.
+ */
 enum TD_OPS{
 	TD_OP_READ = 0,
 	TD_OP_WRITE,
 	TD_OP_BLOCK_STATUS,
+	TD_OP_DISCARD,
+	TD_OP_WRITE_ZEROES,
+	TD_OP_FLUSH,
 	TD_OPS_END
 };
 
@@ -112,6 +137,8 @@ enum TD_OPS{
 #define TD_IGNORE_ENOSPC             0x01000
 #define TD_OPEN_NO_O_DIRECT          0x02000
 
+#define TD_DISK_VECTORED             0x00001 /* tap_disk.flags: accepts iov requests */
+
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
 
@@ -189,6 +216,14 @@ struct td_request {
 	int                          op;
 	void                        *buf;
 
+	/*
+	 * Vectored requests (iovcnt > 0, buf NULL) cover iov[0..iovcnt)
+	 * contiguously from sec. Only issued to drivers flagged
+	 * TD_DISK_VECTORED.
+	 */
+	struct td_iovec             *iov;
+	int                          iovcnt;
+
 	int                          status;
 	td_sector_t                  sec;
 	int                          secs;
@@ -207,6 +242,13 @@ struct td_vbd_encryption
 	/* key size in octets */
 	uint8_t                    key_size;
 	uint8_t                    *encryption_key;
+
+	/*
+	 * Not a key, but this is the per-VBD state every td_open in the
+	 * chain gets: the VHD bitmap cache size asked for at open time,
+	 * 0 for the default.
+	 */
+	uint32_t                   bm_cache_size;
 };
 
 /* 
@@ -224,6 +266,9 @@ struct tap_disk {
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_block_status)(td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
+	void (*td_queue_discard)     (td_driver_t *, td_request_t);
+	void (*td_queue_write_zeroes)(td_driver_t *, td_request_t);
+	void (*td_queue_flush)       (td_driver_t *, td_request_t);
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
 
@@ -68,6 +68,77 @@ tapdisk_xenblkif_find(const domid_t domid, const int devid)
 }
 
 
+struct td_xenblkif *
+tapdisk_xenblkif_find_queue(const domid_t domid, const int devid,
+        const int queue)
+{
+    struct td_xenblkif *blkif = NULL;
+    struct td_xenio_ctx *ctx;
+
+    tapdisk_xenio_for_each_ctx(ctx) {
+        tapdisk_xenio_ctx_find_blkif(ctx, blkif,
+                                     blkif->domid == domid &&
+                                     blkif->devid == devid &&
+                                     blkif->queue == queue);
+        if (blkif)
+            return blkif;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Returns the live block interface of the VBD with the highest queue number,
+ * NULL if there is none.
+ */
+static struct td_xenblkif *
+tapdisk_xenblkif_find_last_queue(const domid_t domid, const int devid)
+{
+    struct td_xenblkif *blkif, *last = NULL;
+    struct td_xenio_ctx *ctx;
+
+    tapdisk_xenio_for_each_ctx(ctx) {
+        tapdisk_xenio_for_each_blkif(blkif, ctx) {
+            if (!blkif->dead && blkif->domid == domid &&
+                    blkif->devid == devid &&
+                    (!last || blkif->queue > last->queue))
+                last = blkif;
+        }
+    }
+
+    return last;
+}
+
+
+/**
+ * Stops the queue accounting into the VBD metrics. Queue 0 owns them: when
+ * it goes, the other queues of the VBD, dead or alive, drop their pointer
+ * into the file rather than keep writing to an unmapped page.
+ */
+static int
+tapdisk_xenblkif_vbd_stats_stop(struct td_xenblkif *blkif)
+{
+    struct td_xenblkif *other;
+    struct td_xenio_ctx *ctx;
+
+    if (blkif->queue) {
+        blkif->vbd_stats.stats = NULL;
+        return 0;
+    }
+
+    tapdisk_xenio_for_each_ctx(ctx) {
+        tapdisk_xenio_for_each_blkif(other, ctx) {
+            if (other != blkif && other->domid == blkif->domid &&
+                    other->devid == blkif->devid)
+                other->vbd_stats.stats = NULL;
+        }
+    }
+
+    return td_metrics_vbd_stop(&blkif->vbd_stats);
+}
+
+
 /**
  * Returns 0 on success, -errno on failure.
  */
@@ -123,8 +194,12 @@ tapdisk_xenblkif_stats_create(struct td_xenblkif *blkif)
     int err = 0, len;
     char *_path = NULL;
 
-    len = asprintf(&blkif->xenvbd_stats.root, "/dev/shm/vbd3-%d-%d",
-            blkif->domid, blkif->devid);
+    if (!blkif->queue)
+        len = asprintf(&blkif->xenvbd_stats.root, "/dev/shm/vbd3-%d-%d",
+                blkif->domid, blkif->devid);
+    else
+        len = asprintf(&blkif->xenvbd_stats.root, "/dev/shm/vbd3-%d-%d.%d",
+                blkif->domid, blkif->devid, blkif->queue);
     if (unlikely(len == -1)) {
         err = errno;
         blkif->xenvbd_stats.root = NULL;
@@ -229,6 +304,8 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif)
     tapdisk_xenblkif_reqs_free(blkif);
 
     if (blkif->ctx) {
+        td_pgrant_pool_free(blkif);
+
         if (blkif->port >= 0)
             xenevtchn_unbind(blkif->ctx->xce_handle, blkif->port);
 
@@ -249,7 +326,7 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif)
         list_del(&blkif->entry);
         tapdisk_xenio_ctx_put(blkif->ctx);
     }
-    err = td_metrics_vbd_stop(&blkif->vbd_stats);
+    err = tapdisk_xenblkif_vbd_stats_stop(blkif);
     if (unlikely(err))
         EPRINTF("failed to destroy blkfront stats file: %s\n", strerror(-err));
 
@@ -275,15 +352,10 @@ tapdisk_xenblkif_reqs_pending(const struct td_xenblkif * const blkif)
 }
 
 
-int
-tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
+static int
+tapdisk_xenblkif_disconnect_queue(struct td_xenblkif *blkif)
 {
     int err;
-    struct td_xenblkif *blkif;
-
-    blkif = tapdisk_xenblkif_find(domid, devid);
-    if (!blkif)
-        return -ENODEV;
 
     if (tapdisk_xenblkif_reqs_pending(blkif)) {
         RING_DEBUG(blkif, "disconnect from ring with %d pending requests\n",
@@ -299,7 +371,7 @@ tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
             blkif->port = -1;
         }
 
-        err = td_metrics_vbd_stop(&blkif->vbd_stats);
+        err = tapdisk_xenblkif_vbd_stats_stop(blkif);
         if (unlikely(err))
             EPRINTF("failed to destroy blkfront stats file: %s\n", strerror(-err));
 
@@ -319,6 +391,29 @@ tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
 }
 
 
+int
+tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
+{
+    struct td_xenblkif *blkif;
+    int err = 0, err2;
+
+    if (!tapdisk_xenblkif_find(domid, devid))
+        return -ENODEV;
+
+    /*
+     * The other queues account into the metrics of queue 0, so tear down the
+     * last queue first.
+     */
+    while ((blkif = tapdisk_xenblkif_find_last_queue(domid, devid))) {
+        err2 = tapdisk_xenblkif_disconnect_queue(blkif);
+        if (err2 && !err)
+            err = err2;
+    }
+
+    return err;
+}
+
+
 void
 tapdisk_xenblkif_sched_stoppolling(const struct td_xenblkif *blkif)
 {
@@ -432,11 +527,14 @@ tapdisk_xenblkif_cb_chkrng(event_id_t id __attribute__((unused)),
 
 
 int
-tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
+tapdisk_xenblkif_connect(domid_t domid, int devid, int queue,
+        const grant_ref_t * grefs,
         int order, evtchn_port_t port, int proto, int poll_duration,
-        int poll_idle_threshold, const char *pool, td_vbd_t * vbd)
+        int poll_idle_threshold, bool persistent_grants, const char *pool,
+        td_vbd_t * vbd)
 {
     struct td_xenblkif *td_blkif = NULL; /* TODO rename to blkif */
+    struct td_xenblkif *first = NULL;
     struct td_xenio_ctx *td_ctx;
     int err;
     unsigned int i;
@@ -449,11 +547,23 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
     /*
      * Already connected?
      */
-    if (tapdisk_xenblkif_find(domid, devid)) {
+    if (tapdisk_xenblkif_find_queue(domid, devid, queue)) {
         /* TODO log error */
         return -EALREADY;
     }
 
+    /*
+     * Additional queues share the VBD metrics of the first one.
+     */
+    if (queue) {
+        first = tapdisk_xenblkif_find_queue(domid, devid, 0);
+        if (!first) {
+            EPRINTF("%d/%d: queue %d connected before queue 0\n",
+                    domid, devid, queue);
+            return -EINVAL;
+        }
+    }
+
     err = tapdisk_xenio_ctx_get(pool, &td_ctx);
     if (err) {
         /* TODO log error */
@@ -469,6 +579,7 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 
     td_blkif->domid = domid;
     td_blkif->devid = devid;
+    td_blkif->queue = queue;
     td_blkif->vbd = vbd;
     td_blkif->ctx = td_ctx;
     td_blkif->proto = proto;
@@ -577,6 +688,15 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         goto fail;
     }
 
+    if (persistent_grants) {
+        err = td_pgrant_pool_init(td_blkif);
+        if (unlikely(err)) {
+            RING_ERR(td_blkif, "failed to set up persistent grants: %s\n",
+                    strerror(-err));
+            goto fail;
+        }
+    }
+
 	td_blkif->chkrng_event = tapdisk_server_register_event(
 			SCHEDULER_POLL_TIMEOUT,	-1, TV_INF,
 			tapdisk_xenblkif_cb_chkrng, td_blkif);
@@ -586,9 +706,13 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 		goto fail;
 	}
 
-	err = td_metrics_vbd_start(td_blkif->domid, td_blkif->devid, &td_blkif->vbd_stats);
-	if (unlikely(err))
-		goto fail;
+	if (!first) {
+		err = td_metrics_vbd_start(td_blkif->domid, td_blkif->devid,
+				&td_blkif->vbd_stats);
+		if (unlikely(err))
+			goto fail;
+	} else
+		td_blkif->vbd_stats.stats = first->vbd_stats.stats;
 
 	td_blkif->stoppolling_event = tapdisk_server_register_event(
 			SCHEDULER_POLL_TIMEOUT,	-1, TV_INF,
@@ -44,6 +44,7 @@
 #include "xen_blkif.h"
 #include "td-req.h"
 #include "td-stats.h"
+#include "td-pgrant.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-metrics.h"
@@ -64,6 +65,12 @@ struct td_xenblkif {
      */
     int devid;
 
+    /**
+     * The queue this ring serves. A multi-queue front-end gets a block
+     * interface per queue, each with its own ring, event channel, requests
+     * and stats.
+     */
+    int queue;
 
     /**
 	 * Pointer to the context this block interface belongs to.
@@ -170,6 +177,11 @@ struct td_xenblkif {
     unsigned n_reqs_bufcache_free;
     event_id_t reqs_bufcache_evtid;
 
+    /**
+     * Guest grants kept mapped when the front-end uses persistent grants.
+     */
+    struct td_pgrant_pool pgrants;
+
 	bool dead;
 
 	struct {
@@ -215,6 +227,7 @@ struct td_xenblkif {
  *
  * @param domid the ID of the guest domain
  * @param devid the device ID
+ * @param queue the queue the ring serves, 0 for single-queue front-ends
  * @param grefs the grant references
  * @param order number of grant references
  * @param port event channel port of the guest domain to use for ring
@@ -222,17 +235,20 @@ struct td_xenblkif {
  * @param proto protocol (native, x86, or x64)
  * @param poll_duration polling duration (microseconds; 0 means no polling)
  * @param poll_idle_threshold CPU threshold above which we permit polling
+ * @param persistent_grants whether the front-end uses persistent grants
  * @param pool name of the context
  * @param vbd the VBD
  * @returns 0 on success
  */
 int
-tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
+tapdisk_xenblkif_connect(domid_t domid, int devid, int queue,
+        const grant_ref_t * grefs,
         int order, evtchn_port_t port, int proto, int poll_duration,
-        int poll_idle_threshold, const char *pool, td_vbd_t * vbd);
+        int poll_idle_threshold, bool persistent_grants, const char *pool,
+        td_vbd_t * vbd);
 
 /**
- * Disconnects the tapdisk from the shared ring.
+ * Disconnects the tapdisk from the shared rings of all queues of the VBD.
  *
  * @param domid the domain ID of the guest domain
  * @param devid the device ID of the VBD
@@ -256,7 +272,7 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif);
 /**
  * Searches all block interfaces in all contexts for a block interface
  * having the specified domain and device ID. Dead block interfaces are
- * ignored.
+ * ignored. For multi-queue VBDs any of the queues may be returned.
  *
  * @param domid the domain ID
  * @param devid the device ID
@@ -265,6 +281,13 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif);
 struct td_xenblkif *
 tapdisk_xenblkif_find(const domid_t domid, const int devid);
 
+/**
+ * Like tapdisk_xenblkif_find, but only matches the specified queue.
+ */
+struct td_xenblkif *
+tapdisk_xenblkif_find_queue(const domid_t domid, const int devid,
+        const int queue);
+
 /**
  * Returns the event ID associated with the event channel. Since the event
  * channel can be shared by multiple block interfaces, the event ID will be
@@ -138,6 +138,38 @@ xenio_pending_blkif(struct td_xenio_ctx * const ctx)
         dst->seg[i] = src->seg[i];              \
 }
 
+/*
+ * NB. the operation is already known to be BLKIF_OP_INDIRECT, don't read it
+ * again from the ring as the guest may have changed it meanwhile.
+ */
+#define blkif_get_req_indirect(dst, src)                                \
+{                                                                       \
+    blkif_request_indirect_t *ind = (blkif_request_indirect_t *)dst;    \
+    int i;                                                              \
+    ind->operation = BLKIF_OP_INDIRECT;                                 \
+    ind->indirect_op = src->indirect_op;                                \
+    ind->nr_segments = src->nr_segments;                                \
+    ind->handle = src->handle;                                          \
+    ind->id = src->id;                                                  \
+    ind->sector_number = src->sector_number;                            \
+    for (i = 0; i < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; i++)          \
+        ind->indirect_grefs[i] = src->indirect_grefs[i];                \
+}
+
+/*
+ * NB. as above, the operation is already known to be BLKIF_OP_DISCARD.
+ */
+#define blkif_get_req_discard(dst, src)                                 \
+{                                                                       \
+    blkif_request_discard_t *dis = (blkif_request_discard_t *)dst;      \
+    dis->operation = BLKIF_OP_DISCARD;                                  \
+    dis->flag = src->flag;                                              \
+    dis->handle = src->handle;                                          \
+    dis->id = src->id;                                                  \
+    dis->sector_number = src->sector_number;                            \
+    dis->nr_sectors = src->nr_sectors;                                  \
+}
+
 /**
  * Utility function that retrieves a request using @idx as the ring index,
  * copying it to the @dst in a H/W independent way.
@@ -170,7 +202,14 @@ xenio_blkif_get_request(struct td_xenblkif * const blkif,
             {
                 blkif_x86_32_request_t *src;
                 src = RING_GET_REQUEST(&rings->x86_32, idx);
-                blkif_get_req(dst, src);
+                if (src->operation == BLKIF_OP_INDIRECT) {
+                    blkif_x86_32_request_indirect_t *isrc = (void *)src;
+                    blkif_get_req_indirect(dst, isrc);
+                } else if (src->operation == BLKIF_OP_DISCARD) {
+                    blkif_x86_32_request_discard_t *dsrc = (void *)src;
+                    blkif_get_req_discard(dst, dsrc);
+                } else
+                    blkif_get_req(dst, src);
                 break;
             }
 
@@ -178,7 +217,14 @@ xenio_blkif_get_request(struct td_xenblkif * const blkif,
             {
                 blkif_x86_64_request_t *src;
                 src = RING_GET_REQUEST(&rings->x86_64, idx);
-                blkif_get_req(dst, src);
+                if (src->operation == BLKIF_OP_INDIRECT) {
+                    blkif_x86_64_request_indirect_t *isrc = (void *)src;
+                    blkif_get_req_indirect(dst, isrc);
+                } else if (src->operation == BLKIF_OP_DISCARD) {
+                    blkif_x86_64_request_discard_t *dsrc = (void *)src;
+                    blkif_get_req_discard(dst, dsrc);
+                } else
+                    blkif_get_req(dst, src);
                 break;
             }
 
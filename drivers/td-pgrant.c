@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "blktap-xenif.h"
+#include "debug.h"
+#include "tapdisk-log.h"
+#include "td-pgrant.h"
+#include "td-blkif.h"
+#include "td-ctx.h"
+
+static unsigned int
+td_pgrant_pool_size(void)
+{
+    const char *size;
+    int n;
+
+    size = getenv("TAPDISK3_PERSISTENT_GRANTS");
+    if (!size)
+        return TD_PGRANT_POOL_SIZE;
+
+    n = atoi(size);
+    return n > 0 ? n : 0;
+}
+
+int
+td_pgrant_pool_init(struct td_xenblkif *blkif)
+{
+    struct td_pgrant_pool *pool = &blkif->pgrants;
+    unsigned int i, buckets;
+
+    INIT_LIST_HEAD(&pool->lru);
+    INIT_LIST_HEAD(&pool->free);
+    pool->n_mapped = 0;
+
+    pool->size = td_pgrant_pool_size();
+    if (!pool->size)
+        return 0;
+
+    for (buckets = 1; buckets < pool->size; buckets <<= 1)
+        ;
+    pool->hash_mask = buckets - 1;
+
+    pool->grants = calloc(pool->size, sizeof(*pool->grants));
+    pool->hash = calloc(buckets, sizeof(*pool->hash));
+    if (!pool->grants || !pool->hash) {
+        free(pool->grants);
+        free(pool->hash);
+        pool->grants = NULL;
+        pool->hash = NULL;
+        pool->size = 0;
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < pool->size; i++)
+        list_add_tail(&pool->grants[i].entry, &pool->free);
+
+    RING_DEBUG(blkif, "persistent grants enabled, pool of %u\n", pool->size);
+
+    return 0;
+}
+
+static void
+td_pgrant_unmap(struct td_xenblkif *blkif, struct td_pgrant *pg)
+{
+    struct td_pgrant_pool *pool = &blkif->pgrants;
+    struct td_pgrant **pp;
+    int err;
+
+    for (pp = &pool->hash[pg->gref & pool->hash_mask]; *pp != pg;
+            pp = &(*pp)->hnext)
+        ASSERT(*pp);
+    *pp = pg->hnext;
+
+    err = xengnttab_unmap(blkif->ctx->xcg_handle, pg->addr, 1);
+    if (unlikely(err))
+        RING_ERR(blkif, "failed to unmap persistent grant %u: %s\n",
+                pg->gref, strerror(errno));
+
+    pg->addr = NULL;
+    pg->hnext = NULL;
+    list_move(&pg->entry, &pool->free);
+    pool->n_mapped--;
+    blkif->stats.pgrants.unmaps++;
+}
+
+void
+td_pgrant_pool_free(struct td_xenblkif *blkif)
+{
+    struct td_pgrant_pool *pool = &blkif->pgrants;
+    struct td_pgrant *pg, *tmp;
+
+    if (!pool->grants)
+        return;
+
+    list_for_each_entry_safe(pg, tmp, &pool->lru, entry)
+        td_pgrant_unmap(blkif, pg);
+
+    free(pool->grants);
+    free(pool->hash);
+    pool->grants = NULL;
+    pool->hash = NULL;
+    pool->size = 0;
+}
+
+void *
+td_pgrant_get(struct td_xenblkif *blkif, grant_ref_t gref)
+{
+    struct td_pgrant_pool *pool = &blkif->pgrants;
+    struct td_pgrant *pg;
+    void *addr;
+
+    if (!pool->size)
+        return NULL;
+
+    for (pg = pool->hash[gref & pool->hash_mask]; pg; pg = pg->hnext)
+        if (pg->gref == gref) {
+            list_move(&pg->entry, &pool->lru);
+            blkif->stats.pgrants.hits++;
+            return pg->addr;
+        }
+
+    blkif->stats.pgrants.misses++;
+
+    /*
+     * Persistent grants are always mapped read-write, as blkfront grants
+     * them. A front-end that grants read-only gets grant copies instead.
+     */
+    addr = xengnttab_map_grant_ref(blkif->ctx->xcg_handle, blkif->domid,
+            gref, PROT_READ | PROT_WRITE);
+    if (unlikely(!addr)) {
+        blkif->stats.pgrants.errors++;
+        return NULL;
+    }
+
+    if (list_empty(&pool->free))
+        td_pgrant_unmap(blkif,
+                list_entry(pool->lru.prev, struct td_pgrant, entry));
+
+    pg = list_entry(pool->free.next, struct td_pgrant, entry);
+    pg->gref = gref;
+    pg->addr = addr;
+    pg->hnext = pool->hash[gref & pool->hash_mask];
+    pool->hash[gref & pool->hash_mask] = pg;
+    list_move(&pg->entry, &pool->lru);
+    pool->n_mapped++;
+
+    return addr;
+}
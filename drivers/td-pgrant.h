@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TD_PGRANT_H__
+#define __TD_PGRANT_H__
+
+#include <xen/grant_table.h>
+
+#include "list.h"
+
+struct td_xenblkif;
+
+/*
+ * Default number of guest grants a block interface keeps mapped when the
+ * front-end uses persistent grants, same as blkback.
+ */
+#define TD_PGRANT_POOL_SIZE 1056
+
+/**
+ * A guest grant mapped into the tapdisk's address space.
+ */
+struct td_pgrant {
+    grant_ref_t gref;
+    void *addr;
+
+    /**
+     * Next grant in the same hash bucket.
+     */
+    struct td_pgrant *hnext;
+
+    /**
+     * Position in the LRU list, or in the free list when not mapped.
+     */
+    struct list_head entry;
+};
+
+/**
+ * Persistently mapped guest grants of a block interface, with least recently
+ * used ones unmapped first once the pool is full.
+ */
+struct td_pgrant_pool {
+    struct td_pgrant *grants;
+    struct td_pgrant **hash;
+    unsigned int hash_mask;
+
+    /**
+     * Mapped grants, most recently used first.
+     */
+    struct list_head lru;
+    struct list_head free;
+
+    unsigned int size;
+    unsigned int n_mapped;
+};
+
+/**
+ * Sets up the persistent grant pool of a block interface. The pool size
+ * can be overridden with TAPDISK3_PERSISTENT_GRANTS.
+ *
+ * @returns 0 on success, -errno otherwise
+ */
+int
+td_pgrant_pool_init(struct td_xenblkif *blkif);
+
+/**
+ * Unmaps all grants and releases the pool.
+ */
+void
+td_pgrant_pool_free(struct td_xenblkif *blkif);
+
+/**
+ * Returns the address the guest grant is mapped at, mapping it if
+ * necessary. Returns NULL if the pool is disabled or the grant cannot be
+ * mapped, in which case the caller has to fall back to grant copy.
+ */
+void *
+td_pgrant_get(struct td_xenblkif *blkif, grant_ref_t gref);
+
+#endif /* __TD_PGRANT_H__ */
@@ -121,7 +121,7 @@ td_xenblkif_bufcache_free(struct td_xenblkif * const blkif)
 
     while (blkif->n_reqs_bufcache_free > TD_REQS_BUFCACHE_MIN){
         munmap(blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free],
-               (size_t)BLKIF_MAX_BUFFER_SEGMENTS_PER_REQUEST << PAGE_SHIFT);
+               (size_t)TD_REQ_BUFFER_SIZE);
     }
 }
 
@@ -196,8 +196,10 @@ tapdisk_xenblkif_free_request(struct td_xenblkif * const blkif,
 
     blkif->reqs_free[blkif->ring_size - (++blkif->n_reqs_free)] = &tapreq->msg;
 
-	if (likely(tapreq->msg.nr_segments))
+	if (likely(tapreq->vma)) {
 	    td_xenblkif_bufcache_put(blkif, tapreq->vma);
+	    tapreq->vma = NULL;
+	}
 }
 
 /**
@@ -339,6 +341,16 @@ blkif_rq_wr(blkif_request_t const * const msg)
 }
 
 
+/**
+ * Tells whether the request is a discard.
+ */
+static inline bool
+blkif_rq_discard(blkif_request_t const * const msg)
+{
+	return BLKIF_OP_DISCARD == msg->operation;
+}
+
+
 /**
  * Tells whether the request requires data to transferred.
  */
@@ -349,91 +361,177 @@ blkif_rq_data(blkif_request_t const * const msg)
 }
 
 
+/**
+ * Issues a grant copy prepared in tapreq->gcopy_segs and checks the status of
+ * each segment.
+ */
+static int
+guest_grant_copy(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq,
+        struct ioctl_gntdev_grant_copy * const gcopy)
+{
+    unsigned int i;
+    long err;
+
+    err = -ioctl(blkif->ctx->gntdev_fd, IOCTL_GNTDEV_GRANT_COPY, gcopy);
+    if (err) {
+        err = -errno;
+        RING_ERR(blkif, "failed to grant-copy request %"PRIu64" "
+                "(%u segments): %s\n", tapreq->msg.id,
+                gcopy->count, strerror(-err));
+        return err;
+    }
+
+	for (i = 0; i < gcopy->count; i++) {
+		struct gntdev_grant_copy_segment *gcopy_seg = &gcopy->segments[i];
+		if (gcopy_seg->status != GNTST_okay) {
+			/*
+			 * TODO use gnttabop_error for reporting errors, defined in
+			 * xen/extras/mini-os/include/gnttab.h (header not available to
+			 * user space)
+			 */
+			RING_ERR(blkif, "req %lu: failed to grant-copy segment %d: %d\n",
+                    tapreq->msg.id, i, gcopy_seg->status);
+			return -EIO;
+		}
+	}
+
+    return 0;
+}
+
+
 static int
 guest_copy2(struct td_xenblkif * const blkif,
         struct td_xenblkif_req * const tapreq /* TODO rename to req */) {
 
-    int i = 0;
-    long err = 0;
+    int i = 0, n = 0;
     struct ioctl_gntdev_grant_copy gcopy;
 
     ASSERT(blkif);
     ASSERT(blkif->ctx);
     ASSERT(tapreq);
     ASSERT(blkif_rq_data(&tapreq->msg));
-	ASSERT(tapreq->msg.nr_segments > 0);
-	ASSERT(tapreq->msg.nr_segments <= ARRAY_SIZE(tapreq->gcopy_segs));
+	ASSERT(tapreq->nr_segments > 0);
+	ASSERT(tapreq->nr_segments <= ARRAY_SIZE(tapreq->gcopy_segs));
+
+    for (i = 0; i < tapreq->nr_segments; i++) {
+        struct blkif_request_segment *blkif_seg = &tapreq->seg[i];
+        struct gntdev_grant_copy_segment *gcopy_seg;
+        const size_t offset = blkif_seg->first_sect << SECTOR_SHIFT;
+        const size_t len = (blkif_seg->last_sect - blkif_seg->first_sect + 1)
+            << SECTOR_SHIFT;
+        void *buf = tapreq->vma + (i << PAGE_SHIFT) + offset;
+        void *page;
+
+        /*
+         * Persistently mapped grants are copied directly, the rest go
+         * through a single grant copy.
+         */
+        page = td_pgrant_get(blkif, blkif_seg->gref);
+        if (page) {
+            if (blkif_rq_wr(&tapreq->msg))
+                memcpy(buf, page + offset, len);
+            else
+                memcpy(page + offset, buf, len);
+            continue;
+        }
 
-    for (i = 0; i < tapreq->msg.nr_segments; i++) {
-        struct blkif_request_segment *blkif_seg = &tapreq->msg.seg[i];
-        struct gntdev_grant_copy_segment *gcopy_seg = &tapreq->gcopy_segs[i];
+        gcopy_seg = &tapreq->gcopy_segs[n++];
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
         if (blkif_rq_wr(&tapreq->msg)) {
             /* copy from guest */
-            gcopy_seg->dest.virt = tapreq->vma + (i << PAGE_SHIFT)
-                + (blkif_seg->first_sect << SECTOR_SHIFT);
+            gcopy_seg->dest.virt = buf;
             gcopy_seg->source.foreign.ref = blkif_seg->gref;
-            gcopy_seg->source.foreign.offset = blkif_seg->first_sect << SECTOR_SHIFT;
+            gcopy_seg->source.foreign.offset = offset;
             gcopy_seg->source.foreign.domid = blkif->domid;
             gcopy_seg->flags = GNTCOPY_source_gref;
         } else {
             /* copy to guest */
-            gcopy_seg->source.virt = tapreq->vma + (i << PAGE_SHIFT)
-                + (blkif_seg->first_sect << SECTOR_SHIFT);
+            gcopy_seg->source.virt = buf;
             gcopy_seg->dest.foreign.ref = blkif_seg->gref;
-            gcopy_seg->dest.foreign.offset = blkif_seg->first_sect << SECTOR_SHIFT;
+            gcopy_seg->dest.foreign.offset = offset;
             gcopy_seg->dest.foreign.domid = blkif->domid;
             gcopy_seg->flags = GNTCOPY_dest_gref;
         }
-
-        gcopy_seg->len = (blkif_seg->last_sect
-                - blkif_seg->first_sect
-                + 1)
-            << SECTOR_SHIFT;
-    }
+        gcopy_seg->len = len;
 #else
-        gcopy_seg->iov.iov_base = tapreq->vma + (i << PAGE_SHIFT)
-            + (blkif_seg->first_sect << SECTOR_SHIFT);
-        gcopy_seg->iov.iov_len = (blkif_seg->last_sect
-                - blkif_seg->first_sect
-                + 1)
-            << SECTOR_SHIFT;
+        gcopy_seg->iov.iov_base = buf;
+        gcopy_seg->iov.iov_len = len;
         gcopy_seg->ref = blkif_seg->gref;
-        gcopy_seg->offset = blkif_seg->first_sect << SECTOR_SHIFT;
+        gcopy_seg->offset = offset;
+#endif
     }
 
+    if (!n)
+        return 0;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
     gcopy.dir = blkif_rq_wr(&tapreq->msg);
     gcopy.domid = blkif->domid;
 #endif
-    gcopy.count = tapreq->msg.nr_segments;
+    gcopy.count = n;
 	gcopy.segments = tapreq->gcopy_segs;
 
-    err = -ioctl(blkif->ctx->gntdev_fd, IOCTL_GNTDEV_GRANT_COPY, &gcopy);
-    if (err) {
-        err = -errno;
-        RING_ERR(blkif, "failed to grant-copy request %"PRIu64" "
-                "(%d segments): %s\n", tapreq->msg.id,
-                tapreq->msg.nr_segments, strerror(-err));
-        goto out;
+    return guest_grant_copy(blkif, tapreq, &gcopy);
+}
+
+
+/**
+ * Copies the segment descriptors of an indirect request from the guest's
+ * indirect pages into tapreq->indirect_segs.
+ */
+static int
+guest_copy_indirect(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq,
+        const grant_ref_t * const grefs, const int nr_segs)
+{
+    struct ioctl_gntdev_grant_copy gcopy;
+    size_t left = nr_segs * sizeof(struct blkif_request_segment);
+    void *dst = tapreq->indirect_segs;
+    int i, n = 0, nr_pages = BLKIF_INDIRECT_PAGES(nr_segs);
+
+    ASSERT(nr_pages <= BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST);
+
+    for (i = 0; i < nr_pages; i++) {
+        struct gntdev_grant_copy_segment *gcopy_seg;
+        size_t len = left < BLKIF_INDIRECT_PAGE_SIZE ?
+            left : BLKIF_INDIRECT_PAGE_SIZE;
+        void *page;
+
+        page = td_pgrant_get(blkif, grefs[i]);
+        if (page)
+            memcpy(dst, page, len);
+        else {
+            gcopy_seg = &tapreq->gcopy_segs[n++];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+            gcopy_seg->dest.virt = dst;
+            gcopy_seg->source.foreign.ref = grefs[i];
+            gcopy_seg->source.foreign.offset = 0;
+            gcopy_seg->source.foreign.domid = blkif->domid;
+            gcopy_seg->flags = GNTCOPY_source_gref;
+            gcopy_seg->len = len;
+#else
+            gcopy_seg->iov.iov_base = dst;
+            gcopy_seg->iov.iov_len = len;
+            gcopy_seg->ref = grefs[i];
+            gcopy_seg->offset = 0;
+#endif
+        }
+        dst += len;
+        left -= len;
     }
 
-	for (i = 0; i < tapreq->msg.nr_segments; i++) {
-		struct gntdev_grant_copy_segment *gcopy_seg = &tapreq->gcopy_segs[i];
-		if (gcopy_seg->status != GNTST_okay) {
-			/*
-			 * TODO use gnttabop_error for reporting errors, defined in
-			 * xen/extras/mini-os/include/gnttab.h (header not available to
-			 * user space)
-			 */
-			RING_ERR(blkif, "req %lu: failed to grant-copy segment %d: %d\n",
-                    tapreq->msg.id, i, gcopy_seg->status);
-			err = -EIO;
-			goto out;
-		}
-	}
+    if (!n)
+        return 0;
 
-out:
-    return err;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+    gcopy.dir = 1; /* from the guest */
+    gcopy.domid = blkif->domid;
+#endif
+    gcopy.count = n;
+    gcopy.segments = tapreq->gcopy_segs;
+
+    return guest_grant_copy(blkif, tapreq, &gcopy);
 }
 
 
@@ -496,8 +594,10 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 				sum = &blkif->stats.xenvbd->st_rd_sum_usecs;
 				max = &blkif->stats.xenvbd->st_rd_max_usecs;
 			}
-			blkif->vbd_stats.stats->read_reqs_completed++;
-			ticks = &blkif->vbd_stats.stats->read_total_ticks;
+			if (likely(blkif->vbd_stats.stats)) {
+				blkif->vbd_stats.stats->read_reqs_completed++;
+				ticks = &blkif->vbd_stats.stats->read_total_ticks;
+			}
 			if (likely(!err)) {
 				_err = guest_copy2(blkif, tapreq);
 				if (unlikely(_err)) {
@@ -512,8 +612,10 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 				sum = &blkif->stats.xenvbd->st_wr_sum_usecs;
 				max = &blkif->stats.xenvbd->st_wr_max_usecs;
 			}
-			blkif->vbd_stats.stats->write_reqs_completed++;
-			ticks = &blkif->vbd_stats.stats->write_total_ticks;
+			if (likely(blkif->vbd_stats.stats)) {
+				blkif->vbd_stats.stats->write_reqs_completed++;
+				ticks = &blkif->vbd_stats.stats->write_total_ticks;
+			}
 		}
 
 		if (likely(cnt)) {
@@ -521,7 +623,8 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 			long long interval;
 			gettimeofday(&now, NULL);
 			interval = timeval_to_us(&now) - timeval_to_us(&tapreq->ts);
-			*ticks += interval;
+			if (likely(ticks))
+				*ticks += interval;
 			if (interval > *max)
 				*max = interval;
 
@@ -591,6 +694,40 @@ out:
  * @param token token previously associated with this request
  * @param final TODO ?
  */
+static inline void
+__tapdisk_xenblkif_request_cb(struct td_vbd_request * const vreq,
+        const int error, void * const token, const int final);
+
+
+/**
+ * Sets up the next chunk of a discard, starting at @sec, as the request's
+ * td_vbd_request_t.
+ */
+static void
+tapdisk_xenblkif_prep_discard(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req, const blkif_sector_t sec)
+{
+    td_vbd_request_t *vreq = &req->vreq;
+    blkif_sector_t end;
+
+    end = (sec / TD_REQ_DISCARD_SECS + 1) * TD_REQ_DISCARD_SECS;
+    if (end > req->discard_end)
+        end = req->discard_end;
+
+    memset(vreq, 0, sizeof(*vreq));
+    req->iov[0].base = NULL;
+    req->iov[0].secs = end - sec;
+
+    vreq->op = TD_OP_DISCARD;
+    vreq->sec = sec;
+    vreq->iov = req->iov;
+    vreq->iovcnt = 1;
+    vreq->name = req->name;
+    vreq->token = blkif;
+    vreq->cb = __tapdisk_xenblkif_request_cb;
+}
+
+
 static inline void
 __tapdisk_xenblkif_request_cb(struct td_vbd_request * const vreq,
         const int error, void * const token, const int final)
@@ -603,10 +740,31 @@ __tapdisk_xenblkif_request_cb(struct td_vbd_request * const vreq,
 
     tapreq = container_of(vreq, struct td_xenblkif_req, vreq);
 
+    /*
+     * Queue the next chunk of a discard behind whatever else arrived in the
+     * meantime. If this was the last completion of the batch, the responses
+     * the others left on the ring still have to go out.
+     */
+    if (blkif_rq_discard(&tapreq->msg) && !error && !blkif->dead) {
+        const blkif_sector_t next = vreq->sec + vreq->iov->secs;
+
+        if (next < tapreq->discard_end) {
+            if (final) {
+                xenio_blkif_put_response(blkif, NULL, 0, 1);
+                blkif->stats.kicks.out++;
+            }
+
+            tapdisk_xenblkif_prep_discard(blkif, tapreq, next);
+            if (likely(!tapdisk_vbd_queue_request(blkif->vbd, vreq)))
+                return;
+        }
+    }
+
     if (error) {
         if (likely(!blkif->dead)) {
             blkif->stats.errors.img++;
-            blkif->vbd_stats.stats->io_errors++;
+            if (likely(blkif->vbd_stats.stats))
+                blkif->vbd_stats.stats->io_errors++;
         }
     }
 
@@ -637,15 +795,17 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
         goto out;
     }
 
-    for (i = 0; i < req->msg.nr_segments; i++) {
-        struct blkif_request_segment *seg = &req->msg.seg[i];
+    for (i = 0; i < req->nr_segments; i++) {
+        struct blkif_request_segment *seg = &req->seg[i];
         req->gref[i] = seg->gref;
 
         /*
          * Note that first and last may be equal, which means only one sector
-         * must be transferred.
+         * must be transferred. Each segment's sectors must stay within its
+         * page, the last one would otherwise overrun the buffer.
          */
-        if (seg->last_sect < seg->first_sect) {
+        if (seg->last_sect < seg->first_sect ||
+                seg->last_sect >= (PAGE_SIZE >> SECTOR_SHIFT)) {
             RING_ERR(blkif, "req %lu: invalid sectors %d-%d\n",
                     req->msg.id, seg->first_sect, seg->last_sect);
             err = EINVAL;
@@ -666,12 +826,10 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
     last = NULL;
     page = req->vma;
 
-    for (i = 0; i < req->msg.nr_segments; i++) { /* for each segment */
-        struct blkif_request_segment *seg = &req->msg.seg[i];
+    for (i = 0; i < req->nr_segments; i++) { /* for each segment */
+        struct blkif_request_segment *seg = &req->seg[i];
         size_t size;
 
-        /* TODO check that first_sect/last_sect are within page */
-
         next = page + (seg->first_sect << SECTOR_SHIFT);
         size = seg->last_sect - seg->first_sect + 1;
 
@@ -725,6 +883,100 @@ out:
 }
 
 
+/**
+ * Fetches the segments of an indirect request from the guest and rewrites
+ * the request descriptor so that it looks like a direct one from then on.
+ *
+ * @param blkif the block interface
+ * @param req the request, whose msg holds a blkif_request_indirect_t
+ * @returns 0 on success, a positive error code otherwise
+ */
+static inline int
+tapdisk_xenblkif_parse_indirect(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    blkif_request_indirect_t *ind = (blkif_request_indirect_t *)&req->msg;
+    grant_ref_t grefs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+    const uint8_t op = ind->indirect_op;
+    const int nr_segs = ind->nr_segments;
+    const uint64_t id = ind->id;
+    const blkif_sector_t sector = ind->sector_number;
+    const blkif_vdev_t handle = ind->handle;
+    int err;
+
+    if (unlikely(op != BLKIF_OP_READ && op != BLKIF_OP_WRITE)) {
+        RING_ERR(blkif, "req %lu: invalid indirect request type %d\n",
+                id, op);
+        return EINVAL;
+    }
+
+    memcpy(grefs, ind->indirect_grefs, sizeof(grefs));
+
+    /*
+     * NB. ind aliases msg. From here on the request looks like a direct one
+     * carrying the real operation, which is also what the response echoes.
+     */
+    req->msg.operation = op;
+    req->msg.nr_segments = 0;
+    req->msg.handle = handle;
+    req->msg.id = id;
+    req->msg.sector_number = sector;
+
+    if (unlikely(!nr_segs || nr_segs > TD_REQ_MAX_SEGMENTS)) {
+        RING_ERR(blkif, "req %lu: bad number of indirect segments (%d)\n",
+                id, nr_segs);
+        return EINVAL;
+    }
+
+    err = guest_copy_indirect(blkif, req, grefs, nr_segs);
+    if (unlikely(err))
+        return -err;
+
+    req->seg = req->indirect_segs;
+    req->nr_segments = nr_segs;
+
+    blkif->stats.indirect++;
+
+    return 0;
+}
+
+
+/**
+ * Turns a discard into the td_vbd_request_t for its first chunk.
+ *
+ * @returns 0 on success, a positive error code otherwise
+ */
+static inline int
+tapdisk_xenblkif_parse_discard(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    blkif_request_discard_t *dis = (blkif_request_discard_t *)&req->msg;
+    const blkif_sector_t sector = dis->sector_number;
+    const uint64_t nr_sectors = dis->nr_sectors;
+
+    if (likely(blkif->stats.xenvbd))
+        blkif->stats.xenvbd->st_ds_req++;
+
+    /* Timestamp before the requests leave the blkif layer */
+    gettimeofday(&req->ts, NULL);
+
+    if (unlikely(!nr_sectors || sector + nr_sectors < sector)) {
+        RING_ERR(blkif, "req %lu: invalid discard of %"PRIu64" sectors "
+                "at %"PRIu64"\n", dis->id, nr_sectors, sector);
+        return EINVAL;
+    }
+
+    req->discard_end = sector + nr_sectors;
+
+    snprintf(req->name, sizeof(req->name), "xenvbd-%d-%d.%"SCNx64"",
+             blkif->domid, blkif->devid, dis->id);
+
+    tapdisk_xenblkif_prep_discard(blkif, req, sector);
+
+    return 0;
+}
+
+
 /**
  * Initialises the standard tapdisk request (td_vbd_request_t) from the
  * intermediate ring request (td_xenblkif_req) in order to prepare it
@@ -740,7 +992,7 @@ static inline int
 tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
         struct td_xenblkif_req * const tapreq)
 {
-    int err = 0;
+    int err = 0, max_segs;
     td_vbd_request_t *vreq;
 
     ASSERT(tapreq);
@@ -750,7 +1002,22 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     memset(vreq, 0, sizeof(*vreq));
 
 	tapreq->vma = NULL;
+	tapreq->nr_segments = 0;
+
+    if (tapreq->msg.operation == BLKIF_OP_INDIRECT) {
+        err = tapdisk_xenblkif_parse_indirect(blkif, tapreq);
+        if (unlikely(err))
+            goto out;
+        max_segs = TD_REQ_MAX_SEGMENTS;
+    } else {
+        tapreq->seg = tapreq->msg.seg;
+        tapreq->nr_segments = tapreq->msg.nr_segments;
+        max_segs = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+    }
+
     switch (tapreq->msg.operation) {
+    case BLKIF_OP_DISCARD:
+        return tapdisk_xenblkif_parse_discard(blkif, tapreq);
     case BLKIF_OP_READ:
         if (likely(blkif->stats.xenvbd))
 			blkif->stats.xenvbd->st_rd_req++;
@@ -780,16 +1047,16 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     /*
      * Check that the number of segments is sane.
      */
-    if (unlikely((tapreq->msg.nr_segments == 0 &&
+    if (unlikely((tapreq->nr_segments == 0 &&
                 tapreq->msg.operation != BLKIF_OP_WRITE_BARRIER) ||
-            tapreq->msg.nr_segments > BLKIF_MAX_BUFFER_SEGMENTS_PER_REQUEST)) {
+            tapreq->nr_segments > max_segs)) {
         RING_ERR(blkif, "req %lu: bad number of segments in request (%d)\n",
-                tapreq->msg.id, tapreq->msg.nr_segments);
+                tapreq->msg.id, tapreq->nr_segments);
         err = EINVAL;
         goto out;
     }
 
-    if (likely(tapreq->msg.nr_segments))
+    if (likely(tapreq->nr_segments))
         err = tapdisk_xenblkif_parse_request(blkif, tapreq);
     /*
      * If we only got one request from the ring and that was a barrier one,
@@ -839,7 +1106,7 @@ tapdisk_xenblkif_queue_request(struct td_xenblkif * const blkif,
         return err;
     }
 
-	if (likely(tapreq->msg.nr_segments)) {
+	if (likely(tapreq->nr_segments) || blkif_rq_discard(&tapreq->msg)) {
 		err = tapdisk_vbd_queue_request(blkif->vbd, &tapreq->vreq);
 		if (unlikely(err)) {
 			/* TODO log error */
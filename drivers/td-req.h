@@ -38,7 +38,22 @@
 #include <xen/gntdev.h>
 #include "td-blkif.h"
 
-#define TD_REQ_BUFFER_SIZE (BLKIF_MAX_BUFFER_SEGMENTS_PER_REQUEST << PAGE_SHIFT)
+/*
+ * Largest request we accept, either direct or through indirect descriptors.
+ */
+#define TD_REQ_MAX_SEGMENTS BLKIF_MAX_INDIRECT_SEGMENTS_PER_REQUEST
+#if TD_REQ_MAX_SEGMENTS != TD_MAX_SEGMENTS_PER_REQUEST
+#error "TD_MAX_SEGMENTS_PER_REQUEST does not match the blkif limit"
+#endif
+#define TD_REQ_BUFFER_SIZE (TD_REQ_MAX_SEGMENTS << PAGE_SHIFT)
+
+/*
+ * Discards are passed on in aligned chunks of at most this many sectors, one
+ * chunk at a time, so that a guest-wide trim takes turns with the rest of
+ * the I/O instead of holding it up. A multiple of the VHD block size, so
+ * that the chunks don't split blocks a discard covers.
+ */
+#define TD_REQ_DISCARD_SECS (16 << (20 - SECTOR_SHIFT))
 
 /**
  * Representation of the intermediate request used to retrieve a request from
@@ -77,16 +92,35 @@ struct td_xenblkif_req {
 
     struct timeval ts;
 
+    /**
+     * The segments of the request, either msg.seg or, for indirect requests,
+     * indirect_segs, and how many of them there are.
+     */
+    struct blkif_request_segment *seg;
+    int nr_segments;
+
+    /**
+     * Segments copied from the guest's indirect pages. The operation, id, and
+     * sector of an indirect request are moved to msg, so past parsing it
+     * looks like a direct one.
+     */
+    struct blkif_request_segment indirect_segs[TD_REQ_MAX_SEGMENTS];
+
     /**
      * The scatter/gather list td_vbd_request_t.iov points to.
      */
-    struct td_iovec iov[BLKIF_MAX_BUFFER_SEGMENTS_PER_REQUEST];
+    struct td_iovec iov[TD_REQ_MAX_SEGMENTS];
 
-    grant_ref_t gref[BLKIF_MAX_BUFFER_SEGMENTS_PER_REQUEST];
+    grant_ref_t gref[TD_REQ_MAX_SEGMENTS];
     int prot;
 
+    /**
+     * For discards, the sector after the last one to discard.
+     */
+    blkif_sector_t discard_end;
+
 	struct gntdev_grant_copy_segment
-		gcopy_segs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+		gcopy_segs[TD_REQ_MAX_SEGMENTS];
 };
 
 struct td_xenblkif;
@@ -45,6 +45,7 @@ tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
     tapdisk_stats_field(st, "pool", "s", blkif->ctx->pool);
     tapdisk_stats_field(st, "domid", "d", blkif->domid);
     tapdisk_stats_field(st, "devid", "d", blkif->devid);
+    tapdisk_stats_field(st, "queue", "d", blkif->queue);
 
     tapdisk_stats_field(st, "reqs", "[");
     tapdisk_stats_val(st, "llu", blkif->stats.reqs.in);
@@ -56,6 +57,19 @@ tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
     tapdisk_stats_val(st, "llu", blkif->stats.kicks.out);
     tapdisk_stats_leave(st, ']');
 
+    tapdisk_stats_field(st, "indirect", "llu", blkif->stats.indirect);
+
+    if (blkif->pgrants.size) {
+        tapdisk_stats_field(st, "pgrants", "{");
+        tapdisk_stats_field(st, "size", "u", blkif->pgrants.size);
+        tapdisk_stats_field(st, "mapped", "u", blkif->pgrants.n_mapped);
+        tapdisk_stats_field(st, "hits", "llu", blkif->stats.pgrants.hits);
+        tapdisk_stats_field(st, "misses", "llu", blkif->stats.pgrants.misses);
+        tapdisk_stats_field(st, "unmaps", "llu", blkif->stats.pgrants.unmaps);
+        tapdisk_stats_field(st, "errors", "llu", blkif->stats.pgrants.errors);
+        tapdisk_stats_leave(st, '}');
+    }
+
     tapdisk_stats_field(st, "errors", "{");
     tapdisk_stats_field(st, "msg", "llu", blkif->stats.errors.msg);
     tapdisk_stats_field(st, "map", "llu", blkif->stats.errors.map);
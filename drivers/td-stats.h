@@ -42,6 +42,20 @@ struct td_xenblkif_stats {
         unsigned long long in;
         unsigned long long out;
     } kicks;
+    /**
+     * Requests that came in through indirect descriptors.
+     */
+    unsigned long long indirect;
+    /**
+     * Persistent grant pool lookups, grants unmapped to make room, and
+     * grants that could not be mapped and were grant-copied instead.
+     */
+    struct {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long unmaps;
+        unsigned long long errors;
+    } pgrants;
     struct {
         unsigned long long msg;
         unsigned long long map;
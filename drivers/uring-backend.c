@@ -0,0 +1,1015 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "tapdisk.h"
+#include "tapdisk-log.h"
+#include "tapdisk-server.h"
+#include "io-optimize.h"
+#include "uring-backend.h"
+#include "timeout-math.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+#include <linux/io_uring.h>
+
+#define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
+#define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+/*
+ * io_uring backend. Tiocbs are prepped as libaio iocbs, so io-optimize
+ * can merge them exactly as for libaio; each merged iocb then becomes
+ * one sqe. The ring fd itself is polled for completions, which are
+ * reaped straight off the cq ring.
+ *
+ * Files are registered lazily, on first use, into a sparse table.
+ * Closing an image retires the slots of the fds it closed (see
+ * uring_backend_forget_files), so a recycled fd number never hits a
+ * stale registration. Other images' slots are left alone: their sqes
+ * may still be waiting for the kernel, or the sqpoll thread.
+ *
+ * TAPDISK3_URING_SQPOLL=<ms> enables a kernel submission thread which
+ * idles out after <ms> milliseconds without work.
+ */
+
+#define URING_MAX_FILES        64
+#define URING_FILE_FREE        -1
+#define URING_FILE_STALE       -2     /* closed, still in the kernel table */
+#define URING_SQPOLL_IDLE_MAX  10000
+#define URING_RETRY_USECS      1000
+
+#define uring_backend_queue_empty(q) ((q)->queued == 0)
+#define uring_backend_queue_full(q)  \
+	(((q)->tiocbs_pending + (q)->queued) >= (q)->size)
+
+#define uring_ptr(ring, off)      ((void *)((char *)(ring) + (off)))
+#define uring_load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define uring_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct uring_sq {
+	unsigned             *khead;
+	unsigned             *ktail;
+	unsigned             *kring_mask;
+	unsigned             *kflags;
+	unsigned             *array;
+	struct io_uring_sqe  *sqes;
+	unsigned              tail;
+
+	void                 *ring;
+	size_t                ring_sz;
+	size_t                sqes_sz;
+};
+
+struct uring_cq {
+	unsigned             *khead;
+	unsigned             *ktail;
+	unsigned             *kring_mask;
+	struct io_uring_cqe  *cqes;
+
+	void                 *ring;
+	size_t                ring_sz;
+};
+
+typedef struct _uring_queue {
+	int                   size;
+
+	int                   ring_fd;
+	unsigned              flags;
+	int                   event_id;
+	int                   retry_id;    /* timer while sqes are refused */
+	struct uring_sq       sq;
+	struct uring_cq       cq;
+
+	struct opioctx        opioctx;
+
+	int                   queued;
+	struct iocb         **iocbs;
+	struct io_event      *events;
+
+	/* number of sqes pending in the ring */
+	int                   iocbs_pending;
+
+	/* number of tiocbs pending, larger due to request coalescing */
+	int                   tiocbs_pending;
+
+	struct tlist          deferred;
+	int                   tiocbs_deferred;
+
+	/* registered file table, by fd, or URING_FILE_FREE/STALE */
+	int                   files[URING_MAX_FILES];
+	int                   nr_files;    /* slots ever used, or -1 */
+	int                   nr_stale;
+
+	uint64_t              deferrals;
+	uint64_t              sqes;
+	uint64_t              enters;
+	uint64_t              wakeups;
+	uint64_t              retries;
+	uint64_t              fixed;
+} uring_queue;
+
+static inline int
+__uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned to_submit, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline void
+queue_tiocb(uring_queue *queue, struct tiocb *tiocb)
+{
+	struct iocb *iocb = &(tiocb->uiocb.io);
+
+	if (queue->queued) {
+		struct tiocb *prev = (struct tiocb *)
+			queue->iocbs[queue->queued - 1]->data;
+		prev->next = tiocb;
+	}
+
+	queue->iocbs[queue->queued++] = iocb;
+}
+
+static inline int
+deferred_tiocbs(uring_queue *queue)
+{
+	return (queue->deferred.head != NULL);
+}
+
+static inline void
+defer_tiocb(uring_queue *queue, struct tiocb *tiocb)
+{
+	struct tlist *list = &queue->deferred;
+
+	if (!list->head)
+		list->head = list->tail = tiocb;
+	else
+		list->tail = list->tail->next = tiocb;
+
+	queue->tiocbs_deferred++;
+	queue->deferrals++;
+}
+
+static inline void
+queue_deferred_tiocb(uring_queue *queue)
+{
+	struct tlist *list = &queue->deferred;
+
+	if (list->head) {
+		struct tiocb *tiocb = list->head;
+
+		list->head = tiocb->next;
+		if (!list->head)
+			list->tail = NULL;
+
+		queue_tiocb(queue, tiocb);
+		queue->tiocbs_deferred--;
+	}
+}
+
+static inline void
+queue_deferred_tiocbs(uring_queue *queue)
+{
+	while (!uring_backend_queue_full(queue) && deferred_tiocbs(queue))
+		queue_deferred_tiocb(queue);
+}
+
+/*
+ * td_complete may queue more tiocbs
+ */
+static void
+complete_tiocb(uring_queue *queue, struct tiocb *tiocb, unsigned long res)
+{
+	int err;
+	struct iocb *iocb = &(tiocb->uiocb.io);
+
+	if (res == iocb_nbytes(iocb))
+		err = 0;
+	else if ((int)res < 0)
+		err = (int)res;
+	else
+		err = -EIO;
+
+	tiocb->cb(tiocb->arg, tiocb, err);
+}
+
+static void
+complete_events(uring_queue *queue, int nr)
+{
+	struct io_event *ep;
+	struct tiocb *tiocb;
+	int i, split;
+
+	split = io_split(&queue->opioctx, queue->events, nr);
+
+	DBG("events: %d, tiocbs: %d\n", nr, split);
+
+	queue->iocbs_pending  -= nr;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = queue->events; i-- > 0; ep++) {
+		tiocb = ep->obj->data;
+		if (tiocb)
+			complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+uring_sqpoll_idle(void)
+{
+	const char *idle;
+	long ms;
+
+	idle = getenv("TAPDISK3_URING_SQPOLL");
+	if (!idle)
+		return 0;
+
+	ms = strtol(idle, NULL, 10);
+	if (ms <= 0)
+		return 0;
+
+	return ms > URING_SQPOLL_IDLE_MAX ? URING_SQPOLL_IDLE_MAX : ms;
+}
+
+static int
+uring_file_index(uring_queue *queue, int fd)
+{
+	struct io_uring_files_update up;
+	int i, slot, err;
+
+	slot = -1;
+	for (i = 0; i < queue->nr_files; i++) {
+		if (queue->files[i] == fd)
+			return i;
+		if (slot < 0 && queue->files[i] == URING_FILE_FREE)
+			slot = i;
+	}
+
+	if (queue->nr_files < 0)
+		return -1;
+
+	if (slot < 0) {
+		if (queue->nr_files == URING_MAX_FILES)
+			return -1;
+		slot = queue->nr_files;
+	}
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds    = (uintptr_t)&fd;
+
+	err = __uring_register(queue->ring_fd,
+			       IORING_REGISTER_FILES_UPDATE, &up, 1);
+	if (err < 0)
+		return -1;
+
+	queue->files[slot] = fd;
+	if (slot == queue->nr_files)
+		queue->nr_files++;
+
+	return slot;
+}
+
+static void
+uring_register_files(uring_queue *queue)
+{
+	int i, err;
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		queue->files[i] = URING_FILE_FREE;
+
+	err = __uring_register(queue->ring_fd, IORING_REGISTER_FILES,
+			       queue->files, URING_MAX_FILES);
+	if (err < 0) {
+		DPRINTF("io_uring: no registered files: %d\n", -errno);
+		queue->nr_files = -1;
+		return;
+	}
+
+	queue->nr_files = 0;
+}
+
+/*
+ * Drops stale slots from the kernel table, once no sqe waits in the
+ * ring, so that nothing the kernel has yet to read can name them. Until
+ * then they are neither matched nor reused.
+ */
+static void
+uring_clear_stale_files(uring_queue *queue)
+{
+	struct uring_sq *sq = &queue->sq;
+	struct io_uring_files_update up;
+	int i, fd = -1;
+
+	if (!queue->nr_stale)
+		return;
+
+	if (sq->tail != uring_load_acquire(sq->khead))
+		return;
+
+	for (i = 0; i < queue->nr_files; i++) {
+		if (queue->files[i] != URING_FILE_STALE)
+			continue;
+
+		memset(&up, 0, sizeof(up));
+		up.offset = i;
+		up.fds    = (uintptr_t)&fd;
+
+		if (__uring_register(queue->ring_fd,
+				     IORING_REGISTER_FILES_UPDATE,
+				     &up, 1) < 0) {
+			ERR(-errno, "io_uring: failed to drop file %d", i);
+			continue;
+		}
+
+		queue->files[i] = URING_FILE_FREE;
+		queue->nr_stale--;
+	}
+}
+
+/*
+ * Called once an image is closed, with its I/O drained: its fds are
+ * the registered ones that no longer are open.
+ */
+static void
+uring_backend_forget_files(tqueue q)
+{
+	uring_queue *queue = (uring_queue *)q;
+	int i, fd;
+
+	if (!queue || queue->nr_files <= 0)
+		return;
+
+	for (i = 0; i < queue->nr_files; i++) {
+		fd = queue->files[i];
+		if (fd < 0)
+			continue;
+
+		if (fcntl(fd, F_GETFD) == -1 && errno == EBADF) {
+			queue->files[i] = URING_FILE_STALE;
+			queue->nr_stale++;
+		}
+	}
+
+	uring_clear_stale_files(queue);
+}
+
+static int
+uring_probe_ops(uring_queue *queue)
+{
+	static const int ops[] = { IORING_OP_READV, IORING_OP_WRITEV,
+				   IORING_OP_READ, IORING_OP_WRITE };
+	struct io_uring_probe *probe;
+	size_t size;
+	int i, err;
+
+	size  = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (!probe)
+		return -ENOMEM;
+
+	err = __uring_register(queue->ring_fd, IORING_REGISTER_PROBE,
+			       probe, 256);
+	if (err < 0) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	for (i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			err = -EOPNOTSUPP;
+			goto out;
+		}
+	}
+
+	err = 0;
+
+out:
+	free(probe);
+	return err;
+}
+
+static void
+uring_unmap_rings(uring_queue *queue)
+{
+	if (queue->sq.sqes) {
+		munmap(queue->sq.sqes, queue->sq.sqes_sz);
+		queue->sq.sqes = NULL;
+	}
+
+	if (queue->cq.ring && queue->cq.ring != queue->sq.ring)
+		munmap(queue->cq.ring, queue->cq.ring_sz);
+	queue->cq.ring = NULL;
+
+	if (queue->sq.ring) {
+		munmap(queue->sq.ring, queue->sq.ring_sz);
+		queue->sq.ring = NULL;
+	}
+}
+
+static void *
+uring_mmap(int fd, size_t size, off_t offset)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static int
+uring_map_rings(uring_queue *queue, struct io_uring_params *p)
+{
+	struct uring_sq *sq = &queue->sq;
+	struct uring_cq *cq = &queue->cq;
+	unsigned i;
+
+	sq->ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	cq->ring_sz = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq->ring_sz > sq->ring_sz)
+			sq->ring_sz = cq->ring_sz;
+		cq->ring_sz = sq->ring_sz;
+	}
+
+	sq->ring = uring_mmap(queue->ring_fd, sq->ring_sz, IORING_OFF_SQ_RING);
+	if (!sq->ring)
+		return -errno;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		cq->ring = sq->ring;
+	else {
+		cq->ring = uring_mmap(queue->ring_fd, cq->ring_sz,
+				      IORING_OFF_CQ_RING);
+		if (!cq->ring)
+			return -errno;
+	}
+
+	sq->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+	sq->sqes    = uring_mmap(queue->ring_fd, sq->sqes_sz, IORING_OFF_SQES);
+	if (!sq->sqes)
+		return -errno;
+
+	sq->khead      = uring_ptr(sq->ring, p->sq_off.head);
+	sq->ktail      = uring_ptr(sq->ring, p->sq_off.tail);
+	sq->kring_mask = uring_ptr(sq->ring, p->sq_off.ring_mask);
+	sq->kflags     = uring_ptr(sq->ring, p->sq_off.flags);
+	sq->array      = uring_ptr(sq->ring, p->sq_off.array);
+	sq->tail       = *sq->ktail;
+
+	cq->khead      = uring_ptr(cq->ring, p->cq_off.head);
+	cq->ktail      = uring_ptr(cq->ring, p->cq_off.tail);
+	cq->kring_mask = uring_ptr(cq->ring, p->cq_off.ring_mask);
+	cq->cqes       = uring_ptr(cq->ring, p->cq_off.cqes);
+
+	/* sqe slots map 1:1 onto the submission array */
+	for (i = 0; i < p->sq_entries; i++)
+		sq->array[i] = i;
+
+	return 0;
+}
+
+static void
+uring_backend_destroy(uring_queue *queue)
+{
+	if (queue->event_id >= 0) {
+		tapdisk_server_unregister_event(queue->event_id);
+		queue->event_id = -1;
+	}
+
+	if (queue->retry_id >= 0) {
+		tapdisk_server_unregister_event(queue->retry_id);
+		queue->retry_id = -1;
+	}
+
+	uring_unmap_rings(queue);
+
+	if (queue->ring_fd >= 0) {
+		close(queue->ring_fd);
+		queue->ring_fd = -1;
+	}
+}
+
+static void uring_backend_event(event_id_t, char, void *);
+
+static int
+uring_backend_setup(uring_queue *queue, int qlen)
+{
+	struct io_uring_params p;
+	int err, idle;
+
+	memset(&p, 0, sizeof(p));
+
+	idle = uring_sqpoll_idle();
+	if (idle) {
+		p.flags         |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = idle;
+	}
+
+	queue->ring_fd = __uring_setup(qlen, &p);
+	if (queue->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	queue->flags = p.flags;
+
+	/* cq is sized at least twice the sq, it cannot overflow */
+	if (p.sq_entries < (unsigned)qlen) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = uring_map_rings(queue, &p);
+	if (err)
+		goto fail;
+
+	err = uring_probe_ops(queue);
+	if (err)
+		goto fail;
+
+	uring_register_files(queue);
+
+	queue->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      queue->ring_fd, TV_ZERO,
+					      uring_backend_event,
+					      queue);
+	err = queue->event_id;
+	if (err < 0)
+		goto fail;
+
+	DPRINTF("I/O queue driver: io_uring, %u entries%s\n",
+		p.sq_entries, idle ? ", sqpoll" : "");
+
+	return 0;
+
+fail:
+	ERR(err, "io_uring setup failed");
+	uring_backend_destroy(queue);
+	return err;
+}
+
+static void
+uring_prep_sqe(uring_queue *queue, struct iocb *io)
+{
+	struct uring_sq *sq = &queue->sq;
+	struct io_uring_sqe *sqe;
+	int idx;
+
+	sqe = &sq->sqes[sq->tail & *sq->kring_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	switch (io->aio_lio_opcode) {
+	case IO_CMD_PREAD:
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr   = (uintptr_t)io->u.c.buf;
+		sqe->len    = io->u.c.nbytes;
+		break;
+	case IO_CMD_PWRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->addr   = (uintptr_t)io->u.c.buf;
+		sqe->len    = io->u.c.nbytes;
+		break;
+	case IO_CMD_PREADV:
+		sqe->opcode = IORING_OP_READV;
+		sqe->addr   = (uintptr_t)io->u.v.vec;
+		sqe->len    = io->u.v.nr;
+		break;
+	case IO_CMD_PWRITEV:
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr   = (uintptr_t)io->u.v.vec;
+		sqe->len    = io->u.v.nr;
+		break;
+	default:
+		ASSERT(0);
+	}
+
+	sqe->off       = iocb_offset(io);
+	sqe->user_data = (uintptr_t)io;
+
+	idx = uring_file_index(queue, io->aio_fildes);
+	if (idx >= 0) {
+		sqe->fd     = idx;
+		sqe->flags |= IOSQE_FIXED_FILE;
+		queue->fixed++;
+	} else
+		sqe->fd     = io->aio_fildes;
+
+	sq->tail++;
+	queue->sqes++;
+}
+
+/*
+ * Take back sqes the kernel has not consumed yet and fail them.
+ */
+static void
+uring_fail_sqes(uring_queue *queue, int err)
+{
+	struct uring_sq *sq = &queue->sq;
+	struct io_uring_sqe *sqe;
+	struct io_event *ep;
+	unsigned head;
+	int nr = 0;
+
+	head = uring_load_acquire(sq->khead);
+
+	ERR(err, "io_uring_enter error: %u sqes failed", sq->tail - head);
+
+	while (sq->tail != head) {
+		sqe = &sq->sqes[--sq->tail & *sq->kring_mask];
+		ep  = &queue->events[nr++];
+		memset(ep, 0, sizeof(*ep));
+		ep->obj = (struct iocb *)(uintptr_t)sqe->user_data;
+		ep->res = err;
+	}
+
+	uring_store_release(sq->ktail, sq->tail);
+
+	complete_events(queue, nr);
+}
+
+static void uring_enter(uring_queue *);
+
+static void
+uring_backend_retry(event_id_t id, char mode, void *private)
+{
+	uring_queue *queue = private;
+
+	tapdisk_server_unregister_event(queue->retry_id);
+	queue->retry_id = -1;
+
+	uring_enter(queue);
+}
+
+/*
+ * The kernel refused the sqes for now. A completion still to come
+ * retries them from uring_backend_event; with none in flight, a timer
+ * has to.
+ */
+static void
+uring_enter_later(uring_queue *queue, unsigned to_submit)
+{
+	int id;
+
+	if (queue->iocbs_pending > (int)to_submit || queue->retry_id >= 0)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					   TV_USECS(URING_RETRY_USECS),
+					   uring_backend_retry, queue);
+	if (id < 0) {
+		if (!(queue->flags & IORING_SETUP_SQPOLL))
+			uring_fail_sqes(queue, id);
+		else
+			ERR(id, "io_uring retry timer failed");
+		return;
+	}
+
+	queue->retry_id = id;
+	queue->retries++;
+}
+
+static void
+uring_enter(uring_queue *queue)
+{
+	struct uring_sq *sq = &queue->sq;
+	unsigned to_submit, flags = 0;
+	int ret;
+
+again:
+	to_submit = sq->tail - uring_load_acquire(sq->khead);
+	if (!to_submit)
+		return;
+
+	if (queue->flags & IORING_SETUP_SQPOLL) {
+		/* order the tail store against the flags load */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!(uring_load_acquire(sq->kflags) & IORING_SQ_NEED_WAKEUP))
+			return;
+		flags |= IORING_ENTER_SQ_WAKEUP;
+		queue->wakeups++;
+	}
+
+	ret = __uring_enter(queue->ring_fd, to_submit, flags);
+	queue->enters++;
+
+	if (ret >= 0)
+		return;
+
+	ret = -errno;
+	switch (ret) {
+	case -EINTR:
+		goto again;
+	case -EAGAIN:
+	case -EBUSY:
+		/* sqes stay in the ring until the kernel takes them */
+		DBG("io_uring_enter: %d, %u sqes left\n", ret, to_submit);
+		uring_enter_later(queue, to_submit);
+		break;
+	default:
+		if (!(queue->flags & IORING_SETUP_SQPOLL))
+			uring_fail_sqes(queue, ret);
+		else
+			ERR(ret, "io_uring sqpoll wakeup failed");
+	}
+}
+
+static void
+uring_backend_event(event_id_t id, char mode, void *private)
+{
+	uring_queue *queue = private;
+	struct uring_cq *cq = &queue->cq;
+	struct io_uring_cqe *cqe;
+	struct io_event *ep;
+	unsigned head, tail;
+	int nr = 0;
+
+	head = *cq->khead;
+	tail = uring_load_acquire(cq->ktail);
+
+	while (head != tail && nr < queue->size) {
+		cqe = &cq->cqes[head & *cq->kring_mask];
+		ep  = &queue->events[nr++];
+		memset(ep, 0, sizeof(*ep));
+		ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res = (long)cqe->res;
+		head++;
+	}
+
+	uring_store_release(cq->khead, head);
+
+	complete_events(queue, nr);
+
+	/* pick up sqes an earlier io_uring_enter left behind */
+	uring_enter(queue);
+	uring_clear_stale_files(queue);
+}
+
+static void
+uring_backend_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf,
+	size_t size, long long offset, td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &(tiocb->uiocb.io);
+
+	if (rw)
+		io_prep_pwrite(iocb, fd, buf, size, offset);
+	else
+		io_prep_pread(iocb, fd, buf, size, offset);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+}
+
+static int
+uring_backend_prepv_tiocb(struct tiocb *tiocb, int fd, int rw,
+	struct iovec *iov, int iovcnt,
+	long long offset, td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &(tiocb->uiocb.io);
+
+	if (rw)
+		io_prep_pwritev(iocb, fd, iov, iovcnt, offset);
+	else
+		io_prep_preadv(iocb, fd, iov, iovcnt, offset);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+
+	return 0;
+}
+
+static void
+uring_backend_queue_tiocb(tqueue q, struct tiocb *tiocb)
+{
+	uring_queue *queue = (uring_queue *)q;
+
+	if (!uring_backend_queue_full(queue))
+		queue_tiocb(queue, tiocb);
+	else
+		defer_tiocb(queue, tiocb);
+}
+
+/*
+ * Everything queued since the last call goes out with a single
+ * io_uring_enter, or none at all when the sqpoll thread is awake.
+ */
+static int
+uring_backend_submit_tiocbs(tqueue q)
+{
+	uring_queue *queue = (uring_queue *)q;
+	struct uring_sq *sq = &queue->sq;
+	int i, merged;
+
+	if (!queue->queued)
+		return 0;
+
+	io_sort(&queue->opioctx, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+	for (i = 0; i < merged; i++)
+		uring_prep_sqe(queue, queue->iocbs[i]);
+
+	DBG("queued: %d, merged: %d\n", queue->queued, merged);
+
+	queue->iocbs_pending  += merged;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	uring_store_release(sq->ktail, sq->tail);
+	uring_enter(queue);
+
+	return merged;
+}
+
+static int
+uring_backend_submit_all_tiocbs(tqueue q)
+{
+	int submitted = 0;
+	uring_queue *queue = (uring_queue *)q;
+
+	do {
+		submitted += uring_backend_submit_tiocbs(queue);
+	} while (!uring_backend_queue_empty(queue));
+
+	return submitted;
+}
+
+static void
+uring_backend_free_queue(tqueue *q)
+{
+	uring_queue *queue = (uring_queue *)*q;
+
+	if (!queue)
+		return;
+
+	uring_backend_destroy(queue);
+
+	free(queue->iocbs);
+	free(queue->events);
+	opio_free(&queue->opioctx);
+	free(queue);
+	*q = NULL;
+}
+
+static int
+uring_backend_init_queue(tqueue *q, int size, int drv, struct tfilter *filter)
+{
+	uring_queue *queue;
+	int err;
+
+	queue = calloc(1, sizeof(uring_queue));
+	if (!queue)
+		return -ENOMEM;
+
+	*q = queue;
+
+	queue->size     = size;
+	queue->ring_fd  = -1;
+	queue->event_id = -1;
+	queue->retry_id = -1;
+	queue->nr_files = -1;
+
+	if (!size)
+		return 0;
+
+	queue->iocbs  = calloc(size, sizeof(struct iocb *));
+	queue->events = calloc(size, sizeof(struct io_event));
+	if (!queue->iocbs || !queue->events) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = opio_init(&queue->opioctx, size);
+	if (err)
+		goto fail;
+
+	opio_set_elevator(&queue->opioctx, opio_elevator_env());
+
+	err = uring_backend_setup(queue, size);
+	if (err)
+		goto fail;
+
+	return 0;
+
+fail:
+	uring_backend_free_queue(q);
+	return err;
+}
+
+static void
+uring_backend_debug_queue(tqueue q)
+{
+	uring_queue *queue = (uring_queue *)q;
+	struct tiocb *tiocb = queue->deferred.head;
+
+	WARN("IO_URING QUEUE:\n");
+	WARN("size: %d, sqpoll: %d, files: %d, stale: %d, queued: %d, "
+	     "iocbs_pending: %d, tiocbs_pending: %d, tiocbs_deferred: %d, "
+	     "deferrals: %"PRIu64"\n",
+	     queue->size, !!(queue->flags & IORING_SETUP_SQPOLL),
+	     queue->nr_files, queue->nr_stale, queue->queued,
+	     queue->iocbs_pending, queue->tiocbs_pending,
+	     queue->tiocbs_deferred, queue->deferrals);
+	WARN("sqes: %"PRIu64", fixed: %"PRIu64", enters: %"PRIu64", "
+	     "wakeups: %"PRIu64", retries: %"PRIu64"\n",
+	     queue->sqes, queue->fixed, queue->enters, queue->wakeups,
+	     queue->retries);
+	WARN("elevator: %zu, iocbs merged: %"PRIu64" -> %"PRIu64"\n",
+	     queue->opioctx.merge_max, queue->opioctx.iocbs_in,
+	     queue->opioctx.iocbs_out);
+
+	if (tiocb) {
+		WARN("deferred:\n");
+		for (; tiocb != NULL; tiocb = tiocb->next) {
+			struct iocb *io = &(tiocb->uiocb.io);
+			WARN("%s of %lu bytes at %lld\n",
+			     iocb_opcode(io),
+			     iocb_nbytes(io), iocb_offset(io));
+		}
+	}
+}
+
+struct backend* get_uring_backend()
+{
+	static struct backend uring_backend = {
+		.debug=uring_backend_debug_queue,
+		.init=uring_backend_init_queue,
+		.free_queue=uring_backend_free_queue,
+		.queue=uring_backend_queue_tiocb,
+		.submit_all=uring_backend_submit_all_tiocbs,
+		.submit_tiocbs=uring_backend_submit_tiocbs,
+		.prep=uring_backend_prep_tiocb,
+		.prepv=uring_backend_prepv_tiocb,
+		.forget_files=uring_backend_forget_files
+	};
+	return &uring_backend;
+}
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+struct backend* get_uring_backend()
+{
+	return NULL;
+}
+
+#endif
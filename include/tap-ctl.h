@@ -33,6 +33,7 @@
 
 #include <syslog.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <sys/time.h>
 #include <tapdisk-message.h>
 #include <list.h>
@@ -110,7 +111,8 @@ int tap_ctl_allocate(int *minor, char **devname);
 int tap_ctl_free(const int minor);
 
 int tap_ctl_create(const char *params, char **devname, int flags, 
-		   int prt_minor, char *secondary, int timeout, const char *logpath);
+		   int prt_minor, char *secondary, int timeout, const char *logpath,
+		   int bm_cache_size);
 int tap_ctl_destroy(const int id, const int minor, int force,
 		    struct timeval *timeout);
 
@@ -122,7 +124,8 @@ int tap_ctl_detach(const int id, const int minor);
 
 int tap_ctl_open(const int id, const int minor, const char *params, int flags,
 		 const int prt_minor, const char *secondary, int timeout,
-		 const char *logpath, uint8_t key_size, uint8_t *encryption_key);
+		 const char *logpath, uint8_t key_size, uint8_t *encryption_key,
+		 int bm_cache_size);
 int tap_ctl_close(const int id, const int minor, const int force,
 		  struct timeval *timeout);
 
@@ -149,8 +152,10 @@ int tap_ctl_blk_major(void);
  * ring
  * @param domid the domain ID of the guest VM
  * @param devid the device ID
+ * @param queue the queue the ring serves, for multi-queue front-ends
  * @param poll_duration polling duration (microseconds; 0 means no polling)
  * @param poll_idle_threshold CPU idle threshold above which we poll
+ * @param persistent_grants whether the front-end uses persistent grants
  * @param grefs the grant references
  * @param order number of grant references, expressed as a 2's order
  * @param port event channel port
@@ -163,8 +168,8 @@ int tap_ctl_blk_major(void);
  * @returns 0 on success, a negative error code otherwise
  */
 int tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int
-		devid, int poll_duration, int poll_idle_threshold,
-		const grant_ref_t * grefs, const int order, const evtchn_port_t
+		devid, const int queue, int poll_duration, int poll_idle_threshold,
+		bool persistent_grants, const grant_ref_t * grefs, const int order, const evtchn_port_t
 		port, int proto, const char *pool, const int minor);
 
 /**
@@ -76,6 +76,7 @@ struct tapdisk_message_params {
 	uint32_t                         prt_devnum;
 	uint16_t                         req_timeout;
 	char                             secondary[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+	uint32_t                         bm_cache_size;
 };
 
 struct tapdisk_message_image {
@@ -162,6 +163,16 @@ typedef struct tapdisk_message_blkif {
 	 * Idle CPU threshold above which polling is permitted.
 	 */
 	uint32_t poll_idle_threshold;
+
+	/**
+	 * Non-zero if the front-end uses persistent grants.
+	 */
+	uint32_t persistent_grants;
+
+	/**
+	 * Queue this ring serves, 0 unless the front-end uses multiple queues.
+	 */
+	uint32_t queue;
 } tapdisk_message_blkif_t;
 
 /**
@@ -61,8 +61,29 @@ struct blkif_x86_32_response {
 	uint8_t         operation;       /* copied from request */
 	int16_t         status;          /* BLKIF_RSP_???       */
 };
+struct blkif_x86_32_request_indirect {
+	uint8_t        operation;    /* BLKIF_OP_INDIRECT                    */
+	uint8_t        indirect_op;  /* BLKIF_OP_{READ/WRITE}                */
+	uint16_t       nr_segments;  /* number of segments                   */
+	uint64_t       id;           /* private guest value, echoed in resp  */
+	blkif_sector_t sector_number;/* start sector idx on disk (r/w only)  */
+	blkif_vdev_t   handle;       /* same as for read/write requests      */
+	uint16_t       _pad1;
+	grant_ref_t    indirect_grefs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+	uint64_t       _pad2;        /* make it 64 byte aligned              */
+};
+struct blkif_x86_32_request_discard {
+	uint8_t        operation;    /* BLKIF_OP_DISCARD                     */
+	uint8_t        flag;         /* BLKIF_DISCARD_SECURE or zero         */
+	blkif_vdev_t   handle;       /* same as for read/write requests      */
+	uint64_t       id;           /* private guest value, echoed in resp  */
+	blkif_sector_t sector_number;/* start sector idx on disk             */
+	uint64_t       nr_sectors;   /* number of contiguous sectors         */
+};
 typedef struct blkif_x86_32_request blkif_x86_32_request_t;
 typedef struct blkif_x86_32_response blkif_x86_32_response_t;
+typedef struct blkif_x86_32_request_indirect blkif_x86_32_request_indirect_t;
+typedef struct blkif_x86_32_request_discard blkif_x86_32_request_discard_t;
 #pragma pack(pop)
 
 /* x86_64 protocol version */
@@ -79,8 +100,28 @@ struct blkif_x86_64_response {
 	uint8_t         operation;       /* copied from request */
 	int16_t         status;          /* BLKIF_RSP_???       */
 };
+struct blkif_x86_64_request_indirect {
+	uint8_t        operation;    /* BLKIF_OP_INDIRECT                    */
+	uint8_t        indirect_op;  /* BLKIF_OP_{READ/WRITE}                */
+	uint16_t       nr_segments;  /* number of segments                   */
+	uint64_t       __attribute__((__aligned__(8))) id;
+	blkif_sector_t sector_number;/* start sector idx on disk (r/w only)  */
+	blkif_vdev_t   handle;       /* same as for read/write requests      */
+	uint16_t       _pad1;
+	grant_ref_t    indirect_grefs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+};
+struct blkif_x86_64_request_discard {
+	uint8_t        operation;    /* BLKIF_OP_DISCARD                     */
+	uint8_t        flag;         /* BLKIF_DISCARD_SECURE or zero         */
+	blkif_vdev_t   handle;       /* same as for read/write requests      */
+	uint64_t       __attribute__((__aligned__(8))) id;
+	blkif_sector_t sector_number;/* start sector idx on disk             */
+	uint64_t       nr_sectors;   /* number of contiguous sectors         */
+};
 typedef struct blkif_x86_64_request blkif_x86_64_request_t;
 typedef struct blkif_x86_64_response blkif_x86_64_response_t;
+typedef struct blkif_x86_64_request_indirect blkif_x86_64_request_indirect_t;
+typedef struct blkif_x86_64_request_discard blkif_x86_64_request_discard_t;
 
 DEFINE_RING_TYPES(blkif_common, struct blkif_common_request, struct blkif_common_response);
 DEFINE_RING_TYPES(blkif_x86_32, struct blkif_x86_32_request, struct blkif_x86_32_response);
@@ -135,4 +176,17 @@ static inline void blkif_get_x86_64_req(blkif_request_t *dst, blkif_x86_64_reque
 
 #define BLKIF_MAX_BUFFER_SEGMENTS_PER_REQUEST 32
 
+/*
+ * Indirect descriptors: the segment array lives in up to
+ * BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST guest pages. We advertise 256
+ * segments (1MiB with 4KiB pages), which fits in a single indirect page.
+ */
+#define BLKIF_INDIRECT_PAGE_SIZE 4096
+#define BLKIF_SEGS_PER_INDIRECT_FRAME \
+	(BLKIF_INDIRECT_PAGE_SIZE / sizeof(struct blkif_request_segment))
+#define BLKIF_INDIRECT_PAGES(_segs) \
+	(((_segs) + BLKIF_SEGS_PER_INDIRECT_FRAME - 1) / \
+	 BLKIF_SEGS_PER_INDIRECT_FRAME)
+#define BLKIF_MAX_INDIRECT_SEGMENTS_PER_REQUEST 256
+
 #endif /* __XEN_BLKIF_H__ */
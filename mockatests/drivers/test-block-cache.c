@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "test-suites.h"
+
+#include "block-cache.c"
+
+/* from test-scheduler.c, which wraps gettimeofday for the whole binary */
+extern struct timeval fake_gettimeofday;
+
+#define TEST_CACHE_SECTORS 4096
+
+static void
+sector_fill(char *buf, uint32_t seed)
+{
+	int i;
+
+	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++)
+		buf[i] = (char)(seed * 31 + i);
+
+	memcpy(buf, &seed, sizeof(seed));
+}
+
+static block_cache_t *
+cache_open(const char *name)
+{
+	block_cache_t *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	assert_non_null(cache);
+
+	assert_int_equal(block_cache_store_get(), 0);
+
+	cache->name       = (char *)name;
+	cache->tree.cache = cache;
+	assert_int_equal(radix_tree_initialize(&cache->tree,
+					       TEST_CACHE_SECTORS), 0);
+
+	return cache;
+}
+
+static void
+cache_close(block_cache_t *cache)
+{
+	radix_tree_free(&cache->tree);
+	block_cache_store_put();
+	free(cache);
+}
+
+static block_cache_page_t *
+leaf_page(block_cache_t *cache, uint64_t sector)
+{
+	char *buf;
+
+	buf = radix_tree_find_leaf(&cache->tree, sector);
+	if (!buf)
+		return NULL;
+
+	return (block_cache_page_t *)(buf - offsetof(block_cache_page_t, buf));
+}
+
+/* Test that identical sectors of two caches share a page until both drop it */
+void
+test_block_cache_shares_pages(void **state)
+{
+	char buf[RADIX_TREE_NODE_SIZE];
+	block_cache_t *a, *b;
+	block_cache_page_t *page;
+
+	unsetenv("TAPDISK3_BLOCK_CACHE_SIZE");
+	a = cache_open("a");
+	b = cache_open("b");
+
+	sector_fill(buf, 1);
+	assert_int_equal(radix_tree_add_leaves(&a->tree, buf, 3, 1), 0);
+	assert_int_equal(radix_tree_add_leaves(&b->tree, buf, 7, 1), 0);
+
+	page = leaf_page(a, 3);
+	assert_non_null(page);
+	assert_ptr_equal(leaf_page(b, 7), page);
+	assert_int_equal(page->refs, 2);
+	assert_int_equal(store.pages, 1);
+	assert_int_equal(store.refs, 2);
+	assert_int_equal(a->stats.dedups, 0);
+	assert_int_equal(b->stats.dedups, 1);
+
+	cache_close(a);
+	assert_int_equal(page->refs, 1);
+	assert_int_equal(store.pages, 1);
+	assert_int_equal(store.refs, 1);
+	assert_memory_equal(leaf_page(b, 7)->buf, buf, RADIX_TREE_NODE_SIZE);
+
+	radix_tree_destroy(&b->tree);
+	assert_int_equal(store.pages, 0);
+	assert_int_equal(store.refs, 0);
+	assert_int_equal(store.size, 0);
+	assert_null(store.hash[block_cache_hash(buf) & store.hash_mask]);
+
+	cache_close(b);
+	assert_int_equal(store.users, 0);
+}
+
+/* Test that a page whose hash matches but whose contents differ is not reused */
+void
+test_block_cache_hash_collision(void **state)
+{
+	char x[RADIX_TREE_NODE_SIZE], y[RADIX_TREE_NODE_SIZE];
+	block_cache_page_t *px, *py, **chain;
+	block_cache_t *cache;
+
+	unsetenv("TAPDISK3_BLOCK_CACHE_SIZE");
+	cache = cache_open("a");
+
+	sector_fill(x, 1);
+	sector_fill(y, 2);
+	assert_int_not_equal(block_cache_hash(x), block_cache_hash(y));
+
+	px = block_cache_page_get(cache, x);
+	assert_non_null(px);
+
+	/* no collision is known, so move x where y would hash to */
+	chain = &store.hash[px->hash & store.hash_mask];
+	assert_ptr_equal(*chain, px);
+	*chain     = px->next;
+	px->hash   = block_cache_hash(y);
+	chain      = &store.hash[px->hash & store.hash_mask];
+	px->next   = *chain;
+	*chain     = px;
+
+	py = block_cache_page_get(cache, y);
+	assert_non_null(py);
+	assert_ptr_not_equal(px, py);
+	assert_true(px->hash == py->hash);
+	assert_memory_equal(px->buf, x, RADIX_TREE_NODE_SIZE);
+	assert_memory_equal(py->buf, y, RADIX_TREE_NODE_SIZE);
+	assert_int_equal(px->refs, 1);
+	assert_int_equal(py->refs, 1);
+	assert_int_equal(store.pages, 2);
+	assert_int_equal(cache->stats.dedups, 0);
+
+	block_cache_page_put(px);
+	block_cache_page_put(py);
+	assert_int_equal(store.pages, 0);
+	assert_null(*chain);
+
+	cache_close(cache);
+}
+
+/* Test that TAPDISK3_BLOCK_CACHE_SIZE bounds the pages and nodes together */
+void
+test_block_cache_size_bound(void **state)
+{
+	char buf[RADIX_TREE_NODE_SIZE];
+	block_cache_t *cache;
+	uint32_t sector;
+
+	setenv("TAPDISK3_BLOCK_CACHE_SIZE", "1", 1);
+	cache = cache_open("a");
+	assert_int_equal(store.max_size, 1 << 20);
+
+	/* as block_cache_miss does, stop inserting once the store is full */
+	for (sector = 0; !block_cache_store_full(1); sector++) {
+		assert_true(sector < TEST_CACHE_SECTORS);
+		sector_fill(buf, sector);
+		assert_int_equal(radix_tree_add_leaves(&cache->tree, buf,
+						       sector, 1), 0);
+	}
+
+	assert_int_equal(store.pages, sector);
+	assert_int_equal(store.size,
+			 store.pages * sizeof(block_cache_page_t) +
+			 cache->tree.nodes * sizeof(radix_tree_node_t));
+	assert_true(store.size + sizeof(block_cache_page_t) >= store.max_size);
+
+	/* the insert that filled it may have added a node on top */
+	assert_true(store.size < store.max_size + sizeof(radix_tree_node_t));
+
+	cache_close(cache);
+	assert_int_equal(store.size, 0);
+	unsetenv("TAPDISK3_BLOCK_CACHE_SIZE");
+}
+
+/* Test that pruning idle sectors drops their references to the store */
+void
+test_block_cache_prune_releases_pages(void **state)
+{
+	char shared[RADIX_TREE_NODE_SIZE], own[RADIX_TREE_NODE_SIZE];
+	block_cache_t *a, *b;
+
+	unsetenv("TAPDISK3_BLOCK_CACHE_SIZE");
+	fake_gettimeofday.tv_sec  = 1000;
+	fake_gettimeofday.tv_usec = 0;
+
+	a = cache_open("a");
+	b = cache_open("b");
+
+	sector_fill(shared, 1);
+	sector_fill(own, 2);
+	assert_int_equal(radix_tree_add_leaves(&a->tree, shared, 0, 1), 0);
+	assert_int_equal(radix_tree_add_leaves(&a->tree, own, 1, 1), 0);
+	assert_int_equal(radix_tree_add_leaves(&b->tree, shared, 0, 1), 0);
+	assert_int_equal(store.pages, 2);
+	assert_int_equal(store.refs, 3);
+
+	/* not idle for long enough yet */
+	fake_gettimeofday.tv_sec += BLOCK_CACHE_PAGE_IDLETIME - 1;
+	radix_tree_prune(&a->tree);
+	assert_int_equal(store.refs, 3);
+	assert_int_equal(a->stats.prunes, 0);
+
+	fake_gettimeofday.tv_sec += 1;
+	radix_tree_prune(&a->tree);
+	assert_int_equal(a->stats.prunes, 2);
+	assert_int_equal(a->tree.size, 0);
+	assert_int_equal(a->tree.nodes, 1);
+	assert_null(radix_tree_find_leaf(&a->tree, 0));
+	assert_null(radix_tree_find_leaf(&a->tree, 1));
+
+	/* the page b still holds stays, the other one is freed */
+	assert_int_equal(store.pages, 1);
+	assert_int_equal(store.refs, 1);
+	assert_memory_equal(radix_tree_find_leaf(&b->tree, 0), shared,
+			    RADIX_TREE_NODE_SIZE);
+
+	cache_close(a);
+	cache_close(b);
+	assert_int_equal(store.pages, 0);
+	assert_int_equal(store.size, 0);
+
+	memset(&fake_gettimeofday, 0, sizeof(fake_gettimeofday));
+}
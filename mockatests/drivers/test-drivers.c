@@ -42,7 +42,11 @@ int main(void)
 		cmocka_run_group_tests_name("Stats tests", tapdisk_stats_tests, NULL, NULL)+
 		cmocka_run_group_tests_name("nbd_server_tests", tapdisk_nbdserver_tests, NULL, NULL)+
 		cmocka_run_group_tests_name("VBD tests", tapdisk_vbd_tests, NULL, NULL)+
-		cmocka_run_group_tests_name("Scheduler tests", tapdisk_sched_tests, NULL, NULL);
+		cmocka_run_group_tests_name("Scheduler tests", tapdisk_sched_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Xen blkif request tests", tapdisk_xenblkif_req_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Worker pool tests", tapdisk_workers_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Shared cache tests", tapdisk_shared_cache_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Block cache tests", tapdisk_block_cache_tests, NULL, NULL);
 
 	return result;
 }
@@ -39,6 +39,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 
 #include "scheduler.c"
@@ -77,6 +78,13 @@ event_queue_length(const scheduler_t* s)
 
 void fake_event_cb (event_id_t id, char mode, void *private) {}
 
+static uint32_t
+epoll_mask(const scheduler_t* s, int fd)
+{
+  const struct sched_fd* sfd = scheduler_lookup_fd((scheduler_t*)s, fd);
+  return sfd ? sfd->mask : 0;
+}
+
 int mock_fd_create()
 {
   const int fd = eventfd(0, 0);
@@ -664,17 +672,23 @@ test_scheduler_check_timeouts(void **state)
   scheduler_t s;
   scheduler_initialize(&s);
 
-  char mode = SCHEDULER_POLL_TIMEOUT;
-  int fd = 1;
-  struct timeval timeout = {};
+  const int fd = mock_fd_create();
   event_cb_t cb = &fake_event_cb;
 
-  const int id1 = scheduler_register_event(&s, mode, fd, timeout, cb, NULL);
-  const int id2 = scheduler_register_event(&s, mode, fd, timeout, cb, NULL);
-  const int id3 = scheduler_register_event(&s, mode, fd, timeout, cb, NULL);
-  const int id4 = scheduler_register_event(&s, mode, fd, timeout, cb, NULL);
-  const int id5 = scheduler_register_event(&s, mode, fd, timeout, cb, NULL);
-  const int id6 = scheduler_register_event(&s, mode, fd, timeout, cb, NULL);
+  fake_gettimeofday = (struct timeval){ .tv_sec = 0};
+
+  const int id1 = scheduler_register_event(&s, SCHEDULER_POLL_TIMEOUT, -1,
+                                           TV_SECS(1), cb, NULL);
+  const int id2 = scheduler_register_event(&s, SCHEDULER_POLL_TIMEOUT, -1,
+                                           TV_SECS(1), cb, NULL);
+  const int id3 = scheduler_register_event(&s, SCHEDULER_POLL_READ_FD, fd,
+                                           TV_SECS(1), cb, NULL);
+  const int id4 = scheduler_register_event(&s, SCHEDULER_POLL_TIMEOUT, -1,
+                                           TV_INF, cb, NULL);
+  const int id5 = scheduler_register_event(&s, SCHEDULER_POLL_TIMEOUT, -1,
+                                           TV_SECS(3), cb, NULL);
+  const int id6 = scheduler_register_event(&s, SCHEDULER_POLL_TIMEOUT, -1,
+                                           TV_SECS(1), cb, NULL);
 
   event_t* e1 = list_first_entry(&s.events, event_t, next);
   event_t* e2 = list_next_entry(e1, next);
@@ -683,24 +697,39 @@ test_scheduler_check_timeouts(void **state)
   event_t* e5 = list_next_entry(e4, next);
   event_t* e6 = list_next_entry(e5, next);
 
+  // Only finite TIMEOUT events are armed
+  assert_int_equal(s.heap_len, 4);
+
+  scheduler_unregister_event(&s, id1);            // 1: skip because dead
+  scheduler_set_pending(&s, e2, SCHEDULER_POLL_READ_FD); // 2: skip because already pending
+                                                  // 3: skip because not TIMEOUT mode
+                                                  // 4: skip because timeout is INF
+                                                  // 5: skip because timeout not reached
+                                                  // 6: mark because timeout has passed
+  assert_int_equal(s.heap_len, 3);
+
   // Set current time to 2
   fake_gettimeofday = (struct timeval){ .tv_sec = 2};
 
-  e1->dead = true;                      // 1: skip because dead
-  e2->pending = SCHEDULER_POLL_TIMEOUT; // 2: skip because already pending
-  e3->mode = SCHEDULER_POLL_READ_FD;    // 3: skip because TIMEOUT mode
-  e4->timeout = TV_INF;                 // 4: skip because timeout is INF
-  e5->deadline.tv_sec = 3;              // 5: skip because timeout not reached
-  e6->deadline.tv_sec = 1;              // 6: mark because timeout has passed
-
   scheduler_check_timeouts(&s);
-  assert_int_not_equal(e1->pending, SCHEDULER_POLL_TIMEOUT); // unchanged
-  assert_int_equal(e2->pending, SCHEDULER_POLL_TIMEOUT);     // unchanged
-  assert_int_not_equal(e3->pending, SCHEDULER_POLL_TIMEOUT); // unchanged
-  assert_int_not_equal(e4->pending, SCHEDULER_POLL_TIMEOUT); // unchanged
-  assert_int_not_equal(e5->pending, SCHEDULER_POLL_TIMEOUT); // unchanged
-  assert_int_equal(e6->pending, SCHEDULER_POLL_TIMEOUT); // changed
+  assert_int_equal(e1->pending, 0);                          // unchanged
+  assert_int_equal(e2->pending, SCHEDULER_POLL_READ_FD);     // unchanged
+  assert_int_equal(e3->pending, 0);                          // unchanged
+  assert_int_equal(e4->pending, 0);                          // unchanged
+  assert_int_equal(e5->pending, 0);                          // unchanged
+  assert_int_equal(e6->pending, SCHEDULER_POLL_TIMEOUT);     // changed
+
+  // Expired events leave the heap until their callback re-arms them
+  assert_int_equal(s.heap_len, 1);
+  assert_ptr_equal(s.heap[0], e5);
+  assert_int_equal(e2->heap_idx, -1);
+  assert_int_equal(e6->heap_idx, -1);
+
+  assert_int_equal(scheduler_run_events(&s), 2);
+  assert_int_equal(s.heap_len, 3);
+  assert_int_equal(e6->deadline.tv_sec, 3);
 
+  close(fd);
   scheduler_unregister_event(&s, id1);
   scheduler_unregister_event(&s, id2);
   scheduler_unregister_event(&s, id3);
@@ -710,6 +739,66 @@ test_scheduler_check_timeouts(void **state)
   scheduler_gc_events(&s);
 }
 
+static scheduler_t* oneshot_sched;
+static event_id_t oneshot_order[16];
+static int oneshot_fired;
+
+static void
+oneshot_event_cb(event_id_t id, char mode, void *private)
+{
+  oneshot_order[oneshot_fired++] = id;
+  scheduler_event_set_timeout(oneshot_sched, id, TV_INF);
+}
+
+void
+test_scheduler_timeouts_expire_in_deadline_order(void **state)
+{
+  // The timer heap hands out events by deadline, not registration order
+  scheduler_t s;
+  scheduler_initialize(&s);
+
+  static const int secs[] = { 7, 3, 9, 1, 5, 8, 2, 6, 4 };
+  const int n = sizeof(secs) / sizeof(secs[0]);
+  int ids[sizeof(secs) / sizeof(secs[0])];
+  int i, t;
+
+  s.max_timeout = TV_SECS(600);
+  oneshot_sched = &s;
+  oneshot_fired = 0;
+  fake_gettimeofday = (struct timeval){ .tv_sec = 0};
+
+  for (i = 0; i < n; i++)
+    ids[i] = scheduler_register_event(&s, SCHEDULER_POLL_TIMEOUT, -1,
+                                      TV_SECS(secs[i]), &oneshot_event_cb, NULL);
+
+  // Push the 1s event back past everything else
+  assert_int_equal(s.heap[0]->id, ids[3]);
+  scheduler_event_set_timeout(&s, ids[3], TV_SECS(10));
+  assert_int_equal(s.heap[0]->id, ids[6]);
+
+  for (t = 1; t <= 10; t++) {
+    fake_gettimeofday = (struct timeval){ .tv_sec = t };
+
+    scheduler_prepare_events(&s);
+    assert_int_equal(s.timeout.tv_sec, t == 1 ? 1 : 0);
+
+    scheduler_check_timeouts(&s);
+    scheduler_run_events(&s);
+
+    assert_int_equal(oneshot_fired, t == 1 ? 0 : t - 1);
+  }
+
+  // 2s, 3s, ... 9s, then the postponed one
+  for (i = 0; i < n - 1; i++)
+    assert_int_equal(secs[oneshot_order[i] - ids[0]], i + 2);
+  assert_int_equal(oneshot_order[n - 1], ids[3]);
+  assert_int_equal(s.heap_len, 0);
+
+  for (i = 0; i < n; i++)
+    scheduler_unregister_event(&s, ids[i]);
+  scheduler_gc_events(&s);
+}
+
 void
 test_scheduler_callback(void **state)
 {
@@ -743,7 +832,7 @@ test_scheduler_callback(void **state)
   // Update current time to time_now2
   fake_gettimeofday = (struct timeval){ .tv_sec = time_now2 };
 
-  scheduler_event_callback(event1, test_mode);
+  scheduler_event_callback(&s, event1, test_mode);
 
   // Check callback has been called
   assert_int_equal(event_cb_spy.was_called, 1);
@@ -776,7 +865,7 @@ test_scheduler_callback_ignores_masked_events(void **state)
   event1->masked = true;
 
   const int test_mode = 1;
-  scheduler_event_callback(event1, test_mode);
+  scheduler_event_callback(&s, event1, test_mode);
 
   // Check callback has not been called
   assert_int_equal(event_cb_spy.was_called, 0);
@@ -803,7 +892,7 @@ test_scheduler_run_events_run_callback_if_pending(void **state)
   event_t* event = list_first_entry(&s.events, event_t, next);
 
   // Set event to pending
-  event->pending = SCHEDULER_POLL_TIMEOUT;
+  scheduler_set_pending(&s, event, SCHEDULER_POLL_TIMEOUT);
 
   const int n_dispatched = scheduler_run_events(&s);
 
@@ -856,7 +945,7 @@ test_scheduler_run_events_pending_mode_is_reset(void **state)
   event_t* event = list_first_entry(&s.events, event_t, next);
 
   // Set event to pending
-  event->pending = SCHEDULER_POLL_TIMEOUT;
+  scheduler_set_pending(&s, event, SCHEDULER_POLL_TIMEOUT);
 
   (void)scheduler_run_events(&s);
 
@@ -886,7 +975,7 @@ test_scheduler_run_events_ignore_event_if_dead(void **state)
   event_t* event = list_first_entry(&s.events, event_t, next);
 
   // Set event to pending
-  event->pending = SCHEDULER_POLL_TIMEOUT;
+  scheduler_set_pending(&s, event, SCHEDULER_POLL_TIMEOUT);
 
   event->dead = true;
 
@@ -918,29 +1007,31 @@ test_scheduler_prepare_events_no_events(void **state)
   scheduler_t s;
   scheduler_initialize(&s);
   scheduler_prepare_events(&s);
-  assert_int_equal(s.max_fd, -1);
+  assert_int_equal(s.nr_fds, 0);
+  assert_int_equal(s.heap_len, 0);
 }
 
 void
 test_scheduler_prepare_events_masked_event_ignored(void **state)
 {
-  // scheduler_prepare_events masked event is ignored
+  // masked event is dropped from the epoll set until unmasked
   scheduler_t s;
   scheduler_initialize(&s);
 
-  const char md = SCHEDULER_POLL_TIMEOUT;
-  const int fd = 1;
+  const char md = SCHEDULER_POLL_READ_FD;
+  const int fd = mock_fd_create();
   const struct timeval to = {};
   const int id = scheduler_register_event(&s, md, fd, to, &fake_event_cb, NULL);
-  event_t* event = list_first_entry(&s.events, event_t, next);
+  assert_int_equal(epoll_mask(&s, fd), EPOLLIN);
 
   // Mask the event here
-  event->masked = true;
-
-  scheduler_prepare_events(&s);
+  scheduler_mask_event(&s, id, 1);
+  assert_int_equal(epoll_mask(&s, fd), 0);
 
-  assert_int_equal(s.max_fd, -1);
+  scheduler_mask_event(&s, id, 0);
+  assert_int_equal(epoll_mask(&s, fd), EPOLLIN);
 
+  close(fd);
   scheduler_unregister_event(&s, id);
   scheduler_gc_events(&s);
 }
@@ -948,68 +1039,60 @@ test_scheduler_prepare_events_masked_event_ignored(void **state)
 void
 test_scheduler_prepare_events_dead_event_ignored(void **state)
 {
-  // scheduler_prepare_events dead event is ignored
+  // dead event is dropped from the epoll set straight away
   scheduler_t s;
   scheduler_initialize(&s);
 
-  const char md = SCHEDULER_POLL_TIMEOUT;
-  const int fd = 1;
+  const char md = SCHEDULER_POLL_READ_FD;
+  const int fd = mock_fd_create();
   const struct timeval to = {};
   const int id = scheduler_register_event(&s, md, fd, to, &fake_event_cb, NULL);
-  event_t* event = list_first_entry(&s.events, event_t, next);
+  assert_int_equal(epoll_mask(&s, fd), EPOLLIN);
 
   // Unalive event here
-  event->dead = true;
-
-  scheduler_prepare_events(&s);
-
-  assert_int_equal(s.max_fd, -1);
-
   scheduler_unregister_event(&s, id);
+  assert_int_equal(epoll_mask(&s, fd), 0);
+  assert_int_equal(event_queue_length(&s), 1);
+
   scheduler_gc_events(&s);
+  assert_null(scheduler_lookup_fd(&s, fd));
+
+  close(fd);
 }
 
 void
 test_scheduler_add_read_event(void **state)
 {
-  // scheduler_prepare_events add READ_FD
+  // scheduler_register_event add READ_FD
   scheduler_t s;
   scheduler_initialize(&s);
 
   const char md = SCHEDULER_POLL_READ_FD;
-  const int test_fd = 991;
+  const int test_fd = mock_fd_create();
   const struct timeval to = {};
-  const int id = scheduler_register_event(&s, md, test_fd, to, &fake_event_cb, NULL);
-
-  scheduler_prepare_events(&s);
+  const int event_id = scheduler_register_event(&s, md, test_fd, to, &fake_event_cb, NULL);
 
-  assert_int_equal(s.max_fd, test_fd);
+  assert_int_equal(epoll_mask(&s, test_fd), EPOLLIN);
 
-  scheduler_unregister_event(&s, id);
+  close(test_fd);
+  scheduler_unregister_event(&s, event_id);
   scheduler_gc_events(&s);
 }
 
 void
 test_scheduler_read_event_with_invalid_fd(void **state)
 {
-  // scheduler_prepare_events READ_FD event with invalid file descriptor is ignored
+  // READ_FD event with invalid file descriptor is not polled
   scheduler_t s;
   scheduler_initialize(&s);
 
   const char md = SCHEDULER_POLL_READ_FD;
-  const int fd = mock_fd_create();
   const struct timeval to = {};
-  const int event_id = scheduler_register_event(&s, md, fd, to, &fake_event_cb, NULL);
-  event_t* event = list_first_entry(&s.events, event_t, next);
-
-  // Invalid event
-  event->fd = -2;
-
-  scheduler_prepare_events(&s);
+  const int event_id = scheduler_register_event(&s, md, -2, to, &fake_event_cb, NULL);
+  assert_true(event_id > 0);
 
-  assert_int_equal(s.max_fd, -1);
+  assert_int_equal(s.nr_fds, 0);
 
-  close(fd);
   scheduler_unregister_event(&s, event_id);
   scheduler_gc_events(&s);
 }
@@ -1017,19 +1100,18 @@ test_scheduler_read_event_with_invalid_fd(void **state)
 void
 test_scheduler_add_write_event(void **state)
 {
-  // scheduler_prepare_events add WRITE_FD
+  // scheduler_register_event add WRITE_FD
   scheduler_t s;
   scheduler_initialize(&s);
 
   const char md = SCHEDULER_POLL_WRITE_FD;
-  const int test_fd = 991;
+  const int test_fd = mock_fd_create();
   const struct timeval to = {};
   const int event_id = scheduler_register_event(&s, md, test_fd, to, &fake_event_cb, NULL);
 
-  scheduler_prepare_events(&s);
-
-  assert_int_equal(s.max_fd, test_fd);
+  assert_int_equal(epoll_mask(&s, test_fd), EPOLLOUT);
 
+  close(test_fd);
   scheduler_unregister_event(&s, event_id);
   scheduler_gc_events(&s);
 }
@@ -1037,24 +1119,17 @@ test_scheduler_add_write_event(void **state)
 void
 test_scheduler_write_event_with_invalid_fd(void **state)
 {
-  // scheduler_prepare_events WRITE_FD event with invalid file descriptor is ignored
+  // WRITE_FD event with invalid file descriptor is not polled
   scheduler_t s;
   scheduler_initialize(&s);
 
   const char md = SCHEDULER_POLL_WRITE_FD;
-  const int fd = mock_fd_create();
   const struct timeval to = {};
-  const int event_id = scheduler_register_event(&s, md, fd, to, &fake_event_cb, NULL);
-  event_t* event = list_first_entry(&s.events, event_t, next);
-
-  // Invalid event
-  event->fd = -2;
-
-  scheduler_prepare_events(&s);
+  const int event_id = scheduler_register_event(&s, md, -2, to, &fake_event_cb, NULL);
+  assert_true(event_id > 0);
 
-  assert_int_equal(s.max_fd, -1);
+  assert_int_equal(s.nr_fds, 0);
 
-  close(fd);
   scheduler_unregister_event(&s, event_id);
   scheduler_gc_events(&s);
 }
@@ -1062,19 +1137,18 @@ test_scheduler_write_event_with_invalid_fd(void **state)
 void
 test_scheduler_add_except_event(void **state)
 {
-  // scheduler_prepare_events add EXCEPT_FD
+  // scheduler_register_event add EXCEPT_FD
   scheduler_t s;
   scheduler_initialize(&s);
 
   const char md = SCHEDULER_POLL_EXCEPT_FD;
-  const int test_fd = 991;
+  const int test_fd = mock_fd_create();
   const struct timeval to = {};
   const int event_id = scheduler_register_event(&s, md, test_fd, to, &fake_event_cb, NULL);
 
-  scheduler_prepare_events(&s);
-
-  assert_int_equal(s.max_fd, test_fd);
+  assert_int_equal(epoll_mask(&s, test_fd), EPOLLPRI);
 
+  close(test_fd);
   scheduler_unregister_event(&s, event_id);
   scheduler_gc_events(&s);
 }
@@ -1082,23 +1156,17 @@ test_scheduler_add_except_event(void **state)
 void
 test_scheduler_except_event_with_invalid_fd(void **state)
 {
-  // scheduler_prepare_events EXCEPT_FD event with invalid file descriptor is ignored
+  // EXCEPT_FD event with invalid file descriptor is not polled
   scheduler_t s;
   scheduler_initialize(&s);
 
   const char md = SCHEDULER_POLL_EXCEPT_FD;
-  const int fd = mock_fd_create();
   const struct timeval to = {};
-  const int event_id = scheduler_register_event(&s, md, fd, to, &fake_event_cb, NULL);
-  event_t* event = list_first_entry(&s.events, event_t, next);
+  const int event_id = scheduler_register_event(&s, md, -2, to, &fake_event_cb, NULL);
+  assert_true(event_id > 0);
 
-  // Invalid event
-  event->fd = -2;
+  assert_int_equal(s.nr_fds, 0);
 
-  scheduler_prepare_events(&s);
-
-  assert_int_equal(s.max_fd, -1);
-  close(fd);
   scheduler_unregister_event(&s, event_id);
   scheduler_gc_events(&s);
 }
@@ -1250,9 +1318,11 @@ test_scheduler_timeout_event_ignored_if_no_timeout(void **state)
   fake_gettimeofday = (struct timeval){ .tv_sec = 0, .tv_usec = 0};
   const int id = scheduler_register_event(&s, md, fd, to, &fake_event_cb, NULL);
 
+  assert_int_equal(s.heap_len, 0);
+
   scheduler_prepare_events(&s);
 
-  assert_int_equal(s.max_fd, -1);
+  assert_int_equal(s.timeout.tv_sec, 600);
   scheduler_unregister_event(&s, id);
   scheduler_gc_events(&s);
 }
@@ -1421,10 +1491,8 @@ test_scheduler_run_single_dead_event(void **state)
   assert_int_equal(event_cb_spy.was_called, 0);
 
   /* The garbage collector has now removed the dead event from the list */
-  const event_t* e2 = list_first_entry(&s.events, event_t, next);
-  /* The head of the list is now an empty placeholder. */
-  assert_int_equal(e2->id, 0);
-  assert_ptr_not_equal(e2, e1); /* The dead event is gone. */
+  assert_true(list_empty(&s.events));
+  assert_null(scheduler_lookup_fd(&s, fd));
 
   close(fd);
   scheduler_unregister_event(&s, event_id);
@@ -1637,3 +1705,143 @@ test_scheduler_run_deleted_duplicate_event(void **state)
   scheduler_unregister_event(&s, event_id2);
   scheduler_gc_events(&s);
 }
+
+void
+test_scheduler_run_masked_fd_event(void **state)
+{
+  scheduler_t s;
+  scheduler_initialize(&s);
+
+  const int fd = mock_fd_create();
+
+  event_cb_spy_t event_cb_spy = {};
+  const int event_id = scheduler_register_event(&s, SCHEDULER_POLL_WRITE_FD, fd,
+                                                (struct timeval){}, &mock_event_cb,
+                                                &event_cb_spy);
+  assert_true(event_id > 0);
+
+  scheduler_mask_event(&s, event_id, 1);
+
+  /* Writable, but masked, so expect a timeout */
+  scheduler_set_max_timeout(&s, (struct timeval){ .tv_sec = 0, .tv_usec = 500 });
+  assert_int_equal(scheduler_wait_for_events(&s), 0);
+  assert_int_equal(event_cb_spy.was_called, 0);
+
+  scheduler_mask_event(&s, event_id, 0);
+
+  assert_int_equal(scheduler_wait_for_events(&s), 0);
+  assert_int_equal(event_cb_spy.was_called, 1);
+
+  close(fd);
+  scheduler_unregister_event(&s, event_id);
+  scheduler_gc_events(&s);
+}
+
+/* epoll refuses regular files, which select() always reports ready.
+ * The scheduler has to keep doing the same. */
+void
+test_scheduler_run_regular_file_is_always_ready(void **state)
+{
+  scheduler_t s;
+  scheduler_initialize(&s);
+
+  FILE *f = tmpfile();
+  assert_non_null(f);
+  const int fd = fileno(f);
+
+  event_cb_spy_t event_cb_spy = {};
+  const int event_id = scheduler_register_event(&s, SCHEDULER_POLL_READ_FD, fd,
+                                                (struct timeval){}, &mock_event_cb,
+                                                &event_cb_spy);
+  assert_true(event_id > 0);
+  assert_false(list_empty(&s.always_ready));
+
+  /* Must not block, even with a long timeout */
+  s.max_timeout = TV_SECS(600);
+  assert_int_equal(scheduler_wait_for_events(&s), 0);
+  assert_int_equal(event_cb_spy.was_called, 1);
+  assert_int_equal(event_cb_spy.mode, SCHEDULER_POLL_READ_FD);
+
+  scheduler_unregister_event(&s, event_id);
+  assert_true(list_empty(&s.always_ready));
+  scheduler_gc_events(&s);
+
+  fclose(f);
+}
+
+/* select() could not watch descriptors at or above FD_SETSIZE. */
+void
+test_scheduler_run_fd_above_fd_setsize(void **state)
+{
+  struct rlimit rl;
+  const int high_fd = FD_SETSIZE + 16;
+
+  assert_int_equal(getrlimit(RLIMIT_NOFILE, &rl), 0);
+  if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max <= high_fd)
+    skip();
+  if (rl.rlim_cur <= high_fd) {
+    rl.rlim_cur = high_fd + 1;
+    assert_int_equal(setrlimit(RLIMIT_NOFILE, &rl), 0);
+  }
+
+  scheduler_t s;
+  scheduler_initialize(&s);
+
+  const int tmp_fd = mock_fd_create();
+  const int fd = dup2(tmp_fd, high_fd);
+  assert_int_equal(fd, high_fd);
+  close(tmp_fd);
+
+  event_cb_spy_t event_cb_spy = {};
+  const int event_id = scheduler_register_event(&s, SCHEDULER_POLL_READ_FD, fd,
+                                                (struct timeval){}, &mock_event_cb,
+                                                &event_cb_spy);
+  assert_true(event_id > 0);
+  assert_int_equal(epoll_mask(&s, fd), EPOLLIN);
+
+  mock_fd_set_readable(fd);
+
+  assert_int_equal(scheduler_wait_for_events(&s), 0);
+  assert_int_equal(event_cb_spy.was_called, 1);
+
+  close(fd);
+  scheduler_unregister_event(&s, event_id);
+  scheduler_gc_events(&s);
+}
+
+/* Closing an fd drops it from epoll; a recycled number has to be armed
+ * afresh even when the events left on it ask for the same mask. */
+void
+test_scheduler_run_recycled_fd_is_rearmed(void **state)
+{
+  scheduler_t s;
+  scheduler_initialize(&s);
+
+  event_cb_spy_t event_cb_spy = {};
+  const int fd = mock_fd_create();
+  const int id1 = scheduler_register_event(&s, SCHEDULER_POLL_READ_FD, fd,
+                                           (struct timeval){}, &mock_event_cb,
+                                           &event_cb_spy);
+  assert_true(id1 > 0);
+
+  close(fd);
+  const int new_fd = mock_fd_create();
+  assert_int_equal(new_fd, fd);
+
+  const int id2 = scheduler_register_event(&s, SCHEDULER_POLL_READ_FD, new_fd,
+                                           (struct timeval){}, &mock_event_cb,
+                                           &event_cb_spy);
+  assert_true(id2 > 0);
+  assert_int_equal(epoll_mask(&s, new_fd), EPOLLIN);
+
+  mock_fd_set_readable(new_fd);
+
+  s.max_timeout = TV_SECS(1);
+  assert_int_equal(scheduler_wait_for_events(&s), 0);
+  assert_int_equal(event_cb_spy.was_called, 1);
+
+  close(new_fd);
+  scheduler_unregister_event(&s, id1);
+  scheduler_unregister_event(&s, id2);
+  scheduler_gc_events(&s);
+}
@@ -59,8 +59,28 @@ static const struct CMUnitTest tapdisk_vbd_tests[] = {
 
 void test_nbdserver_new_protocol_handshake(void **state);
 void test_nbdserver_new_protocol_handshake_send_fails(void **state);
+void test_nbdserver_read_reply_single_sendmsg(void **state);
+void test_nbdserver_structured_read_reply(void **state);
+void test_nbdserver_structured_read_holes(void **state);
+void test_nbdserver_coalesce_extents(void **state);
+void test_nbdserver_write_partial_recv(void **state);
+void test_nbdserver_reply_would_block(void **state);
+void test_nbdserver_dataless_requests(void **state);
+void test_nbdserver_empty_trim_reply_send_fails(void **state);
+void test_nbdserver_cache_reply(void **state);
+void test_nbdserver_per_client_stats(void **state);
 static const struct CMUnitTest tapdisk_nbdserver_tests[] = {
-	cmocka_unit_test(test_nbdserver_new_protocol_handshake)
+	cmocka_unit_test(test_nbdserver_new_protocol_handshake),
+	cmocka_unit_test(test_nbdserver_read_reply_single_sendmsg),
+	cmocka_unit_test(test_nbdserver_structured_read_reply),
+	cmocka_unit_test(test_nbdserver_structured_read_holes),
+	cmocka_unit_test(test_nbdserver_coalesce_extents),
+	cmocka_unit_test(test_nbdserver_write_partial_recv),
+	cmocka_unit_test(test_nbdserver_reply_would_block),
+	cmocka_unit_test(test_nbdserver_dataless_requests),
+	cmocka_unit_test(test_nbdserver_empty_trim_reply_send_fails),
+	cmocka_unit_test(test_nbdserver_cache_reply),
+	cmocka_unit_test(test_nbdserver_per_client_stats)
 };
 
 void test_scheduler_set_max_timeout(void **state);
@@ -88,6 +108,7 @@ void test_scheduler_get_uuid_overflow(void **state);
 void test_scheduler_get_uuid_overflow_fragmented(void **state);
 void test_scheduler_gc_will_remove_dead_events_from_list(void **state);
 void test_scheduler_check_timeouts(void **state);
+void test_scheduler_timeouts_expire_in_deadline_order(void **state);
 void test_scheduler_callback(void **state);
 void test_scheduler_callback_ignores_masked_events(void **state);
 void test_scheduler_run_events_run_callback_if_pending(void **state);
@@ -118,6 +139,10 @@ void test_scheduler_run_duplicate_fds_are_handled_once(void **state);
 void test_scheduler_run_with_duplicate_callbacks(void **state);
 void test_scheduler_run_read_and_write_fd(void **state);
 void test_scheduler_run_deleted_duplicate_event(void **state);
+void test_scheduler_run_masked_fd_event(void **state);
+void test_scheduler_run_regular_file_is_always_ready(void **state);
+void test_scheduler_run_fd_above_fd_setsize(void **state);
+void test_scheduler_run_recycled_fd_is_rearmed(void **state);
 
 static const struct CMUnitTest tapdisk_sched_tests[] = {
   cmocka_unit_test(test_scheduler_set_max_timeout),
@@ -145,6 +170,7 @@ static const struct CMUnitTest tapdisk_sched_tests[] = {
   cmocka_unit_test(test_scheduler_get_uuid_overflow_fragmented),
   cmocka_unit_test(test_scheduler_gc_will_remove_dead_events_from_list),
   cmocka_unit_test(test_scheduler_check_timeouts),
+  cmocka_unit_test(test_scheduler_timeouts_expire_in_deadline_order),
   cmocka_unit_test(test_scheduler_callback),
   cmocka_unit_test(test_scheduler_callback_ignores_masked_events),
   cmocka_unit_test(test_scheduler_run_events_run_callback_if_pending),
@@ -175,6 +201,98 @@ static const struct CMUnitTest tapdisk_sched_tests[] = {
   cmocka_unit_test(test_scheduler_run_with_duplicate_callbacks),
   cmocka_unit_test(test_scheduler_run_read_and_write_fd),
   cmocka_unit_test(test_scheduler_run_deleted_duplicate_event),
+  cmocka_unit_test(test_scheduler_run_masked_fd_event),
+  cmocka_unit_test(test_scheduler_run_regular_file_is_always_ready),
+  cmocka_unit_test(test_scheduler_run_fd_above_fd_setsize),
+  cmocka_unit_test(test_scheduler_run_recycled_fd_is_rearmed),
+};
+
+void test_xenblkif_indirect_write(void **state);
+void test_xenblkif_indirect_read(void **state);
+void test_xenblkif_indirect_bad_op(void **state);
+void test_xenblkif_indirect_too_many_segments(void **state);
+void test_xenblkif_indirect_sectors_beyond_page(void **state);
+void test_xenblkif_direct_too_many_segments(void **state);
+void test_xenblkif_discard_chunks(void **state);
+void test_xenblkif_discard_chunk_pushes_batch(void **state);
+void test_xenblkif_pgrant_write(void **state);
+void test_xenblkif_pgrant_lru(void **state);
+void test_xenblkif_pgrant_map_failure(void **state);
+void test_xenblkif_find_queue(void **state);
+void test_xenblkif_disconnect_drops_shared_vbd_stats(void **state);
+int xenblkif_req_setup(void **state);
+int xenblkif_req_teardown(void **state);
+
+static const struct CMUnitTest tapdisk_xenblkif_req_tests[] = {
+	cmocka_unit_test_setup_teardown(test_xenblkif_indirect_write,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_indirect_read,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_indirect_bad_op,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_indirect_too_many_segments,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_indirect_sectors_beyond_page,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_direct_too_many_segments,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_discard_chunks,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_discard_chunk_pushes_batch,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_pgrant_write,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_pgrant_lru,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test_setup_teardown(test_xenblkif_pgrant_map_failure,
+		xenblkif_req_setup, xenblkif_req_teardown),
+	cmocka_unit_test(test_xenblkif_find_queue),
+	cmocka_unit_test(test_xenblkif_disconnect_drops_shared_vbd_stats)
+};
+
+/* Worker pool tests */
+void test_workers_queue_and_reap(void **state);
+void test_workers_inline_when_full(void **state);
+void test_workers_sync_pool_apart(void **state);
+
+static const struct CMUnitTest tapdisk_workers_tests[] = {
+	cmocka_unit_test(test_workers_queue_and_reap),
+	cmocka_unit_test(test_workers_inline_when_full),
+	cmocka_unit_test(test_workers_sync_pool_apart)
+};
+
+/* Shared cache tests */
+void test_shared_cache_disabled(void **state);
+void test_shared_cache_read_write(void **state);
+void test_shared_cache_reattach(void **state);
+void test_shared_cache_across_processes(void **state);
+void test_shared_cache_evicts_oldest(void **state);
+void test_shared_cache_refuses_unsafe_segment(void **state);
+void test_shared_cache_faults_in_on_use(void **state);
+void test_shared_image_follows_rewrites(void **state);
+
+static const struct CMUnitTest tapdisk_shared_cache_tests[] = {
+	cmocka_unit_test(test_shared_cache_disabled),
+	cmocka_unit_test(test_shared_cache_read_write),
+	cmocka_unit_test(test_shared_cache_reattach),
+	cmocka_unit_test(test_shared_cache_across_processes),
+	cmocka_unit_test(test_shared_cache_evicts_oldest),
+	cmocka_unit_test(test_shared_cache_refuses_unsafe_segment),
+	cmocka_unit_test(test_shared_cache_faults_in_on_use),
+	cmocka_unit_test(test_shared_image_follows_rewrites)
+};
+
+/* Block cache tests */
+void test_block_cache_shares_pages(void **state);
+void test_block_cache_hash_collision(void **state);
+void test_block_cache_size_bound(void **state);
+void test_block_cache_prune_releases_pages(void **state);
+
+static const struct CMUnitTest tapdisk_block_cache_tests[] = {
+	cmocka_unit_test(test_block_cache_shares_pages),
+	cmocka_unit_test(test_block_cache_hash_collision),
+	cmocka_unit_test(test_block_cache_size_bound),
+	cmocka_unit_test(test_block_cache_prune_releases_pages)
 };
 
 #endif /* __TEST_SUITES_H__ */
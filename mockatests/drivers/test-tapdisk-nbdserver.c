@@ -33,6 +33,11 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include "test-suites.h"
 #include "tapdisk.h"
@@ -67,3 +72,655 @@ test_nbdserver_new_protocol_handshake(void **state)
 	int err = tapdisk_nbdserver_new_protocol_handshake(&client, new_fd);
 	assert_int_equal(err, 0);
 }
+
+static char sent[8192];
+static size_t n_sent;
+
+ssize_t
+__wrap_recv(int fd, void *buf, size_t len, int flags)
+{
+	ssize_t n = mock_type(ssize_t);
+
+	check_expected(fd);
+
+	if (n < 0) {
+		errno = -n;
+		return -1;
+	}
+
+	assert_true((size_t)n <= len);
+	memcpy(buf, mock_ptr_type(void *), n);
+	return n;
+}
+
+static void
+expect_recv(int fd, const void *buf, ssize_t n)
+{
+	expect_value(__wrap_recv, fd, fd);
+	will_return(__wrap_recv, n);
+	if (n >= 0)
+		will_return(__wrap_recv, buf);
+}
+
+ssize_t
+__wrap_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	size_t iovlen = msg->msg_iovlen;
+	ssize_t len = mock_type(ssize_t);
+	ssize_t left = len;
+	size_t i;
+
+	check_expected(fd);
+	check_expected(iovlen);
+
+	if (len < 0) {
+		errno = -len;
+		return -1;
+	}
+
+	for (i = 0; i < msg->msg_iovlen && left > 0; i++) {
+		size_t n = msg->msg_iov[i].iov_len;
+
+		if (n > (size_t)left)
+			n = left;
+
+		assert_true(n_sent + n <= sizeof(sent));
+		memcpy(sent + n_sent, msg->msg_iov[i].iov_base, n);
+		n_sent += n;
+		left -= n;
+	}
+
+	return len;
+}
+
+static int
+capture_vreq(const LargestIntegralType value,
+	     const LargestIntegralType check_value_data)
+{
+	*(td_vbd_request_t **)check_value_data = (td_vbd_request_t *)value;
+	return 1;
+}
+
+static void
+nbdserver_make_request(struct nbd_request *request, uint32_t type,
+		       const char *handle, uint64_t from, uint32_t len)
+{
+	request->magic = htonl(NBD_REQUEST_MAGIC);
+	request->type = htonl(type);
+	memcpy(request->handle, handle, sizeof(request->handle));
+	request->from = htobe64(from);
+	request->len = htonl(len);
+}
+
+static td_vbd_request_t *
+nbdserver_submit(td_nbdserver_client_t *client, uint32_t type,
+		 const char *handle, uint64_t from, uint32_t len)
+{
+	td_vbd_request_t *vreq = NULL;
+	struct nbd_request request;
+
+	nbdserver_make_request(&request, type, handle, from, len);
+
+	expect_recv(client->client_fd, &request, sizeof(request));
+	expect_recv(client->client_fd, NULL, -EAGAIN);
+	expect_check(__wrap_tapdisk_vbd_queue_request, vreq, capture_vreq,
+		     &vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+
+	tapdisk_nbdserver_clientcb(0, 0, client);
+
+	assert_non_null(vreq);
+	return vreq;
+}
+
+static td_vbd_request_t *
+nbdserver_submit_read(td_nbdserver_client_t *client, const char *handle,
+		      uint64_t from, uint32_t len)
+{
+	td_vbd_request_t *vreq;
+
+	vreq = nbdserver_submit(client, TAPDISK_NBD_CMD_READ, handle,
+				from, len);
+	assert_int_equal(vreq->op, TD_OP_READ);
+	assert_int_equal(vreq->iov->secs, len >> SECTOR_SHIFT);
+
+	return vreq;
+}
+
+static void
+nbdserver_client_setup(td_nbdserver_t *server, struct stats *stats,
+		       td_nbdserver_client_t **client)
+{
+	memset(server, 0, sizeof(*server));
+	memset(stats, 0, sizeof(*stats));
+	INIT_LIST_HEAD(&server->clients);
+	server->nbd_stats.stats = stats;
+
+	*client = tapdisk_nbdserver_alloc_client(server);
+	assert_non_null(*client);
+	(*client)->client_fd = 42;
+	n_sent = 0;
+}
+
+void
+test_nbdserver_read_reply_single_sendmsg(void **state)
+{
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq;
+	struct nbd_reply *reply;
+	void *buf;
+
+	nbdserver_client_setup(&server, &stats, &client);
+
+	vreq = nbdserver_submit_read(client, "handle01", 4096, 1024);
+	memset(vreq->iov->base, 0xab, 1024);
+	buf = vreq->iov->base;
+
+	/* reply and payload are gathered, the kernel only takes part of it */
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 2);
+	will_return(__wrap_sendmsg, 100);
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 1);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply) + 1024 - 100);
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	assert_int_equal(n_sent, sizeof(struct nbd_reply) + 1024);
+	reply = (struct nbd_reply *)sent;
+	assert_int_equal(reply->magic, htonl(NBD_REPLY_MAGIC));
+	assert_int_equal(reply->error, 0);
+	assert_memory_equal(reply->handle, "handle01", sizeof(reply->handle));
+	assert_memory_equal(sent + sizeof(*reply), buf, 1024);
+	assert_int_equal(stats.read_reqs_completed, 1);
+
+	/* the next request of the same size reuses the buffer */
+	vreq = nbdserver_submit_read(client, "handle01", 0, 1024);
+	assert_ptr_equal(vreq->iov->base, buf);
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 2);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply) + 1024);
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	tapdisk_nbdserver_free_client(client);
+}
+
+void
+test_nbdserver_structured_read_reply(void **state)
+{
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq;
+	struct nbd_structured_reply *reply;
+	uint64_t offset;
+
+	nbdserver_client_setup(&server, &stats, &client);
+	client->structured_reply = true;
+
+	/* DF goes straight to the read, and back in a single chunk */
+	vreq = nbdserver_submit(client,
+				TAPDISK_NBD_CMD_READ | NBD_CMD_FLAG_DF << 16,
+				"handle01", 8192, 512);
+	assert_int_equal(vreq->op, TD_OP_READ);
+	memset(vreq->iov->base, 0x5a, 512);
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 3);
+	will_return(__wrap_sendmsg, sizeof(*reply) + sizeof(offset) + 512);
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	assert_int_equal(n_sent, sizeof(*reply) + sizeof(offset) + 512);
+	reply = (struct nbd_structured_reply *)sent;
+	assert_int_equal(reply->magic, htobe32(NBD_STRUCTURED_REPLY_MAGIC));
+	assert_int_equal(reply->type, htobe16(NBD_REPLY_TYPE_OFFSET_DATA));
+	assert_int_equal(reply->flags, htobe16(NBD_REPLY_FLAG_DONE));
+	assert_int_equal(reply->length, htobe32(sizeof(offset) + 512));
+	memcpy(&offset, sent + sizeof(*reply), sizeof(offset));
+	assert_int_equal(be64toh(offset), 8192);
+	assert_int_equal((unsigned char)sent[sizeof(*reply) + sizeof(offset)],
+			 0x5a);
+
+	tapdisk_nbdserver_free_client(client);
+}
+
+static void
+nbdserver_add_extent(tapdisk_extents_t *extents, td_sector_t start,
+		     td_sector_t length, int flag)
+{
+	tapdisk_extent_t *extent = calloc(1, sizeof(*extent));
+
+	assert_non_null(extent);
+	extent->start = start;
+	extent->length = length;
+	extent->flag = flag;
+
+	if (extents->tail)
+		extents->tail->next = extent;
+	else
+		extents->head = extent;
+	extents->tail = extent;
+	extents->count++;
+}
+
+static void
+nbdserver_check_chunk(const char *buf, uint16_t type, uint16_t flags,
+		      uint32_t length, uint64_t offset)
+{
+	struct nbd_structured_reply reply;
+	uint64_t off;
+
+	memcpy(&reply, buf, sizeof(reply));
+	memcpy(&off, buf + sizeof(reply), sizeof(off));
+	assert_int_equal(reply.magic, htobe32(NBD_STRUCTURED_REPLY_MAGIC));
+	assert_int_equal(reply.type, htobe16(type));
+	assert_int_equal(reply.flags, htobe16(flags));
+	assert_int_equal(reply.length, htobe32(length));
+	assert_int_equal(be64toh(off), offset);
+}
+
+void
+test_nbdserver_structured_read_holes(void **state)
+{
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq, *requeued = NULL;
+	const size_t hole = sizeof(struct nbd_structured_reply) +
+		sizeof(struct nbd_structured_reply_offset_hole);
+	const size_t data = sizeof(struct nbd_structured_reply) +
+		sizeof(uint64_t) + 512;
+	uint32_t hole_size;
+
+	nbdserver_client_setup(&server, &stats, &client);
+	client->structured_reply = true;
+
+	/* the allocation is looked up first, and goes out in order */
+	vreq = nbdserver_submit(client, TAPDISK_NBD_CMD_READ, "handle01",
+				0, 3 * 512);
+	assert_int_equal(vreq->op, TD_OP_BLOCK_STATUS);
+	nbdserver_add_extent(vreq->data, 1, 1, TD_BLOCK_STATE_HOLE);
+	nbdserver_add_extent(vreq->data, 0, 1, TD_BLOCK_STATE_NONE);
+	nbdserver_add_extent(vreq->data, 2, 1, TD_BLOCK_STATE_NONE);
+
+	expect_check(__wrap_tapdisk_vbd_queue_request, vreq, capture_vreq,
+		     &requeued);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	vreq->cb(vreq, 0, vreq->token, 1);
+	assert_ptr_equal(requeued, vreq);
+	assert_int_equal(vreq->op, TD_OP_READ);
+	assert_int_equal(vreq->sec, 0);
+	assert_int_equal(vreq->iov->secs, 3);
+
+	memset(vreq->iov->base, 0x11, 512);
+	memset(vreq->iov->base + 1024, 0x33, 512);
+
+	/* the hole has no payload, only the last chunk is done */
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 5);
+	will_return(__wrap_sendmsg, hole + 2 * data);
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	assert_int_equal(n_sent, hole + 2 * data);
+	nbdserver_check_chunk(sent, NBD_REPLY_TYPE_OFFSET_DATA, 0,
+			      sizeof(uint64_t) + 512, 0);
+	assert_int_equal((unsigned char)sent[data - 1], 0x11);
+	nbdserver_check_chunk(sent + data, NBD_REPLY_TYPE_OFFSET_HOLE, 0,
+			      sizeof(struct nbd_structured_reply_offset_hole),
+			      512);
+	memcpy(&hole_size, sent + data + hole - sizeof(hole_size),
+	       sizeof(hole_size));
+	assert_int_equal(be32toh(hole_size), 512);
+	nbdserver_check_chunk(sent + hole + data, NBD_REPLY_TYPE_OFFSET_DATA,
+			      NBD_REPLY_FLAG_DONE, sizeof(uint64_t) + 512, 1024);
+	assert_int_equal((unsigned char)sent[hole + 2 * data - 1], 0x33);
+	assert_int_equal(stats.read_reqs_completed, 1);
+
+	/* nothing allocated, nothing to read */
+	n_sent = 0;
+	vreq = nbdserver_submit(client, TAPDISK_NBD_CMD_READ, "handle02",
+				4096, 3 * 512);
+	nbdserver_add_extent(vreq->data, 8, 3, TD_BLOCK_STATE_HOLE);
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 1);
+	will_return(__wrap_sendmsg, hole);
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	nbdserver_check_chunk(sent, NBD_REPLY_TYPE_OFFSET_HOLE,
+			      NBD_REPLY_FLAG_DONE,
+			      sizeof(struct nbd_structured_reply_offset_hole),
+			      4096);
+	memcpy(&hole_size, sent + hole - sizeof(hole_size), sizeof(hole_size));
+	assert_int_equal(be32toh(hole_size), 3 * 512);
+
+	/* no block status underneath, read it all and stop asking */
+	vreq = nbdserver_submit(client, TAPDISK_NBD_CMD_READ, "handle03",
+				0, 512);
+	expect_check(__wrap_tapdisk_vbd_queue_request, vreq, capture_vreq,
+		     &requeued);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	vreq->cb(vreq, -EOPNOTSUPP, vreq->token, 1);
+	assert_int_equal(vreq->op, TD_OP_READ);
+	assert_true(client->no_block_status);
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 3);
+	will_return(__wrap_sendmsg, data);
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	vreq = nbdserver_submit_read(client, "handle04", 0, 512);
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 3);
+	will_return(__wrap_sendmsg, data);
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	tapdisk_nbdserver_free_client(client);
+}
+
+void
+test_nbdserver_coalesce_extents(void **state)
+{
+	tapdisk_extents_t *extents = calloc(1, sizeof(*extents));
+	tapdisk_extent_t *extent;
+
+	assert_non_null(extents);
+
+	/* pieces from different images of the chain, out of order */
+	nbdserver_add_extent(extents, 8, 4, TD_BLOCK_STATE_HOLE);
+	nbdserver_add_extent(extents, 0, 4, TD_BLOCK_STATE_NONE);
+	nbdserver_add_extent(extents, 12, 4, TD_BLOCK_STATE_HOLE);
+	nbdserver_add_extent(extents, 4, 4, TD_BLOCK_STATE_NONE);
+	nbdserver_add_extent(extents, 16, 4, TD_BLOCK_STATE_NONE);
+
+	assert_int_equal(coalesce_extents(extents), 0);
+	assert_int_equal(extents->count, 3);
+
+	extent = extents->head;
+	assert_int_equal(extent->start, 0);
+	assert_int_equal(extent->length, 8);
+	assert_int_equal(extent->flag, TD_BLOCK_STATE_NONE);
+	extent = extent->next;
+	assert_int_equal(extent->start, 8);
+	assert_int_equal(extent->length, 8);
+	assert_int_equal(extent->flag, TD_BLOCK_STATE_HOLE);
+	extent = extent->next;
+	assert_int_equal(extent->start, 16);
+	assert_int_equal(extent->length, 4);
+	assert_ptr_equal(extent, extents->tail);
+	assert_null(extent->next);
+
+	free_extents(extents);
+}
+
+void
+test_nbdserver_write_partial_recv(void **state)
+{
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq = NULL;
+	struct nbd_request request;
+	char payload[1024];
+	char *hdr = (char *)&request;
+
+	nbdserver_client_setup(&server, &stats, &client);
+	nbdserver_make_request(&request, TAPDISK_NBD_CMD_WRITE, "handle02",
+			       512, sizeof(payload));
+	memset(payload, 0xcd, sizeof(payload));
+
+	/* only part of the header is there, nothing gets submitted */
+	expect_recv(42, hdr, 10);
+	expect_recv(42, NULL, -EAGAIN);
+	tapdisk_nbdserver_clientcb(0, 0, client);
+	assert_null(client->rx_req);
+
+	/* the rest of the header and half of the payload */
+	expect_recv(42, hdr + 10, sizeof(request) - 10);
+	expect_recv(42, payload, 512);
+	expect_recv(42, NULL, -EAGAIN);
+	tapdisk_nbdserver_clientcb(0, 0, client);
+	assert_non_null(client->rx_req);
+	assert_int_equal(stats.write_reqs_submitted, 1);
+
+	expect_recv(42, payload + 512, 512);
+	expect_check(__wrap_tapdisk_vbd_queue_request, vreq, capture_vreq,
+		     &vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	expect_recv(42, NULL, -EAGAIN);
+	tapdisk_nbdserver_clientcb(0, 0, client);
+
+	assert_non_null(vreq);
+	assert_null(client->rx_req);
+	assert_int_equal(vreq->op, TD_OP_WRITE);
+	assert_int_equal(vreq->sec, 1);
+	assert_int_equal(vreq->iov->secs, 2);
+	assert_memory_equal(vreq->iov->base, payload, sizeof(payload));
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 1);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply));
+	vreq->cb(vreq, 0, vreq->token, 1);
+	assert_int_equal(stats.write_reqs_completed, 1);
+
+	tapdisk_nbdserver_free_client(client);
+}
+
+void
+test_nbdserver_reply_would_block(void **state)
+{
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq1, *vreq2;
+	struct nbd_reply *reply;
+
+	nbdserver_client_setup(&server, &stats, &client);
+
+	vreq1 = nbdserver_submit_read(client, "handle01", 0, 512);
+	vreq2 = nbdserver_submit_read(client, "handle02", 512, 512);
+	assert_int_equal(tapdisk_nbdserver_reqs_pending(client), 2);
+
+	/* the second read completes first and the socket is full */
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 2);
+	will_return(__wrap_sendmsg, -EAGAIN);
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_WRITE_FD);
+	expect_value(__wrap_tapdisk_server_register_event, cb,
+		     tapdisk_nbdserver_writercb);
+	vreq2->cb(vreq2, 0, vreq2->token, 1);
+	assert_int_equal(n_sent, 0);
+
+	/* the first one queues up behind it */
+	vreq1->cb(vreq1, 0, vreq1->token, 1);
+	assert_int_equal(n_sent, 0);
+	assert_int_equal(tapdisk_nbdserver_reqs_pending(client), 2);
+
+	/* both go out in completion order once the socket drains */
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 2);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply) + 512);
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 2);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply) + 512);
+	expect_value(__wrap_tapdisk_server_unregister_event, event, 0);
+	tapdisk_nbdserver_writercb(0, SCHEDULER_POLL_WRITE_FD, client);
+
+	assert_int_equal(n_sent, 2 * (sizeof(struct nbd_reply) + 512));
+	reply = (struct nbd_reply *)sent;
+	assert_memory_equal(reply->handle, "handle02", sizeof(reply->handle));
+	reply = (struct nbd_reply *)(sent + sizeof(*reply) + 512);
+	assert_memory_equal(reply->handle, "handle01", sizeof(reply->handle));
+	assert_int_equal(tapdisk_nbdserver_reqs_pending(client), 0);
+
+	tapdisk_nbdserver_free_client(client);
+}
+
+void
+test_nbdserver_dataless_requests(void **state)
+{
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq;
+	struct nbd_reply *reply;
+
+	nbdserver_client_setup(&server, &stats, &client);
+
+	/* trims and zeroing take no buffer */
+	vreq = nbdserver_submit(client, TAPDISK_NBD_CMD_TRIM, "handle01",
+				1 << 20, 1 << 20);
+	assert_int_equal(vreq->op, TD_OP_DISCARD);
+	assert_int_equal(vreq->sec, (1 << 20) >> SECTOR_SHIFT);
+	assert_int_equal(vreq->iov->secs, (1 << 20) >> SECTOR_SHIFT);
+	assert_null(vreq->iov->base);
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 1);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply));
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	vreq = nbdserver_submit(client, TAPDISK_NBD_CMD_WRITE_ZEROES,
+				"handle02", 0, 4096);
+	assert_int_equal(vreq->op, TD_OP_WRITE_ZEROES);
+	assert_null(vreq->iov->base);
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 1);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply));
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	/* a flush covers one nominal sector */
+	vreq = nbdserver_submit(client, TAPDISK_NBD_CMD_FLUSH, "handle03",
+				0, 0);
+	assert_int_equal(vreq->op, TD_OP_FLUSH);
+	assert_int_equal(vreq->sec, 0);
+	assert_int_equal(vreq->iov->secs, 1);
+	assert_null(vreq->iov->base);
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 1);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply));
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	assert_int_equal(n_sent, 3 * sizeof(struct nbd_reply));
+	reply = (struct nbd_reply *)(sent + 2 * sizeof(*reply));
+	assert_int_equal(reply->error, 0);
+	assert_memory_equal(reply->handle, "handle03", sizeof(reply->handle));
+	assert_int_equal(tapdisk_nbdserver_reqs_pending(client), 0);
+
+	tapdisk_nbdserver_free_client(client);
+}
+
+void
+test_nbdserver_empty_trim_reply_send_fails(void **state)
+{
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq;
+	struct nbd_request request;
+
+	nbdserver_client_setup(&server, &stats, &client);
+
+	vreq = nbdserver_submit_read(client, "handle01", 0, 512);
+
+	/* the reply is left to the write event, the socket isn't touched */
+	nbdserver_make_request(&request, TAPDISK_NBD_CMD_TRIM, "handle02",
+			       0, 0);
+	expect_recv(42, &request, sizeof(request));
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_WRITE_FD);
+	expect_value(__wrap_tapdisk_server_register_event, cb,
+		     tapdisk_nbdserver_writercb);
+	expect_recv(42, NULL, -EAGAIN);
+	tapdisk_nbdserver_clientcb(0, 0, client);
+	assert_int_equal(n_sent, 0);
+	assert_int_equal(tapdisk_nbdserver_reqs_pending(client), 2);
+
+	/* the peer is gone, the client outlives it for the pending read */
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 1);
+	will_return(__wrap_sendmsg, -ECONNRESET);
+	expect_value(__wrap_tapdisk_server_unregister_event, event, 0);
+	tapdisk_nbdserver_writercb(0, SCHEDULER_POLL_WRITE_FD, client);
+	assert_true(client->dead);
+	assert_int_equal(client->client_fd, -1);
+	assert_int_equal(tapdisk_nbdserver_reqs_pending(client), 1);
+
+	/* and goes with it */
+	vreq->cb(vreq, 0, vreq->token, 1);
+	assert_int_equal(n_sent, 0);
+}
+
+void
+test_nbdserver_cache_reply(void **state)
+{
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq;
+
+	nbdserver_client_setup(&server, &stats, &client);
+
+	/* the range is read, but only the bare reply goes back */
+	vreq = nbdserver_submit(client, TAPDISK_NBD_CMD_CACHE, "handle01",
+				0, 8 << 20);
+	assert_int_equal(vreq->op, TD_OP_READ);
+	assert_int_equal(vreq->iov->secs, (2 << 20) >> SECTOR_SHIFT);
+	assert_non_null(vreq->iov->base);
+
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 1);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply));
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	assert_int_equal(n_sent, sizeof(struct nbd_reply));
+	assert_int_equal(stats.read_reqs_completed, 0);
+
+	tapdisk_nbdserver_free_client(client);
+}
+
+void
+test_nbdserver_per_client_stats(void **state)
+{
+	td_nbdserver_client_t *client1, *client2;
+	td_nbdserver_t server;
+	struct stats stats;
+	td_vbd_request_t *vreq;
+
+	nbdserver_client_setup(&server, &stats, &client1);
+	client2 = tapdisk_nbdserver_alloc_client(&server);
+	assert_non_null(client2);
+	client2->client_fd = 43;
+
+	/* both connections feed the same VBD, each keeps its own counts */
+	vreq = nbdserver_submit_read(client1, "handle01", 0, 1024);
+	expect_value(__wrap_sendmsg, fd, 42);
+	expect_value(__wrap_sendmsg, iovlen, 2);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply) + 1024);
+	vreq->cb(vreq, 0, vreq->token, 1);
+
+	vreq = nbdserver_submit_read(client2, "handle02", 4096, 512);
+	expect_value(__wrap_sendmsg, fd, 43);
+	expect_value(__wrap_sendmsg, iovlen, 2);
+	will_return(__wrap_sendmsg, sizeof(struct nbd_reply) + 512);
+	vreq->cb(vreq, -EIO, vreq->token, 1);
+
+	assert_int_equal(client1->stats.reqs_in, 1);
+	assert_int_equal(client1->stats.reqs_out, 1);
+	assert_int_equal(client1->stats.read_secs, 2);
+	assert_int_equal(client1->stats.errors, 0);
+	assert_int_equal(client2->stats.reqs_in, 1);
+	assert_int_equal(client2->stats.reqs_out, 1);
+	assert_int_equal(client2->stats.read_secs, 1);
+	assert_int_equal(client2->stats.errors, 1);
+	assert_int_equal(stats.read_reqs_completed, 2);
+	assert_int_equal(stats.io_errors, 1);
+
+	tapdisk_nbdserver_free_client(client2);
+	tapdisk_nbdserver_free_client(client1);
+}
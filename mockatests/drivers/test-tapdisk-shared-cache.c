@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "test-suites.h"
+
+#include "libvhd.h"
+#include "tapdisk-shared-cache.h"
+
+#define TEST_SECTOR_SIZE TD_SHARED_CACHE_SECTOR_SIZE
+
+static const td_shared_image_t image_a = { { 0x1111, 0x2222 }, 1 };
+static const td_shared_image_t image_b = { { 0x3333, 0x4444 }, 1 };
+
+static char path[64];
+
+static void
+sector_fill(char *buf, const td_shared_image_t *image, uint64_t sector)
+{
+	int i;
+
+	for (i = 0; i < TEST_SECTOR_SIZE; i++)
+		buf[i] = (char)(image->id[0] + sector * 7 + i);
+}
+
+static void
+shared_cache_setup(const char *mb)
+{
+	snprintf(path, sizeof(path), "/tmp/test-shared-cache.%d", getpid());
+	unlink(path);
+
+	setenv("TAPDISK3_SHARED_CACHE_PATH", path, 1);
+	setenv("TAPDISK3_SHARED_CACHE_SIZE", mb, 1);
+	assert_int_equal(tapdisk_shared_cache_get(), 0);
+}
+
+static void
+shared_cache_teardown(void)
+{
+	tapdisk_shared_cache_put();
+	unlink(path);
+	unsetenv("TAPDISK3_SHARED_CACHE_PATH");
+	unsetenv("TAPDISK3_SHARED_CACHE_SIZE");
+}
+
+/* Test that without a size the shared cache is off */
+void
+test_shared_cache_disabled(void **state)
+{
+	unsetenv("TAPDISK3_SHARED_CACHE_SIZE");
+	assert_int_equal(tapdisk_shared_cache_get(), -ENOENT);
+}
+
+/* Test that a sector reads back as written, for its own image only */
+void
+test_shared_cache_read_write(void **state)
+{
+	char in[TEST_SECTOR_SIZE], out[TEST_SECTOR_SIZE];
+
+	shared_cache_setup("2");
+
+	sector_fill(in, &image_a, 5);
+	assert_int_equal(tapdisk_shared_cache_read(&image_a, 5, out), -ENOENT);
+	assert_int_equal(tapdisk_shared_cache_write(&image_a, 5, in), 0);
+
+	assert_int_equal(tapdisk_shared_cache_read(&image_a, 5, out), 0);
+	assert_memory_equal(in, out, TEST_SECTOR_SIZE);
+
+	assert_int_equal(tapdisk_shared_cache_read(&image_a, 6, out), -ENOENT);
+	assert_int_equal(tapdisk_shared_cache_read(&image_b, 5, out), -ENOENT);
+
+	shared_cache_teardown();
+}
+
+/* Test that sectors outlive the tapdisk that cached them */
+void
+test_shared_cache_reattach(void **state)
+{
+	char in[TEST_SECTOR_SIZE], out[TEST_SECTOR_SIZE];
+
+	shared_cache_setup("2");
+
+	sector_fill(in, &image_a, 9);
+	assert_int_equal(tapdisk_shared_cache_write(&image_a, 9, in), 0);
+	tapdisk_shared_cache_put();
+
+	/* a different size does not reformat it */
+	setenv("TAPDISK3_SHARED_CACHE_SIZE", "4", 1);
+	assert_int_equal(tapdisk_shared_cache_get(), 0);
+	assert_int_equal(tapdisk_shared_cache_read(&image_a, 9, out), 0);
+	assert_memory_equal(in, out, TEST_SECTOR_SIZE);
+
+	shared_cache_teardown();
+}
+
+/* Test that another process reads what this one cached, and back */
+void
+test_shared_cache_across_processes(void **state)
+{
+	char in[TEST_SECTOR_SIZE], out[TEST_SECTOR_SIZE];
+	int status;
+	pid_t pid;
+
+	shared_cache_setup("2");
+
+	sector_fill(in, &image_a, 1);
+	assert_int_equal(tapdisk_shared_cache_write(&image_a, 1, in), 0);
+	tapdisk_shared_cache_put();
+
+	pid = fork();
+	assert_true(pid >= 0);
+	if (!pid) {
+		if (tapdisk_shared_cache_get() ||
+		    tapdisk_shared_cache_read(&image_a, 1, out) ||
+		    memcmp(in, out, TEST_SECTOR_SIZE))
+			_exit(1);
+		sector_fill(in, &image_b, 2);
+		_exit(!!tapdisk_shared_cache_write(&image_b, 2, in));
+	}
+
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	assert_int_equal(tapdisk_shared_cache_get(), 0);
+	sector_fill(in, &image_b, 2);
+	assert_int_equal(tapdisk_shared_cache_read(&image_b, 2, out), 0);
+	assert_memory_equal(in, out, TEST_SECTOR_SIZE);
+
+	shared_cache_teardown();
+}
+
+/* Test that a full cache makes room by evicting, keeping recent sectors */
+void
+test_shared_cache_evicts_oldest(void **state)
+{
+	char in[TEST_SECTOR_SIZE], out[TEST_SECTOR_SIZE];
+	td_shared_cache_info_t info;
+	uint64_t sector, sectors;
+
+	shared_cache_setup("2");
+
+	tapdisk_shared_cache_info(&info);
+	sectors = info.slots * 2;
+
+	for (sector = 0; sector < sectors; sector++) {
+		sector_fill(in, &image_a, sector);
+		assert_int_equal(tapdisk_shared_cache_write(&image_a, sector,
+							    in), 0);
+	}
+
+	tapdisk_shared_cache_info(&info);
+	assert_int_equal(info.inserts, sectors);
+	assert_true(info.evictions >= sectors - info.slots);
+
+	/* the last sector written cannot have been evicted yet */
+	sector_fill(in, &image_a, sectors - 1);
+	assert_int_equal(tapdisk_shared_cache_read(&image_a, sectors - 1,
+						   out), 0);
+	assert_memory_equal(in, out, TEST_SECTOR_SIZE);
+
+	shared_cache_teardown();
+}
+
+/* Test that a segment others could read, reach or forge is not mapped */
+void
+test_shared_cache_refuses_unsafe_segment(void **state)
+{
+	uint64_t sets = UINT64_MAX / 8;
+	char link[80];
+	int fd;
+
+	shared_cache_setup("2");
+	tapdisk_shared_cache_put();
+
+	assert_int_equal(chmod(path, 0644), 0);
+	assert_int_equal(tapdisk_shared_cache_get(), -EPERM);
+	assert_int_equal(chmod(path, 0600), 0);
+
+	snprintf(link, sizeof(link), "%s.link", path);
+	unlink(link);
+	assert_int_equal(symlink(path, link), 0);
+	setenv("TAPDISK3_SHARED_CACHE_PATH", link, 1);
+	assert_int_equal(tapdisk_shared_cache_get(), -ELOOP);
+	setenv("TAPDISK3_SHARED_CACHE_PATH", path, 1);
+	unlink(link);
+
+	/* a layout claiming more sets than fit */
+	fd = open(path, O_WRONLY);
+	assert_true(fd >= 0);
+	assert_int_equal(pwrite(fd, &sets, sizeof(sets), 24), sizeof(sets));
+	close(fd);
+	assert_int_equal(tapdisk_shared_cache_get(), -EINVAL);
+
+	unlink(path);
+	assert_int_equal(tapdisk_shared_cache_get(), 0);
+	shared_cache_teardown();
+}
+
+/* Test that tapdisk's mlockall does not fault in the whole segment */
+void
+test_shared_cache_faults_in_on_use(void **state)
+{
+	unsigned char vec;
+	long page;
+	void *map;
+	int fd;
+
+	if (mlockall(MCL_FUTURE))
+		skip();
+
+	/* on tmpfs, as by default, where faults do not read ahead */
+	snprintf(path, sizeof(path), "/dev/shm/test-shared-cache.%d",
+		 getpid());
+	unlink(path);
+	setenv("TAPDISK3_SHARED_CACHE_PATH", path, 1);
+	setenv("TAPDISK3_SHARED_CACHE_SIZE", "4", 1);
+	assert_int_equal(tapdisk_shared_cache_get(), 0);
+	munlockall();
+
+	/* the pages of the segment, rather than our mapping of them */
+	page = sysconf(_SC_PAGESIZE);
+	fd = open(path, O_RDONLY);
+	assert_true(fd >= 0);
+	map = mmap(NULL, 4 << 20, PROT_READ, MAP_SHARED, fd, 0);
+	assert_true(map != MAP_FAILED);
+	assert_int_equal(mincore((char *)map + (4 << 20) - page, page, &vec), 0);
+	assert_int_equal(vec & 1, 0);
+	munmap(map, 4 << 20);
+	close(fd);
+
+	shared_cache_teardown();
+}
+
+/* Test that an image rewritten in place no longer finds its old sectors */
+void
+test_shared_image_follows_rewrites(void **state)
+{
+	td_shared_image_t before, again, after;
+	char vhd[64];
+	int fd;
+
+	snprintf(vhd, sizeof(vhd), "/tmp/test-shared-image.%d.vhd", getpid());
+	unlink(vhd);
+	assert_int_equal(vhd_create(vhd, 8 << 20, HD_TYPE_DYNAMIC, 0, 0), 0);
+
+	assert_int_equal(tapdisk_shared_image_vhd(vhd, &before), 0);
+	assert_int_equal(tapdisk_shared_image_vhd(vhd, &again), 0);
+	assert_memory_equal(&before, &again, sizeof(before));
+
+	/* the footer stays as it was */
+	fd = open(vhd, O_WRONLY);
+	assert_true(fd >= 0);
+	assert_int_equal(pwrite(fd, "x", 1, 3 * TEST_SECTOR_SIZE), 1);
+	close(fd);
+
+	assert_int_equal(tapdisk_shared_image_vhd(vhd, &after), 0);
+	assert_memory_equal(before.id, after.id, sizeof(before.id));
+	assert_true(before.gen != after.gen);
+
+	unlink(vhd);
+}
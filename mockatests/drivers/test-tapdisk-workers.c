@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test-suites.h"
+
+#include "tapdisk-workers.h"
+#include "scheduler.h"
+
+#define TEST_WORKS 512
+
+struct test_work {
+	td_work_t           work;
+	pthread_t           ran_on;
+	int                 ran;
+	int                 done;
+	int                 order;
+};
+
+static struct test_work works[TEST_WORKS];
+static int nr_done;
+static int blocked;
+static int release;
+
+static void
+test_work_fn(td_work_t *work)
+{
+	struct test_work *tw = (struct test_work *)work;
+
+	tw->ran_on = pthread_self();
+	__atomic_add_fetch(&tw->ran, 1, __ATOMIC_RELEASE);
+}
+
+static void
+test_work_block_fn(td_work_t *work)
+{
+	__atomic_store_n(&blocked, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&release, __ATOMIC_ACQUIRE))
+		usleep(100);
+
+	test_work_fn(work);
+}
+
+static void
+test_work_done(td_work_t *work)
+{
+	struct test_work *tw = (struct test_work *)work;
+
+	tw->done++;
+	tw->order = nr_done++;
+}
+
+static void
+workers_setup(int nr)
+{
+	memset(works, 0, sizeof(works));
+	nr_done = blocked = release = 0;
+
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_READ_FD);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	assert_int_equal(tapdisk_workers_get(TD_WORKERS_CPU, nr), 0);
+}
+
+static void
+workers_reap_all(int nr)
+{
+	int tries;
+
+	for (tries = 0; nr_done < nr && tries < 10000; tries++) {
+		tapdisk_workers_reap();
+		if (nr_done < nr)
+			usleep(100);
+	}
+	assert_int_equal(nr_done, nr);
+}
+
+static void
+workers_teardown(void)
+{
+	expect_value(__wrap_tapdisk_server_unregister_event, event, 0);
+	tapdisk_workers_put(TD_WORKERS_CPU);
+}
+
+/* Test that queued work runs once off the tapdisk thread, and completes
+ * on it, in reap */
+void
+test_workers_queue_and_reap(void **state)
+{
+	int i;
+
+	workers_setup(4);
+
+	for (i = 0; i < TEST_WORKS; i++) {
+		works[i].work.fn   = test_work_fn;
+		works[i].work.done = test_work_done;
+		tapdisk_workers_queue(TD_WORKERS_CPU, &works[i].work);
+	}
+
+	workers_reap_all(TEST_WORKS);
+
+	for (i = 0; i < TEST_WORKS; i++) {
+		assert_int_equal(works[i].ran, 1);
+		assert_int_equal(works[i].done, 1);
+		assert_false(pthread_equal(works[i].ran_on, pthread_self()));
+	}
+
+	workers_teardown();
+}
+
+/* Test that work queued to saturated workers runs in the caller, with
+ * its completion still deferred to reap */
+void
+test_workers_inline_when_full(void **state)
+{
+	int i;
+
+	workers_setup(1);
+
+	works[0].work.fn   = test_work_block_fn;
+	works[0].work.done = test_work_done;
+	tapdisk_workers_queue(TD_WORKERS_CPU, &works[0].work);
+	while (!__atomic_load_n(&blocked, __ATOMIC_ACQUIRE))
+		usleep(100);
+
+	/* fills the ring, the last one cannot go */
+	for (i = 1; i < TEST_WORKS; i++) {
+		works[i].work.fn   = test_work_fn;
+		works[i].work.done = test_work_done;
+		tapdisk_workers_queue(TD_WORKERS_CPU, &works[i].work);
+	}
+
+	assert_int_equal(works[TEST_WORKS - 1].ran, 1);
+	assert_true(pthread_equal(works[TEST_WORKS - 1].ran_on,
+				  pthread_self()));
+	assert_int_equal(works[TEST_WORKS - 1].done, 0);
+
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	workers_reap_all(TEST_WORKS);
+
+	for (i = 0; i < TEST_WORKS; i++)
+		assert_int_equal(works[i].done, 1);
+
+	workers_teardown();
+}
+
+/* Test that blocking work holds up nothing queued to the cpu pool */
+void
+test_workers_sync_pool_apart(void **state)
+{
+	int i;
+
+	workers_setup(1);
+
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_READ_FD);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	assert_int_equal(tapdisk_workers_get(TD_WORKERS_SYNC, 1), 0);
+
+	works[0].work.fn   = test_work_block_fn;
+	works[0].work.done = test_work_done;
+	tapdisk_workers_queue(TD_WORKERS_SYNC, &works[0].work);
+	while (!__atomic_load_n(&blocked, __ATOMIC_ACQUIRE))
+		usleep(100);
+
+	for (i = 1; i < 64; i++) {
+		works[i].work.fn   = test_work_fn;
+		works[i].work.done = test_work_done;
+		tapdisk_workers_queue(TD_WORKERS_CPU, &works[i].work);
+	}
+
+	workers_reap_all(63);
+	assert_int_equal(works[0].done, 0);
+	for (i = 1; i < 64; i++)
+		assert_false(pthread_equal(works[i].ran_on, pthread_self()));
+
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	workers_reap_all(64);
+	assert_int_equal(works[0].done, 1);
+
+	expect_value(__wrap_tapdisk_server_unregister_event, event, 0);
+	tapdisk_workers_put(TD_WORKERS_SYNC);
+	workers_teardown();
+}
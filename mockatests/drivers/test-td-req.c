@@ -0,0 +1,716 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "test-suites.h"
+#include "td-req.h"
+#include "td-blkif.h"
+#include "td-ctx.h"
+#include "tapdisk-server.h"
+#include "tapdisk-metrics.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-utils.h"
+
+/*
+ * Guest memory, a page per grant reference. Grant 0 is used for the
+ * indirect page, data pages start at grant 1.
+ */
+#define GUEST_PAGES (TD_REQ_MAX_SEGMENTS + 2)
+#define GUEST_INDIRECT_GREF 0
+
+static uint8_t *guest_mem;
+static int guest_grant_copies;
+
+static uint8_t *
+guest_page(grant_ref_t gref)
+{
+	assert_true(gref < GUEST_PAGES);
+	return guest_mem + ((size_t)gref << PAGE_SHIFT);
+}
+
+int __real_ioctl(int fd, unsigned long request, ...);
+
+/*
+ * Emulates IOCTL_GNTDEV_GRANT_COPY against guest_mem, everything else goes
+ * to the real ioctl.
+ */
+int
+__wrap_ioctl(int fd, unsigned long request, ...)
+{
+	struct ioctl_gntdev_grant_copy *gcopy;
+	unsigned int i;
+	va_list ap;
+
+	va_start(ap, request);
+	gcopy = va_arg(ap, void *);
+	va_end(ap);
+
+	if (request != IOCTL_GNTDEV_GRANT_COPY)
+		return __real_ioctl(fd, request, gcopy);
+
+	guest_grant_copies++;
+
+	for (i = 0; i < gcopy->count; i++) {
+		struct gntdev_grant_copy_segment *seg = &gcopy->segments[i];
+
+		if (seg->flags & GNTCOPY_source_gref) {
+			assert_true(seg->source.foreign.offset + seg->len <= PAGE_SIZE);
+			memcpy(seg->dest.virt,
+			       guest_page(seg->source.foreign.ref) +
+			       seg->source.foreign.offset, seg->len);
+		} else {
+			assert_true(seg->flags & GNTCOPY_dest_gref);
+			assert_true(seg->dest.foreign.offset + seg->len <= PAGE_SIZE);
+			memcpy(guest_page(seg->dest.foreign.ref) +
+			       seg->dest.foreign.offset, seg->source.virt, seg->len);
+		}
+		seg->status = GNTST_okay;
+	}
+
+	return 0;
+}
+
+static int guest_maps, guest_unmaps;
+static bool guest_maps_fail;
+
+void *
+__wrap_xengnttab_map_grant_ref(xengnttab_handle *xgt, uint32_t domid,
+                               uint32_t ref, int prot)
+{
+	if (guest_maps_fail)
+		return NULL;
+	guest_maps++;
+	return guest_page(ref);
+}
+
+int
+__wrap_xengnttab_unmap(xengnttab_handle *xgt, void *start_address,
+                       uint32_t count)
+{
+	assert_int_equal(count, 1);
+	guest_unmaps++;
+	return 0;
+}
+
+struct req_state {
+	struct td_xenblkif blkif;
+	struct td_xenio_ctx ctx;
+	struct stats stats;
+	blkif_sring_t *sring;
+};
+
+static void
+expect_bufcache_timer(void)
+{
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+	             SCHEDULER_POLL_TIMEOUT);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+}
+
+int
+xenblkif_req_setup(void **state)
+{
+	struct req_state *s;
+	size_t i;
+
+	/* normally set up by tapdisk_server_init */
+	PAGE_SIZE = 4096;
+	PAGE_SHIFT = 12;
+
+	s = calloc(1, sizeof(*s));
+	assert_non_null(s);
+
+	guest_mem = calloc(GUEST_PAGES, PAGE_SIZE);
+	assert_non_null(guest_mem);
+	for (i = 0; i < (size_t)GUEST_PAGES << PAGE_SHIFT; i++)
+		guest_mem[i] = (uint8_t)(i * 7 + (i >> PAGE_SHIFT));
+	guest_grant_copies = 0;
+	guest_maps = guest_unmaps = 0;
+	guest_maps_fail = false;
+
+	s->sring = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	assert_non_null(s->sring);
+	SHARED_RING_INIT(s->sring);
+
+	s->ctx.gntdev_fd = -1;
+	s->blkif.ctx = &s->ctx;
+	s->blkif.proto = BLKIF_PROTOCOL_NATIVE;
+	s->blkif.vbd_stats.stats = &s->stats;
+	s->blkif.chkrng_event = -1;
+	BACK_RING_INIT(&s->blkif.rings.native, s->sring, PAGE_SIZE);
+
+	expect_bufcache_timer();
+	assert_int_equal(tapdisk_xenblkif_reqs_init(&s->blkif), 0);
+
+	*state = s;
+	return 0;
+}
+
+int
+xenblkif_req_teardown(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+
+	td_pgrant_pool_free(blkif);
+	assert_int_equal(guest_maps, guest_unmaps);
+
+	while (blkif->n_reqs_bufcache_free)
+		munmap(blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free],
+		       TD_REQ_BUFFER_SIZE);
+	tapdisk_xenblkif_reqs_free(blkif);
+
+	free(s->sring);
+	free(s);
+	free(guest_mem);
+	guest_mem = NULL;
+	return 0;
+}
+
+/*
+ * Takes a free request and fills it in as an indirect request whose segment
+ * descriptors live in the guest's indirect page.
+ */
+static struct td_xenblkif_req *
+make_indirect(struct td_xenblkif *blkif, uint8_t op, int nr_segs,
+              uint8_t first_sect, uint8_t last_sect)
+{
+	blkif_request_t *msg = blkif->reqs_free[blkif->ring_size -
+	                                        blkif->n_reqs_free--];
+	blkif_request_indirect_t *ind = (blkif_request_indirect_t *)msg;
+	struct blkif_request_segment *segs;
+	int i;
+
+	memset(msg, 0, sizeof(*msg));
+	ind->operation = BLKIF_OP_INDIRECT;
+	ind->indirect_op = op;
+	ind->nr_segments = nr_segs;
+	ind->id = 0xabcd;
+	ind->sector_number = 2048;
+	ind->handle = 51712;
+	ind->indirect_grefs[0] = GUEST_INDIRECT_GREF;
+
+	segs = (void *)guest_page(GUEST_INDIRECT_GREF);
+	for (i = 0; i < nr_segs && i < BLKIF_SEGS_PER_INDIRECT_FRAME; i++) {
+		segs[i].gref = i + 1;
+		segs[i].first_sect = first_sect;
+		segs[i].last_sect = last_sect;
+	}
+
+	return msg_to_tapreq(msg);
+}
+
+/*
+ * Takes a free request and fills it in as a direct request of whole pages,
+ * starting at grant 1.
+ */
+static struct td_xenblkif_req *
+make_direct(struct td_xenblkif *blkif, uint8_t op, int nr_segs)
+{
+	blkif_request_t *msg = blkif->reqs_free[blkif->ring_size -
+	                                        blkif->n_reqs_free--];
+	int i;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->operation = op;
+	msg->nr_segments = nr_segs;
+	msg->id = 0x1234;
+	msg->sector_number = 64;
+	for (i = 0; i < nr_segs; i++) {
+		msg->seg[i].gref = i + 1;
+		msg->seg[i].first_sect = 0;
+		msg->seg[i].last_sect = 7;
+	}
+
+	return msg_to_tapreq(msg);
+}
+
+static blkif_response_t *
+last_response(struct td_xenblkif *blkif)
+{
+	blkif_back_ring_t *ring = &blkif->rings.native;
+
+	assert_true(ring->rsp_prod_pvt > 0);
+	return RING_GET_RESPONSE(ring, ring->rsp_prod_pvt - 1);
+}
+
+void
+test_xenblkif_indirect_write(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+	const int nr_segs = 40;
+	struct td_xenblkif_req *req;
+	blkif_request_t *msg;
+	blkif_response_t *rsp;
+	int i;
+
+	req = make_indirect(blkif, BLKIF_OP_WRITE, nr_segs, 0, 7);
+	msg = &req->msg;
+
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &req->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	tapdisk_xenblkif_queue_requests(blkif, &msg, 1);
+
+	/* one copy for the descriptors, one for the data */
+	assert_int_equal(guest_grant_copies, 2);
+	assert_int_equal(blkif->stats.indirect, 1);
+	assert_int_equal(req->nr_segments, nr_segs);
+	assert_int_equal(msg->operation, BLKIF_OP_WRITE);
+
+	/* whole pages are merged into a single I/O vector */
+	assert_int_equal(req->vreq.iovcnt, 1);
+	assert_int_equal(req->vreq.iov[0].secs, nr_segs * 8);
+	assert_int_equal(req->vreq.sec, 2048);
+	assert_int_equal(s->stats.write_sectors, nr_segs * 8);
+	for (i = 0; i < nr_segs; i++)
+		assert_memory_equal((uint8_t *)req->vma + ((size_t)i << PAGE_SHIFT),
+		                    guest_page(i + 1), PAGE_SIZE);
+
+	expect_bufcache_timer();
+	req->vreq.cb(&req->vreq, 0, req->vreq.token, 1);
+
+	rsp = last_response(blkif);
+	assert_int_equal(rsp->id, 0xabcd);
+	assert_int_equal(rsp->operation, BLKIF_OP_WRITE);
+	assert_int_equal(rsp->status, BLKIF_RSP_OKAY);
+	assert_int_equal(blkif->n_reqs_free, blkif->ring_size);
+}
+
+void
+test_xenblkif_indirect_read(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+	const int nr_segs = TD_REQ_MAX_SEGMENTS;
+	struct td_xenblkif_req *req;
+	blkif_request_t *msg;
+	blkif_response_t *rsp;
+	int i;
+
+	req = make_indirect(blkif, BLKIF_OP_READ, nr_segs, 0, 7);
+	msg = &req->msg;
+
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &req->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	tapdisk_xenblkif_queue_requests(blkif, &msg, 1);
+
+	/* reads only fetch the descriptors up front */
+	assert_int_equal(guest_grant_copies, 1);
+	assert_int_equal(req->vreq.iovcnt, 1);
+	assert_int_equal(req->vreq.iov[0].secs, nr_segs * 8);
+
+	memset(req->vreq.iov[0].base, 0x5a, TD_REQ_BUFFER_SIZE);
+
+	expect_bufcache_timer();
+	req->vreq.cb(&req->vreq, 0, req->vreq.token, 1);
+
+	assert_int_equal(guest_grant_copies, 2);
+	for (i = 1; i <= nr_segs; i++) {
+		uint8_t *page = guest_page(i);
+		assert_int_equal(page[0], 0x5a);
+		assert_int_equal(page[PAGE_SIZE - 1], 0x5a);
+	}
+
+	rsp = last_response(blkif);
+	assert_int_equal(rsp->operation, BLKIF_OP_READ);
+	assert_int_equal(rsp->status, BLKIF_RSP_OKAY);
+}
+
+void
+test_xenblkif_indirect_bad_op(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+	struct td_xenblkif_req *req;
+	blkif_request_t *msg;
+	blkif_response_t *rsp;
+
+	req = make_indirect(blkif, BLKIF_OP_WRITE_BARRIER, 4, 0, 7);
+	msg = &req->msg;
+
+	tapdisk_xenblkif_queue_requests(blkif, &msg, 1);
+
+	assert_int_equal(guest_grant_copies, 0);
+	assert_int_equal(blkif->stats.errors.map, 1);
+	rsp = last_response(blkif);
+	assert_int_equal(rsp->id, 0xabcd);
+	assert_int_equal(rsp->status, BLKIF_RSP_ERROR);
+	assert_int_equal(blkif->n_reqs_free, blkif->ring_size);
+}
+
+void
+test_xenblkif_indirect_too_many_segments(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+	struct td_xenblkif_req *req;
+	blkif_request_t *msg;
+	blkif_response_t *rsp;
+
+	req = make_indirect(blkif, BLKIF_OP_READ, TD_REQ_MAX_SEGMENTS + 1, 0, 7);
+	msg = &req->msg;
+
+	tapdisk_xenblkif_queue_requests(blkif, &msg, 1);
+
+	assert_int_equal(guest_grant_copies, 0);
+	rsp = last_response(blkif);
+	assert_int_equal(rsp->operation, BLKIF_OP_READ);
+	assert_int_equal(rsp->status, BLKIF_RSP_ERROR);
+}
+
+void
+test_xenblkif_indirect_sectors_beyond_page(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+	struct td_xenblkif_req *req;
+	blkif_request_t *msg;
+	blkif_response_t *rsp;
+
+	req = make_indirect(blkif, BLKIF_OP_WRITE, 2, 0, 8);
+	msg = &req->msg;
+
+	/* the buffer goes back to an idle cache */
+	expect_bufcache_timer();
+	tapdisk_xenblkif_queue_requests(blkif, &msg, 1);
+
+	rsp = last_response(blkif);
+	assert_int_equal(rsp->status, BLKIF_RSP_ERROR);
+	assert_int_equal(blkif->n_reqs_free, blkif->ring_size);
+}
+
+void
+test_xenblkif_direct_too_many_segments(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+	blkif_request_t *msg;
+	blkif_response_t *rsp;
+
+	msg = blkif->reqs_free[blkif->ring_size - blkif->n_reqs_free--];
+	memset(msg, 0, sizeof(*msg));
+	msg->operation = BLKIF_OP_WRITE;
+	msg->nr_segments = BLKIF_MAX_SEGMENTS_PER_REQUEST + 1;
+	msg->id = 7;
+
+	tapdisk_xenblkif_queue_requests(blkif, &msg, 1);
+
+	assert_int_equal(guest_grant_copies, 0);
+	rsp = last_response(blkif);
+	assert_int_equal(rsp->id, 7);
+	assert_int_equal(rsp->status, BLKIF_RSP_ERROR);
+}
+
+void
+test_xenblkif_discard_chunks(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+	struct td_xenblkif_req *req;
+	blkif_request_discard_t *dis;
+	blkif_request_t *msg;
+	blkif_response_t *rsp;
+
+	msg = blkif->reqs_free[blkif->ring_size - blkif->n_reqs_free--];
+	memset(msg, 0, sizeof(*msg));
+	dis = (blkif_request_discard_t *)msg;
+	dis->operation = BLKIF_OP_DISCARD;
+	dis->id = 0x5678;
+	dis->sector_number = 1000;
+	dis->nr_sectors = 2 * TD_REQ_DISCARD_SECS;
+	req = msg_to_tapreq(msg);
+
+	/* the first chunk ends at the next chunk boundary */
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &req->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	tapdisk_xenblkif_queue_requests(blkif, &msg, 1);
+
+	assert_int_equal(guest_grant_copies, 0);
+	assert_null(req->vma);
+	assert_int_equal(req->vreq.op, TD_OP_DISCARD);
+	assert_int_equal(req->vreq.sec, 1000);
+	assert_int_equal(req->vreq.iov[0].secs, TD_REQ_DISCARD_SECS - 1000);
+	assert_null(req->vreq.iov[0].base);
+
+	/* each completed chunk queues the next one */
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &req->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	req->vreq.cb(&req->vreq, 0, req->vreq.token, 1);
+	assert_int_equal(req->vreq.sec, TD_REQ_DISCARD_SECS);
+	assert_int_equal(req->vreq.iov[0].secs, TD_REQ_DISCARD_SECS);
+
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &req->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	req->vreq.cb(&req->vreq, 0, req->vreq.token, 1);
+	assert_int_equal(req->vreq.sec, 2 * TD_REQ_DISCARD_SECS);
+	assert_int_equal(req->vreq.iov[0].secs, 1000);
+	assert_int_equal(blkif->n_reqs_free, blkif->ring_size - 1);
+
+	req->vreq.cb(&req->vreq, 0, req->vreq.token, 1);
+
+	rsp = last_response(blkif);
+	assert_int_equal(rsp->id, 0x5678);
+	assert_int_equal(rsp->operation, BLKIF_OP_DISCARD);
+	assert_int_equal(rsp->status, BLKIF_RSP_OKAY);
+	assert_int_equal(blkif->n_reqs_free, blkif->ring_size);
+}
+
+/*
+ * A discard chunk completing last in a batch must still push the responses
+ * the rest of the batch left on the ring, although the discard itself
+ * carries on.
+ */
+void
+test_xenblkif_discard_chunk_pushes_batch(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+	struct td_xenblkif_req *read, *req;
+	blkif_request_discard_t *dis;
+	blkif_request_t *msgs[2];
+
+	read = make_direct(blkif, BLKIF_OP_READ, 1);
+	msgs[0] = &read->msg;
+
+	msgs[1] = blkif->reqs_free[blkif->ring_size - blkif->n_reqs_free--];
+	memset(msgs[1], 0, sizeof(*msgs[1]));
+	dis = (blkif_request_discard_t *)msgs[1];
+	dis->operation = BLKIF_OP_DISCARD;
+	dis->id = 0x5678;
+	dis->sector_number = 0;
+	dis->nr_sectors = 2 * TD_REQ_DISCARD_SECS;
+	req = msg_to_tapreq(msgs[1]);
+
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &read->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &req->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	tapdisk_xenblkif_queue_requests(blkif, msgs, 2);
+
+	/* the read completes first in the batch, and is not pushed yet */
+	read->vreq.cb(&read->vreq, 0, read->vreq.token, 0);
+	assert_int_equal(blkif->rings.native.rsp_prod_pvt, 1);
+	assert_int_equal(s->sring->rsp_prod, 0);
+
+	/* the first discard chunk ends the batch */
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &req->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	req->vreq.cb(&req->vreq, 0, req->vreq.token, 1);
+	assert_int_equal(req->vreq.sec, TD_REQ_DISCARD_SECS);
+	assert_int_equal(s->sring->rsp_prod, 1);
+	assert_int_equal(last_response(blkif)->id, 0x1234);
+
+	req->vreq.cb(&req->vreq, 0, req->vreq.token, 1);
+	assert_int_equal(s->sring->rsp_prod, 2);
+	assert_int_equal(last_response(blkif)->id, 0x5678);
+	assert_int_equal(blkif->n_reqs_free, blkif->ring_size);
+}
+
+static void
+queue_and_complete_write(struct td_xenblkif *blkif, int nr_segs)
+{
+	struct td_xenblkif_req *req;
+	blkif_request_t *msg;
+	int i;
+
+	req = make_direct(blkif, BLKIF_OP_WRITE, nr_segs);
+	msg = &req->msg;
+
+	expect_value(__wrap_tapdisk_vbd_queue_request, vreq, &req->vreq);
+	will_return(__wrap_tapdisk_vbd_queue_request, 0);
+	tapdisk_xenblkif_queue_requests(blkif, &msg, 1);
+
+	for (i = 0; i < nr_segs; i++)
+		assert_memory_equal((uint8_t *)req->vma + ((size_t)i << PAGE_SHIFT),
+		                    guest_page(i + 1), PAGE_SIZE);
+
+	expect_bufcache_timer();
+	req->vreq.cb(&req->vreq, 0, req->vreq.token, 1);
+	assert_int_equal(last_response(blkif)->status, BLKIF_RSP_OKAY);
+}
+
+void
+test_xenblkif_pgrant_write(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+
+	setenv("TAPDISK3_PERSISTENT_GRANTS", "8", 1);
+	assert_int_equal(td_pgrant_pool_init(blkif), 0);
+	unsetenv("TAPDISK3_PERSISTENT_GRANTS");
+	assert_int_equal(blkif->pgrants.size, 8);
+
+	queue_and_complete_write(blkif, 3);
+	assert_int_equal(blkif->stats.pgrants.misses, 3);
+	assert_int_equal(blkif->stats.pgrants.hits, 0);
+	assert_int_equal(guest_maps, 3);
+
+	queue_and_complete_write(blkif, 3);
+	assert_int_equal(blkif->stats.pgrants.misses, 3);
+	assert_int_equal(blkif->stats.pgrants.hits, 3);
+	assert_int_equal(guest_maps, 3);
+
+	/* all data moved through the mappings */
+	assert_int_equal(guest_grant_copies, 0);
+}
+
+void
+test_xenblkif_pgrant_lru(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+
+	setenv("TAPDISK3_PERSISTENT_GRANTS", "2", 1);
+	assert_int_equal(td_pgrant_pool_init(blkif), 0);
+	unsetenv("TAPDISK3_PERSISTENT_GRANTS");
+
+	assert_ptr_equal(td_pgrant_get(blkif, 1), guest_page(1));
+	assert_ptr_equal(td_pgrant_get(blkif, 2), guest_page(2));
+	assert_ptr_equal(td_pgrant_get(blkif, 1), guest_page(1));
+
+	/* 2 is the least recently used */
+	assert_ptr_equal(td_pgrant_get(blkif, 3), guest_page(3));
+	assert_int_equal(guest_unmaps, 1);
+	assert_int_equal(blkif->pgrants.n_mapped, 2);
+
+	assert_ptr_equal(td_pgrant_get(blkif, 1), guest_page(1));
+	assert_int_equal(blkif->stats.pgrants.hits, 2);
+
+	assert_ptr_equal(td_pgrant_get(blkif, 2), guest_page(2));
+	assert_int_equal(guest_unmaps, 2);
+	assert_int_equal(blkif->stats.pgrants.misses, 4);
+	assert_int_equal(blkif->stats.pgrants.unmaps, 2);
+}
+
+void
+test_xenblkif_pgrant_map_failure(void **state)
+{
+	struct req_state *s = *state;
+	struct td_xenblkif *blkif = &s->blkif;
+
+	assert_int_equal(td_pgrant_pool_init(blkif), 0);
+	assert_int_equal(blkif->pgrants.size, TD_PGRANT_POOL_SIZE);
+
+	guest_maps_fail = true;
+	queue_and_complete_write(blkif, 2);
+
+	assert_int_equal(blkif->stats.pgrants.errors, 2);
+	assert_int_equal(blkif->pgrants.n_mapped, 0);
+	assert_int_equal(guest_grant_copies, 1);
+}
+
+void
+test_xenblkif_find_queue(void **state)
+{
+	struct td_xenio_ctx ctx;
+	struct td_xenblkif blkifs[4];
+	int i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(blkifs, 0, sizeof(blkifs));
+	INIT_LIST_HEAD(&ctx.blkifs);
+	list_add_tail(&ctx.entry, &_td_xenio_ctxs);
+
+	for (i = 0; i < 4; i++) {
+		blkifs[i].domid = 5;
+		blkifs[i].devid = 768;
+		blkifs[i].queue = i;
+		list_add_tail(&blkifs[i].entry_ctx, &ctx.blkifs);
+	}
+	blkifs[3].devid = 832;
+	blkifs[3].queue = 0;
+	blkifs[2].dead = true;
+
+	assert_ptr_equal(tapdisk_xenblkif_find_queue(5, 768, 0), &blkifs[0]);
+	assert_ptr_equal(tapdisk_xenblkif_find_queue(5, 768, 1), &blkifs[1]);
+	assert_null(tapdisk_xenblkif_find_queue(5, 768, 2));
+	assert_ptr_equal(tapdisk_xenblkif_find_queue(5, 832, 0), &blkifs[3]);
+	assert_null(tapdisk_xenblkif_find_queue(5, 832, 1));
+	assert_null(tapdisk_xenblkif_find_queue(6, 768, 0));
+	assert_non_null(tapdisk_xenblkif_find(5, 768));
+
+	list_del(&ctx.entry);
+}
+
+/*
+ * Queues after the first account into the VBD metrics of queue 0. Once
+ * those are gone, no queue may keep a pointer into them, even one left
+ * dead with requests in flight.
+ */
+void
+test_xenblkif_disconnect_drops_shared_vbd_stats(void **state)
+{
+	struct td_xenio_ctx ctx;
+	struct td_xenblkif blkifs[2];
+	struct stats stats;
+	td_vbd_t vbd;
+	int i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(blkifs, 0, sizeof(blkifs));
+	memset(&vbd, 0, sizeof(vbd));
+	INIT_LIST_HEAD(&ctx.blkifs);
+	INIT_LIST_HEAD(&vbd.dead_rings);
+	list_add_tail(&ctx.entry, &_td_xenio_ctxs);
+
+	for (i = 0; i < 2; i++) {
+		blkifs[i].domid = 5;
+		blkifs[i].devid = 768;
+		blkifs[i].queue = i;
+		blkifs[i].vbd = &vbd;
+		blkifs[i].port = -1;
+		/* one request in flight, so the ring goes dead */
+		blkifs[i].ring_size = 32;
+		blkifs[i].n_reqs_free = 31;
+		blkifs[i].vbd_stats.stats = &stats;
+		shm_init(&blkifs[i].xenvbd_stats.io_ring);
+		shm_init(&blkifs[i].xenvbd_stats.stats);
+		INIT_LIST_HEAD(&blkifs[i].entry);
+		list_add_tail(&blkifs[i].entry_ctx, &ctx.blkifs);
+	}
+
+	assert_int_equal(tapdisk_xenblkif_disconnect(5, 768), 0);
+
+	assert_true(blkifs[0].dead);
+	assert_true(blkifs[1].dead);
+	assert_null(blkifs[1].vbd_stats.stats);
+
+	list_del(&ctx.entry);
+}
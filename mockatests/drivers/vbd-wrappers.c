@@ -35,6 +35,9 @@
 
 #include "tapdisk.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-server.h"
+#include "tapdisk-vbd.h"
+#include "td-ctx.h"
 
 int
 __wrap_tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
@@ -67,3 +70,29 @@ __wrap_tapdisk_server_register_event(char mode, int fd,
 	return 0;
 }
 
+void
+__wrap_tapdisk_server_unregister_event(event_id_t event)
+{
+	check_expected(event);
+}
+
+
+int
+__wrap_tapdisk_vbd_queue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	check_expected_ptr(vreq);
+	return (int)mock();
+}
+
+int
+__wrap_tapdisk_server_event_set_timeout(event_id_t event_id,
+                                        struct timeval timeo)
+{
+	return 0;
+}
+
+int
+__wrap_xenevtchn_notify(xenevtchn_handle *xce, evtchn_port_t port)
+{
+	return 0;
+}
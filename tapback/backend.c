@@ -259,6 +259,17 @@ tapback_backend_create_device(backend_t *backend,
         goto out;
     }
 
+    /* Enable multi-queue, one ring and event channel per queue */
+    if (backend->max_queues > 1) {
+        err = tapback_device_printf(device, XBT_NULL, MAX_QUEUES, true, "%u",
+                backend->max_queues);
+        if (unlikely(err)) {
+            WARN(device, "failed to write %s: %s\n", MAX_QUEUES,
+                    strerror(-err));
+            goto out;
+        }
+    }
+
 out:
     if (err) {
         WARN(NULL, "%s: error creating device: %s\n", name, strerror(-err));
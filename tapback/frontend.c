@@ -68,6 +68,60 @@ xenbus_switch_state(vbd_t * const device,
     return err;
 }
 
+/**
+ * Reads the grant references and the event channel of a shared ring. For
+ * multi-queue front-ends the nodes of each queue live under queue-<n>/,
+ * otherwise the prefix is empty.
+ *
+ * @returns 0 on success, an error code otherwise
+ */
+static int
+read_ring(vbd_t * const device, const char * const prefix, const int order,
+        grant_ref_t * const gref, evtchn_port_t * const port)
+{
+    /*
+     * +10 is for INT_MAX, +1 for NULL termination
+     */
+    static const size_t len = sizeof("queue-/") + 10 + sizeof(EVENT_CHANNEL)
+        + 10 + 1;
+    char path[len];
+    const int nr_pages = 1 << order;
+    int i;
+
+    /*
+     * Read the grant references.
+     */
+    for (i = 0; i < nr_pages; i++) {
+        int n;
+
+        if (order)
+            n = snprintf(path, len, "%s%s%d", prefix, RING_REF, i);
+        else
+            n = snprintf(path, len, "%s%s", prefix, RING_REF);
+        if (n >= (int)len) {
+            DBG(device, "error printing to buffer\n");
+            return EINVAL;
+        }
+        if (1 != tapback_device_scanf_otherend(device, XBT_NULL, path,
+                    "%u", &gref[i])) {
+            WARN(device, "failed to read grant ref %s\n", path);
+            return ENOENT;
+        }
+    }
+
+    /*
+     * Read the event channel.
+     */
+    snprintf(path, len, "%s%s", prefix, EVENT_CHANNEL);
+    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, path,
+                "%u", port)) {
+        WARN(device, "failed to read event channel %s\n", path);
+        return ENOENT;
+    }
+
+    return 0;
+}
+
 /**
  * Core functions that instructs the tapdisk to connect to the shared ring (if
  * not already connected).
@@ -77,6 +131,9 @@ xenbus_switch_state(vbd_t * const device,
  * This function is idempotent: if the tapback daemon gets restarted this
  * function will be called again but it won't really do anything.
  *
+ * A multi-queue front-end gets one shared ring per queue, each with its own
+ * event channel.
+ *
  * @param device the VBD the tapdisk should connect to
  * @returns (a) 0 on success, (b) ESRCH if the tapdisk is not available, and
  * (c) an error code otherwise
@@ -90,6 +147,7 @@ connect_tap(vbd_t * const device)
     char *proto_str = NULL;
     char *persistent_grants_str = NULL;
     int nr_pages = 0, proto = 0, order = 0;
+    unsigned int nr_queues = 1, queue;
     bool persistent_grants = false;
 
     ASSERT(device);
@@ -127,46 +185,14 @@ connect_tap(vbd_t * const device)
         goto out;
     }
 
-    /*
-     * Read the grant references.
-     */
-    if (order) {
-        int i = 0;
-        /*
-         * +10 is for INT_MAX, +1 for NULL termination
-         */
+    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, NUM_QUEUES,
+                "%u", &nr_queues))
+        nr_queues = 1;
 
-        static const size_t len = sizeof(RING_REF) + 10 + 1;
-        char ring_ref[len];
-        for (i = 0; i < nr_pages; i++) {
-            if (snprintf(ring_ref, len, "%s%d", RING_REF, i) >= (int)len) {
-                DBG(device, "error printing to buffer\n");
-                err = EINVAL;
-                goto out;
-            }
-            if (1 != tapback_device_scanf_otherend(device, XBT_NULL, ring_ref,
-                        "%u", &gref[i])) {
-                WARN(device, "failed to read grant ref 0x%x\n", i);
-                err = ENOENT;
-                goto out;
-            }
-        }
-    } else {
-        if (1 != tapback_device_scanf_otherend(device, XBT_NULL, RING_REF,
-                    "%u", &gref[0])) {
-            WARN(device, "failed to read grant ref\n");
-            err = ENOENT;
-            goto out;
-        }
-    }
-
-    /*
-     * Read the event channel.
-     */
-    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, EVENT_CHANNEL,
-                "%u", &port)) {
-        WARN(device, "failed to read event channel\n");
-        err = ENOENT;
+    if (nr_queues < 1 || nr_queues > device->backend->max_queues) {
+        WARN(device, "invalid number of queues %u, max %u\n", nr_queues,
+                device->backend->max_queues);
+        err = EINVAL;
         goto out;
     }
 
@@ -187,7 +213,7 @@ connect_tap(vbd_t * const device)
         goto out;
     }
 
-    DBG(device, "protocol=%d\n", proto);
+    DBG(device, "protocol=%d, queues=%u\n", proto, nr_queues);
 
     /*
      * Does the front-end support persistent grants?
@@ -210,34 +236,56 @@ connect_tap(vbd_t * const device)
         DBG(device, "front-end doesn't support persistent grants\n");
 
     /*
-     * persistent grants are not yet supported
+     * Persistent grants are only used if we offered them as well.
      */
-    if (persistent_grants)
-        WARN(device, "front-end supports persistent grants but we don't\n");
+    if (persistent_grants && !device->backend->persistent_grants) {
+        DBG(device, "front-end supports persistent grants but they are "
+                "disabled\n");
+        persistent_grants = false;
+    }
 
     /*
-     * Create the shared ring and ask the tapdisk to connect to it.
+     * Create the shared rings and ask the tapdisk to connect to them.
      */
-    if ((err = -tap_ctl_connect_xenblkif(device->tap->pid, device->domid,
-                    device->devid, device->polling_duration, device->polling_idle_threshold,
-		    gref, order, port, proto, NULL,
-                    device->minor))) {
-        /*
-         * This happens if the tapback dameon gets restarted while there are
-         * active VBDs.
-         */
-        if (err == EALREADY) {
-            INFO(device, "tapdisk[%d] minor=%d already connected to the "
-					"shared ring\n", device->tap->pid, device->tap->minor);
-            err = 0;
-        } else {
-            WARN(device, "tapdisk[%d] failed to connect to the shared "
-                    "ring: %s\n", device->tap->pid, strerror(err));
+    for (queue = 0; queue < nr_queues; queue++) {
+        char prefix[sizeof("queue-/") + 10];
+
+        if (nr_queues > 1)
+            snprintf(prefix, sizeof(prefix), "queue-%u/", queue);
+        else
+            prefix[0] = '\0';
+
+        err = read_ring(device, prefix, order, gref, &port);
+        if (err)
             goto out;
+
+        if ((err = -tap_ctl_connect_xenblkif(device->tap->pid, device->domid,
+                        device->devid, queue, device->polling_duration,
+                        device->polling_idle_threshold, persistent_grants,
+                        gref, order, port, proto, NULL, device->minor))) {
+            /*
+             * This happens if the tapback dameon gets restarted while there
+             * are active VBDs.
+             */
+            if (err == EALREADY) {
+                INFO(device, "tapdisk[%d] minor=%d queue=%u already connected "
+                        "to the shared ring\n", device->tap->pid,
+                        device->tap->minor, queue);
+                err = 0;
+            } else {
+                WARN(device, "tapdisk[%d] failed to connect queue %u to the "
+                        "shared ring: %s\n", device->tap->pid, queue,
+                        strerror(err));
+                goto out;
+            }
         }
-    }
 
-    device->connected = true;
+        /*
+         * Set as soon as one queue is up so that a failure further down
+         * disconnects the ones already connected.
+         */
+        device->connected = true;
+    }
 
     DBG(device, "tapdisk[%d] connected to shared ring\n", device->tap->pid);
 
@@ -284,14 +332,44 @@ connect_frontend(vbd_t *device) {
         abort_transaction = true;
 
         /*
-         * FIXME blkback writes discard-granularity, discard-alignment,
-         * discard-secure, feature-discard but we don't.
+         * Discard is only offered for writable VBDs, tapdisk punches holes
+         * so there's no secure erase.
          */
+        if (device->backend->discard && !(device->info & VDISK_READONLY)) {
+            if ((err = tapback_device_printf(device, xst, FEAT_DISCARD, true,
+                            "%d", 1))) {
+                WARN(device, "failed to write %s: %s\n", FEAT_DISCARD,
+                        strerror(-err));
+                break;
+            }
+
+            if ((err = tapback_device_printf(device, xst, DISCARD_GRANULARITY,
+                            true, "%u", TAPBACK_DISCARD_GRANULARITY))) {
+                WARN(device, "failed to write %s: %s\n", DISCARD_GRANULARITY,
+                        strerror(-err));
+                break;
+            }
+
+            if ((err = tapback_device_printf(device, xst, DISCARD_ALIGNMENT,
+                            true, "%u", 0))) {
+                WARN(device, "failed to write %s: %s\n", DISCARD_ALIGNMENT,
+                        strerror(-err));
+                break;
+            }
+
+            if ((err = tapback_device_printf(device, xst, DISCARD_SECURE,
+                            true, "%d", 0))) {
+                WARN(device, "failed to write %s: %s\n", DISCARD_SECURE,
+                        strerror(-err));
+                break;
+            }
+        }
 
         /*
-		 * Write the number of sectors, sector size, info, and barrier support
-		 * to the back-end path in XenStore so that the front-end creates a VBD
-		 * with the appropriate characteristics.
+		 * Write the number of sectors, sector size, info, barrier, persistent
+		 * grant and indirect descriptor support to the back-end path in
+		 * XenStore so that the front-end creates a VBD with the appropriate
+		 * characteristics.
          */
         if ((err = tapback_device_printf(device, xst, "feature-barrier", true,
                         "%d", device->backend->barrier ? 1 : 0))) {
@@ -300,6 +378,21 @@ connect_frontend(vbd_t *device) {
             break;
         }
 
+        if ((err = tapback_device_printf(device, xst, FEAT_PERSIST, true,
+                        "%d", device->backend->persistent_grants ? 1 : 0))) {
+            WARN(device, "failed to write %s: %s\n", FEAT_PERSIST,
+                    strerror(-err));
+            break;
+        }
+
+        if ((err = tapback_device_printf(device, xst,
+                        "feature-max-indirect-segments", true, "%u",
+                        BLKIF_MAX_INDIRECT_SEGMENTS_PER_REQUEST))) {
+            WARN(device, "failed to write feature-max-indirect-segments: "
+                    "%s\n", strerror(-err));
+            break;
+        }
+
         if ((err = tapback_device_printf(device, xst, "sector-size", true,
                         "%u", device->sector_size))) {
             WARN(device, "failed to write sector-size: %s\n", strerror(-err));
@@ -230,7 +230,8 @@ tapback_write_pid(const char *pidfile)
  */
 static inline backend_t *
 tapback_backend_create(const char *name, const char *pidfile,
-        const domid_t domid, const bool barrier)
+        const domid_t domid, const bool barrier, const bool persistent_grants,
+        const unsigned int max_queues, const bool discard)
 {
     int err;
     int len;
@@ -266,6 +267,9 @@ tapback_backend_create(const char *name, const char *pidfile,
     }
 
 	backend->barrier = barrier;
+	backend->persistent_grants = persistent_grants;
+	backend->max_queues = max_queues;
+	backend->discard = discard;
 
     backend->path = NULL;
 
@@ -487,6 +491,9 @@ usage(FILE * const stream, const char * const prog)
 			"\t[-h|--help]\n"
             "\t[-v|--verbose]\n"
 			"\t[-b]--nobarrier]\n"
+			"\t[-g|--persistent-grants]\n"
+			"\t[-q|--max-queues <n>]\n"
+			"\t[-D|--nodiscard]\n"
             "\t[-n|--name]\n", prog);
 }
 
@@ -560,6 +567,9 @@ int main(int argc, char **argv)
 	backend_t *backend = NULL;
     domid_t opt_domid = 0;
 	bool opt_barrier = true;
+	bool opt_persistent_grants = false;
+	unsigned int opt_max_queues = 1;
+	bool opt_discard = true;
 
 	if (access("/dev/xen/gntdev", F_OK ) == -1) {
 		WARN(NULL, "grant device does not exist\n");
@@ -580,11 +590,14 @@ int main(int argc, char **argv)
             {"pidfile", 0, NULL, 'p'},
             {"domain", 0, NULL, 'x'},
 			{"nobarrier", 0, NULL, 'b'},
+			{"persistent-grants", 0, NULL, 'g'},
+			{"max-queues", 1, NULL, 'q'},
+			{"nodiscard", 0, NULL, 'D'},
 
         };
         int c;
 
-        c = getopt_long(argc, argv, "hdvn:p:x:b", longopts, NULL);
+        c = getopt_long(argc, argv, "hdvn:p:x:bgq:D", longopts, NULL);
         if (c < 0)
             break;
 
@@ -624,6 +637,20 @@ int main(int argc, char **argv)
 		case 'b':
 			opt_barrier = false;
 			break;
+		case 'g':
+			opt_persistent_grants = true;
+			break;
+		case 'q':
+			opt_max_queues = strtoul(optarg, &end, 0);
+			if (*end != 0 || end == optarg || !opt_max_queues) {
+				WARN(NULL, "invalid number of queues %s\n", optarg);
+				err = EINVAL;
+				goto fail;
+			}
+			break;
+		case 'D':
+			opt_discard = false;
+			break;
         case '?':
             goto usage;
         }
@@ -658,7 +685,8 @@ int main(int argc, char **argv)
     }
 
 	backend = tapback_backend_create(opt_name, opt_pidfile, opt_domid,
-			opt_barrier);
+			opt_barrier, opt_persistent_grants, opt_max_queues,
+			opt_discard);
 	if (!backend) {
 		err = errno;
         WARN(NULL, "error creating back-end: %s\n", strerror(err));
@@ -121,6 +121,19 @@ int pretty_time(char *buf, unsigned char buf_len);
 #define RING_PAGE_ORDER         "ring-page-order"
 #define EVENT_CHANNEL           "event-channel"
 #define FEAT_PERSIST            "feature-persistent"
+#define NUM_QUEUES              "multi-queue-num-queues"
+#define MAX_QUEUES              "multi-queue-max-queues"
+#define FEAT_DISCARD            "feature-discard"
+#define DISCARD_GRANULARITY     "discard-granularity"
+#define DISCARD_ALIGNMENT       "discard-alignment"
+#define DISCARD_SECURE          "discard-secure"
+
+/*
+ * The discard granularity we advertise, in bytes. VHDs only give space back
+ * in whole blocks, so there's no point in the front-end sending anything
+ * smaller.
+ */
+#define TAPBACK_DISCARD_GRANULARITY (2 << 20)
 #define PROTO                   "protocol"
 #define FRONTEND_KEY            "frontend"
 
@@ -209,6 +222,21 @@ typedef struct backend {
 	 * Tells whether we support write I/O barriers.
 	 */
 	bool barrier;
+
+	/**
+	 * Tells whether we offer persistent grants to front-ends.
+	 */
+	bool persistent_grants;
+
+	/**
+	 * Maximum number of rings a front-end may use per VBD.
+	 */
+	unsigned int max_queues;
+
+	/**
+	 * Tells whether we offer discard to front-ends of writable VBDs.
+	 */
+	bool discard;
 } backend_t;
 
 /**
@@ -29,7 +29,9 @@
  */
 
 #include "unity.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Header file for SUT */
 #include "drivers/block-aio.h"
@@ -37,6 +39,7 @@
 /* Mocks */
 #include "mock_tapdisk-interface.h"
 #include "mock_tapdisk-stats.h"
+#include "mock_tapdisk-workers.h"
 
 void setUp(void)
 {
@@ -55,9 +58,10 @@ void test_tdaio_queue_read_computes_size_and_offset_correctly(void)
     int expected_size;
     uint64_t expected_offset;
     struct aio_request aio;
-    struct tdaio_state prv;
+    static struct tdaio_state prv;
 
     driver.data = &prv;
+    treq.iovcnt = 0;
     treq.secs = 10;
     driver.info.sector_size = 2048;
     treq.sec = (uint64_t) 23;
@@ -84,3 +88,149 @@ void test_tdaio_queue_read_computes_size_and_offset_correctly(void)
     // Call to the method to test
     tdaio_queue_read(&driver, treq);
 }
+
+void test_tdaio_queue_read_vectored_issues_single_readv(void)
+{
+    // Initialisation
+    td_driver_t driver;
+    td_request_t treq;
+    struct td_iovec iov[2];
+    char buf[2][4 * SECTOR_SIZE];
+
+    uint64_t expected_offset;
+    struct aio_request aio;
+    static struct tdaio_state prv;
+
+    driver.data = &prv;
+    iov[0].base = buf[0];
+    iov[0].secs = 4;
+    iov[1].base = buf[1];
+    iov[1].secs = 2;
+    treq.buf = NULL;
+    treq.iov = iov;
+    treq.iovcnt = 2;
+    treq.secs = 6;
+    treq.sec = (uint64_t) 23;
+
+    prv.fd = 3;
+    prv.aio_free_count = 1;
+    prv.iov_free_count = 1;
+
+    prv.aio_free_list[0] = &aio;
+    prv.iov_free_list[0] = prv.iovs[0];
+
+    // Expectations
+    expected_offset = treq.sec * (uint64_t) SECTOR_SIZE;
+
+    td_prep_readv_ExpectAndReturn(
+        &driver,
+        &aio.tiocb,
+        prv.fd,
+        prv.iovs[0],
+        2,
+        expected_offset,
+        tdaio_complete,
+        &aio,
+        0);
+
+    td_queue_tiocb_Expect(&driver, &aio.tiocb);
+
+    // Call to the method to test
+    tdaio_queue_read(&driver, treq);
+
+    TEST_ASSERT_EQUAL_PTR(prv.iovs[0], aio.iov);
+    TEST_ASSERT_EQUAL_PTR(buf[1], aio.iov[1].iov_base);
+    TEST_ASSERT_EQUAL(2 * SECTOR_SIZE, aio.iov[1].iov_len);
+    TEST_ASSERT_EQUAL(0, prv.aio_free_count);
+    TEST_ASSERT_EQUAL(0, prv.iov_free_count);
+}
+
+void test_tdaio_queue_read_vectored_splits_without_free_iovs(void)
+{
+    // Initialisation
+    td_driver_t driver;
+    td_request_t treq;
+    struct td_iovec iov[2];
+    char buf[2][4 * SECTOR_SIZE];
+
+    struct aio_request aio[3];
+    static struct tdaio_state prv;
+
+    driver.data = &prv;
+    iov[0].base = buf[0];
+    iov[0].secs = 4;
+    iov[1].base = buf[1];
+    iov[1].secs = 2;
+    treq.buf = NULL;
+    treq.iov = iov;
+    treq.iovcnt = 2;
+    treq.secs = 6;
+    treq.sec = (uint64_t) 23;
+
+    prv.fd = 3;
+    prv.aio_free_count = 3;
+    prv.iov_free_count = 0;
+
+    prv.aio_free_list[0] = &aio[2];
+    prv.aio_free_list[1] = &aio[1];
+    prv.aio_free_list[2] = &aio[0];
+
+    // Expectations: the vectored slot goes back, one read per segment
+    td_prep_read_Expect(
+        &driver,
+        &aio[0].tiocb,
+        prv.fd,
+        buf[0],
+        4 * SECTOR_SIZE,
+        23 * (uint64_t) SECTOR_SIZE,
+        tdaio_complete,
+        &aio[0]);
+    td_queue_tiocb_Ignore();
+    td_prep_read_Expect(
+        &driver,
+        &aio[1].tiocb,
+        prv.fd,
+        buf[1],
+        2 * SECTOR_SIZE,
+        27 * (uint64_t) SECTOR_SIZE,
+        tdaio_complete,
+        &aio[1]);
+
+    // Call to the method to test
+    tdaio_queue_read(&driver, treq);
+}
+
+void test_tdaio_queue_flush_completes_from_worker(void)
+{
+    // Initialisation
+    td_driver_t driver;
+    td_request_t treq;
+    struct aio_request aio;
+    static struct tdaio_state prv;
+    FILE *f = tmpfile();
+
+    TEST_ASSERT_NOT_NULL(f);
+
+    driver.data = &prv;
+    memset(&treq, 0, sizeof(treq));
+
+    prv.fd = fileno(f);
+    prv.workers = 1;
+    prv.aio_free_count = 1;
+    prv.aio_free_list[0] = &aio;
+
+    // Expectations: nothing completes on the tapdisk thread yet
+    tapdisk_workers_queue_Expect(TD_WORKERS_SYNC, &aio.work);
+
+    // Call to the method to test
+    tdaio_queue_flush(&driver, treq);
+    TEST_ASSERT_EQUAL(0, prv.aio_free_count);
+
+    // The worker runs fn, then the scheduler runs done
+    aio.work.fn(&aio.work);
+    td_complete_request_Expect(treq, 0);
+    aio.work.done(&aio.work);
+    TEST_ASSERT_EQUAL(1, prv.aio_free_count);
+
+    fclose(f);
+}